@@ -0,0 +1,242 @@
+//*********************************************************
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+//*********************************************************
+#include "pch.h"
+
+namespace FallbackLayer
+{
+    static
+        double ComputeOverlapVolume(
+            const AABB& box0,
+            const AABB& box1)
+    {
+        double volume = 1.0;
+        for (UINT axis = 0; axis < 3; ++axis)
+        {
+            const float extent = std::min(box0.maxArr[axis], box1.maxArr[axis]) - std::max(box0.minArr[axis], box1.minArr[axis]);
+            if (extent <= 0)
+            {
+                return 0;
+            }
+            volume *= extent;
+        }
+        return volume;
+    }
+
+    static
+        void WriteJsonArray(
+            std::ostream& output,
+            const std::vector<UINT>& values)
+    {
+        output << "[";
+        for (size_t i = 0; i < values.size(); ++i)
+        {
+            output << (i ? ", " : "") << values[i];
+        }
+        output << "]";
+    }
+
+    enum ReportBuildMode
+    {
+        ReportBuildModeSah,
+        ReportBuildModeFastBuild,
+        ReportBuildModeFastTrace,
+        ReportBuildModeSpatialSplits,
+        ReportBuildModeUpdate,
+        NumReportBuildModes
+    };
+
+    static const char* ReportBuildModeNames[NumReportBuildModes] = { "sah", "fast_build", "fast_trace", "spatial_splits", "update" };
+    static const float ReportOverlapThreshold = 1e-5f;
+    static const float ReportDuplicateBudget = 0.3f;
+
+    static
+        void BuildInReportMode(
+            const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC& desc,
+            ReportBuildMode mode,
+            void* pData)
+    {
+        D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC modeDesc = desc;
+        switch (mode)
+        {
+        case ReportBuildModeFastBuild:
+            modeDesc.Inputs.Flags = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_BUILD;
+            break;
+        case ReportBuildModeFastTrace:
+            modeDesc.Inputs.Flags = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE;
+            break;
+        case ReportBuildModeSpatialSplits:
+            BuildRaytracingAccelerationStructureWithSpatialSplitsOnCpu(&modeDesc, ReportOverlapThreshold, ReportDuplicateBudget, pData);
+            return;
+        case ReportBuildModeUpdate:
+            modeDesc.Inputs.Flags = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE;
+            modeDesc.SourceAccelerationStructureData = (D3D12_GPU_VIRTUAL_ADDRESS)pData;
+            break;
+        }
+        BuildRaytracingAccelerationStructureOnCpu(&modeDesc, pData);
+    }
+}
+
+void GetAccelerationStructureQualityOnCpu(
+    _In_  const void *pData,
+    _Out_ AccelerationStructureQuality &quality)
+{
+    const BVHOffsets& offsets = *(const BVHOffsets*)pData;
+    const AABBNode* nodes = (const AABBNode*)((const BYTE*)pData + offsets.offsetToBoxes);
+
+    quality = AccelerationStructureQuality();
+    quality.sahCost = GetAccelerationStructureSahCostOnCpu(pData);
+
+    // Walked from the root rather than over the array, which can have unused nodes
+    double overlapVolume = 0;
+    std::vector<std::pair<UINT, UINT>> nodeStack(1, std::make_pair(0u, 0u));
+    while (!nodeStack.empty())
+    {
+        const UINT nodeIndex = nodeStack.back().first;
+        const UINT depth = nodeStack.back().second;
+        nodeStack.pop_back();
+        quality.numNodes++;
+
+        const AABBNode& node = nodes[nodeIndex];
+        if (node.leaf)
+        {
+            // Top level leaves hold one instance but store 0
+            const UINT numPrimitives = std::max(1u, (UINT)node.leafNode.numTriangleIds);
+            if (quality.leavesAtDepth.size() <= depth)
+            {
+                quality.leavesAtDepth.resize(depth + 1);
+            }
+            if (quality.leavesWithNumPrimitives.size() <= numPrimitives)
+            {
+                quality.leavesWithNumPrimitives.resize(numPrimitives + 1);
+            }
+            quality.leavesAtDepth[depth]++;
+            quality.leavesWithNumPrimitives[numPrimitives]++;
+            quality.numLeaves++;
+            quality.numPrimitives += numPrimitives;
+            continue;
+        }
+
+        AABB leftBox;
+        AABB rightBox;
+        FallbackLayer::DecompressAABB(leftBox, nodes[node.internalNode.leftNodeIndex]);
+        FallbackLayer::DecompressAABB(rightBox, nodes[node.rightNodeIndex]);
+        overlapVolume += FallbackLayer::ComputeOverlapVolume(leftBox, rightBox);
+
+        nodeStack.push_back(std::make_pair((UINT)node.internalNode.leftNodeIndex, depth + 1));
+        nodeStack.push_back(std::make_pair((UINT)node.rightNodeIndex, depth + 1));
+    }
+
+    // A box overlaps itself by its volume
+    AABB rootBox;
+    FallbackLayer::DecompressAABB(rootBox, nodes[0]);
+    const double rootVolume = FallbackLayer::ComputeOverlapVolume(rootBox, rootBox);
+    quality.siblingOverlap = rootVolume > 0 ? (float)(overlapVolume / rootVolume) : 0.0f;
+}
+
+void WriteAccelerationStructureQualityOnCpu(
+    _In_  const void *pData,
+    std::ostream &output)
+{
+    AccelerationStructureQuality quality;
+    GetAccelerationStructureQualityOnCpu(pData, quality);
+
+    output << "{ \"sah_cost\": " << quality.sahCost
+        << ", \"sibling_overlap\": " << quality.siblingOverlap
+        << ", \"nodes\": " << quality.numNodes
+        << ", \"leaves\": " << quality.numLeaves
+        << ", \"primitives\": " << quality.numPrimitives
+        << ", \"max_depth\": " << quality.leavesAtDepth.size() - 1
+        << ", \"leaves_at_depth\": ";
+    FallbackLayer::WriteJsonArray(output, quality.leavesAtDepth);
+    output << ", \"leaves_with_num_primitives\": ";
+    FallbackLayer::WriteJsonArray(output, quality.leavesWithNumPrimitives);
+    output << " }";
+}
+
+void WriteAccelerationStructureBuildReportOnCpu(
+    _In_reads_(numMeshes) const AccelerationStructureReportMesh *pMeshes,
+    UINT numMeshes,
+    UINT numRepeats,
+    std::ostream &output)
+{
+    using namespace FallbackLayer;
+
+    numRepeats = std::max(numRepeats, 1u);
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+
+    output << "{\n  \"repeats\": " << numRepeats
+        << ",\n  \"overlap_threshold\": " << ReportOverlapThreshold
+        << ",\n  \"duplicate_budget\": " << ReportDuplicateBudget
+        << ",\n  \"meshes\": [";
+    for (UINT i = 0; i < numMeshes; ++i)
+    {
+        const AccelerationStructureReportMesh& mesh = pMeshes[i];
+        const UINT numTriangles = mesh.indexCount / 3;
+        output << (i ? "," : "") << "\n    {\n      \"name\": \"" << mesh.pName << "\",\n      \"triangles\": " << numTriangles
+            << ",\n      \"builds\": [";
+
+        D3D12_RAYTRACING_GEOMETRY_DESC geometryDesc = {};
+        geometryDesc.Type = D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES;
+        geometryDesc.Flags = D3D12_RAYTRACING_GEOMETRY_FLAG_OPAQUE;
+        geometryDesc.Triangles.IndexBuffer = (D3D12_GPU_VIRTUAL_ADDRESS)mesh.pIndices;
+        geometryDesc.Triangles.IndexFormat = DXGI_FORMAT_R32_UINT;
+        geometryDesc.Triangles.IndexCount = mesh.indexCount;
+        geometryDesc.Triangles.VertexBuffer.StartAddress = (D3D12_GPU_VIRTUAL_ADDRESS)mesh.pVertices;
+        geometryDesc.Triangles.VertexBuffer.StrideInBytes = sizeof(float) * 3;
+        geometryDesc.Triangles.VertexFormat = DXGI_FORMAT_R32G32B32_FLOAT;
+        geometryDesc.Triangles.VertexCount = mesh.vertexCount;
+
+        D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc = {};
+        desc.Inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL;
+        desc.Inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+        desc.Inputs.NumDescs = 1;
+        desc.Inputs.pGeometryDescs = &geometryDesc;
+
+        std::vector<BYTE> sahBuild;
+        for (UINT mode = 0; mode < NumReportBuildModes && numTriangles > 0; ++mode)
+        {
+            const UINT accelerationStructureSize = mode == ReportBuildModeSpatialSplits ?
+                GetSpatialSplitAccelerationStructureSizeOnCpu(numTriangles, ReportDuplicateBudget) :
+                GetOffsetToPrimitives(numTriangles) + GetOffsetFromPrimitivesToPrimitiveMetaData(numTriangles) + numTriangles * SizeOfPrimitiveMetaData;
+            std::vector<BYTE> accelerationStructure(accelerationStructureSize);
+            if (mode == ReportBuildModeUpdate)
+            {
+                accelerationStructure = sahBuild;
+            }
+
+            std::vector<double> milliseconds;
+            for (UINT repeat = 0; repeat < numRepeats; ++repeat)
+            {
+                LARGE_INTEGER start;
+                LARGE_INTEGER end;
+                QueryPerformanceCounter(&start);
+                BuildInReportMode(desc, (ReportBuildMode)mode, accelerationStructure.data());
+                QueryPerformanceCounter(&end);
+                milliseconds.push_back(1000.0 * (end.QuadPart - start.QuadPart) / frequency.QuadPart);
+            }
+            std::sort(milliseconds.begin(), milliseconds.end());
+            if (mode == ReportBuildModeSah)
+            {
+                sahBuild = accelerationStructure;
+            }
+
+            output << (mode ? "," : "") << "\n        { \"mode\": \"" << ReportBuildModeNames[mode]
+                << "\", \"build_ms_min\": " << milliseconds.front()
+                << ", \"build_ms_median\": " << milliseconds[milliseconds.size() / 2]
+                << ", \"quality\": ";
+            WriteAccelerationStructureQualityOnCpu(accelerationStructure.data(), output);
+            output << " }";
+        }
+        output << "\n      ]\n    }";
+    }
+    output << "\n  ]\n}\n";
+}
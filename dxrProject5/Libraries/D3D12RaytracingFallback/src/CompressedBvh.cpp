@@ -0,0 +1,434 @@
+//*********************************************************
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+//*********************************************************
+#include "pch.h"
+
+namespace FallbackLayer
+{
+    static const UINT NumQuantizationSteps = 255;
+
+    //
+    // A min of 0 decodes to the min of the parent and a max of 255 to its max, exactly,
+    // so a decoded box never reaches past its parent's
+    //
+
+    static
+        float DecodeMin(const AABB &parentBox, UINT axis, UINT value)
+    {
+        const float step = (parentBox.maxArr[axis] - parentBox.minArr[axis]) * (1.0f / NumQuantizationSteps);
+        return parentBox.minArr[axis] + value * step;
+    }
+
+    static
+        float DecodeMax(const AABB &parentBox, UINT axis, UINT value)
+    {
+        const float step = (parentBox.maxArr[axis] - parentBox.minArr[axis]) * (1.0f / NumQuantizationSteps);
+        return parentBox.maxArr[axis] - (NumQuantizationSteps - value) * step;
+    }
+
+    static
+        void DecodeChildBox(AABB &box, const AABB &parentBox, const UINT8 bounds[2][3])
+    {
+        for (UINT axis = 0; axis < 3; axis++)
+        {
+            box.minArr[axis] = DecodeMin(parentBox, axis, bounds[0][axis]);
+            box.maxArr[axis] = DecodeMax(parentBox, axis, bounds[1][axis]);
+        }
+    }
+
+    //
+    // Rounds the planes of box outwards onto the grid of parentBox, which must hold it
+    //
+
+    static
+        void EncodeChildBox(UINT8 bounds[2][3], const AABB &parentBox, const AABB &box)
+    {
+        for (UINT axis = 0; axis < 3; axis++)
+        {
+            const float extent = parentBox.maxArr[axis] - parentBox.minArr[axis];
+            const float scale = extent > 0.0f ? NumQuantizationSteps / extent : 0.0f;
+            int minValue = (int)std::floor((box.minArr[axis] - parentBox.minArr[axis]) * scale);
+            int maxValue = (int)std::ceil((box.maxArr[axis] - parentBox.minArr[axis]) * scale);
+            minValue = std::min(std::max(minValue, 0), (int)NumQuantizationSteps);
+            maxValue = std::min(std::max(maxValue, minValue), (int)NumQuantizationSteps);
+
+            // The decode rounds differently, which can leave a plane just inside the box
+            while (minValue > 0 && DecodeMin(parentBox, axis, minValue) > box.minArr[axis])
+            {
+                minValue--;
+            }
+            while (maxValue < (int)NumQuantizationSteps && DecodeMax(parentBox, axis, maxValue) < box.maxArr[axis])
+            {
+                maxValue++;
+            }
+
+            bounds[0][axis] = (UINT8)minValue;
+            bounds[1][axis] = (UINT8)maxValue;
+        }
+    }
+
+    static
+        void GetPrimitiveBox(AABB &box, const Primitive &primitive)
+    {
+        if (primitive.PrimitiveType != TRIANGLE_TYPE)
+        {
+            box = primitive.aabb;
+            return;
+        }
+
+        const Triangle &triangle = primitive.triangle;
+        for (UINT axis = 0; axis < 3; axis++)
+        {
+            box.minArr[axis] = std::min(std::min((&triangle.v0.x)[axis], (&triangle.v1.x)[axis]), (&triangle.v2.x)[axis]);
+            box.maxArr[axis] = std::max(std::max((&triangle.v0.x)[axis], (&triangle.v1.x)[axis]), (&triangle.v2.x)[axis]);
+        }
+    }
+
+    static
+        void ExtendBox(AABB &box, const AABB &other)
+    {
+        for (UINT axis = 0; axis < 3; axis++)
+        {
+            box.minArr[axis] = std::min(box.minArr[axis], other.minArr[axis]);
+            box.maxArr[axis] = std::max(box.maxArr[axis], other.maxArr[axis]);
+        }
+    }
+
+    static
+        bool IsBoxContained(const AABB &parentBox, const AABB &box)
+    {
+        for (UINT axis = 0; axis < 3; axis++)
+        {
+            if (box.minArr[axis] < parentBox.minArr[axis] || box.maxArr[axis] > parentBox.maxArr[axis])
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static
+        bool IntersectBox(
+            float &entryT,
+            const CpuRayData &ray,
+            const AABB &box,
+            float tMin,
+            float tMax)
+    {
+        float exitT = tMax;
+        entryT = tMin;
+        for (UINT axis = 0; axis < 3; axis++)
+        {
+            const float nearPlane = ray.nearSide[axis] ? box.maxArr[axis] : box.minArr[axis];
+            const float farPlane = ray.nearSide[axis] ? box.minArr[axis] : box.maxArr[axis];
+            entryT = std::max(entryT, nearPlane * ray.inverseDirection[axis] - ray.originTimesInverseDirection[axis]);
+            exitT = std::min(exitT, farPlane * ray.inverseDirection[axis] - ray.originTimesInverseDirection[axis]);
+        }
+        return entryT <= exitT;
+    }
+
+    bool CompressedBVH::Compress(const BYTE *pAccelerationStructure)
+    {
+        const BVHOffsets &offsets = *(const BVHOffsets *)pAccelerationStructure;
+        const AABBNode *pNodes = (const AABBNode *)(pAccelerationStructure + offsets.offsetToBoxes);
+        m_pPrimitives = (const Primitive *)(pAccelerationStructure + offsets.offsetToVertices);
+        m_pMetaData = (const PrimitiveMetaData *)(pAccelerationStructure + offsets.offsetToPrimitiveMetaData);
+
+        std::vector<UINT> preorder;
+        std::vector<UINT> nodeStack(1, 0);
+        UINT numBvh2Nodes = 0;
+        while (!nodeStack.empty())
+        {
+            const UINT nodeIndex = nodeStack.back();
+            nodeStack.pop_back();
+            preorder.push_back(nodeIndex);
+            numBvh2Nodes = std::max(numBvh2Nodes, nodeIndex + 1);
+            if (!pNodes[nodeIndex].leaf)
+            {
+                nodeStack.push_back(pNodes[nodeIndex].internalNode.leftNodeIndex);
+                nodeStack.push_back(pNodes[nodeIndex].rightNodeIndex);
+            }
+        }
+
+        //
+        // The boxes are taken from the primitives rather than the AABBNodes. Center and half
+        // dimensions don't round trip to the same planes, and the encoding needs every box
+        // to hold its children's exactly.
+        //
+        std::vector<AABB> boxes(numBvh2Nodes);
+        for (auto it = preorder.rbegin(); it != preorder.rend(); ++it)
+        {
+            const AABBNode &node = pNodes[*it];
+            AABB &box = boxes[*it];
+            if (node.leaf)
+            {
+                const UINT firstPrimitive = node.leafNode.firstTriangleId;
+                GetPrimitiveBox(box, m_pPrimitives[firstPrimitive]);
+                for (UINT i = 1; i < std::max((UINT)node.leafNode.numTriangleIds, 1u); i++)
+                {
+                    AABB primitiveBox;
+                    GetPrimitiveBox(primitiveBox, m_pPrimitives[firstPrimitive + i]);
+                    ExtendBox(box, primitiveBox);
+                }
+            }
+            else
+            {
+                box = boxes[node.internalNode.leftNodeIndex];
+                ExtendBox(box, boxes[node.rightNodeIndex]);
+            }
+        }
+
+        auto GetLeaf = [&](UINT nodeIndex)
+        {
+            const AABBNode &node = pNodes[nodeIndex];
+            const UINT numPrimitives = std::max((UINT)node.leafNode.numTriangleIds, 1u);
+            assert(numPrimitives <= WideBVHMaxPrimitivesInLeaf && node.leafNode.firstTriangleId <= 0xFFFFFF);
+            return WideBVHLeafFlag | (numPrimitives << 24) | node.leafNode.firstTriangleId;
+        };
+
+        m_nodes.clear();
+        m_rootBox = boxes[0];
+        m_depth = 1;
+        if (pNodes[0].leaf)
+        {
+            m_root = GetLeaf(0);
+            return true;
+        }
+
+        // Each node is encoded against its parent's box as traversal decodes it
+        struct CompressTask
+        {
+            UINT bvh2NodeIndex;
+            UINT nodeIndex;
+            AABB box;
+            UINT depth;
+        };
+
+        m_root = 0;
+        m_nodes.reserve(numBvh2Nodes / 2 + 1);
+        m_nodes.emplace_back();
+
+        std::vector<CompressTask> tasks;
+        tasks.push_back({ 0, 0, m_rootBox, 1 });
+        while (!tasks.empty())
+        {
+            const CompressTask task = tasks.back();
+            tasks.pop_back();
+
+            const AABBNode &bvh2Node = pNodes[task.bvh2NodeIndex];
+            const UINT bvh2Children[2] = { bvh2Node.internalNode.leftNodeIndex, bvh2Node.rightNodeIndex };
+            for (UINT i = 0; i < 2; i++)
+            {
+                const UINT bvh2Child = bvh2Children[i];
+                EncodeChildBox(m_nodes[task.nodeIndex].bounds[i], task.box, boxes[bvh2Child]);
+
+                UINT child;
+                if (pNodes[bvh2Child].leaf)
+                {
+                    child = GetLeaf(bvh2Child);
+                }
+                else
+                {
+                    AABB childBox;
+                    DecodeChildBox(childBox, task.box, m_nodes[task.nodeIndex].bounds[i]);
+
+                    child = (UINT)m_nodes.size();
+                    m_nodes.emplace_back();
+                    tasks.push_back({ bvh2Child, child, childBox, task.depth + 1 });
+                    m_depth = std::max(m_depth, task.depth + 1);
+                }
+                m_nodes[task.nodeIndex].children[i] = child;
+            }
+        }
+
+        // Each level deeper leaves at most one sibling behind on the stack
+        return m_depth + 1 <= CompressedBVHMaxStackSize;
+    }
+
+    bool CompressedBVH::Validate() const
+    {
+        auto IsLeafContained = [&](UINT leaf, const AABB &box)
+        {
+            const UINT first = GetWideBVHLeafFirstPrimitive(leaf);
+            const UINT end = first + GetWideBVHLeafNumPrimitives(leaf);
+            for (UINT primitiveIndex = first; primitiveIndex < end; primitiveIndex++)
+            {
+                AABB primitiveBox;
+                GetPrimitiveBox(primitiveBox, m_pPrimitives[primitiveIndex]);
+                if (!IsBoxContained(box, primitiveBox))
+                {
+                    return false;
+                }
+            }
+            return true;
+        };
+
+        if (IsWideBVHLeaf(m_root))
+        {
+            return IsLeafContained(m_root, m_rootBox);
+        }
+
+        struct ValidateTask
+        {
+            UINT nodeIndex;
+            AABB box;
+        };
+
+        std::vector<ValidateTask> tasks;
+        tasks.push_back({ m_root, m_rootBox });
+        while (!tasks.empty())
+        {
+            const ValidateTask task = tasks.back();
+            tasks.pop_back();
+            if (task.nodeIndex >= m_nodes.size())
+            {
+                return false;
+            }
+
+            const CompressedBVHNode &node = m_nodes[task.nodeIndex];
+            for (UINT i = 0; i < 2; i++)
+            {
+                AABB childBox;
+                DecodeChildBox(childBox, task.box, node.bounds[i]);
+                if (!IsBoxContained(task.box, childBox))
+                {
+                    return false;
+                }
+
+                if (IsWideBVHLeaf(node.children[i]))
+                {
+                    if (!IsLeafContained(node.children[i], childBox))
+                    {
+                        return false;
+                    }
+                }
+                else
+                {
+                    tasks.push_back({ node.children[i], childBox });
+                }
+            }
+        }
+        return true;
+    }
+
+    bool CompressedBVH::TraceClosestHit(const CpuRay &ray, CpuRayHit &hit, CpuTraversalStats *pStats) const
+    {
+        struct StackEntry
+        {
+            UINT child;
+            float t;
+            AABB box;
+        };
+
+        CpuRayData rayData;
+        GetCpuRayData(rayData, ray.origin, ray.direction);
+
+        StackEntry stack[CompressedBVHMaxStackSize];
+        UINT stackSize = 0;
+        float rootT;
+        if (IntersectBox(rootT, rayData, m_rootBox, ray.tMin, ray.tMax))
+        {
+            stack[stackSize++] = { m_root, rootT, m_rootBox };
+        }
+
+        bool isHit = false;
+        float closestT = ray.tMax;
+        UINT bvhPrimitiveIndex = 0;
+        float2 barycentrics;
+        UINT hitKind;
+        UINT64 nodesVisited = 0, primitivesTested = 0;
+        auto IntersectLeaf = [&](UINT leaf)
+        {
+            const UINT first = GetWideBVHLeafFirstPrimitive(leaf);
+            const UINT end = first + GetWideBVHLeafNumPrimitives(leaf);
+            for (UINT primitiveIndex = first; primitiveIndex < end; primitiveIndex++)
+            {
+                primitivesTested++;
+                const Primitive &primitive = m_pPrimitives[primitiveIndex];
+                if (primitive.PrimitiveType == TRIANGLE_TYPE &&
+                    IntersectTriangle(closestT, barycentrics, hitKind, rayData, ray.tMin, primitive.triangle, 0, 0))
+                {
+                    isHit = true;
+                    bvhPrimitiveIndex = primitiveIndex;
+                }
+            }
+        };
+
+        while (stackSize > 0)
+        {
+            const StackEntry entry = stack[--stackSize];
+            if (entry.t > closestT)
+            {
+                continue;
+            }
+
+            // Only a root that is a leaf gets here as one, other leaves are tested with their parent
+            if (IsWideBVHLeaf(entry.child))
+            {
+                IntersectLeaf(entry.child);
+                continue;
+            }
+
+            const CompressedBVHNode &node = m_nodes[entry.child];
+            nodesVisited++;
+
+            StackEntry innerNodes[2];
+            UINT numInnerNodes = 0;
+            for (UINT i = 0; i < 2; i++)
+            {
+                AABB childBox;
+                DecodeChildBox(childBox, entry.box, node.bounds[i]);
+                float childT;
+                if (!IntersectBox(childT, rayData, childBox, ray.tMin, closestT))
+                {
+                    continue;
+                }
+
+                if (IsWideBVHLeaf(node.children[i]))
+                {
+                    IntersectLeaf(node.children[i]);
+                }
+                else
+                {
+                    innerNodes[numInnerNodes++] = { node.children[i], childT, childBox };
+                }
+            }
+
+            // Farther first, so that the nearer child is popped next
+            if (numInnerNodes == 2 && innerNodes[0].t < innerNodes[1].t)
+            {
+                std::swap(innerNodes[0], innerNodes[1]);
+            }
+            for (UINT i = 0; i < numInnerNodes; i++)
+            {
+                stack[stackSize++] = innerNodes[i];
+            }
+        }
+
+        if (pStats)
+        {
+            pStats->nodesVisited += nodesVisited;
+            pStats->primitivesTested += primitivesTested;
+        }
+
+        if (isHit)
+        {
+            const PrimitiveMetaData &metaData = m_pMetaData[bvhPrimitiveIndex];
+            hit = {};
+            hit.t = closestT;
+            hit.barycentrics = barycentrics;
+            hit.hitKind = hitKind;
+            hit.primitiveIndex = metaData.PrimitiveIndex;
+            hit.geometryContributionToHitGroupIndex = metaData.GeometryContributionToHitGroupIndex;
+            hit.bvhPrimitiveIndex = bvhPrimitiveIndex;
+        }
+        return isHit;
+    }
+}
@@ -0,0 +1,60 @@
+//*********************************************************
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+//*********************************************************
+#pragma once
+namespace FallbackLayer
+{
+    static const UINT CompressedBVHMaxStackSize = 512;
+
+    //
+    // A BVH2 node holding the boxes of its two children in 8 bits per plane, as
+    // 255ths of its own box. Its own box is decoded from its parent, so the root
+    // box is the only one kept in floats. The planes are rounded outwards, so a
+    // decoded box always holds what is below it. Children are encoded like the
+    // child slots of WideBVHNode, without empty ones.
+    //
+    struct CompressedBVHNode
+    {
+        UINT children[2];
+        UINT8 bounds[2][2][3];          // [child][min, max][x, y, z]
+    };
+
+    //
+    // Compresses the BVH2 of a bottom level built by BuildRaytracingAccelerationStructureOnCpu
+    // for tracing on the CPU, in less than half the memory of its AABBNodes.
+    //
+    class CompressedBVH
+    {
+    public:
+        // The acceleration structure must outlive this, primitives are read straight from it.
+        // Returns false if the result is too deep for the traversal stack.
+        bool Compress(const BYTE *pAccelerationStructure);
+
+        // Decodes every box from the root down and checks that it holds the primitives of
+        // its leaves and the decoded boxes of its children
+        bool Validate() const;
+
+        // Closest triangle hit in [tMin, tMax] with no ray or instance flags, like TraceRayOnCpuBottomLevel()
+        bool TraceClosestHit(const CpuRay &ray, CpuRayHit &hit, CpuTraversalStats *pStats = nullptr) const;
+
+        const std::vector<CompressedBVHNode> &GetNodes() const { return m_nodes; }
+        const AABB &GetRootBox() const { return m_rootBox; }
+        UINT GetDepth() const { return m_depth; }
+        UINT64 GetSizeInBytes() const { return m_nodes.size() * sizeof(CompressedBVHNode); }
+
+    private:
+        std::vector<CompressedBVHNode> m_nodes;
+        AABB m_rootBox;
+        UINT m_root = WideBVHEmptyChild;    // Node 0, or a leaf if the tree is one
+        const Primitive *m_pPrimitives = nullptr;
+        const PrimitiveMetaData *m_pMetaData = nullptr;
+        UINT m_depth = 0;
+    };
+}
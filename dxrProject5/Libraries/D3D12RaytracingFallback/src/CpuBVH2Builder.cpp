@@ -9,6 +9,8 @@
 //
 //*********************************************************
 #include "pch.h"
+#include <intrin.h>
+#include "TreeletReorderBindings.h"
 
 namespace FallbackLayer
 {
@@ -40,13 +42,31 @@ namespace FallbackLayer
         return v & 0x00ffffff;
     }
 
+    //
+    // Nodes with at least this many primitives scan them in parallel, in chunks of this size
+    //
+
+    static const UINT32 PARALLEL_SCAN_CHUNK_SIZE = 16 * 1024;
+
+    //
+    // On a scheduler with a single virtual processor the tasks and chunks would only run
+    // one after another, so the build doesn't split its work at all
+    //
+
+    static
+        bool IsBuildParallel()
+    {
+        return concurrency::CurrentScheduler::GetNumberOfVirtualProcessors() != 1;
+    }
+
     static
         void ComputeBox(
             AABB& overallBox,
             const std::vector<AABB>& boxes,
-            const std::vector<PrimitiveMetaData>& metadata)
+            const PrimitiveMetaData* metadata,
+            UINT32 numTris)
     {
-        if (metadata.empty())
+        if (numTris == 0)
         {
             overallBox.max.x = overallBox.min.x = 0;
             overallBox.max.y = overallBox.min.y = 0;
@@ -54,9 +74,26 @@ namespace FallbackLayer
             return;
         }
 
+        if (numTris > PARALLEL_SCAN_CHUNK_SIZE && IsBuildParallel())
+        {
+            const UINT32 numChunks = (numTris + PARALLEL_SCAN_CHUNK_SIZE - 1) / PARALLEL_SCAN_CHUNK_SIZE;
+            std::vector<AABB> chunkBoxes(numChunks);
+            concurrency::parallel_for(0u, numChunks, [&](UINT32 chunk)
+            {
+                const UINT32 first = chunk * PARALLEL_SCAN_CHUNK_SIZE;
+                ComputeBox(chunkBoxes[chunk], boxes, metadata + first, std::min(PARALLEL_SCAN_CHUNK_SIZE, numTris - first));
+            });
+
+            overallBox = chunkBoxes[0];
+            for (UINT32 i = 1; i < numChunks; ++i)
+            {
+                AddExtentToBox(overallBox, chunkBoxes[i]);
+            }
+            return;
+        }
+
         overallBox = boxes[metadata[0].PrimitiveIndex];
 
-        const UINT32 numTris = (UINT32)metadata.size();
         for (UINT32 i = 1; i < numTris; ++i)
         {
             const UINT32 triId = metadata[i].PrimitiveIndex;
@@ -109,6 +146,11 @@ namespace FallbackLayer
         return (USHORT)(sign >> 16 | body >> 13);
     }
 
+    //
+    // AABBNodes stay in fp32, the traversal shaders read them that way. CompressedBVH
+    // quantizes the boxes for CPU traversal instead.
+    //
+
     static
         float QuantizeToFp16(
             float v)
@@ -116,16 +158,15 @@ namespace FallbackLayer
         return v;
     }
 
+    //
+    // Writes a box into a node's center and half dimensions, leaving its links alone
+    //
+
     static
-        UINT32 BuildBVHAddNode(
-            BVH& bvh,
-            const AABB& box,
-            UINT32 maxDimension)
+        void PackAABBNode(
+            AABBNode& packedBox,
+            const AABB& box)
     {
-        UNREFERENCED_PARAMETER(maxDimension);
-        assert(maxDimension < 3);
-        const UINT32 nodeIndex = (UINT32)bvh.m_nodes.size();
-
         float cX = (box.max.x + box.min.x) * 0.5f;
         float cY = (box.max.y + box.min.y) * 0.5f;
         float cZ = (box.max.z + box.min.z) * 0.5f;
@@ -137,88 +178,62 @@ namespace FallbackLayer
         float dY = max(box.max.y - cY, cY - box.min.y);
         float dZ = max(box.max.z - cZ, cZ - box.min.z);
 
-        AABBNode packedBox;
         packedBox.center[0] = cX;
         packedBox.center[1] = cY;
         packedBox.center[2] = cZ;
         packedBox.halfDim[0] = dX;
         packedBox.halfDim[1] = dY;
         packedBox.halfDim[2] = dZ;
-        packedBox.nodeAllBits = 0;
-
-        bvh.m_nodes.push_back(packedBox);
-
-        assert(bvh.m_nodes.size() - 1 == nodeIndex);
-
-        bvh.m_nodes[nodeIndex].internalNode.separatingAxis = 0;
-
-        return nodeIndex;
     }
 
     static
-        UINT32 BuildBVHAddLeaf(
-            BVH& bvh,
+        UINT32 BuildBVHAddNode(
+            std::vector<AABBNode>& nodes,
             const AABB& box,
-            const std::vector<PrimitiveMetaData>& metadata)
+            UINT32 maxDimension)
     {
-        const UINT32 nodeIndex = BuildBVHAddNode(bvh, box, 0);
-
-        bvh.m_nodes[nodeIndex].nodeAllBits = 0;
-        bvh.m_nodes[nodeIndex].leaf = true;
+        UNREFERENCED_PARAMETER(maxDimension);
+        assert(maxDimension < 3);
+        const UINT32 nodeIndex = (UINT32)nodes.size();
 
-        const UINT32 idIndex = (UINT32)bvh.m_metadata.size();
+        AABBNode packedBox;
+        PackAABBNode(packedBox, box);
+        packedBox.nodeAllBits = 0;
 
-        std::copy(metadata.begin(), metadata.end(), std::back_inserter(bvh.m_metadata));
+        nodes.push_back(packedBox);
 
-        assert(metadata.size() < 128);
-        assert(idIndex < (1 << 24));
+        assert(nodes.size() - 1 == nodeIndex);
 
-        bvh.m_nodes[nodeIndex].leafNode.firstTriangleId = idIndex;
-        bvh.m_nodes[nodeIndex].leafNode.numTriangleIds = (UINT32)metadata.size();
+        nodes[nodeIndex].internalNode.separatingAxis = 0;
 
         return nodeIndex;
     }
 
     //
-    // Sort min to max by centroid
+    // Leaves refer to their triangles' range of the metadata, which the build leaves in leaf order
     //
 
     static
-        void SortByCentroid(
-            std::vector<PrimitiveMetaData>& metadata,
-            const std::vector<AABB>& boxes,
-            UINT32 maxDimension)
+        UINT32 BuildBVHAddLeaf(
+            std::vector<AABBNode>& nodes,
+            const AABB& box,
+            UINT32 firstTriangleId,
+            UINT32 numTriangles)
     {
-        struct TriPosition
-        {
-            float   pos;
-            UINT32  id;
-        };
-
-        std::vector<TriPosition> sortTris(metadata.size());
+        const UINT32 nodeIndex = BuildBVHAddNode(nodes, box, 0);
 
-        for (UINT32 i = 0; i < metadata.size(); ++i)
-        {
-            const UINT32 triId = metadata[i].PrimitiveIndex;
-            const AABB& box = boxes[triId];
+        nodes[nodeIndex].nodeAllBits = 0;
+        nodes[nodeIndex].leaf = true;
 
-            const float boxCenter = (box.maxArr[maxDimension] + box.minArr[maxDimension]) / 2;
-
-            sortTris[i].pos = boxCenter;
-            sortTris[i].id = metadata[i].PrimitiveIndex;
-        }
+        assert(numTriangles < 128);
+        assert(firstTriangleId < (1 << 24));
 
-        // Split the list into left and right sublists
-        std::sort(sortTris.begin(), sortTris.end(), [](auto&& a, auto&& b) -> bool { return a.pos < b.pos; });
+        nodes[nodeIndex].leafNode.firstTriangleId = firstTriangleId;
+        nodes[nodeIndex].leafNode.numTriangleIds = numTriangles;
 
-        // Update the output
-        for (UINT32 i = 0; i < metadata.size(); ++i)
-        {
-            metadata[i].PrimitiveIndex = sortTris[i].id;
-        }
+        return nodeIndex;
     }
 
-
     static
         float ComputeBoxSurfaceArea(
             const AABB& box)
@@ -241,37 +256,127 @@ namespace FallbackLayer
         box.min.x = box.min.y = box.min.z = 10e10f;//FLT_MAX;
     }
 
+    static const UINT NUM_SAH_BINS = 64;
+
+    struct SahBin
+    {
+        AABB    box;
+        UINT    numTriangles;
+    };
+
+    struct SahBins
+    {
+        SahBin  bins[3][NUM_SAH_BINS];
+    };
+
+    static
+        UINT GetSahBinIndex(
+            const AABB& triBox,
+            UINT axis,
+            float rangeMin,
+            float inverseExtents)
+    {
+        const float centroid = (triBox.maxArr[axis] + triBox.minArr[axis]) * 0.5f;
+
+        return std::min(NUM_SAH_BINS - 1,
+            UINT(NUM_SAH_BINS * ((centroid - rangeMin) * inverseExtents)));
+    }
+
+    //
+    // Place triangles into the buckets of all three axes in one pass.
+    // Axes the node is flat along put everything in the first bucket.
+    //
+
+    static
+        void BinPrimitives(
+            SahBins& sahBins,
+            const PrimitiveMetaData* metadata,
+            UINT32 numTris,
+            const AABB& nodeBox,
+            const std::vector<AABB>& boxes)
+    {
+        float inverseExtents[3];
+        for (UINT i = 0; i < 3; ++i)
+        {
+            const float extents = nodeBox.maxArr[i] - nodeBox.minArr[i];
+            inverseExtents[i] = extents == 0 ? 0 : 1.f / extents;
+
+            for (UINT j = 0; j < NUM_SAH_BINS; ++j)
+            {
+                sahBins.bins[i][j].numTriangles = 0;
+                InitBoxToInverseMax(sahBins.bins[i][j].box);
+            }
+        }
+
+        for (UINT32 j = 0; j < numTris; ++j)
+        {
+            const AABB& triBox = boxes[metadata[j].PrimitiveIndex];
+
+            for (UINT i = 0; i < 3; ++i)
+            {
+                SahBin& bin = sahBins.bins[i][GetSahBinIndex(triBox, i, nodeBox.minArr[i], inverseExtents[i])];
+                bin.numTriangles++;
+                AddExtentToBox(bin.box, triBox);
+            }
+        }
+    }
+
     //
     // A feeble attempt at a SAH builder
     //
+    // Finds the axis and bucket boundary with the best score: triangles in buckets up to
+    // splitBin go left. Returns false if that doesn't leave triangles on both sides.
+    //
 
     static
-        void SahSplit(
-            std::vector<PrimitiveMetaData>& metadata,
+        bool SahSplit(
+            const PrimitiveMetaData* metadata,
+            UINT32 numTris,
             UINT32& maxDimension,
+            UINT32& splitBin,
             UINT32& numTrisInLeftNode,
             const AABB& nodeBox,
             const std::vector<AABB>& boxes)
     {
-        static const UINT NUM_SAH_BINS = 64;
+        // NOTE: use vector if this blows out the stack?
+        SahBins sahBins;
 
-        struct SahBin
+        if (numTris > PARALLEL_SCAN_CHUNK_SIZE && IsBuildParallel())
         {
-            AABB    box;
-            UINT    numTriangles;
-        };
+            // Bin chunks in parallel, then add up their buckets
+            const UINT32 numChunks = (numTris + PARALLEL_SCAN_CHUNK_SIZE - 1) / PARALLEL_SCAN_CHUNK_SIZE;
+            std::vector<SahBins> chunkBins(numChunks);
+            concurrency::parallel_for(0u, numChunks, [&](UINT32 chunk)
+            {
+                const UINT32 first = chunk * PARALLEL_SCAN_CHUNK_SIZE;
+                BinPrimitives(chunkBins[chunk], metadata + first, std::min(PARALLEL_SCAN_CHUNK_SIZE, numTris - first), nodeBox, boxes);
+            });
 
-        // NOTE: use vector if this blows out the stack?
-        SahBin  sahBins[3][NUM_SAH_BINS];
+            sahBins = chunkBins[0];
+            for (UINT32 chunk = 1; chunk < numChunks; ++chunk)
+            {
+                for (UINT i = 0; i < 3; ++i)
+                {
+                    for (UINT j = 0; j < NUM_SAH_BINS; ++j)
+                    {
+                        sahBins.bins[i][j].numTriangles += chunkBins[chunk].bins[i][j].numTriangles;
+                        AddExtentToBox(sahBins.bins[i][j].box, chunkBins[chunk].bins[i][j].box);
+                    }
+                }
+            }
+        }
+        else
+        {
+            BinPrimitives(sahBins, metadata, numTris, nodeBox, boxes);
+        }
 
         // For the score to be meaningful it seems we need to normalize it to something
         const float normalizeToParent = 1.f / ComputeBoxSurfaceArea(nodeBox);
 
-        const UINT numTris = (UINT)metadata.size();
-
         float bestSah = FLT_MAX;
         maxDimension = 0;
-        //numTrisInLeftNode = triangleIds.size() / 2;
+        splitBin = 0;
+        numTrisInLeftNode = 0;
 
         // Compute SAH score per axis
         for (UINT i = 0; i < 3; ++i)
@@ -280,38 +385,13 @@ namespace FallbackLayer
             if (extents == 0)
                 continue;
 
-            const float rangeMin = nodeBox.minArr[i];
-
-            const float inverseExtents = 1.f / extents;
-
-            // Init boxes
-            for (UINT j = 0; j < NUM_SAH_BINS; ++j)
-            {
-                sahBins[i][j].numTriangles = 0;
-                InitBoxToInverseMax(sahBins[i][j].box);
-            }
-
-            // Place triangles into the buckets
-            for (UINT j = 0; j < metadata.size(); ++j)
-            {
-                const UINT triId = metadata[j].PrimitiveIndex;
-
-                const AABB& triBox = boxes[triId];
-
-                const float centroid = (triBox.maxArr[i] + triBox.minArr[i]) * 0.5f;
-
-                const UINT binIndex = std::min(NUM_SAH_BINS - 1,
-                    UINT(NUM_SAH_BINS * ((centroid - rangeMin) * inverseExtents)));
-
-                sahBins[i][binIndex].numTriangles++;
-                AddExtentToBox(sahBins[i][binIndex].box, triBox);
-            }
+            const SahBin* bins = sahBins.bins[i];
 
             // Make sure we caught all of them once
             UINT testTris = 0;
             for (UINT j = 0; j < NUM_SAH_BINS; ++j)
             {
-                testTris += sahBins[i][j].numTriangles;
+                testTris += bins[j].numTriangles;
             }
             assert(testTris == numTris);
 
@@ -324,8 +404,8 @@ namespace FallbackLayer
             {
                 const UINT rightIdx = NUM_SAH_BINS - j - 1;
 
-                rightBoxes[rightIdx] = sahBins[i][rightIdx].box;
-                leftBoxes[j] = sahBins[i][j].box;
+                rightBoxes[rightIdx] = bins[rightIdx].box;
+                leftBoxes[j] = bins[j].box;
 
                 if (j > 0)
                 {
@@ -340,13 +420,13 @@ namespace FallbackLayer
             // Find the plane with the best score
             for (UINT j = 0; j < NUM_SAH_BINS - 1; ++j)
             {
-                if (!sahBins[i][j].numTriangles)
+                if (!bins[j].numTriangles)
                 {
                     continue;
                 }
 
-                numTrianglesOnLeft += sahBins[i][j].numTriangles;
-                numTrianglesOnRight -= sahBins[i][j].numTriangles;
+                numTrianglesOnLeft += bins[j].numTriangles;
+                numTrianglesOnRight -= bins[j].numTriangles;
 
                 const float sah = (numTrianglesOnLeft * ComputeBoxSurfaceArea(leftBoxes[j]) +
                     numTrianglesOnRight * ComputeBoxSurfaceArea(rightBoxes[j + 1])) *
@@ -358,266 +438,1682 @@ namespace FallbackLayer
                 {
                     bestSah = sah;
                     maxDimension = i;
+                    splitBin = j;
                     numTrisInLeftNode = numTrianglesOnLeft;
                 }
             }
         }
 
-        //
-        // Split the set to try to get a balanced tree
-        //
-
-        SortByCentroid(metadata, boxes, maxDimension);
+        return numTrisInLeftNode > 0 && numTrisInLeftNode < numTris;
     }
 
     //
-    // It's a good idea to do a breadth-first build because then nodes from the same level
-    // get adjacent memory locations. It does take a lot of memory though.
+    // Reorders a node's triangles in place: its right child's first, then its left child's, which is
+    // the order the leaves end up in. Splits at the best SAH plane; if SAH fails, try to balance by
+    // splitting at the median centroid along maxDimension instead. Returns the number that go right.
     //
-    // "Uniform BVH"
-    // -- both children are valid for all internal nodes
-    // -- left child's index is +1 of the parent index, right child's index is stored
-    //    in the packed AABB structure.
-    // -- there could be a varaible number of triangles in leaves
+
+    static
+        UINT32 PartitionPrimitives(
+            PrimitiveMetaData* metadata,
+            UINT32 numTris,
+            UINT32& splitDimension,
+            const AABB& nodeBox,
+            const std::vector<AABB>& boxes)
+    {
+        UINT32 splitBin;
+        UINT32 numTrisInLeftNode;
+        if (SahSplit(metadata, numTris, splitDimension, splitBin, numTrisInLeftNode, nodeBox, boxes))
+        {
+            const float rangeMin = nodeBox.minArr[splitDimension];
+            const float inverseExtents = 1.f / (nodeBox.maxArr[splitDimension] - rangeMin);
+
+            const PrimitiveMetaData* leftBegin = std::partition(metadata, metadata + numTris,
+                [&](const PrimitiveMetaData& primitive) -> bool
+            {
+                return GetSahBinIndex(boxes[primitive.PrimitiveIndex], splitDimension, rangeMin, inverseExtents) > splitBin;
+            });
+            assert(UINT32(leftBegin - metadata) == numTris - numTrisInLeftNode);
+            UNREFERENCED_PARAMETER(leftBegin);
+
+            return numTris - numTrisInLeftNode;
+        }
+
+        // The left child gets the lower half, the right child the rest
+        const UINT32 axis = splitDimension;
+        const UINT32 numTrisInRightNode = numTris - numTris / 2;
+        std::nth_element(metadata, metadata + numTrisInRightNode, metadata + numTris,
+            [&](const PrimitiveMetaData& a, const PrimitiveMetaData& b) -> bool
+        {
+            const AABB& boxA = boxes[a.PrimitiveIndex];
+            const AABB& boxB = boxes[b.PrimitiveIndex];
+            return (boxA.maxArr[axis] + boxA.minArr[axis]) / 2 > (boxB.maxArr[axis] + boxB.minArr[axis]) / 2;
+        });
+
+        return numTrisInRightNode;
+    }
+
+    //
+    // Builds the subtree over metadata[begin, end) on this thread. The right child of every node
+    // is built first, so that it lands right after its parent.
     //
     static
-        void BuildBVH(
-            BVH& bvh,
+        void BuildBVHSubtree(
+            std::vector<AABBNode>& nodes,
             const std::vector<AABB>& boxes,
-            const std::vector<PrimitiveMetaData>& primitiveMetaData,
+            PrimitiveMetaData* metadata,
+            UINT32 begin,
+            UINT32 end,
             UINT32 maxTrisInLeaf)
     {
-        //
-        // These are huge so use pointers
-        //
         struct StackItem
         {
-            std::vector<PrimitiveMetaData> primitiveMetaData;
+            UINT32              begin;
+            UINT32              end;
             UINT32              parentIndex;
             UINT                right : 1;
-            UINT                axis : 2;
         };
 
-        std::deque<StackItem*>   fifoLefts;
-        std::deque<StackItem*>   fifoRights;
-
-        StackItem* temp = new StackItem;
-        temp->parentIndex = (UINT)-1;
-        temp->primitiveMetaData = primitiveMetaData;
-        temp->right = false;
-        temp->axis = 0;
-        fifoRights.push_back(temp);
+        // Uniform BVH pops the right node first, so its left sibling waits underneath it
+        std::vector<StackItem> stack;
+        stack.reserve(64);
+        stack.push_back({ begin, end, (UINT)-1, false });
 
-        while (!fifoLefts.empty() || !fifoRights.empty())
+        while (!stack.empty())
         {
-            // Uniform BVH pops the first left node
-            StackItem* item = nullptr;
-
-            if (!fifoRights.empty())
-            {
-                item = fifoRights.back();
-                fifoRights.pop_back();
-            }
-
-            if (!item)
-            {
-                item = fifoLefts.back();
-                fifoLefts.pop_back();
-            }
+            const StackItem item = stack.back();
+            stack.pop_back();
 
             //
             // Compute overall bounding box
             //
-            AABB nodeBox;
-            ComputeBox(nodeBox, boxes, item->primitiveMetaData);
+            const UINT32 numTrianglesInNode = item.end - item.begin;
+            const UINT32 parentIndex = item.parentIndex;
 
-            const UINT32 numTrianglesInNode = (UINT32)item->primitiveMetaData.size();
-            const UINT32 parentIndex = item->parentIndex;
+            AABB nodeBox;
+            ComputeBox(nodeBox, boxes, metadata + item.begin, numTrianglesInNode);
 
             UINT32 thisNodeIndex;
 
             // Leaf or internal node?
             if (numTrianglesInNode <= maxTrisInLeaf)
             {
-                thisNodeIndex = BuildBVHAddLeaf(bvh, nodeBox, item->primitiveMetaData);
+                thisNodeIndex = BuildBVHAddLeaf(nodes, nodeBox, item.begin, numTrianglesInNode);
             }
             else
             {
                 //
-                // Find separating plane. Use Median for speed.
-                // SAH is better but also more expensive to build.
+                // Find separating plane
                 //
 
                 UINT splitDimension;
-                UINT leftChildNumNodes;
-
-                SahSplit(item->primitiveMetaData,
+                const UINT32 rightChildNumNodes = PartitionPrimitives(metadata + item.begin,
+                    numTrianglesInNode,
                     splitDimension,
-                    leftChildNumNodes,
                     nodeBox,
                     boxes);
-
-                assert(leftChildNumNodes <= item->primitiveMetaData.size());
-
-                // Try to balance by using the median if SAH failed
-                if ((leftChildNumNodes == 0 ||
-                    leftChildNumNodes == item->primitiveMetaData.size()) &&
-                    item->primitiveMetaData.size() > MAX_TRIS_IN_LEAF)
-                {
-                    leftChildNumNodes = (UINT)item->primitiveMetaData.size() / 2;
-                }
-
-                const UINT32 rightChildNumNodes = (UINT32)item->primitiveMetaData.size() - leftChildNumNodes;
-
+                const UINT32 split = item.begin + rightChildNumNodes;
 
                 //
                 // "Recurse"
                 //
 
-                thisNodeIndex = BuildBVHAddNode(bvh, nodeBox, splitDimension);
-
-                StackItem* leftItem = new StackItem;
-                leftItem->parentIndex = thisNodeIndex;
-                leftItem->primitiveMetaData.resize(leftChildNumNodes);
-                leftItem->right = false;
-                leftItem->axis = splitDimension;
-                for (UINT32 i = 0; i < leftChildNumNodes; ++i)
-                {
-                    leftItem->primitiveMetaData[i] = item->primitiveMetaData[i];
-                }
-
-                StackItem* rightItem = new StackItem;
-                rightItem->parentIndex = thisNodeIndex;
-                rightItem->primitiveMetaData.resize(rightChildNumNodes);
-                rightItem->right = true;
-                rightItem->axis = splitDimension;
-                for (UINT32 i = 0; i < rightChildNumNodes; ++i)
-                {
-                    rightItem->primitiveMetaData[i] = item->primitiveMetaData[i + leftChildNumNodes];
-                }
+                thisNodeIndex = BuildBVHAddNode(nodes, nodeBox, splitDimension);
 
-                fifoLefts.push_back(leftItem);
-                fifoRights.push_back(rightItem);
+                stack.push_back({ split, item.end, thisNodeIndex, false });
+                stack.push_back({ item.begin, split, thisNodeIndex, true });
             }
 
             // Update child link of the parent
             if (parentIndex != -1)
             {
-                if (!item->right)
+                if (!item.right)
                 {
-                    bvh.m_nodes[parentIndex].internalNode.leftNodeIndex = thisNodeIndex;
-                    bvh.m_nodes[parentIndex].rightNodeIndex = parentIndex + 1;
+                    nodes[parentIndex].internalNode.leftNodeIndex = thisNodeIndex;
+                    nodes[parentIndex].rightNodeIndex = parentIndex + 1;
                 }
             }
-
-            // Free the item after use
-            delete item;
         }
     }
 
-    void BuildUniformBVH(
-        _In_  UINT NumElements,
-        _In_reads_opt_(NumElements)  const D3D12_RAYTRACING_GEOMETRY_DESC *pGeometries,
-        BVH &bvh)
-    {
-        using namespace DirectX;
-        //
-        // Compute number of triangles
-        //
+    //
+    // Subtrees with at least this many triangles build their left child as a separate task
+    //
 
-        UINT    totalNumberOfTriangles = 0;
+    static const UINT32 PARALLEL_SUBTREE_MIN_TRIS = 4 * 1024;
 
-        for (UINT i = 0; i < NumElements; ++i)
+    //
+    // The nodes one task built, already in the final order, except that the left subtrees
+    // of its parallel splits were built by other tasks and still need to be inserted,
+    // each before local node nodeInsertIndex
+    //
+
+    struct BVHFragment
+    {
+        struct Child
         {
-            auto &geometry = pGeometries[i];
-            if (geometry.Type == D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES)
-            {
-                totalNumberOfTriangles += GetPrimitiveCountFromGeometryDesc(geometry);
-            }
-            else
-            {
-                throw - 1; // Intersection shaders not supported yet
-            }
+            UINT32  parentIndex;
+            UINT32  nodeInsertIndex;
+            std::unique_ptr<BVHFragment> fragment;
+        };
 
-        }
+        std::vector<AABBNode>   m_nodes;
+        std::vector<Child>      m_children;     // In insertion order
+        UINT32                  m_totalNodes;   // Including the children's
+    };
 
-        //
-        // Create AABBs
-        //
+    static
+        void BuildBVHFragment(
+            BVHFragment& fragment,
+            const std::vector<AABB>& boxes,
+            PrimitiveMetaData* metadata,
+            UINT32 begin,
+            UINT32 end,
+            UINT32 maxTrisInLeaf)
+    {
+        const UINT32 numTrianglesInNode = end - begin;
+        if (numTrianglesInNode < PARALLEL_SUBTREE_MIN_TRIS || numTrianglesInNode <= maxTrisInLeaf)
+        {
+            BuildBVHSubtree(fragment.m_nodes, boxes, metadata, begin, end, maxTrisInLeaf);
+            return;
+        }
 
-        std::vector<AABB> boxes;
-        boxes.resize(totalNumberOfTriangles);
+        AABB nodeBox;
+        ComputeBox(nodeBox, boxes, metadata + begin, numTrianglesInNode);
 
-        std::vector<PrimitiveMetaData> primitiveMetaData;
-        primitiveMetaData.resize(totalNumberOfTriangles);
+        UINT splitDimension;
+        const UINT32 split = begin + PartitionPrimitives(metadata + begin, numTrianglesInNode, splitDimension, nodeBox, boxes);
 
-        std::vector<float>  triangleVertices;
-        triangleVertices.resize(totalNumberOfTriangles * 9);
+        const UINT32 thisNodeIndex = BuildBVHAddNode(fragment.m_nodes, nodeBox, splitDimension);
+        fragment.m_nodes[thisNodeIndex].rightNodeIndex = thisNodeIndex + 1;
 
-        UINT triangleIndex = 0;
-        for (UINT i = 0; i < NumElements; ++i)
+        // The left child is stolen by an idle thread, or built here once the right one is done.
+        // Their triangles don't overlap, so both partition the same array.
+        std::unique_ptr<BVHFragment> leftFragment(new BVHFragment);
+        concurrency::task_group tasks;
+        tasks.run([&]
         {
-            auto &geometry = pGeometries[i];
-            if (geometry.Type != D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES)
-            {
-                throw - 1; // Intersection shaders not supported yet
-            }
+            BuildBVHFragment(*leftFragment, boxes, metadata, split, end, maxTrisInLeaf);
+        });
+        BuildBVHFragment(fragment, boxes, metadata, begin, split, maxTrisInLeaf);
+        tasks.wait();
+
+        BVHFragment::Child child;
+        child.parentIndex = thisNodeIndex;
+        child.nodeInsertIndex = (UINT32)fragment.m_nodes.size();
+        child.fragment = std::move(leftFragment);
+        fragment.m_children.push_back(std::move(child));
+    }
 
-            auto &triangles = geometry.Triangles;
-            if (GetPrimitiveCountFromGeometryDesc(geometry) == 0)
+    static
+        void ComputeFragmentTotals(
+            BVHFragment& fragment)
+    {
+        fragment.m_totalNodes = (UINT32)fragment.m_nodes.size();
 
-            {
-                continue;
-            }
+        for (auto& child : fragment.m_children)
+        {
+            ComputeFragmentTotals(*child.fragment);
+            fragment.m_totalNodes += child.fragment->m_totalNodes;
+        }
+    }
 
-            // 
-            const UINT64 vertexStrideDwords = triangles.VertexBuffer.StrideInBytes / 4;
-            const UINT numTris = GetPrimitiveCountFromGeometryDesc(geometry);
+    //
+    // Copies a fragment and, in parallel, its children into their final place, fixing up
+    // the node indices on the way
+    //
+
+    static
+        void PlaceBVHFragment(
+            std::vector<AABBNode>& nodes,
+            const BVHFragment& fragment,
+            UINT32 nodeBase)
+    {
+        const auto& children = fragment.m_children;
+        const UINT32 numChildren = (UINT32)children.size();
 
-            float *pVertexData = (float *)geometry.Triangles.VertexBuffer.StartAddress;
-            float *pIndexData = (float *)geometry.Triangles.IndexBuffer;
+        // Sizes of the children inserted before child i
+        std::vector<UINT32> nodeShift(numChildren + 1, 0);
+        for (UINT32 i = 0; i < numChildren; ++i)
+        {
+            nodeShift[i + 1] = nodeShift[i] + children[i].fragment->m_totalNodes;
+        }
 
-            const float* pVertices = (float*)(pVertexData);
-            const UINT16* pIndices = (UINT16*)(pIndexData);
+        // Every node a child was inserted at or before moves past it
+        auto placeNode = [&](UINT32 index) -> UINT32
+        {
+            auto next = std::upper_bound(children.begin(), children.end(), index,
+                [](UINT32 i, const BVHFragment::Child& child) { return i < child.nodeInsertIndex; });
+            return nodeBase + index + nodeShift[next - children.begin()];
+        };
 
-            for (UINT j = 0; j < numTris; ++j)
+        concurrency::task_group tasks;
+        for (UINT32 i = 0; i < numChildren; ++i)
+        {
+            const UINT32 childNodeBase = nodeBase + children[i].nodeInsertIndex + nodeShift[i];
+            const BVHFragment* pChild = children[i].fragment.get();
+            tasks.run([&nodes, pChild, childNodeBase]
             {
-                const UINT16 i0 = pIndices[j * 3 + 0];
-                const UINT16 i1 = pIndices[j * 3 + 1];
-                const UINT16 i2 = pIndices[j * 3 + 2];
+                PlaceBVHFragment(nodes, *pChild, childNodeBase);
+            });
+        }
 
-                const float* v0 = &pVertices[i0 * vertexStrideDwords];
-                const float* v1 = &pVertices[i1 * vertexStrideDwords];
-                const float* v2 = &pVertices[i2 * vertexStrideDwords];
+        for (UINT32 i = 0; i < (UINT32)fragment.m_nodes.size(); ++i)
+        {
+            AABBNode node = fragment.m_nodes[i];
+            if (!node.leaf)
+            {
+                node.internalNode.leftNodeIndex = placeNode(node.internalNode.leftNodeIndex);
+                node.rightNodeIndex = placeNode(node.rightNodeIndex);
+            }
+            nodes[placeNode(i)] = node;
+        }
+
+        // Parallel splits point at the left subtree the other task built
+        for (UINT32 i = 0; i < numChildren; ++i)
+        {
+            nodes[placeNode(children[i].parentIndex)].internalNode.leftNodeIndex =
+                nodeBase + children[i].nodeInsertIndex + nodeShift[i];
+        }
+
+        tasks.wait();
+    }
+
+    //
+    // It's a good idea to do a breadth-first build because then nodes from the same level
+    // get adjacent memory locations. It does take a lot of memory though.
+    //
+    // "Uniform BVH"
+    // -- both children are valid for all internal nodes
+    // -- left child's index is +1 of the parent index, right child's index is stored
+    //    in the packed AABB structure.
+    // -- there could be a varaible number of triangles in leaves
+    //
+    // Large nodes bin their triangles in parallel and hand their left subtree to another
+    // task; once nodes are small enough each subtree is built by one thread. The result is
+    // the same as building the whole tree on one thread, which is what a scheduler with a
+    // single virtual processor does.
+    //
+    // The triangles are partitioned in place in bvh.m_metadata, and nodes refer to ranges
+    // of it, so the build needs no memory per node beyond the nodes themselves.
+    //
+    static
+        void BuildBVH(
+            BVH& bvh,
+            const std::vector<AABB>& boxes,
+            const std::vector<PrimitiveMetaData>& primitiveMetaData,
+            UINT32 maxTrisInLeaf)
+    {
+        assert(bvh.m_nodes.empty());
+
+        bvh.m_metadata = primitiveMetaData;
+        if (!IsBuildParallel())
+        {
+            BuildBVHSubtree(bvh.m_nodes, boxes, bvh.m_metadata.data(), 0, (UINT32)bvh.m_metadata.size(), maxTrisInLeaf);
+            return;
+        }
+
+        BVHFragment root;
+        BuildBVHFragment(root, boxes, bvh.m_metadata.data(), 0, (UINT32)bvh.m_metadata.size(), maxTrisInLeaf);
+
+        if (root.m_children.empty())
+        {
+            bvh.m_nodes = std::move(root.m_nodes);
+            return;
+        }
+
+        ComputeFragmentTotals(root);
+        bvh.m_nodes.resize(root.m_totalNodes);
+        PlaceBVHFragment(bvh.m_nodes, root, 0);
+    }
+
+    //
+    // Subtrees of an LBVH with at least this many leaves emit their left child as a separate task
+    //
+
+    static const UINT32 PARALLEL_LBVH_MIN_LEAVES = 4 * 1024;
+
+    struct LBVHBuild
+    {
+        const std::vector<AABB>*    m_pBoxes;
+        std::vector<UINT32>         m_sortedIndices;
+        std::vector<HierarchyNode>  m_hierarchy;
+        AABBNode*                   m_pNodes;
+    };
+
+    //
+    // Writes hierarchy node hierarchyIndex, which covers sorted elements first to last, and
+    // its subtree at nodeIndex in the order BuildBVH() emits them: a node, its right subtree,
+    // then its left one. Returns the subtree's box.
+    //
+
+    static
+        AABB EmitLBVHNode(
+            LBVHBuild& build,
+            UINT32 hierarchyIndex,
+            UINT32 first,
+            UINT32 last,
+            UINT32 nodeIndex)
+    {
+        const UINT32 leafNodeOffset = (UINT32)build.m_sortedIndices.size() - 1;
+        AABBNode& node = build.m_pNodes[nodeIndex];
+
+        if (hierarchyIndex >= leafNodeOffset)
+        {
+            const AABB& box = (*build.m_pBoxes)[build.m_sortedIndices[first]];
+            PackAABBNode(node, box);
+            node.nodeAllBits = 0;
+            node.leaf = true;
+            node.leafNode.firstTriangleId = first;
+            node.leafNode.numTriangleIds = 1;
+            return box;
+        }
+
+        // The left child covers first to split, whether it's a leaf or the internal node split
+        const HierarchyNode& hierarchyNode = build.m_hierarchy[hierarchyIndex];
+        const UINT32 leftIndex = hierarchyNode.LeftChildIndex;
+        const UINT32 split = leftIndex >= leafNodeOffset ? leftIndex - leafNodeOffset : leftIndex;
+
+        const UINT32 rightNodeIndex = nodeIndex + 1;
+        const UINT32 leftNodeIndex = nodeIndex + 2 * (last - split);
+
+        AABB leftBox;
+        AABB rightBox;
+        if (last - first + 1 >= PARALLEL_LBVH_MIN_LEAVES)
+        {
+            concurrency::task_group tasks;
+            tasks.run([&]
+            {
+                leftBox = EmitLBVHNode(build, leftIndex, first, split, leftNodeIndex);
+            });
+            rightBox = EmitLBVHNode(build, hierarchyNode.RightChildIndex, split + 1, last, rightNodeIndex);
+            tasks.wait();
+        }
+        else
+        {
+            rightBox = EmitLBVHNode(build, hierarchyNode.RightChildIndex, split + 1, last, rightNodeIndex);
+            leftBox = EmitLBVHNode(build, leftIndex, first, split, leftNodeIndex);
+        }
+
+        AABB box = leftBox;
+        AddExtentToBox(box, rightBox);
+        PackAABBNode(node, box);
+        node.nodeAllBits = 0;
+        node.internalNode.leftNodeIndex = leftNodeIndex;
+        node.rightNodeIndex = rightNodeIndex;
+        return box;
+    }
+
+    //
+    // PREFER_FAST_BUILD: the LBVH of GpuBvh2Builder, over 63-bit Morton codes of the box
+    // centers. Sorting the codes is all it takes to order the primitives, and the tree is
+    // read off the sorted codes, so there's no binning. Trees take more box tests to trace
+    // than BuildBVH() ones, but have the same layout, so they're traced, refit and
+    // updated the same way.
+    //
+
+    static
+        void BuildLBVH(
+            BVH& bvh,
+            const std::vector<AABB>& boxes,
+            const std::vector<PrimitiveMetaData>& primitiveMetaData)
+    {
+        assert(bvh.m_nodes.empty());
+
+        const UINT32 numElements = (UINT32)boxes.size();
+        if (numElements < 2)
+        {
+            BuildBVH(bvh, boxes, primitiveMetaData, MAX_TRIS_IN_LEAF);
+            return;
+        }
+
+        std::vector<float3> centroids(numElements);
+        const UINT32 numChunks = (numElements + PARALLEL_SCAN_CHUNK_SIZE - 1) / PARALLEL_SCAN_CHUNK_SIZE;
+        std::vector<AABB> chunkBounds(numChunks);
+        concurrency::parallel_for(0u, numChunks, [&](UINT32 chunk)
+        {
+            const UINT32 first = chunk * PARALLEL_SCAN_CHUNK_SIZE;
+            const UINT32 end = std::min(first + PARALLEL_SCAN_CHUNK_SIZE, numElements);
+
+            AABB& bounds = chunkBounds[chunk];
+            InitBoxToInverseMax(bounds);
+            for (UINT32 i = first; i < end; ++i)
+            {
+                centroids[i] = (boxes[i].min + boxes[i].max) * 0.5f;
+                const AABB centroidBox = { centroids[i], centroids[i] };
+                AddExtentToBox(bounds, centroidBox);
+            }
+        });
+
+        AABB sceneBounds = chunkBounds[0];
+        for (UINT32 chunk = 1; chunk < numChunks; ++chunk)
+        {
+            AddExtentToBox(sceneBounds, chunkBounds[chunk]);
+        }
+
+        LBVHBuild build;
+        build.m_pBoxes = &boxes;
+        build.m_sortedIndices.resize(numElements);
+        const UINT32 numNodes = numElements + GetNumInternalNodes(numElements);
+        build.m_hierarchy.resize(numNodes);
+
+        std::vector<UINT64> mortonCodes(numElements);
+        CalculateMortonCodesOnCpu(centroids.data(), numElements, sceneBounds, mortonCodes.data(), build.m_sortedIndices.data());
+        SortMortonCodesOnCpu(mortonCodes.data(), build.m_sortedIndices.data(), numElements);
+        ConstructHierarchyOnCpu(mortonCodes.data(), numElements, build.m_hierarchy.data());
+
+        bvh.m_metadata.resize(numElements);
+        concurrency::parallel_for(0u, numChunks, [&](UINT32 chunk)
+        {
+            const UINT32 first = chunk * PARALLEL_SCAN_CHUNK_SIZE;
+            const UINT32 end = std::min(first + PARALLEL_SCAN_CHUNK_SIZE, numElements);
+            for (UINT32 i = first; i < end; ++i)
+            {
+                bvh.m_metadata[i] = primitiveMetaData[build.m_sortedIndices[i]];
+            }
+        });
+
+        bvh.m_nodes.resize(numNodes);
+        build.m_pNodes = bvh.m_nodes.data();
+        EmitLBVHNode(build, 0, 0, numElements - 1, 0);
+    }
+
+    //
+    // Treelet reordering as TreeletReorder.hlsl does it, after Karras and Aila, "Fast Parallel
+    // Construction of High-Quality Bounding Volume Hierarchies". Bottom up, every node with at
+    // least a pass's number of leaves is the root of a treelet: it's split into FullTreeletSize
+    // subtrees by splitting the one with the largest box over and over, and those are put back
+    // together in whichever of the ways to do it has the lowest SAH cost. Passes start at
+    // FullTreeletSize leaves and double it each time.
+    //
+
+    static const UINT32 NUM_TREELET_REORDER_PASSES = 3;
+    static const UINT32 TREELET_SUBSETS = 1 << FullTreeletSize;
+
+    //
+    // Subtrees with at least this many leaves reorder their left child's subtree as a separate task
+    //
+
+    static const UINT32 PARALLEL_TREELET_MIN_LEAVES = 4 * 1024;
+
+    struct TreeletNode
+    {
+        AABB    box;
+        float   area;
+        UINT32  leftChild;
+        UINT32  rightChild;
+        UINT32  numLeaves;
+    };
+
+    static
+        UINT32 CountTreeletLeaves(
+            std::vector<TreeletNode>& tree,
+            UINT32 nodeIndex)
+    {
+        TreeletNode& node = tree[nodeIndex];
+        if (node.numLeaves == 0)
+        {
+            node.numLeaves = CountTreeletLeaves(tree, node.leftChild) + CountTreeletLeaves(tree, node.rightChild);
+        }
+        return node.numLeaves;
+    }
+
+    //
+    // Returns true if the treelet at rootIndex was rearranged
+    //
+
+    static
+        bool ReorderTreelet(
+            std::vector<TreeletNode>& tree,
+            UINT32 rootIndex)
+    {
+        UINT32 treeletLeaves[FullTreeletSize];
+        UINT32 internalNodes[FullTreeletSize - 1];
+        internalNodes[0] = rootIndex;
+        treeletLeaves[0] = tree[rootIndex].leftChild;
+        treeletLeaves[1] = tree[rootIndex].rightChild;
+
+        for (UINT32 treeletSize = 2; treeletSize < FullTreeletSize; ++treeletSize)
+        {
+            float largestArea = -1.0f;
+            UINT32 leafToSplit = 0;
+            for (UINT32 i = 0; i < treeletSize; ++i)
+            {
+                const TreeletNode& node = tree[treeletLeaves[i]];
+                if (node.numLeaves > 1 && node.area > largestArea)
+                {
+                    largestArea = node.area;
+                    leafToSplit = i;
+                }
+            }
+            assert(largestArea >= 0.0f);
+
+            const TreeletNode& nodeToSplit = tree[treeletLeaves[leafToSplit]];
+            internalNodes[treeletSize - 1] = treeletLeaves[leafToSplit];
+            treeletLeaves[leafToSplit] = nodeToSplit.leftChild;
+            treeletLeaves[treeletSize] = nodeToSplit.rightChild;
+        }
+
+        // Box of every subset of the treelet's leaves, the lowest cost of a subtree over it
+        // and the subset its left child gets there. Subsets come after all of their own subsets.
+        AABB subsetBoxes[TREELET_SUBSETS];
+        float subsetAreas[TREELET_SUBSETS];
+        float optimalCosts[TREELET_SUBSETS];
+        BYTE optimalPartitions[TREELET_SUBSETS];
+        for (UINT32 subset = 1; subset < TREELET_SUBSETS; ++subset)
+        {
+            const UINT32 lowestBit = subset & (0 - subset);
+            unsigned long leafIndex;
+            _BitScanForward(&leafIndex, lowestBit);
+
+            subsetBoxes[subset] = tree[treeletLeaves[leafIndex]].box;
+            if (subset == lowestBit)
+            {
+                // A leaf costs the same wherever it goes
+                subsetAreas[subset] = tree[treeletLeaves[leafIndex]].area;
+                optimalCosts[subset] = 0.0f;
+                optimalPartitions[subset] = 0;
+                continue;
+            }
+
+            AddExtentToBox(subsetBoxes[subset], subsetBoxes[subset ^ lowestBit]);
+            subsetAreas[subset] = ComputeBoxSurfaceArea(subsetBoxes[subset]);
+
+            // Each way to split it in two once, with the lowest leaf on the left
+            float lowestCost = FLT_MAX;
+            UINT32 bestPartition = 0;
+            const UINT32 otherLeaves = subset ^ lowestBit;
+            UINT32 otherLeavesOnLeft = otherLeaves;
+            do
+            {
+                otherLeavesOnLeft = (otherLeavesOnLeft - 1) & otherLeaves;
+                const UINT32 partition = lowestBit | otherLeavesOnLeft;
+                const float cost = optimalCosts[partition] + optimalCosts[subset ^ partition];
+                if (cost < lowestCost)
+                {
+                    lowestCost = cost;
+                    bestPartition = partition;
+                }
+            } while (otherLeavesOnLeft != 0);
+
+            optimalCosts[subset] = subsetAreas[subset] + lowestCost;
+            optimalPartitions[subset] = (BYTE)bestPartition;
+        }
+
+        // The cost of the treelet as it is, from the same subset areas so that it ties exactly
+        // when nothing better was found
+        UINT32 nodeSubsets[2 * FullTreeletSize - 1];
+        UINT32 treeletNodes[2 * FullTreeletSize - 1];
+        for (UINT32 i = 0; i < FullTreeletSize; ++i)
+        {
+            treeletNodes[i] = treeletLeaves[i];
+            nodeSubsets[i] = 1 << i;
+        }
+        auto getSubset = [&](UINT32 nodeIndex, UINT32 numTreeletNodes)
+        {
+            for (UINT32 i = 0; i < numTreeletNodes; ++i)
+            {
+                if (treeletNodes[i] == nodeIndex)
+                {
+                    return nodeSubsets[i];
+                }
+            }
+            assert(false);
+            return 0u;
+        };
+
+        float currentCost = 0.0f;
+        UINT32 numTreeletNodes = FullTreeletSize;
+        for (UINT32 i = FullTreeletSize - 1; i-- > 0;)
+        {
+            const TreeletNode& node = tree[internalNodes[i]];
+            const UINT32 subset = getSubset(node.leftChild, numTreeletNodes) | getSubset(node.rightChild, numTreeletNodes);
+            treeletNodes[numTreeletNodes] = internalNodes[i];
+            nodeSubsets[numTreeletNodes++] = subset;
+            currentCost += subsetAreas[subset];
+        }
+
+        if (!(optimalCosts[TREELET_SUBSETS - 1] < currentCost))
+        {
+            return false;
+        }
+
+        // Hand the internal nodes out top down, then fix their boxes up bottom up
+        struct PartitionEntry
+        {
+            UINT32 subset;
+            UINT32 nodeIndex;
+        };
+        PartitionEntry allocatedNodes[FullTreeletSize - 1];
+        PartitionEntry partitionStack[FullTreeletSize - 1];
+        UINT32 numAllocatedNodes = 1;
+        UINT32 partitionStackSize = 1;
+        allocatedNodes[0] = partitionStack[0] = { TREELET_SUBSETS - 1, rootIndex };
+
+        auto getChild = [&](UINT32 subset)
+        {
+            unsigned long leafIndex;
+            _BitScanForward(&leafIndex, subset);
+            if ((subset & (subset - 1)) == 0)
+            {
+                return treeletLeaves[leafIndex];
+            }
+
+            const PartitionEntry entry = { subset, internalNodes[numAllocatedNodes] };
+            allocatedNodes[numAllocatedNodes++] = entry;
+            partitionStack[partitionStackSize++] = entry;
+            return entry.nodeIndex;
+        };
+
+        while (partitionStackSize > 0)
+        {
+            const PartitionEntry partition = partitionStack[--partitionStackSize];
+            const UINT32 leftSubset = optimalPartitions[partition.subset];
+            TreeletNode& node = tree[partition.nodeIndex];
+            node.leftChild = getChild(leftSubset);
+            node.rightChild = getChild(partition.subset ^ leftSubset);
+        }
+
+        for (UINT32 i = FullTreeletSize - 1; i-- > 0;)
+        {
+            TreeletNode& node = tree[allocatedNodes[i].nodeIndex];
+            node.box = subsetBoxes[allocatedNodes[i].subset];
+            node.area = subsetAreas[allocatedNodes[i].subset];
+            node.numLeaves = tree[node.leftChild].numLeaves + tree[node.rightChild].numLeaves;
+        }
+
+        return true;
+    }
+
+    static
+        UINT32 ReorderTreelets(
+            std::vector<TreeletNode>& tree,
+            UINT32 nodeIndex,
+            UINT32 minLeavesInTreelet)
+    {
+        const TreeletNode& node = tree[nodeIndex];
+        if (node.numLeaves < minLeavesInTreelet)
+        {
+            return 0;
+        }
+
+        UINT32 numReordered;
+        if (node.numLeaves >= PARALLEL_TREELET_MIN_LEAVES)
+        {
+            UINT32 numReorderedOnLeft = 0;
+            concurrency::task_group tasks;
+            tasks.run([&]
+            {
+                numReorderedOnLeft = ReorderTreelets(tree, node.leftChild, minLeavesInTreelet);
+            });
+            numReordered = ReorderTreelets(tree, node.rightChild, minLeavesInTreelet);
+            tasks.wait();
+            numReordered += numReorderedOnLeft;
+        }
+        else
+        {
+            numReordered = ReorderTreelets(tree, node.rightChild, minLeavesInTreelet) +
+                ReorderTreelets(tree, node.leftChild, minLeavesInTreelet);
+        }
+
+        return numReordered + (ReorderTreelet(tree, nodeIndex) ? 1 : 0);
+    }
+
+    //
+    // Writes the subtree at nodeIndex to nodes, at outputIndex and in the order BuildBVH() emits them
+    //
+
+    static
+        void EmitTreeletNode(
+            AABBNode* nodes,
+            const std::vector<AABBNode>& inputNodes,
+            const std::vector<TreeletNode>& tree,
+            UINT32 nodeIndex,
+            UINT32 outputIndex)
+    {
+        const TreeletNode& node = tree[nodeIndex];
+        if (inputNodes[nodeIndex].leaf)
+        {
+            nodes[outputIndex] = inputNodes[nodeIndex];
+            return;
+        }
+
+        const UINT32 rightOutputIndex = outputIndex + 1;
+        const UINT32 leftOutputIndex = outputIndex + 2 * tree[node.rightChild].numLeaves;
+        AABBNode& outputNode = nodes[outputIndex];
+        PackAABBNode(outputNode, node.box);
+        outputNode.nodeAllBits = 0;
+        outputNode.internalNode.leftNodeIndex = leftOutputIndex;
+        outputNode.rightNodeIndex = rightOutputIndex;
+
+        if (node.numLeaves >= PARALLEL_TREELET_MIN_LEAVES)
+        {
+            concurrency::task_group tasks;
+            tasks.run([&]
+            {
+                EmitTreeletNode(nodes, inputNodes, tree, node.leftChild, leftOutputIndex);
+            });
+            EmitTreeletNode(nodes, inputNodes, tree, node.rightChild, rightOutputIndex);
+            tasks.wait();
+        }
+        else
+        {
+            EmitTreeletNode(nodes, inputNodes, tree, node.rightChild, rightOutputIndex);
+            EmitTreeletNode(nodes, inputNodes, tree, node.leftChild, leftOutputIndex);
+        }
+    }
+
+    //
+    // Reorders the nodes of any Fallback BVH, whichever layout they're in, and writes them
+    // back in the layout BuildBVH() produces. Leaves are kept as they are. Returns the
+    // number of treelets that were rearranged.
+    //
+
+    static
+        UINT32 ReorderTreeletsOfBVH(
+            AABBNode* nodes,
+            UINT32 numNodes,
+            UINT32 numPasses)
+    {
+        if (numNodes < 2 * FullTreeletSize - 1)
+        {
+            return 0;
+        }
+
+        const std::vector<AABBNode> inputNodes(nodes, nodes + numNodes);
+        std::vector<TreeletNode> tree(numNodes);
+        concurrency::parallel_for(0u, (numNodes + PARALLEL_SCAN_CHUNK_SIZE - 1) / PARALLEL_SCAN_CHUNK_SIZE, [&](UINT32 chunk)
+        {
+            const UINT32 first = chunk * PARALLEL_SCAN_CHUNK_SIZE;
+            const UINT32 end = std::min(first + PARALLEL_SCAN_CHUNK_SIZE, numNodes);
+            for (UINT32 i = first; i < end; ++i)
+            {
+                TreeletNode& node = tree[i];
+                DecompressAABB(node.box, inputNodes[i]);
+                node.area = ComputeBoxSurfaceArea(node.box);
+                node.leftChild = inputNodes[i].leaf ? 0 : inputNodes[i].internalNode.leftNodeIndex;
+                node.rightChild = inputNodes[i].leaf ? 0 : inputNodes[i].rightNodeIndex;
+                node.numLeaves = inputNodes[i].leaf ? 1 : 0;
+            }
+        });
+        CountTreeletLeaves(tree, 0);
+
+        UINT32 numReordered = 0;
+        UINT32 minLeavesInTreelet = FullTreeletSize;
+        for (UINT32 pass = 0; pass < numPasses && minLeavesInTreelet <= tree[0].numLeaves; ++pass)
+        {
+            numReordered += ReorderTreelets(tree, 0, minLeavesInTreelet);
+            minLeavesInTreelet *= 2;
+        }
+
+        EmitTreeletNode(nodes, inputNodes, tree, 0, 0);
+        return numReordered;
+    }
+
+    //
+    // Spatial splits, after Stich et al., "Spatial Splits in Bounding Volume Hierarchies".
+    // Long, thin triangles at an angle to the axes have boxes much larger than themselves,
+    // and those overlap however they are split between two children. A spatial split cuts
+    // the node along a plane instead: triangles crossing it go to both children, each with
+    // the box of its part on that side.
+    //
+    // Nodes only look for one if the children of their best object split overlap by more
+    // than overlapThreshold of the root's surface area, so raising it builds faster and
+    // traces slower. Every triangle sent to both sides adds a primitive to the output, and
+    // there may be up to duplicateBudget times the number of triangles of those.
+    //
+
+    struct SpatialSplitSettings
+    {
+        float   overlapThreshold;
+        float   duplicateBudget;
+    };
+
+    static
+        UINT GetMaxSpatialSplitDuplicates(
+            UINT numTriangles,
+            float duplicateBudget)
+    {
+        return (UINT)(std::max(duplicateBudget, 0.0f) * numTriangles);
+    }
+
+    //
+    // LoadTriangle() pads the max of triangle boxes by this much
+    //
+
+#define AABB_Min_Padding 0.001f
+
+    static const UINT NUM_SPATIAL_BINS = 32;
+
+    //
+    // The triangles of a node, or their parts. metadata[i].PrimitiveIndex indexes boxes and
+    // triangles, so BuildBVH()'s binned object split works on them as they are.
+    //
+
+    struct SplitReferences
+    {
+        std::vector<PrimitiveMetaData>  metadata;
+        std::vector<AABB>               boxes;
+        std::vector<UINT32>             triangles;
+        UINT32                          duplicateBudget;
+    };
+
+    struct SplitBVHBuild
+    {
+        const float*                m_pTriangleVertices;    // 9 for each triangle
+        const PrimitiveMetaData*    m_pMetadata;            // Of each triangle
+        float                       m_minOverlapArea;
+    };
+
+    //
+    // The nodes one task built, in the final order, and the metadata of the leaves' triangles
+    //
+
+    struct SplitBVHFragment
+    {
+        std::vector<AABBNode>           m_nodes;
+        std::vector<PrimitiveMetaData>  m_metadata;
+    };
+
+    static
+        void AddSplitReference(
+            SplitReferences& references,
+            const AABB& box,
+            UINT32 triangle)
+    {
+        PrimitiveMetaData metadata = {};
+        metadata.PrimitiveIndex = (UINT)references.boxes.size();
+        references.metadata.push_back(metadata);
+        references.boxes.push_back(box);
+        references.triangles.push_back(triangle);
+    }
+
+    static
+        bool IsBoxEmpty(
+            const AABB& box)
+    {
+        return box.min.x > box.max.x || box.min.y > box.max.y || box.min.z > box.max.z;
+    }
+
+    //
+    // Boxes of the parts of a triangle on either side of the plane at position along axis,
+    // within the box of the part being split. A side the part doesn't reach gets an empty box.
+    //
+
+    static
+        void SplitTriangleReference(
+            AABB& leftBox,
+            AABB& rightBox,
+            const float* pTriangle,
+            const AABB& box,
+            UINT axis,
+            float position)
+    {
+        InitBoxToInverseMax(leftBox);
+        InitBoxToInverseMax(rightBox);
+
+        auto addPoint = [](AABB& partBox, const float* point)
+        {
+            for (UINT k = 0; k < 3; ++k)
+            {
+                partBox.minArr[k] = std::min(partBox.minArr[k], point[k]);
+                partBox.maxArr[k] = std::max(partBox.maxArr[k], point[k]);
+            }
+        };
+
+        for (UINT i = 0; i < 3; ++i)
+        {
+            const float* v0 = &pTriangle[i * 3];
+            const float* v1 = &pTriangle[((i + 1) % 3) * 3];
+            if (v0[axis] <= position)
+            {
+                addPoint(leftBox, v0);
+            }
+            if (v0[axis] >= position)
+            {
+                addPoint(rightBox, v0);
+            }
+
+            // Where an edge crosses the plane is on both sides
+            if ((v0[axis] < position && v1[axis] > position) || (v0[axis] > position && v1[axis] < position))
+            {
+                const float t = (position - v0[axis]) / (v1[axis] - v0[axis]);
+                float crossing[3];
+                for (UINT k = 0; k < 3; ++k)
+                {
+                    crossing[k] = v0[k] + (v1[k] - v0[k]) * t;
+                }
+                crossing[axis] = position;
+
+                addPoint(leftBox, crossing);
+                addPoint(rightBox, crossing);
+            }
+        }
+
+        // Padding covers the rounding of the crossings
+        for (AABB* pPartBox : { &leftBox, &rightBox })
+        {
+            for (UINT k = 0; k < 3; ++k)
+            {
+                pPartBox->minArr[k] = std::max(pPartBox->minArr[k] - AABB_Min_Padding, box.minArr[k]);
+                pPartBox->maxArr[k] = std::min(pPartBox->maxArr[k] + AABB_Min_Padding, box.maxArr[k]);
+            }
+
+            if (IsBoxEmpty(*pPartBox))
+            {
+                InitBoxToInverseMax(*pPartBox);
+            }
+        }
+    }
+
+    struct SpatialBin
+    {
+        AABB    box;
+        UINT    numEntries;     // References whose first bin this is
+        UINT    numExits;       // References whose last bin this is
+    };
+
+    struct SpatialBins
+    {
+        SpatialBin  bins[3][NUM_SPATIAL_BINS];
+    };
+
+    static
+        UINT GetSpatialBinIndex(
+            float position,
+            float rangeMin,
+            float inverseBinWidth)
+    {
+        return std::min(NUM_SPATIAL_BINS - 1,
+            UINT(std::max(0.0f, (position - rangeMin) * inverseBinWidth)));
+    }
+
+    //
+    // Splits the references at every bin boundary they cross, on all three axes, and adds
+    // each part to the bin it lands in
+    //
+
+    static
+        void BinSpatialSplits(
+            SpatialBins& spatialBins,
+            const SplitBVHBuild& build,
+            const SplitReferences& references,
+            UINT32 first,
+            UINT32 end,
+            const AABB& nodeBox)
+    {
+        float binWidths[3];
+        float inverseBinWidths[3];
+        for (UINT i = 0; i < 3; ++i)
+        {
+            const float extents = nodeBox.maxArr[i] - nodeBox.minArr[i];
+            binWidths[i] = extents / NUM_SPATIAL_BINS;
+            inverseBinWidths[i] = extents == 0 ? 0 : NUM_SPATIAL_BINS / extents;
+
+            for (UINT j = 0; j < NUM_SPATIAL_BINS; ++j)
+            {
+                spatialBins.bins[i][j].numEntries = 0;
+                spatialBins.bins[i][j].numExits = 0;
+                InitBoxToInverseMax(spatialBins.bins[i][j].box);
+            }
+        }
+
+        for (UINT32 j = first; j < end; ++j)
+        {
+            const AABB& box = references.boxes[j];
+            const float* pTriangle = &build.m_pTriangleVertices[references.triangles[j] * 9];
+
+            for (UINT i = 0; i < 3; ++i)
+            {
+                if (inverseBinWidths[i] == 0)
+                {
+                    continue;
+                }
+
+                SpatialBin* bins = spatialBins.bins[i];
+                const UINT firstBin = GetSpatialBinIndex(box.minArr[i], nodeBox.minArr[i], inverseBinWidths[i]);
+                const UINT lastBin = GetSpatialBinIndex(box.maxArr[i], nodeBox.minArr[i], inverseBinWidths[i]);
+
+                AABB remainder = box;
+                for (UINT bin = firstBin; bin < lastBin; ++bin)
+                {
+                    const AABB partToSplit = remainder;
+                    AABB part;
+                    SplitTriangleReference(part, remainder, pTriangle, partToSplit, i, nodeBox.minArr[i] + (bin + 1) * binWidths[i]);
+                    AddExtentToBox(bins[bin].box, part);
+                }
+                AddExtentToBox(bins[lastBin].box, remainder);
+
+                bins[firstBin].numEntries++;
+                bins[lastBin].numExits++;
+            }
+        }
+    }
+
+    //
+    // SAH estimate for a child given its box and references. With one triangle per leaf a
+    // subtree over n references has 2n - 1 boxes to test, so a duplicate costs a leaf and a
+    // node above it rather than just a primitive test; counting only the references spends
+    // the budget on splits the finished tree doesn't gain from.
+    //
+
+    static inline
+        float ComputeChildCost(const AABB& box, float numReferences)
+    {
+        return ComputeBoxSurfaceArea(box) * (2.0f * numReferences - 1.0f);
+    }
+
+    struct SpatialSplit
+    {
+        float   cost;
+        UINT    axis;
+        UINT    bin;            // The plane is past this bin
+        AABB    leftBox;
+        AABB    rightBox;
+        UINT32  numLeft;
+        UINT32  numRight;
+    };
+
+    //
+    // Finds the bin boundary with the best SAH score among those that cross no more than
+    // duplicateBudget references. The boxes and counts are what the children get if every
+    // reference crossing the plane goes to both of them. Returns false if no plane leaves
+    // references on both sides within budget.
+    //
+
+    static
+        bool FindSpatialSplit(
+            SpatialSplit& split,
+            const SplitBVHBuild& build,
+            const SplitReferences& references,
+            const AABB& nodeBox,
+            UINT32 duplicateBudget)
+    {
+        const UINT32 numReferences = (UINT32)references.metadata.size();
+        SpatialBins spatialBins;
+
+        if (numReferences > PARALLEL_SCAN_CHUNK_SIZE)
+        {
+            // Bin chunks in parallel, then add up their bins
+            const UINT32 numChunks = (numReferences + PARALLEL_SCAN_CHUNK_SIZE - 1) / PARALLEL_SCAN_CHUNK_SIZE;
+            std::vector<SpatialBins> chunkBins(numChunks);
+            concurrency::parallel_for(0u, numChunks, [&](UINT32 chunk)
+            {
+                const UINT32 first = chunk * PARALLEL_SCAN_CHUNK_SIZE;
+                BinSpatialSplits(chunkBins[chunk], build, references, first, std::min(first + PARALLEL_SCAN_CHUNK_SIZE, numReferences), nodeBox);
+            });
+
+            spatialBins = chunkBins[0];
+            for (UINT32 chunk = 1; chunk < numChunks; ++chunk)
+            {
+                for (UINT i = 0; i < 3; ++i)
+                {
+                    for (UINT j = 0; j < NUM_SPATIAL_BINS; ++j)
+                    {
+                        spatialBins.bins[i][j].numEntries += chunkBins[chunk].bins[i][j].numEntries;
+                        spatialBins.bins[i][j].numExits += chunkBins[chunk].bins[i][j].numExits;
+                        AddExtentToBox(spatialBins.bins[i][j].box, chunkBins[chunk].bins[i][j].box);
+                    }
+                }
+            }
+        }
+        else
+        {
+            BinSpatialSplits(spatialBins, build, references, 0, numReferences, nodeBox);
+        }
+
+        split.cost = FLT_MAX;
+        for (UINT i = 0; i < 3; ++i)
+        {
+            if (nodeBox.maxArr[i] == nodeBox.minArr[i])
+            {
+                continue;
+            }
+
+            const SpatialBin* bins = spatialBins.bins[i];
+
+            AABB rightBoxes[NUM_SPATIAL_BINS];
+            UINT32 rightCounts[NUM_SPATIAL_BINS];
+            rightBoxes[NUM_SPATIAL_BINS - 1] = bins[NUM_SPATIAL_BINS - 1].box;
+            rightCounts[NUM_SPATIAL_BINS - 1] = bins[NUM_SPATIAL_BINS - 1].numExits;
+            for (UINT j = NUM_SPATIAL_BINS - 1; j-- > 0;)
+            {
+                rightBoxes[j] = rightBoxes[j + 1];
+                AddExtentToBox(rightBoxes[j], bins[j].box);
+                rightCounts[j] = rightCounts[j + 1] + bins[j].numExits;
+            }
+
+            AABB leftBox;
+            InitBoxToInverseMax(leftBox);
+            UINT32 numLeft = 0;
+            for (UINT j = 0; j < NUM_SPATIAL_BINS - 1; ++j)
+            {
+                AddExtentToBox(leftBox, bins[j].box);
+                numLeft += bins[j].numEntries;
+
+                const UINT32 numRight = rightCounts[j + 1];
+                if (numLeft == 0 || numRight == 0 || numLeft + numRight - numReferences > duplicateBudget)
+                {
+                    continue;
+                }
+
+                const float cost = ComputeChildCost(leftBox, (float)numLeft) +
+                    ComputeChildCost(rightBoxes[j + 1], (float)numRight);
+                if (cost < split.cost)
+                {
+                    split.cost = cost;
+                    split.axis = i;
+                    split.bin = j;
+                    split.leftBox = leftBox;
+                    split.rightBox = rightBoxes[j + 1];
+                    split.numLeft = numLeft;
+                    split.numRight = numRight;
+                }
+            }
+        }
+
+        return split.cost < FLT_MAX;
+    }
+
+    //
+    // Sends the references of a node to the children of a spatial split. A reference crossing
+    // the plane goes to both unless putting all of it on one side costs less ("unsplitting"),
+    // or its geometry doesn't allow its any-hit shader to run twice for a ray. Returns false if
+    // that leaves a child with nothing.
+    //
+
+    static
+        bool PartitionSpatialSplit(
+            SplitReferences& leftReferences,
+            SplitReferences& rightReferences,
+            const SplitBVHBuild& build,
+            const SplitReferences& references,
+            const AABB& nodeBox,
+            const SpatialSplit& split)
+    {
+        const UINT axis = split.axis;
+        const float rangeMin = nodeBox.minArr[axis];
+        const float extents = nodeBox.maxArr[axis] - rangeMin;
+        const float inverseBinWidth = NUM_SPATIAL_BINS / extents;
+        const float position = rangeMin + (split.bin + 1) * (extents / NUM_SPATIAL_BINS);
+        const UINT32 numReferences = (UINT32)references.metadata.size();
+
+        // Binned as it was binned, so no more references cross the plane than were counted
+        std::vector<UINT32> crossingReferences;
+        for (UINT32 j = 0; j < numReferences; ++j)
+        {
+            const AABB& box = references.boxes[j];
+            if (GetSpatialBinIndex(box.maxArr[axis], rangeMin, inverseBinWidth) <= split.bin)
+            {
+                AddSplitReference(leftReferences, box, references.triangles[j]);
+            }
+            else if (GetSpatialBinIndex(box.minArr[axis], rangeMin, inverseBinWidth) > split.bin)
+            {
+                AddSplitReference(rightReferences, box, references.triangles[j]);
+            }
+            else
+            {
+                crossingReferences.push_back(j);
+            }
+        }
+
+        AABB leftBox = split.leftBox;
+        AABB rightBox = split.rightBox;
+        for (UINT32 j : crossingReferences)
+        {
+            const AABB& box = references.boxes[j];
+            const UINT32 triangle = references.triangles[j];
+
+            AABB leftPart;
+            AABB rightPart;
+            SplitTriangleReference(leftPart, rightPart, &build.m_pTriangleVertices[triangle * 9], box, axis, position);
+            if (IsBoxEmpty(leftPart) != IsBoxEmpty(rightPart))
+            {
+                // Only rounding made it look like it crosses the plane
+                if (IsBoxEmpty(leftPart))
+                {
+                    AddExtentToBox(rightBox, rightPart);
+                    AddSplitReference(rightReferences, rightPart, triangle);
+                }
+                else
+                {
+                    AddExtentToBox(leftBox, leftPart);
+                    AddSplitReference(leftReferences, leftPart, triangle);
+                }
+                continue;
+            }
+
+            const float numLeft = (float)leftReferences.metadata.size();
+            const float numRight = (float)rightReferences.metadata.size();
+
+            AABB unsplitLeftBox = leftBox;
+            AddExtentToBox(unsplitLeftBox, box);
+            AABB unsplitRightBox = rightBox;
+            AddExtentToBox(unsplitRightBox, box);
+            const float unsplitLeftCost = ComputeChildCost(unsplitLeftBox, numLeft + 1) + ComputeChildCost(rightBox, numRight);
+            const float unsplitRightCost = ComputeChildCost(leftBox, numLeft) + ComputeChildCost(unsplitRightBox, numRight + 1);
+
+            float duplicateCost = FLT_MAX;
+            AABB duplicateLeftBox = leftBox;
+            AABB duplicateRightBox = rightBox;
+            if (!IsBoxEmpty(leftPart) &&
+                !(build.m_pMetadata[triangle].GeometryFlags & D3D12_RAYTRACING_GEOMETRY_FLAG_NO_DUPLICATE_ANYHIT_INVOCATION))
+            {
+                AddExtentToBox(duplicateLeftBox, leftPart);
+                AddExtentToBox(duplicateRightBox, rightPart);
+                duplicateCost = ComputeChildCost(duplicateLeftBox, numLeft + 1) + ComputeChildCost(duplicateRightBox, numRight + 1);
+            }
+
+            if (duplicateCost < unsplitLeftCost && duplicateCost < unsplitRightCost)
+            {
+                leftBox = duplicateLeftBox;
+                rightBox = duplicateRightBox;
+                AddSplitReference(leftReferences, leftPart, triangle);
+                AddSplitReference(rightReferences, rightPart, triangle);
+            }
+            else if (unsplitLeftCost <= unsplitRightCost)
+            {
+                leftBox = unsplitLeftBox;
+                AddSplitReference(leftReferences, box, triangle);
+            }
+            else
+            {
+                rightBox = unsplitRightBox;
+                AddSplitReference(rightReferences, box, triangle);
+            }
+        }
+
+        return !leftReferences.metadata.empty() && !rightReferences.metadata.empty();
+    }
+
+    //
+    // Splits the references of a node between its children, with a spatial split if it's
+    // worth it and within budget, and an object split otherwise. The children share what is
+    // left of the budget by the number of references they get. Returns the split axis.
+    //
+
+    static
+        UINT SplitNodeReferences(
+            SplitReferences& leftReferences,
+            SplitReferences& rightReferences,
+            const SplitBVHBuild& build,
+            SplitReferences& references,
+            const AABB& nodeBox)
+    {
+        const UINT32 numReferences = (UINT32)references.metadata.size();
+
+        UINT splitDimension;
+        const UINT32 numRight = PartitionPrimitives(references.metadata.data(), numReferences, splitDimension, nodeBox, references.boxes);
+
+        UINT32 duplicateBudget = references.duplicateBudget;
+        if (duplicateBudget > 0)
+        {
+            AABB rightBox;
+            AABB leftBox;
+            ComputeBox(rightBox, references.boxes, references.metadata.data(), numRight);
+            ComputeBox(leftBox, references.boxes, references.metadata.data() + numRight, numReferences - numRight);
+
+            AABB overlap;
+            for (UINT k = 0; k < 3; ++k)
+            {
+                overlap.minArr[k] = std::max(leftBox.minArr[k], rightBox.minArr[k]);
+                overlap.maxArr[k] = std::min(leftBox.maxArr[k], rightBox.maxArr[k]);
+            }
+
+            SpatialSplit split;
+            if (!IsBoxEmpty(overlap) &&
+                ComputeBoxSurfaceArea(overlap) > build.m_minOverlapArea &&
+                FindSpatialSplit(split, build, references, nodeBox, duplicateBudget) &&
+                split.cost < ComputeChildCost(rightBox, (float)numRight) + ComputeChildCost(leftBox, (float)(numReferences - numRight)))
+            {
+                if (PartitionSpatialSplit(leftReferences, rightReferences, build, references, nodeBox, split))
+                {
+                    duplicateBudget -= (UINT32)(leftReferences.metadata.size() + rightReferences.metadata.size()) - numReferences;
+                    splitDimension = split.axis;
+                }
+                else
+                {
+                    leftReferences = SplitReferences();
+                    rightReferences = SplitReferences();
+                }
+            }
+        }
+
+        if (leftReferences.metadata.empty())
+        {
+            // The right child gets the references PartitionPrimitives() put first
+            for (UINT32 j = 0; j < numReferences; ++j)
+            {
+                const UINT32 reference = references.metadata[j].PrimitiveIndex;
+                AddSplitReference(j < numRight ? rightReferences : leftReferences, references.boxes[reference], references.triangles[reference]);
+            }
+        }
+
+        const UINT32 numLeft = (UINT32)leftReferences.metadata.size();
+        leftReferences.duplicateBudget = (UINT32)((UINT64)duplicateBudget * numLeft / (numLeft + rightReferences.metadata.size()));
+        rightReferences.duplicateBudget = duplicateBudget - leftReferences.duplicateBudget;
+        return splitDimension;
+    }
+
+    static
+        UINT32 BuildSplitBVHAddLeaf(
+            SplitBVHFragment& fragment,
+            const SplitBVHBuild& build,
+            const SplitReferences& references,
+            const AABB& nodeBox)
+    {
+        const UINT32 nodeIndex = BuildBVHAddLeaf(fragment.m_nodes, nodeBox, (UINT32)fragment.m_metadata.size(), (UINT32)references.metadata.size());
+        for (UINT32 triangle : references.triangles)
+        {
+            fragment.m_metadata.push_back(build.m_pMetadata[triangle]);
+        }
+        return nodeIndex;
+    }
+
+    //
+    // BuildBVHSubtree() for spatial splits. Nodes hold copies of their references, so each
+    // waits on the stack with its own.
+    //
+
+    static
+        void BuildSplitBVHSubtree(
+            SplitBVHFragment& fragment,
+            const SplitBVHBuild& build,
+            SplitReferences& references)
+    {
+        struct StackItem
+        {
+            SplitReferences     references;
+            UINT32              parentIndex;
+            bool                right;
+        };
+
+        std::vector<StackItem> stack;
+        stack.reserve(64);
+        stack.push_back({ std::move(references), (UINT)-1, false });
+
+        while (!stack.empty())
+        {
+            StackItem item = std::move(stack.back());
+            stack.pop_back();
+
+            const UINT32 numReferences = (UINT32)item.references.metadata.size();
+            const UINT32 parentIndex = item.parentIndex;
+
+            AABB nodeBox;
+            ComputeBox(nodeBox, item.references.boxes, item.references.metadata.data(), numReferences);
+
+            UINT32 thisNodeIndex;
+            if (numReferences <= MAX_TRIS_IN_LEAF)
+            {
+                thisNodeIndex = BuildSplitBVHAddLeaf(fragment, build, item.references, nodeBox);
+            }
+            else
+            {
+                SplitReferences leftReferences;
+                SplitReferences rightReferences;
+                const UINT splitDimension = SplitNodeReferences(leftReferences, rightReferences, build, item.references, nodeBox);
+                item.references = SplitReferences();
+
+                thisNodeIndex = BuildBVHAddNode(fragment.m_nodes, nodeBox, splitDimension);
+
+                stack.push_back({ std::move(leftReferences), thisNodeIndex, false });
+                stack.push_back({ std::move(rightReferences), thisNodeIndex, true });
+            }
+
+            if (parentIndex != -1)
+            {
+                if (!item.right)
+                {
+                    fragment.m_nodes[parentIndex].internalNode.leftNodeIndex = thisNodeIndex;
+                    fragment.m_nodes[parentIndex].rightNodeIndex = parentIndex + 1;
+                }
+            }
+        }
+    }
+
+    //
+    // BuildBVHFragment() for spatial splits. The left child's subtree is built into a fragment
+    // of its own, which is appended once the right one is done.
+    //
+
+    static
+        void BuildSplitBVHFragment(
+            SplitBVHFragment& fragment,
+            const SplitBVHBuild& build,
+            SplitReferences& references)
+    {
+        const UINT32 numReferences = (UINT32)references.metadata.size();
+        if (numReferences < PARALLEL_SUBTREE_MIN_TRIS || numReferences <= MAX_TRIS_IN_LEAF)
+        {
+            BuildSplitBVHSubtree(fragment, build, references);
+            return;
+        }
+
+        AABB nodeBox;
+        ComputeBox(nodeBox, references.boxes, references.metadata.data(), numReferences);
+
+        SplitReferences leftReferences;
+        SplitReferences rightReferences;
+        const UINT splitDimension = SplitNodeReferences(leftReferences, rightReferences, build, references, nodeBox);
+        references = SplitReferences();
+
+        const UINT32 thisNodeIndex = BuildBVHAddNode(fragment.m_nodes, nodeBox, splitDimension);
+        fragment.m_nodes[thisNodeIndex].rightNodeIndex = thisNodeIndex + 1;
+
+        SplitBVHFragment leftFragment;
+        concurrency::task_group tasks;
+        tasks.run([&]
+        {
+            BuildSplitBVHFragment(leftFragment, build, leftReferences);
+        });
+        BuildSplitBVHFragment(fragment, build, rightReferences);
+        tasks.wait();
+
+        const UINT32 nodeBase = (UINT32)fragment.m_nodes.size();
+        const UINT32 metadataBase = (UINT32)fragment.m_metadata.size();
+        fragment.m_nodes[thisNodeIndex].internalNode.leftNodeIndex = nodeBase;
+        for (AABBNode node : leftFragment.m_nodes)
+        {
+            if (node.leaf)
+            {
+                node.leafNode.firstTriangleId += metadataBase;
+            }
+            else
+            {
+                node.internalNode.leftNodeIndex += nodeBase;
+                node.rightNodeIndex += nodeBase;
+            }
+            fragment.m_nodes.push_back(node);
+        }
+        fragment.m_metadata.insert(fragment.m_metadata.end(), leftFragment.m_metadata.begin(), leftFragment.m_metadata.end());
+    }
+
+    //
+    // The binned SAH build with spatial splits. The layout is BuildBVH()'s, but leaves may
+    // refer to the same triangle, so bvh.m_metadata can be longer than primitiveMetaData.
+    //
+
+    static
+        void BuildSplitBVH(
+            BVH& bvh,
+            const std::vector<AABB>& boxes,
+            const std::vector<PrimitiveMetaData>& primitiveMetaData,
+            const std::vector<float>& triangleVertices,
+            const SpatialSplitSettings& settings)
+    {
+        assert(bvh.m_nodes.empty());
+
+        const UINT32 numTriangles = (UINT32)boxes.size();
+        SplitReferences references;
+        references.metadata.reserve(numTriangles);
+        references.boxes.reserve(numTriangles);
+        references.triangles.reserve(numTriangles);
+        for (UINT32 i = 0; i < numTriangles; ++i)
+        {
+            AddSplitReference(references, boxes[i], i);
+        }
+        references.duplicateBudget = GetMaxSpatialSplitDuplicates(numTriangles, settings.duplicateBudget);
+
+        AABB rootBox;
+        ComputeBox(rootBox, references.boxes, references.metadata.data(), numTriangles);
+
+        SplitBVHBuild build;
+        build.m_pTriangleVertices = triangleVertices.data();
+        build.m_pMetadata = primitiveMetaData.data();
+        build.m_minOverlapArea = settings.overlapThreshold * ComputeBoxSurfaceArea(rootBox);
+
+        SplitBVHFragment fragment;
+        BuildSplitBVHFragment(fragment, build, references);
+        bvh.m_nodes = std::move(fragment.m_nodes);
+        bvh.m_metadata = std::move(fragment.m_metadata);
+    }
+
+    //
+    // PREFER_FAST_BUILD builds an LBVH, and PREFER_FAST_TRACE reorders the treelets of the
+    // binned SAH build, with the passes GpuBvh2Builder runs for it
+    //
+
+    static
+        void BuildBVH(
+            BVH& bvh,
+            const std::vector<AABB>& boxes,
+            const std::vector<PrimitiveMetaData>& primitiveMetaData,
+            D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS buildFlags)
+    {
+        if (buildFlags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_BUILD)
+        {
+            BuildLBVH(bvh, boxes, primitiveMetaData);
+            return;
+        }
+
+        BuildBVH(bvh, boxes, primitiveMetaData, MAX_TRIS_IN_LEAF);
+        if (buildFlags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE)
+        {
+            ReorderTreeletsOfBVH(bvh.m_nodes.data(), (UINT32)bvh.m_nodes.size(), NUM_TREELET_REORDER_PASSES);
+        }
+    }
+
+    //
+    // Reads triangle triangleIndex of a geometry into pTriVerts, and its box
+    //
+
+    static
+        void LoadTriangle(
+            float* pTriVerts,
+            AABB& box,
+            const D3D12_RAYTRACING_GEOMETRY_DESC& geometry,
+            UINT triangleIndex)
+    {
+        const UINT64 vertexStrideDwords = geometry.Triangles.VertexBuffer.StrideInBytes / 4;
+        const float* pVertices = (float*)geometry.Triangles.VertexBuffer.StartAddress;
+        UINT i0, i1, i2;
+        if (geometry.Triangles.IndexFormat == DXGI_FORMAT_R32_UINT)
+        {
+            const UINT* pIndices = (UINT*)geometry.Triangles.IndexBuffer;
+            i0 = pIndices[triangleIndex * 3 + 0];
+            i1 = pIndices[triangleIndex * 3 + 1];
+            i2 = pIndices[triangleIndex * 3 + 2];
+        }
+        else
+        {
+            const UINT16* pIndices = (UINT16*)geometry.Triangles.IndexBuffer;
+            i0 = pIndices[triangleIndex * 3 + 0];
+            i1 = pIndices[triangleIndex * 3 + 1];
+            i2 = pIndices[triangleIndex * 3 + 2];
+        }
+
+        const float* v0 = &pVertices[i0 * vertexStrideDwords];
+        const float* v1 = &pVertices[i1 * vertexStrideDwords];
+        const float* v2 = &pVertices[i2 * vertexStrideDwords];
+
+        pTriVerts[0] = v0[0];
+        pTriVerts[1] = v0[1];
+        pTriVerts[2] = v0[2];
+
+        pTriVerts[3] = v1[0];
+        pTriVerts[4] = v1[1];
+        pTriVerts[5] = v1[2];
+
+        pTriVerts[6] = v2[0];
+        pTriVerts[7] = v2[1];
+        pTriVerts[8] = v2[2];
+
+        for (UINT k = 0; k < 3; ++k)
+        {
+            box.minArr[k] = std::min(v2[k], std::min(v0[k], v1[k]));
+            box.maxArr[k] = std::max(v2[k], std::max(v0[k], v1[k])) + AABB_Min_Padding;
+
+            if (_isnan(box.minArr[k]) ||
+                _isnan(box.maxArr[k]))
+            {
+                box.minArr[k] = 0;
+                box.maxArr[k] = 0;
+            }
+        }
+    }
+
+    void BuildUniformBVH(
+        _In_  UINT NumElements,
+        _In_reads_opt_(NumElements)  const D3D12_RAYTRACING_GEOMETRY_DESC *pGeometries,
+        D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS buildFlags,
+        const SpatialSplitSettings *pSpatialSplits,
+        BVH &bvh)
+    {
+        using namespace DirectX;
+        //
+        // Compute number of triangles
+        //
+
+        UINT    totalNumberOfTriangles = 0;
+
+        for (UINT i = 0; i < NumElements; ++i)
+        {
+            auto &geometry = pGeometries[i];
+            if (geometry.Type == D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES)
+            {
+                totalNumberOfTriangles += GetPrimitiveCountFromGeometryDesc(geometry);
+            }
+            else
+            {
+                throw - 1; // Intersection shaders not supported yet
+            }
 
-                float* pTriVerts = &triangleVertices[triangleIndex * 9];
+        }
 
-                pTriVerts[0] = v0[0];
-                pTriVerts[1] = v0[1];
-                pTriVerts[2] = v0[2];
+        //
+        // Create AABBs
+        //
 
-                pTriVerts[3] = v1[0];
-                pTriVerts[4] = v1[1];
-                pTriVerts[5] = v1[2];
+        std::vector<AABB> boxes;
+        boxes.resize(totalNumberOfTriangles);
 
-                pTriVerts[6] = v2[0];
-                pTriVerts[7] = v2[1];
-                pTriVerts[8] = v2[2];
+        std::vector<PrimitiveMetaData> primitiveMetaData;
+        primitiveMetaData.resize(totalNumberOfTriangles);
 
-                AABB& box = boxes[triangleIndex];
-                for (UINT k = 0; k < 3; ++k)
-                {
-#define AABB_Min_Padding 0.001f
-                    box.minArr[k] = std::min(v2[k], std::min(v0[k], v1[k]));
-                    box.maxArr[k] = std::max(v2[k], std::max(v0[k], v1[k])) + AABB_Min_Padding;
+        std::vector<float>  triangleVertices;
+        triangleVertices.resize(totalNumberOfTriangles * 9);
 
-                    if (_isnan(box.minArr[k]) ||
-                        _isnan(box.maxArr[k]))
-                    {
-                        box.minArr[k] = 0;
-                        box.maxArr[k] = 0;
-                    }
-                }
+        UINT triangleIndex = 0;
+        for (UINT i = 0; i < NumElements; ++i)
+        {
+            auto &geometry = pGeometries[i];
+            if (geometry.Type != D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES)
+            {
+                throw - 1; // Intersection shaders not supported yet
+            }
+
+            if (GetPrimitiveCountFromGeometryDesc(geometry) == 0)
+
+            {
+                continue;
+            }
+
+            const UINT numTris = GetPrimitiveCountFromGeometryDesc(geometry);
+
+            for (UINT j = 0; j < numTris; ++j)
+            {
+                LoadTriangle(&triangleVertices[triangleIndex * 9], boxes[triangleIndex], geometry, j);
 
                 // Create out internal triangle indices.
                 PrimitiveMetaData metadata;
@@ -635,16 +2131,27 @@ namespace FallbackLayer
         // Create a BVH
         //
 
-        BuildBVH(bvh, boxes, primitiveMetaData, MAX_TRIS_IN_LEAF);
+        if (pSpatialSplits)
+        {
+            BuildSplitBVH(bvh, boxes, primitiveMetaData, triangleVertices, *pSpatialSplits);
+            if (buildFlags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE)
+            {
+                ReorderTreeletsOfBVH(bvh.m_nodes.data(), (UINT32)bvh.m_nodes.size(), NUM_TREELET_REORDER_PASSES);
+            }
+        }
+        else
+        {
+            BuildBVH(bvh, boxes, primitiveMetaData, buildFlags);
+        }
 
         //
         // Now copy and compress geometry
         //
 
-        // Copy verts
-        const UINT numTris = triangleIndex;
+        // Copy verts, once for every leaf a triangle is in
+        const UINT numTris = (UINT)bvh.m_metadata.size();
         bvh.m_triangles.resize(numTris * 3 * 3);
-        assert(bvh.m_triangles.size() == triangleVertices.size());
+        assert(bvh.m_triangles.size() >= triangleVertices.size());
         assert(sizeof(bvh.m_triangles[0]) == sizeof(triangleVertices[0]));
 
         for (UINT i = 0; i < numTris; ++i)
@@ -663,14 +2170,382 @@ namespace FallbackLayer
             XMStoreFloat3((XMFLOAT3*)pOutputTriangle + 2, V2);
         }
     }
+
+    //
+    // On the CPU path InstanceDescs is a CPU address, and so is every
+    // AccelerationStructure pointer: it points at a bottom level that was
+    // built by BuildRaytracingAccelerationStructureOnCpu.
+    //
+
+    static
+        const D3D12_RAYTRACING_FALLBACK_INSTANCE_DESC& GetCpuInstanceDesc(
+            const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs,
+            UINT instanceIndex)
+    {
+        if (inputs.DescsLayout == D3D12_ELEMENTS_LAYOUT_ARRAY_OF_POINTERS)
+        {
+            auto ppInstanceDescs = (const D3D12_RAYTRACING_FALLBACK_INSTANCE_DESC* const*)inputs.InstanceDescs;
+            return *ppInstanceDescs[instanceIndex];
+        }
+
+        auto pInstanceDescs = (const D3D12_RAYTRACING_FALLBACK_INSTANCE_DESC*)inputs.InstanceDescs;
+        return pInstanceDescs[instanceIndex];
+    }
+
+    //
+    // Bounds of a box after an affine (row-major 3x4) transform
+    //
+
+    static
+        void TransformBox(
+            AABB& transformedBox,
+            const AABB& box,
+            const FLOAT transform[3][4])
+    {
+        for (UINT row = 0; row < 3; ++row)
+        {
+            transformedBox.minArr[row] = transform[row][3];
+            transformedBox.maxArr[row] = transform[row][3];
+
+            for (UINT col = 0; col < 3; ++col)
+            {
+                const float a = transform[row][col] * box.minArr[col];
+                const float b = transform[row][col] * box.maxArr[col];
+                transformedBox.minArr[row] += std::min(a, b);
+                transformedBox.maxArr[row] += std::max(a, b);
+            }
+        }
+    }
+
+    //
+    // Mirrors TopLevelLoadAABBs.hlsl: an instance becomes a world-space leaf
+    // box, and its metadata stores the instance desc with the transform
+    // inverted to WorldToObject alongside the original ObjectToWorld.
+    //
+
+    static
+        void LoadInstance(
+            AABB& box,
+            BVHMetadata& metadata,
+            const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs,
+            UINT instanceIndex)
+    {
+        using namespace DirectX;
+
+        const D3D12_RAYTRACING_FALLBACK_INSTANCE_DESC& instanceDesc = GetCpuInstanceDesc(inputs, instanceIndex);
+
+        const BYTE* pBottomLevel = (const BYTE*)instanceDesc.AccelerationStructure.GpuVA;
+        const BVHOffsets& bottomLevelOffsets = *(const BVHOffsets*)pBottomLevel;
+        const AABBNode& bottomLevelRoot = *(const AABBNode*)(pBottomLevel + bottomLevelOffsets.offsetToBoxes);
+
+        AABB objectBox;
+        DecompressAABB(objectBox, bottomLevelRoot);
+        TransformBox(box, objectBox, instanceDesc.Transform);
+
+        const auto& t = instanceDesc.Transform;
+        const XMMATRIX objectToWorld = XMMatrixSet(
+            t[0][0], t[1][0], t[2][0], 0.0f,
+            t[0][1], t[1][1], t[2][1], 0.0f,
+            t[0][2], t[1][2], t[2][2], 0.0f,
+            t[0][3], t[1][3], t[2][3], 1.0f);
+        XMFLOAT4X4 worldToObject;
+        XMStoreFloat4x4(&worldToObject, XMMatrixInverse(nullptr, objectToWorld));
+
+        metadata.instanceDesc = instanceDesc;
+        for (UINT row = 0; row < 3; ++row)
+        {
+            for (UINT col = 0; col < 4; ++col)
+            {
+                metadata.instanceDesc.Transform[row][col] = worldToObject.m[col][row];
+            }
+        }
+        memcpy(metadata.ObjectToWorld, instanceDesc.Transform, sizeof(metadata.ObjectToWorld));
+        metadata.InstanceIndex = instanceIndex;
+    }
+
+    void BuildTopLevelBVH(
+        const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs,
+        BVH &bvh,
+        std::vector<BVHMetadata> &instanceMetadata)
+    {
+        const UINT numInstances = inputs.NumDescs;
+
+        std::vector<AABB> boxes(numInstances);
+        std::vector<PrimitiveMetaData> primitiveMetaData(numInstances);
+        instanceMetadata.resize(numInstances);
+
+        for (UINT i = 0; i < numInstances; ++i)
+        {
+            LoadInstance(boxes[i], instanceMetadata[i], inputs, i);
+
+            primitiveMetaData[i].GeometryContributionToHitGroupIndex = 0;
+            primitiveMetaData[i].PrimitiveIndex = i;
+            primitiveMetaData[i].GeometryFlags = 0;
+        }
+
+        BuildBVH(bvh, boxes, primitiveMetaData, inputs.Flags);
+
+        // Top level leaves are flagged with the leaf bit and their metadata index only
+        for (AABBNode& node : bvh.m_nodes)
+        {
+            if (node.leaf)
+            {
+                node.leafNode.numTriangleIds = 0;
+            }
+        }
+    }
+
+    //
+    // Subtrees with at least this many nodes refit their children's subtrees in parallel
+    //
+
+    static const UINT32 PARALLEL_REFIT_MIN_NODES = 16 * 1024;
+
+    //
+    // Refits the nodes of a subtree bottom up, keeping the topology: leaves get their box
+    // from loadLeafBox, every other node the union of its children's boxes. Returns the
+    // box of the subtree's root.
+    //
+    // A subtree is the contiguous range [begin, end) that starts with its root, followed by
+    // the right child's subtree and then the left child's. Walking the range backwards
+    // finishes the right child's subtree right before its parent and the left child's
+    // before that, so a stack of the unclaimed boxes has the children of the next internal
+    // node on top.
+    //
+
+    template<typename LoadLeafBox>
+    static
+        AABB RefitBVH(
+            AABBNode* nodes,
+            UINT32 begin,
+            UINT32 end,
+            const LoadLeafBox& loadLeafBox)
+    {
+        AABBNode& root = nodes[begin];
+        if (end - begin >= PARALLEL_REFIT_MIN_NODES && !root.leaf && IsBuildParallel())
+        {
+            const UINT32 leftBegin = root.internalNode.leftNodeIndex;
+            assert(root.rightNodeIndex == begin + 1);
+
+            AABB leftBox;
+            concurrency::task_group tasks;
+            tasks.run([&]
+            {
+                leftBox = RefitBVH(nodes, leftBegin, end, loadLeafBox);
+            });
+            AABB box = RefitBVH(nodes, begin + 1, leftBegin, loadLeafBox);
+            tasks.wait();
+
+            AddExtentToBox(box, leftBox);
+            PackAABBNode(root, box);
+            return box;
+        }
+
+        std::vector<AABB> stack;
+        stack.reserve(64);
+        for (UINT32 i = end; i-- > begin;)
+        {
+            AABBNode& node = nodes[i];
+            AABB box;
+            if (node.leaf)
+            {
+                loadLeafBox(box, node);
+            }
+            else
+            {
+                box = stack.back();
+                stack.pop_back();
+                AddExtentToBox(box, stack.back());
+                stack.pop_back();
+            }
+            PackAABBNode(node, box);
+            stack.push_back(box);
+        }
+
+        assert(stack.size() == 1);
+        return stack.back();
+    }
+
+    //
+    // Rereads every triangle of a bottom level from the geometry it was built from and
+    // refits its nodes around them. Leaves of a spatial split get the box of their whole
+    // triangle again, not just of their part of it.
+    //
+    void RefitUniformBVH(
+        _In_  UINT NumElements,
+        _In_reads_opt_(NumElements)  const D3D12_RAYTRACING_GEOMETRY_DESC *pGeometries,
+        BYTE *pData)
+    {
+        const BVHOffsets& offsets = *(const BVHOffsets*)pData;
+        AABBNode* nodes = (AABBNode*)(pData + offsets.offsetToBoxes);
+        Primitive* primitives = (Primitive*)(pData + offsets.offsetToVertices);
+        const PrimitiveMetaData* metadata = (const PrimitiveMetaData*)(pData + offsets.offsetToPrimitiveMetaData);
+        const UINT32 numNodes = (offsets.offsetToVertices - offsets.offsetToBoxes) / sizeof(AABBNode);
+        const UINT32 numTriangles = (offsets.offsetToPrimitiveMetaData - offsets.offsetToVertices) / sizeof(Primitive);
+
+        // The metadata keeps each triangle's geometry and its index among the triangles of all geometries
+        std::vector<UINT> firstTriangleOfGeometry(NumElements);
+        UINT totalNumberOfTriangles = 0;
+        for (UINT i = 0; i < NumElements; ++i)
+        {
+            if (pGeometries[i].Type != D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES)
+            {
+                throw - 1; // Intersection shaders not supported yet
+            }
+
+            firstTriangleOfGeometry[i] = totalNumberOfTriangles;
+            totalNumberOfTriangles += GetPrimitiveCountFromGeometryDesc(pGeometries[i]);
+        }
+
+        // Spatial splits put some triangles in more than one leaf, but every triangle is in one
+        UINT numBuiltTriangles = 0;
+        for (UINT32 i = 0; i < numTriangles; ++i)
+        {
+            numBuiltTriangles = std::max(numBuiltTriangles, metadata[i].PrimitiveIndex + 1);
+        }
+
+        if (totalNumberOfTriangles != numBuiltTriangles)
+        {
+            ThrowFailure(E_INVALIDARG, L"An update must have the same geometry layout as the acceleration structure it updates");
+        }
+
+        // Otherwise every leaf has a triangle
+        if (numTriangles == 0)
+        {
+            return;
+        }
+
+        // Triangles are gathered in the order they're stored, so the metadata and primitives
+        // are read and written front to back, and the refit only reads their boxes
+        std::vector<AABB> triangleBoxes(numTriangles);
+        const UINT32 numChunks = (numTriangles + PARALLEL_SCAN_CHUNK_SIZE - 1) / PARALLEL_SCAN_CHUNK_SIZE;
+        concurrency::parallel_for(0u, numChunks, [&](UINT32 chunk)
+        {
+            const UINT32 first = chunk * PARALLEL_SCAN_CHUNK_SIZE;
+            const UINT32 end = std::min(first + PARALLEL_SCAN_CHUNK_SIZE, numTriangles);
+            for (UINT32 i = first; i < end; ++i)
+            {
+                const UINT geometryIndex = metadata[i].GeometryContributionToHitGroupIndex;
+                LoadTriangle((float*)&primitives[i].triangle, triangleBoxes[i], pGeometries[geometryIndex],
+                    metadata[i].PrimitiveIndex - firstTriangleOfGeometry[geometryIndex]);
+            }
+        });
+
+        RefitBVH(nodes, 0, numNodes, [&](AABB& leafBox, const AABBNode& leaf)
+        {
+            const UINT32 firstTriangle = leaf.leafNode.firstTriangleId;
+            const UINT32 endTriangle = firstTriangle + leaf.leafNode.numTriangleIds;
+
+            leafBox = triangleBoxes[firstTriangle];
+            for (UINT32 i = firstTriangle + 1; i < endTriangle; ++i)
+            {
+                AddExtentToBox(leafBox, triangleBoxes[i]);
+            }
+        });
+    }
+
+    //
+    // Rereads every instance of a top level, with its transform and the current bounds of
+    // its bottom level, and refits its nodes around them
+    //
+    void RefitTopLevelBVH(
+        const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs,
+        BYTE *pData)
+    {
+        const BVHOffsets& offsets = *(const BVHOffsets*)pData;
+        AABBNode* nodes = (AABBNode*)(pData + offsets.offsetToBoxes);
+        BVHMetadata* metadata = (BVHMetadata*)(pData + offsets.offsetToVertices);
+        const UINT32 numNodes = (offsets.offsetToVertices - offsets.offsetToBoxes) / sizeof(AABBNode);
+        const UINT32 numInstances = (offsets.totalSize - offsets.offsetToVertices) / sizeof(BVHMetadata);
+
+        if (inputs.NumDescs != numInstances)
+        {
+            ThrowFailure(E_INVALIDARG, L"An update must have the same number of instances as the acceleration structure it updates");
+        }
+
+        if (numInstances == 0)
+        {
+            return;
+        }
+
+        RefitBVH(nodes, 0, numNodes, [&](AABB& leafBox, const AABBNode& leaf)
+        {
+            BVHMetadata& instanceMetadata = metadata[leaf.leafNode.firstTriangleId];
+            LoadInstance(leafBox, instanceMetadata, inputs, instanceMetadata.InstanceIndex);
+        });
+    }
+
+    //
+    // Expected cost of a ray that hits the root box, in units of one box or primitive test:
+    // the area of each node relative to the root's is the chance the ray reaches it
+    //
+
+    static
+        float ComputeSahCost(
+            const AABBNode* nodes,
+            UINT32 numNodes)
+    {
+        AABB rootBox;
+        DecompressAABB(rootBox, nodes[0]);
+        const float rootArea = ComputeBoxSurfaceArea(rootBox);
+        if (rootArea <= 0)
+        {
+            return 0;
+        }
+
+        double cost = 0;
+        for (UINT32 i = 0; i < numNodes; ++i)
+        {
+            AABB box;
+            DecompressAABB(box, nodes[i]);
+
+            // Top level leaves hold one instance but store 0
+            const UINT numTests = nodes[i].leaf ? std::max(1u, (UINT)nodes[i].leafNode.numTriangleIds) : 1;
+            cost += numTests * ComputeBoxSurfaceArea(box);
+        }
+        return (float)(cost / rootArea);
+    }
 }
 
-void BuildRaytracingAccelerationStructureOnCpu(
+static
+void BuildTopLevelAccelerationStructureOnCpu(
+    _In_  const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC *pDesc,
+    _Out_ void *pData)
+{
+    FallbackLayer::BVH bvh;
+    std::vector<BVHMetadata> instanceMetadata;
+    FallbackLayer::BuildTopLevelBVH(pDesc->Inputs, bvh, instanceMetadata);
+
+    BYTE* outputData = (BYTE*)pData;
+    BVHOffsets offsets;
+    offsets.offsetToBoxes = sizeof(BVHOffsets);
+    const UINT sizeofBoxes = (UINT)(bvh.m_nodes.size() * sizeof(*bvh.m_nodes.data()));
+
+    // offsetToVertices doubles as the offset to the leaf node metadata in a top level
+    offsets.offsetToVertices = offsets.offsetToBoxes + sizeofBoxes;
+    const UINT sizeofMetadata = (UINT)(instanceMetadata.size() * sizeof(BVHMetadata));
+    offsets.totalSize = offsets.offsetToVertices + sizeofMetadata;
+    offsets.offsetToPrimitiveMetaData = offsets.totalSize;
+
+    memcpy(outputData, &offsets, sizeof(offsets));
+    memcpy(outputData + offsets.offsetToBoxes, bvh.m_nodes.data(), sizeofBoxes);
+
+    // Leaves reference metadata in BVH order, so write it out in that order
+    BVHMetadata *pMetadata = (BVHMetadata *)(outputData + offsets.offsetToVertices);
+    for (UINT i = 0; i < bvh.m_metadata.size(); i++)
+    {
+        pMetadata[i] = instanceMetadata[bvh.m_metadata[i].PrimitiveIndex];
+    }
+}
+
+static
+void BuildBottomLevelAccelerationStructureOnCpu(
     _In_  const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC *pDesc,
+    _In_opt_ const FallbackLayer::SpatialSplitSettings *pSpatialSplits,
     _Out_ void *pData)
 {
     FallbackLayer::BVH bvh;
-    FallbackLayer::BuildUniformBVH(pDesc->Inputs.NumDescs, pDesc->Inputs.pGeometryDescs, bvh);
+    FallbackLayer::BuildUniformBVH(pDesc->Inputs.NumDescs, pDesc->Inputs.pGeometryDescs, pDesc->Inputs.Flags, pSpatialSplits, bvh);
 
     BYTE* outputData = (BYTE*)pData;
     BVHOffsets offsets;
@@ -697,3 +2572,97 @@ void BuildRaytracingAccelerationStructureOnCpu(
     }
     memcpy(outputData + offsets.offsetToPrimitiveMetaData, bvh.m_metadata.data(), sizeofMetadata);
 }
+
+static
+void UpdateAccelerationStructureOnCpu(
+    _In_  const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC *pDesc,
+    _Out_ void *pData)
+{
+    const BYTE* pSourceData = (const BYTE*)pDesc->SourceAccelerationStructureData;
+    if (pSourceData == nullptr)
+    {
+        ThrowFailure(E_INVALIDARG, L"SourceAccelerationStructureData must be non-zero to perform an update");
+    }
+
+    if (pSourceData != pData)
+    {
+        memcpy(pData, pSourceData, ((const BVHOffsets*)pSourceData)->totalSize);
+    }
+
+    if (pDesc->Inputs.Type == D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL)
+    {
+        FallbackLayer::RefitTopLevelBVH(pDesc->Inputs, (BYTE*)pData);
+    }
+    else
+    {
+        FallbackLayer::RefitUniformBVH(pDesc->Inputs.NumDescs, pDesc->Inputs.pGeometryDescs, (BYTE*)pData);
+    }
+}
+
+void BuildRaytracingAccelerationStructureOnCpu(
+    _In_  const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC *pDesc,
+    _Out_ void *pData)
+{
+    if (pDesc->Inputs.Flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE)
+    {
+        UpdateAccelerationStructureOnCpu(pDesc, pData);
+        return;
+    }
+
+    if (pDesc->Inputs.Type == D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL)
+    {
+        BuildTopLevelAccelerationStructureOnCpu(pDesc, pData);
+        return;
+    }
+
+    BuildBottomLevelAccelerationStructureOnCpu(pDesc, nullptr, pData);
+}
+
+void BuildRaytracingAccelerationStructureWithSpatialSplitsOnCpu(
+    _In_  const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC *pDesc,
+    float overlapThreshold,
+    float duplicateBudget,
+    _Out_ void *pData)
+{
+    if (pDesc->Inputs.Type != D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL ||
+        (pDesc->Inputs.Flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE))
+    {
+        ThrowFailure(E_INVALIDARG, L"Spatial splits only build bottom levels, BuildRaytracingAccelerationStructureOnCpu updates them");
+    }
+
+    FallbackLayer::SpatialSplitSettings spatialSplits;
+    spatialSplits.overlapThreshold = overlapThreshold;
+    spatialSplits.duplicateBudget = duplicateBudget;
+    BuildBottomLevelAccelerationStructureOnCpu(pDesc, &spatialSplits, pData);
+}
+
+UINT GetSpatialSplitAccelerationStructureSizeOnCpu(
+    UINT numTriangles,
+    float duplicateBudget)
+{
+    const UINT numPrimitives = numTriangles + FallbackLayer::GetMaxSpatialSplitDuplicates(numTriangles, duplicateBudget);
+    return GetOffsetToPrimitives(numPrimitives) +
+        GetOffsetFromPrimitivesToPrimitiveMetaData(numPrimitives) +
+        numPrimitives * SizeOfPrimitiveMetaData;
+}
+
+float GetAccelerationStructureSahCostOnCpu(
+    _In_  const void *pData)
+{
+    const BVHOffsets& offsets = *(const BVHOffsets*)pData;
+    const AABBNode* nodes = (const AABBNode*)((const BYTE*)pData + offsets.offsetToBoxes);
+    const UINT32 numNodes = (offsets.offsetToVertices - offsets.offsetToBoxes) / sizeof(AABBNode);
+    return FallbackLayer::ComputeSahCost(nodes, numNodes);
+}
+
+float ReorderAccelerationStructureTreeletsOnCpu(
+    _Inout_ void *pData)
+{
+    const BVHOffsets& offsets = *(const BVHOffsets*)pData;
+    AABBNode* nodes = (AABBNode*)((BYTE*)pData + offsets.offsetToBoxes);
+    const UINT32 numNodes = (offsets.offsetToVertices - offsets.offsetToBoxes) / sizeof(AABBNode);
+
+    const float sahCost = FallbackLayer::ComputeSahCost(nodes, numNodes);
+    FallbackLayer::ReorderTreeletsOfBVH(nodes, numNodes, FallbackLayer::NUM_TREELET_REORDER_PASSES);
+    return sahCost - FallbackLayer::ComputeSahCost(nodes, numNodes);
+}
@@ -0,0 +1,381 @@
+//*********************************************************
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+//*********************************************************
+#include "pch.h"
+#include <intrin.h>
+
+namespace FallbackLayer
+{
+    //
+    // Every pass works on chunks of this many elements in parallel
+    //
+
+    static const UINT32 LBVH_CHUNK_SIZE = 16 * 1024;
+
+    template<typename Function>
+    static
+        void ForEachChunk(
+            UINT numElements,
+            const Function& function)
+    {
+        const UINT numChunks = (numElements + LBVH_CHUNK_SIZE - 1) / LBVH_CHUNK_SIZE;
+        concurrency::parallel_for(0u, numChunks, [&](UINT chunk)
+        {
+            const UINT first = chunk * LBVH_CHUNK_SIZE;
+            function(chunk, first, std::min(first + LBVH_CHUNK_SIZE, numElements));
+        });
+    }
+
+    //
+    // Centroid position in sceneAABB, scaled to [0, maxCoord - 1] on each axis like
+    // GetMortonCodesFromUnitCoord() does it, in the order y, x, z
+    //
+
+    static
+        void GetMortonCodeCoords(
+            UINT coords[3],
+            const float3 &centroid,
+            const AABB &sceneAABB,
+            float maxCoord)
+    {
+        const float epsilon = 0.00001f;
+        const float3 sceneDimension =
+        {
+            std::max(sceneAABB.max.x - sceneAABB.min.x, epsilon),
+            std::max(sceneAABB.max.y - sceneAABB.min.y, epsilon),
+            std::max(sceneAABB.max.z - sceneAABB.min.z, epsilon)
+        };
+        const float3 unitCoord = (centroid - sceneAABB.min) / sceneDimension;
+        const float adjustedCoord[3] = { unitCoord.y * maxCoord, unitCoord.x * maxCoord, unitCoord.z * maxCoord };
+
+        for (UINT axis = 0; axis < 3; axis++)
+        {
+            // max() picks 0 over NaN as the HLSL one does
+            coords[axis] = (UINT)std::min(std::max(0.0f, adjustedCoord[axis]), maxCoord - 1);
+        }
+    }
+
+    // Moves bit i to bit 3 * i
+    static
+        UINT32 SpreadBits10(
+            UINT32 v)
+    {
+        v &= 0x3ff;
+        v = (v | v << 16) & 0x30000ff;
+        v = (v | v << 8) & 0x300f00f;
+        v = (v | v << 4) & 0x30c30c3;
+        v = (v | v << 2) & 0x9249249;
+        return v;
+    }
+
+    static
+        UINT64 SpreadBits21(
+            UINT64 v)
+    {
+        v &= 0x1fffff;
+        v = (v | v << 32) & 0x1f00000000ffffull;
+        v = (v | v << 16) & 0x1f0000ff0000ffull;
+        v = (v | v << 8) & 0x100f00f00f00f00full;
+        v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+        v = (v | v << 2) & 0x1249249249249249ull;
+        return v;
+    }
+
+    UINT32 CalculateMortonCode30(const float3 &centroid, const AABB &sceneAABB)
+    {
+        UINT coords[3];
+        GetMortonCodeCoords(coords, centroid, sceneAABB, (float)(1 << 10));
+        return SpreadBits10(coords[0]) | SpreadBits10(coords[1]) << 1 | SpreadBits10(coords[2]) << 2;
+    }
+
+    UINT64 CalculateMortonCode63(const float3 &centroid, const AABB &sceneAABB)
+    {
+        UINT coords[3];
+        GetMortonCodeCoords(coords, centroid, sceneAABB, (float)(1 << 21));
+        return SpreadBits21(coords[0]) | SpreadBits21(coords[1]) << 1 | SpreadBits21(coords[2]) << 2;
+    }
+
+    void CalculateMortonCodesOnCpu(
+        const float3 *pCentroids,
+        UINT numElements,
+        const AABB &sceneAABB,
+        UINT32 *pMortonCodes,
+        UINT32 *pIndices)
+    {
+        ForEachChunk(numElements, [&](UINT, UINT first, UINT end)
+        {
+            for (UINT i = first; i < end; i++)
+            {
+                pMortonCodes[i] = CalculateMortonCode30(pCentroids[i], sceneAABB);
+                pIndices[i] = i;
+            }
+        });
+    }
+
+    void CalculateMortonCodesOnCpu(
+        const float3 *pCentroids,
+        UINT numElements,
+        const AABB &sceneAABB,
+        UINT64 *pMortonCodes,
+        UINT32 *pIndices)
+    {
+        ForEachChunk(numElements, [&](UINT, UINT first, UINT end)
+        {
+            for (UINT i = first; i < end; i++)
+            {
+                pMortonCodes[i] = CalculateMortonCode63(pCentroids[i], sceneAABB);
+                pIndices[i] = i;
+            }
+        });
+    }
+
+    //
+    // Least significant digit first, 8 bits at a time. Each chunk counts its digits, the
+    // counts give every chunk its own range of each digit's output, and the chunks move
+    // their elements there in parallel. Passes over a digit all codes share are skipped.
+    //
+
+    template<typename MortonCode>
+    static
+        void RadixSort(
+            MortonCode *pMortonCodes,
+            UINT32 *pIndices,
+            UINT numElements)
+    {
+        static const UINT RadixBits = 8;
+        static const UINT RadixSize = 1 << RadixBits;
+
+        const UINT numChunks = (numElements + LBVH_CHUNK_SIZE - 1) / LBVH_CHUNK_SIZE;
+        std::vector<UINT> chunkOffsets(numChunks * RadixSize);
+        std::vector<MortonCode> tempMortonCodes(numElements);
+        std::vector<UINT32> tempIndices(numElements);
+
+        MortonCode *pSourceCodes = pMortonCodes;
+        UINT32 *pSourceIndices = pIndices;
+        MortonCode *pDestCodes = tempMortonCodes.data();
+        UINT32 *pDestIndices = tempIndices.data();
+
+        for (UINT shift = 0; shift < sizeof(MortonCode) * 8; shift += RadixBits)
+        {
+            ForEachChunk(numElements, [&](UINT chunk, UINT first, UINT end)
+            {
+                UINT *pCounts = &chunkOffsets[chunk * RadixSize];
+                std::fill(pCounts, pCounts + RadixSize, 0);
+                for (UINT i = first; i < end; i++)
+                {
+                    pCounts[(pSourceCodes[i] >> shift) & (RadixSize - 1)]++;
+                }
+            });
+
+            UINT offset = 0;
+            bool isSingleDigit = false;
+            for (UINT digit = 0; digit < RadixSize; digit++)
+            {
+                UINT digitCount = 0;
+                for (UINT chunk = 0; chunk < numChunks; chunk++)
+                {
+                    const UINT count = chunkOffsets[chunk * RadixSize + digit];
+                    chunkOffsets[chunk * RadixSize + digit] = offset + digitCount;
+                    digitCount += count;
+                }
+                isSingleDigit |= digitCount == numElements;
+                offset += digitCount;
+            }
+
+            if (isSingleDigit)
+            {
+                continue;
+            }
+
+            ForEachChunk(numElements, [&](UINT chunk, UINT first, UINT end)
+            {
+                UINT *pOffsets = &chunkOffsets[chunk * RadixSize];
+                for (UINT i = first; i < end; i++)
+                {
+                    const UINT outputIndex = pOffsets[(pSourceCodes[i] >> shift) & (RadixSize - 1)]++;
+                    pDestCodes[outputIndex] = pSourceCodes[i];
+                    pDestIndices[outputIndex] = pSourceIndices[i];
+                }
+            });
+
+            std::swap(pSourceCodes, pDestCodes);
+            std::swap(pSourceIndices, pDestIndices);
+        }
+
+        if (pSourceCodes != pMortonCodes)
+        {
+            memcpy(pMortonCodes, pSourceCodes, numElements * sizeof(MortonCode));
+            memcpy(pIndices, pSourceIndices, numElements * sizeof(UINT32));
+        }
+    }
+
+    void SortMortonCodesOnCpu(UINT32 *pMortonCodes, UINT32 *pIndices, UINT numElements)
+    {
+        RadixSort(pMortonCodes, pIndices, numElements);
+    }
+
+    void SortMortonCodesOnCpu(UINT64 *pMortonCodes, UINT32 *pIndices, UINT numElements)
+    {
+        RadixSort(pMortonCodes, pIndices, numElements);
+    }
+
+    static
+        int CountLeadingZeroes(
+            UINT32 v)
+    {
+        unsigned long highestBit;
+        return _BitScanReverse(&highestBit, v) ? 31 - (int)highestBit : 32;
+    }
+
+    static
+        int CountLeadingZeroes(
+            UINT64 v)
+    {
+        unsigned long highestBit;
+        return _BitScanReverse64(&highestBit, v) ? 63 - (int)highestBit : 64;
+    }
+
+    //
+    // The rest mirrors BuildBVHSplits.hlsli, down to the prefix length of elements with the
+    // same code: one less than the code's bits plus the leading zeroes of their positions
+    //
+
+    template<typename MortonCode>
+    static
+        int GetLongestCommonPrefix(
+            const MortonCode *pMortonCodes,
+            int numElements,
+            int indexA,
+            int indexB)
+    {
+        if (indexA < 0 || indexA >= numElements || indexB < 0 || indexB >= numElements)
+        {
+            return -1;
+        }
+
+        const MortonCode mortonCodeA = pMortonCodes[indexA];
+        const MortonCode mortonCodeB = pMortonCodes[indexB];
+        if (mortonCodeA != mortonCodeB)
+        {
+            return CountLeadingZeroes(mortonCodeA ^ mortonCodeB);
+        }
+        return CountLeadingZeroes((UINT32)(indexA ^ indexB)) + (int)sizeof(MortonCode) * 8 - 1;
+    }
+
+    template<typename MortonCode>
+    static
+        void DetermineRange(
+            const MortonCode *pMortonCodes,
+            int numElements,
+            int idx,
+            int &first,
+            int &last)
+    {
+        int d = GetLongestCommonPrefix(pMortonCodes, numElements, idx, idx + 1) -
+            GetLongestCommonPrefix(pMortonCodes, numElements, idx, idx - 1);
+        d = std::min(std::max(d, -1), 1);
+        const int minPrefix = GetLongestCommonPrefix(pMortonCodes, numElements, idx, idx - d);
+
+        int maxLength = 2;
+        while (GetLongestCommonPrefix(pMortonCodes, numElements, idx, idx + maxLength * d) > minPrefix)
+        {
+            maxLength *= 4;
+        }
+
+        int length = 0;
+        for (int t = maxLength / 2; t > 0; t /= 2)
+        {
+            if (GetLongestCommonPrefix(pMortonCodes, numElements, idx, idx + (length + t) * d) > minPrefix)
+            {
+                length = length + t;
+            }
+        }
+
+        const int j = idx + length * d;
+        first = std::min(idx, j);
+        last = std::max(idx, j);
+    }
+
+    template<typename MortonCode>
+    static
+        int FindSplit(
+            const MortonCode *pMortonCodes,
+            int numElements,
+            int first,
+            int last)
+    {
+        const int commonPrefix = GetLongestCommonPrefix(pMortonCodes, numElements, first, last);
+        int split = first;
+        int step = last - first;
+
+        do
+        {
+            step = (step + 1) >> 1;
+            const int newSplit = split + step;
+
+            if (newSplit < last)
+            {
+                const int splitPrefix = GetLongestCommonPrefix(pMortonCodes, numElements, first, newSplit);
+                if (splitPrefix > commonPrefix)
+                {
+                    split = newSplit;
+                }
+            }
+        } while (step > 1);
+
+        return split;
+    }
+
+    template<typename MortonCode>
+    static
+        void ConstructHierarchy(
+            const MortonCode *pSortedMortonCodes,
+            UINT numElements,
+            HierarchyNode *pHierarchy)
+    {
+        if (numElements == 0)
+        {
+            return;
+        }
+
+        // Each internal node writes its own children and their parent, so no two write the same field
+        const UINT numInternalNodes = GetNumInternalNodes(numElements);
+        const UINT leafNodeOffset = numInternalNodes;
+        ForEachChunk(numInternalNodes, [&](UINT, UINT firstNode, UINT endNode)
+        {
+            for (UINT idx = firstNode; idx < endNode; idx++)
+            {
+                int first, last;
+                DetermineRange(pSortedMortonCodes, (int)numElements, (int)idx, first, last);
+                const UINT split = (UINT)FindSplit(pSortedMortonCodes, (int)numElements, first, last);
+
+                const UINT childAIndex = (split == (UINT)first) ? leafNodeOffset + split : split;
+                const UINT childBIndex = (split + 1 == (UINT)last) ? leafNodeOffset + split + 1 : split + 1;
+
+                pHierarchy[idx].LeftChildIndex = childAIndex;
+                pHierarchy[idx].RightChildIndex = childBIndex;
+                pHierarchy[childAIndex].ParentIndex = idx;
+                pHierarchy[childAIndex].bCollapseChildren = 0;
+                pHierarchy[childBIndex].ParentIndex = idx;
+                pHierarchy[childBIndex].bCollapseChildren = 0;
+            }
+        });
+    }
+
+    void ConstructHierarchyOnCpu(const UINT32 *pSortedMortonCodes, UINT numElements, HierarchyNode *pHierarchy)
+    {
+        ConstructHierarchy(pSortedMortonCodes, numElements, pHierarchy);
+    }
+
+    void ConstructHierarchyOnCpu(const UINT64 *pSortedMortonCodes, UINT numElements, HierarchyNode *pHierarchy)
+    {
+        ConstructHierarchy(pSortedMortonCodes, numElements, pHierarchy);
+    }
+}
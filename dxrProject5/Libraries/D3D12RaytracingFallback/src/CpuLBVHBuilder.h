@@ -0,0 +1,57 @@
+//*********************************************************
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+//*********************************************************
+#pragma once
+namespace FallbackLayer
+{
+    //
+    // The LBVH passes of GpuBvh2Builder on the CPU: Morton codes of the element centroids,
+    // a sort of the codes, and the hierarchy Karras' method reads off the sorted codes.
+    //
+    // With 30-bit codes each of these gives the same result as the GPU pass it's named
+    // after, so they can be used to check those passes. BuildRaytracingAccelerationStructureOnCpu
+    // builds an LBVH with 63-bit codes for PREFER_FAST_BUILD, where far fewer elements end
+    // up sharing a code.
+    //
+
+    // CalculateMortonCodes.hlsli, 10 bits per axis of the centroid's position in sceneAABB
+    UINT32 CalculateMortonCode30(const float3 &centroid, const AABB &sceneAABB);
+
+    // 21 bits per axis, interleaved in the same axis order
+    UINT64 CalculateMortonCode63(const float3 &centroid, const AABB &sceneAABB);
+
+    // MortonCodesCalculator, writes the code of every centroid and the indices 0 to numElements - 1
+    void CalculateMortonCodesOnCpu(
+        const float3 *pCentroids,
+        UINT numElements,
+        const AABB &sceneAABB,
+        UINT32 *pMortonCodes,
+        UINT32 *pIndices);
+
+    void CalculateMortonCodesOnCpu(
+        const float3 *pCentroids,
+        UINT numElements,
+        const AABB &sceneAABB,
+        UINT64 *pMortonCodes,
+        UINT32 *pIndices);
+
+    // BitonicSort, sorts the codes and moves the indices along with them. This is a
+    // radix sort, so elements with the same code stay in the order they were in.
+    void SortMortonCodesOnCpu(UINT32 *pMortonCodes, UINT32 *pIndices, UINT numElements);
+    void SortMortonCodesOnCpu(UINT64 *pMortonCodes, UINT32 *pIndices, UINT numElements);
+
+    //
+    // ConstructHierarchyPass, numElements - 1 internal nodes with node 0 the root, followed
+    // by a leaf for each sorted element. Elements that share a code are told apart by their
+    // position, as in BuildBVHSplits.hlsli.
+    //
+    void ConstructHierarchyOnCpu(const UINT32 *pSortedMortonCodes, UINT numElements, HierarchyNode *pHierarchy);
+    void ConstructHierarchyOnCpu(const UINT64 *pSortedMortonCodes, UINT numElements, HierarchyNode *pHierarchy);
+}
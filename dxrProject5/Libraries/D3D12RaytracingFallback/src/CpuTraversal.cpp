@@ -0,0 +1,817 @@
+//*********************************************************
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+//*********************************************************
+#include "pch.h"
+#include <intrin.h>
+
+namespace FallbackLayer
+{
+    bool IsAvxSupported()
+    {
+        static const bool isSupported = []
+        {
+            int info[4];
+            __cpuid(info, 1);
+            const bool hasAvx = (info[2] & (1 << 28)) != 0;
+            const bool hasOsXsave = (info[2] & (1 << 27)) != 0;
+
+            // The OS also has to preserve the upper halves of the YMM registers
+            return hasAvx && hasOsXsave && (_xgetbv(0) & 0x6) == 0x6;
+        }();
+        return isSupported;
+    }
+
+    void GetCpuRayData(
+        CpuRayData &data,
+        const float3 &origin,
+        const float3 &direction)
+    {
+        const float originArr[3] = { origin.x, origin.y, origin.z };
+        const float directionArr[3] = { direction.x, direction.y, direction.z };
+        for (UINT axis = 0; axis < 3; axis++)
+        {
+            // Keeps the slab distances finite, (bound - origin) * inf can be NaN
+            const float minDirection = 1e-20f;
+            const float d = std::abs(directionArr[axis]) < minDirection ?
+                (directionArr[axis] < 0.0f ? -minDirection : minDirection) : directionArr[axis];
+
+            data.origin[axis] = originArr[axis];
+            data.inverseDirection[axis] = 1.0f / d;
+            data.absInverseDirection[axis] = std::abs(data.inverseDirection[axis]);
+            data.originTimesInverseDirection[axis] = originArr[axis] * data.inverseDirection[axis];
+            data.nearSide[axis] = d < 0.0f ? 1 : 0;
+        }
+
+        const float absDirection[3] = { std::abs(directionArr[0]), std::abs(directionArr[1]), std::abs(directionArr[2]) };
+        UINT zIndex = 2;
+        if (absDirection[0] > absDirection[1] && absDirection[0] > absDirection[2])
+        {
+            zIndex = 0;
+        }
+        else if (absDirection[1] > absDirection[2])
+        {
+            zIndex = 1;
+        }
+        data.swizzledIndices[0] = (zIndex + 1) % 3;
+        data.swizzledIndices[1] = (zIndex + 2) % 3;
+        data.swizzledIndices[2] = zIndex;
+        if (directionArr[zIndex] < 0.0f)
+        {
+            std::swap(data.swizzledIndices[0], data.swizzledIndices[1]);
+        }
+
+        data.shear[0] = directionArr[data.swizzledIndices[0]] / directionArr[zIndex];
+        data.shear[1] = directionArr[data.swizzledIndices[1]] / directionArr[zIndex];
+        data.shear[2] = 1.0f / directionArr[zIndex];
+    }
+
+    // Using Woop/Benthin/Wald 2013: "Watertight Ray/Triangle Intersection"
+    bool IntersectTriangle(
+        float &hitT,
+        float2 &barycentrics,
+        UINT &hitKind,
+        const CpuRayData &ray,
+        float tMin,
+        const Triangle &triangle,
+        UINT rayFlags,
+        UINT instanceFlags)
+    {
+        const bool useCulling = !(instanceFlags & D3D12_RAYTRACING_INSTANCE_FLAG_TRIANGLE_CULL_DISABLE);
+        const bool flipFaces = (instanceFlags & D3D12_RAYTRACING_INSTANCE_FLAG_TRIANGLE_FRONT_COUNTERCLOCKWISE) != 0;
+        const UINT backFaceCullingFlag = flipFaces ? D3D12_RAY_FLAG_CULL_FRONT_FACING_TRIANGLES : D3D12_RAY_FLAG_CULL_BACK_FACING_TRIANGLES;
+        const UINT frontFaceCullingFlag = flipFaces ? D3D12_RAY_FLAG_CULL_BACK_FACING_TRIANGLES : D3D12_RAY_FLAG_CULL_FRONT_FACING_TRIANGLES;
+        const bool useBackfaceCulling = useCulling && (rayFlags & backFaceCullingFlag);
+        const bool useFrontfaceCulling = useCulling && (rayFlags & frontFaceCullingFlag);
+
+        float A[3], B[3], C[3];
+        for (UINT i = 0; i < 3; i++)
+        {
+            const UINT axis = ray.swizzledIndices[i];
+            A[i] = (&triangle.v0.x)[axis] - ray.origin[axis];
+            B[i] = (&triangle.v1.x)[axis] - ray.origin[axis];
+            C[i] = (&triangle.v2.x)[axis] - ray.origin[axis];
+        }
+        for (UINT i = 0; i < 2; i++)
+        {
+            A[i] = A[i] - ray.shear[i] * A[2];
+            B[i] = B[i] - ray.shear[i] * B[2];
+            C[i] = C[i] - ray.shear[i] * C[2];
+        }
+
+        const float U = C[0] * B[1] - C[1] * B[0];
+        const float V = A[0] * C[1] - A[1] * C[0];
+        const float W = B[0] * A[1] - B[1] * A[0];
+        if (useFrontfaceCulling)
+        {
+            if (U > 0.0f || V > 0.0f || W > 0.0f) return false;
+        }
+        else if (useBackfaceCulling)
+        {
+            if (U < 0.0f || V < 0.0f || W < 0.0f) return false;
+        }
+        else if ((U < 0.0f || V < 0.0f || W < 0.0f) &&
+                 (U > 0.0f || V > 0.0f || W > 0.0f))
+        {
+            return false;
+        }
+
+        const float det = U + V + W;
+        if (det == 0.0f) return false;
+
+        const float T = ray.shear[2] * (U * A[2] + V * B[2] + W * C[2]);
+        const float signCorrectedT = (T > 0.0f) == (det > 0.0f) ? std::abs(T) : -std::abs(T);
+        if (signCorrectedT < tMin * std::abs(det) || signCorrectedT > hitT * std::abs(det))
+        {
+            return false;
+        }
+
+        const float rcpDet = 1.0f / det;
+        barycentrics.x = V * rcpDet;
+        barycentrics.y = W * rcpDet;
+        hitT = T * rcpDet;
+        hitKind = (det > 0.0f) != flipFaces ? CpuHitKindTriangleFrontFace : CpuHitKindTriangleBackFace;
+        return true;
+    }
+
+    //
+    // Mirrors RayBoxTest() in TraverseFunction.hlsli
+    //
+    static
+        bool RayBoxTest(
+            float &resultT,
+            float tMin,
+            float closestT,
+            const CpuRayData &ray,
+            const AABBNode &box)
+    {
+        float minT = tMin;
+        float maxT = closestT;
+        for (UINT axis = 0; axis < 3; axis++)
+        {
+            const float relativeMiddle = box.center[axis] * ray.inverseDirection[axis] - ray.originTimesInverseDirection[axis];
+            const float extent = box.halfDim[axis] * ray.absInverseDirection[axis];
+            minT = std::max(minT, relativeMiddle - extent);
+            maxT = std::min(maxT, relativeMiddle + extent);
+        }
+
+        resultT = minT;
+        return minT <= maxT;
+    }
+
+    static
+        bool IsOpaque(bool geometryOpaque, UINT instanceFlags, UINT rayFlags)
+    {
+        bool opaque = geometryOpaque;
+        if (instanceFlags & D3D12_RAYTRACING_INSTANCE_FLAG_FORCE_OPAQUE)
+            opaque = true;
+        else if (instanceFlags & D3D12_RAYTRACING_INSTANCE_FLAG_FORCE_NON_OPAQUE)
+            opaque = false;
+
+        if (rayFlags & D3D12_RAY_FLAG_FORCE_OPAQUE)
+            opaque = true;
+        else if (rayFlags & D3D12_RAY_FLAG_FORCE_NON_OPAQUE)
+            opaque = false;
+
+        return opaque;
+    }
+
+    static
+        bool Cull(bool opaque, UINT rayFlags)
+    {
+        return (opaque && (rayFlags & D3D12_RAY_FLAG_CULL_OPAQUE)) || (!opaque && (rayFlags & D3D12_RAY_FLAG_CULL_NON_OPAQUE));
+    }
+
+    //
+    // Small inline stack that spills to the heap, CPU built trees aren't
+    // bounded by TRAVERSAL_MAX_STACK_DEPTH
+    //
+    template<typename T>
+    class TraversalStack
+    {
+    public:
+        bool IsEmpty() const { return m_size == 0; }
+
+        void Push(const T &entry)
+        {
+            if (m_size < ARRAYSIZE(m_entries))
+            {
+                m_entries[m_size] = entry;
+            }
+            else
+            {
+                m_overflow.push_back(entry);
+            }
+            m_size++;
+        }
+
+        T Pop()
+        {
+            m_size--;
+            if (m_size < ARRAYSIZE(m_entries))
+            {
+                return m_entries[m_size];
+            }
+            const T entry = m_overflow.back();
+            m_overflow.pop_back();
+            return entry;
+        }
+
+    private:
+        T m_entries[2 * TRAVERSAL_MAX_STACK_DEPTH];
+        std::vector<T> m_overflow;
+        UINT m_size = 0;
+    };
+
+    struct BottomLevel
+    {
+        const AABBNode *pNodes;
+        const Primitive *pPrimitives;
+        const PrimitiveMetaData *pMetaData;
+    };
+
+    static
+        BottomLevel GetBottomLevel(const BYTE *pBottomLevel)
+    {
+        const BVHOffsets &offsets = *(const BVHOffsets *)pBottomLevel;
+        BottomLevel bottomLevel;
+        bottomLevel.pNodes = (const AABBNode *)(pBottomLevel + offsets.offsetToBoxes);
+        bottomLevel.pPrimitives = (const Primitive *)(pBottomLevel + offsets.offsetToVertices);
+        bottomLevel.pMetaData = (const PrimitiveMetaData *)(pBottomLevel + offsets.offsetToPrimitiveMetaData);
+        return bottomLevel;
+    }
+
+    // Top levels store BVHMetadata where bottom levels store their primitives
+    static
+        const BVHMetadata *GetInstanceMetadata(const BYTE *pTopLevel)
+    {
+        const BVHOffsets &offsets = *(const BVHOffsets *)pTopLevel;
+        return (const BVHMetadata *)(pTopLevel + offsets.offsetToVertices);
+    }
+
+    static
+        UINT GetLeafNumPrimitives(const AABBNode &node)
+    {
+        // Top level leaves and GPU style leaves hold one primitive
+        return std::max((UINT)node.leafNode.numTriangleIds, 1u);
+    }
+
+    static
+        float3 TransformPoint(const FLOAT transform[3][4], const float3 &p)
+    {
+        return float3
+        {
+            transform[0][0] * p.x + transform[0][1] * p.y + transform[0][2] * p.z + transform[0][3],
+            transform[1][0] * p.x + transform[1][1] * p.y + transform[1][2] * p.z + transform[1][3],
+            transform[2][0] * p.x + transform[2][1] * p.y + transform[2][2] * p.z + transform[2][3]
+        };
+    }
+
+    static
+        float3 TransformVector(const FLOAT transform[3][4], const float3 &v)
+    {
+        return float3
+        {
+            transform[0][0] * v.x + transform[0][1] * v.y + transform[0][2] * v.z,
+            transform[1][0] * v.x + transform[1][1] * v.y + transform[1][2] * v.z,
+            transform[2][0] * v.x + transform[2][1] * v.y + transform[2][2] * v.z
+        };
+    }
+
+    //
+    // Single rays
+    //
+
+    struct RayState
+    {
+        UINT rayFlags;
+        float tMin;
+        float closestT;
+        bool isHit;
+        bool endSearch;
+        CpuRayHit hit;
+        CpuTraversalStats stats;
+    };
+
+    //
+    // Walks a BVH2 nearest child first, calling onLeaf for every leaf the ray
+    // reaches before state.closestT, until state.endSearch
+    //
+    template<typename LeafFunction>
+    static
+        void TraverseBvh2(
+            const AABBNode *pNodes,
+            const CpuRayData &ray,
+            RayState &state,
+            LeafFunction onLeaf)
+    {
+        struct StackEntry
+        {
+            UINT nodeIndex;
+            float t;
+        };
+
+        float rootT;
+        if (!RayBoxTest(rootT, state.tMin, state.closestT, ray, pNodes[0]))
+        {
+            return;
+        }
+
+        TraversalStack<StackEntry> stack;
+        stack.Push({ 0, rootT });
+        while (!stack.IsEmpty() && !state.endSearch)
+        {
+            const StackEntry entry = stack.Pop();
+            if (entry.t > state.closestT)
+            {
+                continue;
+            }
+
+            const AABBNode &node = pNodes[entry.nodeIndex];
+            state.stats.nodesVisited++;
+            if (node.leaf)
+            {
+                onLeaf(node);
+                continue;
+            }
+
+            const UINT leftChildIndex = node.internalNode.leftNodeIndex;
+            const UINT rightChildIndex = node.rightNodeIndex;
+            float leftT, rightT;
+            const bool leftTest = RayBoxTest(leftT, state.tMin, state.closestT, ray, pNodes[leftChildIndex]);
+            const bool rightTest = RayBoxTest(rightT, state.tMin, state.closestT, ray, pNodes[rightChildIndex]);
+            if (leftTest && rightTest)
+            {
+                // Farther child first, left wins ties like in the shader
+                if (rightT < leftT)
+                {
+                    stack.Push({ leftChildIndex, leftT });
+                    stack.Push({ rightChildIndex, rightT });
+                }
+                else
+                {
+                    stack.Push({ rightChildIndex, rightT });
+                    stack.Push({ leftChildIndex, leftT });
+                }
+            }
+            else if (leftTest || rightTest)
+            {
+                stack.Push(rightTest ? StackEntry{ rightChildIndex, rightT } : StackEntry{ leftChildIndex, leftT });
+            }
+        }
+    }
+
+    static
+        void TraverseBottomLevel(
+            const BYTE *pBottomLevel,
+            const CpuRayData &ray,
+            UINT instanceFlags,
+            const BVHMetadata *pInstance,
+            RayState &state)
+    {
+        const BottomLevel bottomLevel = GetBottomLevel(pBottomLevel);
+        TraverseBvh2(bottomLevel.pNodes, ray, state, [&](const AABBNode &leaf)
+        {
+            const UINT firstPrimitive = leaf.leafNode.firstTriangleId;
+            const UINT endPrimitive = firstPrimitive + GetLeafNumPrimitives(leaf);
+            for (UINT primitiveIndex = firstPrimitive; primitiveIndex < endPrimitive && !state.endSearch; primitiveIndex++)
+            {
+                const Primitive &primitive = bottomLevel.pPrimitives[primitiveIndex];
+                const PrimitiveMetaData &metaData = bottomLevel.pMetaData[primitiveIndex];
+                const bool geometryOpaque = (metaData.GeometryFlags & D3D12_RAYTRACING_GEOMETRY_FLAG_OPAQUE) != 0;
+                if (primitive.PrimitiveType != TRIANGLE_TYPE || Cull(IsOpaque(geometryOpaque, instanceFlags, state.rayFlags), state.rayFlags))
+                {
+                    continue;
+                }
+
+                state.stats.primitivesTested++;
+                float2 barycentrics;
+                UINT hitKind;
+                if (IntersectTriangle(state.closestT, barycentrics, hitKind, ray, state.tMin, primitive.triangle, state.rayFlags, instanceFlags))
+                {
+                    CpuRayHit &hit = state.hit;
+                    hit.t = state.closestT;
+                    hit.barycentrics = barycentrics;
+                    hit.hitKind = hitKind;
+                    hit.primitiveIndex = metaData.PrimitiveIndex;
+                    hit.geometryContributionToHitGroupIndex = metaData.GeometryContributionToHitGroupIndex;
+                    hit.bvhPrimitiveIndex = primitiveIndex;
+                    hit.instanceIndex = pInstance ? pInstance->InstanceIndex : 0;
+                    hit.instanceID = pInstance ? pInstance->instanceDesc.InstanceID : 0;
+                    hit.instanceContributionToHitGroupIndex = pInstance ? pInstance->instanceDesc.InstanceContributionToHitGroupIndex : 0;
+                    state.isHit = true;
+                    state.endSearch = (state.rayFlags & D3D12_RAY_FLAG_ACCEPT_FIRST_HIT_AND_END_SEARCH) != 0;
+                }
+            }
+        });
+    }
+
+    static
+        void InitRayState(RayState &state, UINT rayFlags, const CpuRay &ray)
+    {
+        state.rayFlags = rayFlags;
+        state.tMin = ray.tMin;
+        state.closestT = ray.tMax;
+        state.isHit = false;
+        state.endSearch = false;
+        state.stats = {};
+    }
+
+    static
+        bool FinishRay(const RayState &state, CpuRayHit &hit, CpuTraversalStats *pStats)
+    {
+        if (pStats)
+        {
+            pStats->nodesVisited += state.stats.nodesVisited;
+            pStats->primitivesTested += state.stats.primitivesTested;
+        }
+        if (state.isHit)
+        {
+            hit = state.hit;
+        }
+        return state.isHit;
+    }
+
+    bool TraceRayOnCpuBottomLevel(
+        const BYTE *pBottomLevel,
+        UINT rayFlags,
+        const CpuRay &ray,
+        CpuRayHit &hit,
+        CpuTraversalStats *pStats)
+    {
+        RayState state;
+        InitRayState(state, rayFlags, ray);
+
+        CpuRayData rayData;
+        GetCpuRayData(rayData, ray.origin, ray.direction);
+        TraverseBottomLevel(pBottomLevel, rayData, 0, nullptr, state);
+        return FinishRay(state, hit, pStats);
+    }
+
+    bool TraceRayOnCpu(
+        const BYTE *pTopLevel,
+        UINT rayFlags,
+        UINT instanceInclusionMask,
+        const CpuRay &ray,
+        CpuRayHit &hit,
+        CpuTraversalStats *pStats)
+    {
+        RayState state;
+        InitRayState(state, rayFlags, ray);
+
+        CpuRayData worldRay;
+        GetCpuRayData(worldRay, ray.origin, ray.direction);
+
+        const AABBNode *pNodes = (const AABBNode *)(pTopLevel + ((const BVHOffsets *)pTopLevel)->offsetToBoxes);
+        const BVHMetadata *pInstances = GetInstanceMetadata(pTopLevel);
+        TraverseBvh2(pNodes, worldRay, state, [&](const AABBNode &leaf)
+        {
+            const BVHMetadata &instance = pInstances[leaf.leafNode.firstTriangleId];
+            const D3D12_RAYTRACING_FALLBACK_INSTANCE_DESC &instanceDesc = instance.instanceDesc;
+            if (!(instanceDesc.InstanceMask & instanceInclusionMask))
+            {
+                return;
+            }
+
+            // The builder stores WorldToObject in the instance desc. t is the same in both spaces.
+            CpuRayData objectRay;
+            GetCpuRayData(objectRay,
+                TransformPoint(instanceDesc.Transform, ray.origin),
+                TransformVector(instanceDesc.Transform, ray.direction));
+            TraverseBottomLevel((const BYTE *)instanceDesc.AccelerationStructure.GpuVA, objectRay, instanceDesc.Flags, &instance, state);
+        });
+        return FinishRay(state, hit, pStats);
+    }
+
+    //
+    // Packets
+    //
+
+    struct PacketState
+    {
+        UINT rayFlags;
+        UINT activeMask;                                // Rays still searching
+        UINT hitMask;
+        float inverseDirection[3][CpuRayPacketSize];
+        float absInverseDirection[3][CpuRayPacketSize];
+        float originTimesInverseDirection[3][CpuRayPacketSize];
+        float tMin[CpuRayPacketSize];
+        float closestT[CpuRayPacketSize];
+        CpuRayData rays[CpuRayPacketSize];
+        CpuRayHit *pHits;
+        CpuTraversalStats stats;
+    };
+
+    static
+        void SetPacketRay(PacketState &packet, UINT lane, const float3 &origin, const float3 &direction)
+    {
+        CpuRayData &ray = packet.rays[lane];
+        GetCpuRayData(ray, origin, direction);
+        for (UINT axis = 0; axis < 3; axis++)
+        {
+            packet.inverseDirection[axis][lane] = ray.inverseDirection[axis];
+            packet.absInverseDirection[axis][lane] = ray.absInverseDirection[axis];
+            packet.originTimesInverseDirection[axis][lane] = ray.originTimesInverseDirection[axis];
+        }
+    }
+
+    //
+    // RayBoxTest() for all the rays of the packet, returns the mask of the ones that hit
+    //
+    static
+        UINT IntersectPacketBoxSse(
+            const PacketState &packet,
+            const AABBNode &box)
+    {
+        UINT mask = 0;
+        for (UINT i = 0; i < CpuRayPacketSize; i += 4)
+        {
+            __m128 minT = _mm_loadu_ps(&packet.tMin[i]);
+            __m128 maxT = _mm_loadu_ps(&packet.closestT[i]);
+            for (UINT axis = 0; axis < 3; axis++)
+            {
+                const __m128 relativeMiddle = _mm_sub_ps(
+                    _mm_mul_ps(_mm_set1_ps(box.center[axis]), _mm_loadu_ps(&packet.inverseDirection[axis][i])),
+                    _mm_loadu_ps(&packet.originTimesInverseDirection[axis][i]));
+                const __m128 extent = _mm_mul_ps(_mm_set1_ps(box.halfDim[axis]), _mm_loadu_ps(&packet.absInverseDirection[axis][i]));
+                minT = _mm_max_ps(minT, _mm_sub_ps(relativeMiddle, extent));
+                maxT = _mm_min_ps(maxT, _mm_add_ps(relativeMiddle, extent));
+            }
+            mask |= (UINT)_mm_movemask_ps(_mm_cmple_ps(minT, maxT)) << i;
+        }
+        return mask;
+    }
+
+    static
+        UINT IntersectPacketBoxAvx(
+            const PacketState &packet,
+            const AABBNode &box)
+    {
+        __m256 minT = _mm256_loadu_ps(packet.tMin);
+        __m256 maxT = _mm256_loadu_ps(packet.closestT);
+        for (UINT axis = 0; axis < 3; axis++)
+        {
+            const __m256 relativeMiddle = _mm256_sub_ps(
+                _mm256_mul_ps(_mm256_broadcast_ss(&box.center[axis]), _mm256_loadu_ps(packet.inverseDirection[axis])),
+                _mm256_loadu_ps(packet.originTimesInverseDirection[axis]));
+            const __m256 extent = _mm256_mul_ps(_mm256_broadcast_ss(&box.halfDim[axis]), _mm256_loadu_ps(packet.absInverseDirection[axis]));
+            minT = _mm256_max_ps(minT, _mm256_sub_ps(relativeMiddle, extent));
+            maxT = _mm256_min_ps(maxT, _mm256_add_ps(relativeMiddle, extent));
+        }
+        const UINT mask = (UINT)_mm256_movemask_ps(_mm256_cmp_ps(minT, maxT, _CMP_LE_OQ));
+
+        // Avoids the AVX to SSE transition penalty in the caller
+        _mm256_zeroupper();
+        return mask;
+    }
+
+    static
+        UINT IntersectPacketBox(
+            const PacketState &packet,
+            const AABBNode &box)
+    {
+        static const bool useAvx = IsAvxSupported();
+        return useAvx ? IntersectPacketBoxAvx(packet, box) : IntersectPacketBoxSse(packet, box);
+    }
+
+    //
+    // Walks a BVH2 with every active ray of the packet. Children are visited
+    // near to far along the direction of the first ray that reaches them.
+    //
+    template<typename LeafFunction>
+    static
+        void TraverseBvh2Packet(
+            const AABBNode *pNodes,
+            PacketState &packet,
+            LeafFunction onLeaf)
+    {
+        struct StackEntry
+        {
+            UINT nodeIndex;
+            UINT mask;
+        };
+
+        const UINT rootMask = IntersectPacketBox(packet, pNodes[0]) & packet.activeMask;
+        if (!rootMask)
+        {
+            return;
+        }
+
+        TraversalStack<StackEntry> stack;
+        stack.Push({ 0, rootMask });
+        while (!stack.IsEmpty() && packet.activeMask)
+        {
+            const StackEntry entry = stack.Pop();
+            const UINT mask = entry.mask & packet.activeMask;
+            if (!mask)
+            {
+                continue;
+            }
+
+            const AABBNode &node = pNodes[entry.nodeIndex];
+            packet.stats.nodesVisited++;
+            if (node.leaf)
+            {
+                onLeaf(node, mask);
+                continue;
+            }
+
+            const UINT leftChildIndex = node.internalNode.leftNodeIndex;
+            const UINT rightChildIndex = node.rightNodeIndex;
+            const UINT leftMask = IntersectPacketBox(packet, pNodes[leftChildIndex]) & mask;
+            const UINT rightMask = IntersectPacketBox(packet, pNodes[rightChildIndex]) & mask;
+            if (leftMask && rightMask)
+            {
+                unsigned long lane;
+                _BitScanForward(&lane, leftMask | rightMask);
+                const AABBNode &left = pNodes[leftChildIndex];
+                const AABBNode &right = pNodes[rightChildIndex];
+                const CpuRayData &ray = packet.rays[lane];
+                float towardsRight = 0.0f;
+                for (UINT axis = 0; axis < 3; axis++)
+                {
+                    towardsRight += (right.center[axis] - left.center[axis]) * ray.inverseDirection[axis];
+                }
+
+                // Farther child first. The sign of the inverse direction is the sign of the direction.
+                if (towardsRight < 0.0f)
+                {
+                    stack.Push({ leftChildIndex, leftMask });
+                    stack.Push({ rightChildIndex, rightMask });
+                }
+                else
+                {
+                    stack.Push({ rightChildIndex, rightMask });
+                    stack.Push({ leftChildIndex, leftMask });
+                }
+            }
+            else if (leftMask || rightMask)
+            {
+                stack.Push(rightMask ? StackEntry{ rightChildIndex, rightMask } : StackEntry{ leftChildIndex, leftMask });
+            }
+        }
+    }
+
+    static
+        void TraverseBottomLevelPacket(
+            const BYTE *pBottomLevel,
+            UINT instanceFlags,
+            const BVHMetadata *pInstance,
+            PacketState &packet)
+    {
+        const BottomLevel bottomLevel = GetBottomLevel(pBottomLevel);
+        TraverseBvh2Packet(bottomLevel.pNodes, packet, [&](const AABBNode &leaf, UINT mask)
+        {
+            const UINT firstPrimitive = leaf.leafNode.firstTriangleId;
+            const UINT endPrimitive = firstPrimitive + GetLeafNumPrimitives(leaf);
+            for (UINT primitiveIndex = firstPrimitive; primitiveIndex < endPrimitive; primitiveIndex++)
+            {
+                const Primitive &primitive = bottomLevel.pPrimitives[primitiveIndex];
+                const PrimitiveMetaData &metaData = bottomLevel.pMetaData[primitiveIndex];
+                const bool geometryOpaque = (metaData.GeometryFlags & D3D12_RAYTRACING_GEOMETRY_FLAG_OPAQUE) != 0;
+                if (primitive.PrimitiveType != TRIANGLE_TYPE || Cull(IsOpaque(geometryOpaque, instanceFlags, packet.rayFlags), packet.rayFlags))
+                {
+                    continue;
+                }
+
+                for (UINT lanes = mask & packet.activeMask; lanes; lanes &= lanes - 1)
+                {
+                    unsigned long lane;
+                    _BitScanForward(&lane, lanes);
+
+                    packet.stats.primitivesTested++;
+                    float2 barycentrics;
+                    UINT hitKind;
+                    if (!IntersectTriangle(packet.closestT[lane], barycentrics, hitKind, packet.rays[lane], packet.tMin[lane], primitive.triangle, packet.rayFlags, instanceFlags))
+                    {
+                        continue;
+                    }
+
+                    CpuRayHit &hit = packet.pHits[lane];
+                    hit.t = packet.closestT[lane];
+                    hit.barycentrics = barycentrics;
+                    hit.hitKind = hitKind;
+                    hit.primitiveIndex = metaData.PrimitiveIndex;
+                    hit.geometryContributionToHitGroupIndex = metaData.GeometryContributionToHitGroupIndex;
+                    hit.bvhPrimitiveIndex = primitiveIndex;
+                    hit.instanceIndex = pInstance ? pInstance->InstanceIndex : 0;
+                    hit.instanceID = pInstance ? pInstance->instanceDesc.InstanceID : 0;
+                    hit.instanceContributionToHitGroupIndex = pInstance ? pInstance->instanceDesc.InstanceContributionToHitGroupIndex : 0;
+                    packet.hitMask |= 1u << lane;
+                    if (packet.rayFlags & D3D12_RAY_FLAG_ACCEPT_FIRST_HIT_AND_END_SEARCH)
+                    {
+                        packet.activeMask &= ~(1u << lane);
+                    }
+                }
+            }
+        });
+    }
+
+    static
+        void InitPacketState(PacketState &packet, UINT rayFlags, const CpuRay *pRays, UINT activeMask, CpuRayHit *pHits)
+    {
+        packet.rayFlags = rayFlags;
+        packet.activeMask = activeMask & ((1u << CpuRayPacketSize) - 1);
+        packet.hitMask = 0;
+        packet.pHits = pHits;
+        packet.stats = {};
+        for (UINT lane = 0; lane < CpuRayPacketSize; lane++)
+        {
+            const bool isActive = (packet.activeMask >> lane) & 1;
+            const CpuRay &ray = pRays[isActive ? lane : 0];
+
+            // Inactive rays get an empty interval and never hit a box
+            packet.tMin[lane] = isActive ? ray.tMin : FLT_MAX;
+            packet.closestT[lane] = isActive ? ray.tMax : -FLT_MAX;
+            if (isActive)
+            {
+                SetPacketRay(packet, lane, ray.origin, ray.direction);
+            }
+            else
+            {
+                SetPacketRay(packet, lane, float3{ 0.0f, 0.0f, 0.0f }, float3{ 1.0f, 1.0f, 1.0f });
+            }
+        }
+    }
+
+    static
+        UINT FinishPacket(const PacketState &packet, CpuTraversalStats *pStats)
+    {
+        if (pStats)
+        {
+            pStats->nodesVisited += packet.stats.nodesVisited;
+            pStats->primitivesTested += packet.stats.primitivesTested;
+        }
+        return packet.hitMask;
+    }
+
+    UINT TraceRayPacketOnCpuBottomLevel(
+        const BYTE *pBottomLevel,
+        UINT rayFlags,
+        const CpuRay *pRays,
+        UINT activeMask,
+        CpuRayHit *pHits,
+        CpuTraversalStats *pStats)
+    {
+        PacketState packet;
+        InitPacketState(packet, rayFlags, pRays, activeMask, pHits);
+        TraverseBottomLevelPacket(pBottomLevel, 0, nullptr, packet);
+        return FinishPacket(packet, pStats);
+    }
+
+    UINT TraceRayPacketOnCpu(
+        const BYTE *pTopLevel,
+        UINT rayFlags,
+        UINT instanceInclusionMask,
+        const CpuRay *pRays,
+        UINT activeMask,
+        CpuRayHit *pHits,
+        CpuTraversalStats *pStats)
+    {
+        PacketState packet;
+        InitPacketState(packet, rayFlags, pRays, activeMask, pHits);
+
+        // Object space copy of the packet, rebuilt for every instance the packet reaches
+        PacketState objectPacket = packet;
+        const AABBNode *pNodes = (const AABBNode *)(pTopLevel + ((const BVHOffsets *)pTopLevel)->offsetToBoxes);
+        const BVHMetadata *pInstances = GetInstanceMetadata(pTopLevel);
+        TraverseBvh2Packet(pNodes, packet, [&](const AABBNode &leaf, UINT mask)
+        {
+            const BVHMetadata &instance = pInstances[leaf.leafNode.firstTriangleId];
+            const D3D12_RAYTRACING_FALLBACK_INSTANCE_DESC &instanceDesc = instance.instanceDesc;
+            if (!(instanceDesc.InstanceMask & instanceInclusionMask))
+            {
+                return;
+            }
+
+            for (UINT lanes = mask; lanes; lanes &= lanes - 1)
+            {
+                unsigned long lane;
+                _BitScanForward(&lane, lanes);
+                SetPacketRay(objectPacket, lane,
+                    TransformPoint(instanceDesc.Transform, pRays[lane].origin),
+                    TransformVector(instanceDesc.Transform, pRays[lane].direction));
+            }
+            memcpy(objectPacket.tMin, packet.tMin, sizeof(packet.tMin));
+            memcpy(objectPacket.closestT, packet.closestT, sizeof(packet.closestT));
+            objectPacket.activeMask = mask;
+            objectPacket.hitMask = 0;
+            objectPacket.stats = {};
+
+            TraverseBottomLevelPacket((const BYTE *)instanceDesc.AccelerationStructure.GpuVA, instanceDesc.Flags, &instance, objectPacket);
+
+            memcpy(packet.closestT, objectPacket.closestT, sizeof(packet.closestT));
+            packet.hitMask |= objectPacket.hitMask;
+            packet.activeMask &= ~(mask & ~objectPacket.activeMask);
+            packet.stats.nodesVisited += objectPacket.stats.nodesVisited;
+            packet.stats.primitivesTested += objectPacket.stats.primitivesTested;
+        });
+        return FinishPacket(packet, pStats);
+    }
+}
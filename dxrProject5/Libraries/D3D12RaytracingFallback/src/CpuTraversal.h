@@ -0,0 +1,127 @@
+//*********************************************************
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+//*********************************************************
+#pragma once
+namespace FallbackLayer
+{
+    //
+    // Ray tracing on the CPU against acceleration structures built by
+    // BuildRaytracingAccelerationStructureOnCpu, with the semantics of
+    // Traverse() in TraverseFunction.hlsli:
+    //  - closest hit, or the first hit found with RAY_FLAG_ACCEPT_FIRST_HIT_AND_END_SEARCH
+    //  - front/back face culling, flipped by INSTANCE_FLAG_TRIANGLE_FRONT_COUNTERCLOCKWISE
+    //    and disabled by INSTANCE_FLAG_TRIANGLE_CULL_DISABLE
+    //  - opaque/non-opaque culling and forcing, instance masks
+    // There are no shaders: non-opaque triangles are accepted as if their any-hit
+    // shader accepted them, and procedural primitives are skipped.
+    //
+    static const UINT CpuHitKindTriangleFrontFace = 0xFE;
+    static const UINT CpuHitKindTriangleBackFace = 0xFF;
+    static const UINT CpuRayPacketSize = 8;
+
+    struct CpuRay
+    {
+        float3 origin;
+        float3 direction;
+        float tMin;
+        float tMax;
+    };
+
+    struct CpuRayHit
+    {
+        float t;
+        float2 barycentrics;
+        UINT hitKind;
+        UINT primitiveIndex;                            // PrimitiveIndex()
+        UINT geometryContributionToHitGroupIndex;
+        UINT instanceIndex;                             // InstanceIndex(), 0 without a top level
+        UINT instanceID;                                // InstanceID(), 0 without a top level
+        UINT instanceContributionToHitGroupIndex;
+        UINT bvhPrimitiveIndex;                         // Into the primitives of the bottom level
+    };
+
+    struct CpuTraversalStats
+    {
+        UINT64 nodesVisited;
+        UINT64 primitivesTested;
+    };
+
+    // Per ray state for the box and triangle tests, set up like GetRayData()
+    struct CpuRayData
+    {
+        float origin[3];
+        float inverseDirection[3];
+        float absInverseDirection[3];
+        float originTimesInverseDirection[3];
+        UINT nearSide[3];               // 0 when the ray enters boxes through their min plane on that axis
+
+        float shear[3];
+        UINT swizzledIndices[3];
+    };
+
+    void GetCpuRayData(
+        CpuRayData &data,
+        const float3 &origin,
+        const float3 &direction);
+
+    // RayTriangleIntersect() from TraverseFunction.hlsli, a hit in [tMin, hitT] replaces hitT
+    bool IntersectTriangle(
+        float &hitT,
+        float2 &barycentrics,
+        UINT &hitKind,
+        const CpuRayData &ray,
+        float tMin,
+        const Triangle &triangle,
+        UINT rayFlags,
+        UINT instanceFlags);
+
+    bool IsAvxSupported();
+
+    // Returns false on a miss, hit is only written on a hit
+    bool TraceRayOnCpu(
+        const BYTE *pTopLevel,
+        UINT rayFlags,
+        UINT instanceInclusionMask,
+        const CpuRay &ray,
+        CpuRayHit &hit,
+        CpuTraversalStats *pStats = nullptr);
+
+    // As if pBottomLevel were the only instance, with an identity transform and no flags
+    bool TraceRayOnCpuBottomLevel(
+        const BYTE *pBottomLevel,
+        UINT rayFlags,
+        const CpuRay &ray,
+        CpuRayHit &hit,
+        CpuTraversalStats *pStats = nullptr);
+
+    //
+    // CpuRayPacketSize rays at once, the ones in activeMask. Coherent rays share
+    // the node tests, which run on all of them with one SIMD instruction sequence.
+    // Every ray gets the closest hit it would get traced on its own; with
+    // RAY_FLAG_ACCEPT_FIRST_HIT_AND_END_SEARCH the first hit found may differ.
+    // Returns a mask of the rays that hit; the hits of the others aren't written.
+    //
+    UINT TraceRayPacketOnCpu(
+        const BYTE *pTopLevel,
+        UINT rayFlags,
+        UINT instanceInclusionMask,
+        const CpuRay *pRays,
+        UINT activeMask,
+        CpuRayHit *pHits,
+        CpuTraversalStats *pStats = nullptr);
+
+    UINT TraceRayPacketOnCpuBottomLevel(
+        const BYTE *pBottomLevel,
+        UINT rayFlags,
+        const CpuRay *pRays,
+        UINT activeMask,
+        CpuRayHit *pHits,
+        CpuTraversalStats *pStats = nullptr);
+}
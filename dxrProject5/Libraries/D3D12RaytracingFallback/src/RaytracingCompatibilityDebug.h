@@ -9,6 +9,8 @@
 //
 //*********************************************************
 #pragma once
+#include <ostream>
+#include <vector>
 #include "FallbackDebug.h"
 
 #if ENABLE_UAV_LOG
@@ -19,6 +21,84 @@ void OutputDebugLog(ID3D12RaytracingFallbackDevice *pDevice);
 void VisualizeAccelerationStructureLevel(ID3D12RaytracingFallbackDevice *pDevice, UINT level);
 #endif
 
+// Anything built here can be updated, ALLOW_UPDATE isn't needed. With PERFORM_UPDATE the
+// structure at SourceAccelerationStructureData (pData itself for an update in place) is refit
+// to the new vertices or instance transforms in pDesc, keeping its tree.
 void BuildRaytracingAccelerationStructureOnCpu(
     _In_  const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC *pDesc,
     _Out_ void *pData);
+
+// Expected number of box and primitive tests for a ray through the root box. Updates tend to grow
+// it as the geometry moves away from what the tree was built for; compare it to the cost right
+// after the build to decide when to rebuild instead.
+float GetAccelerationStructureSahCostOnCpu(
+    _In_  const void *pData);
+
+// Reorders the treelets of an acceleration structure in place, as a PREFER_FAST_TRACE build does.
+// Any Fallback acceleration structure in CPU memory will do, bottom or top level, built here or
+// read back from the GPU; its nodes are left in the layout the builds here write, so it can be
+// updated afterwards. Returns how much GetAccelerationStructureSahCostOnCpu() went down.
+float ReorderAccelerationStructureTreeletsOnCpu(
+    _Inout_ void *pData);
+
+// Builds a bottom level like BuildRaytracingAccelerationStructureOnCpu, except that nodes can
+// also be split along a plane through their triangles, sending triangles that cross it to both
+// children. That helps most with long, thin triangles at an angle to the axes; meshes of small,
+// evenly sized triangles gain little from it. Marched creatures are such meshes: from 150 to 13K
+// triangles, no overlapThreshold from 1e-3 down to 0 with a duplicateBudget up to 4 lowers their
+// SAH cost by more than 1%, and on average by less than 0.2%, so they are better off without it.
+// Nodes only try it if the children an ordinary split gives them overlap by more than
+// overlapThreshold of the root's surface area: lower thresholds build slower and trace faster,
+// 1e-5 is a good start. At most duplicateBudget times the number of triangles go to more than
+// one leaf, and pData needs GetSpatialSplitAccelerationStructureSizeOnCpu() bytes to hold them.
+// PREFER_FAST_TRACE reorders the treelets afterwards; PREFER_FAST_BUILD is ignored.
+void BuildRaytracingAccelerationStructureWithSpatialSplitsOnCpu(
+    _In_  const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC *pDesc,
+    float overlapThreshold,
+    float duplicateBudget,
+    _Out_ void *pData);
+
+UINT GetSpatialSplitAccelerationStructureSizeOnCpu(
+    UINT numTriangles,
+    float duplicateBudget);
+
+// Quality of the tree of any Fallback acceleration structure in CPU memory, bottom or top level,
+// built here or read back from the GPU
+struct AccelerationStructureQuality
+{
+    float sahCost;                              // GetAccelerationStructureSahCostOnCpu()
+    float siblingOverlap;                       // Volume the two children of a node share, summed over the nodes, over the root's volume
+    UINT numNodes;
+    UINT numLeaves;
+    UINT numPrimitives;                         // In the leaves, so a primitive split between leaves counts more than once
+    std::vector<UINT> leavesAtDepth;            // The root is at depth 0
+    std::vector<UINT> leavesWithNumPrimitives;
+};
+
+void GetAccelerationStructureQualityOnCpu(
+    _In_  const void *pData,
+    _Out_ AccelerationStructureQuality &quality);
+
+// The above as a JSON object
+void WriteAccelerationStructureQualityOnCpu(
+    _In_  const void *pData,
+    std::ostream &output);
+
+struct AccelerationStructureReportMesh
+{
+    const char *pName;
+    const float *pVertices;                     // x, y, z
+    UINT vertexCount;
+    const UINT *pIndices;
+    UINT indexCount;
+};
+
+// Builds every mesh as a bottom level in each mode the builds here have, numRepeats times each,
+// and writes the build times and the quality of the results as JSON, so that builder changes can
+// be compared. The modes are "sah" (no flags), "fast_build", "fast_trace", "spatial_splits"
+// (overlapThreshold 1e-5, duplicateBudget 0.3) and "update", a refit of the "sah" build.
+void WriteAccelerationStructureBuildReportOnCpu(
+    _In_reads_(numMeshes) const AccelerationStructureReportMesh *pMeshes,
+    UINT numMeshes,
+    UINT numRepeats,
+    std::ostream &output);
@@ -0,0 +1,393 @@
+//*********************************************************
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+//*********************************************************
+#include "pch.h"
+#include <intrin.h>
+
+namespace FallbackLayer
+{
+    //
+    // Ray vs. Width children. Returns a bit per child that is hit within
+    // [tMin, tMax] and writes the entry distances of all of them.
+    //
+    template<UINT Width>
+    static
+        UINT IntersectWideNodeSse(
+            const WideBVHNode<Width> &node,
+            const CpuRayData &ray,
+            float tMin,
+            float tMax,
+            float *pDistances)
+    {
+        const UINT nx = ray.nearSide[0], ny = ray.nearSide[1], nz = ray.nearSide[2];
+        const __m128 inverseDirectionX = _mm_set1_ps(ray.inverseDirection[0]);
+        const __m128 inverseDirectionY = _mm_set1_ps(ray.inverseDirection[1]);
+        const __m128 inverseDirectionZ = _mm_set1_ps(ray.inverseDirection[2]);
+        const __m128 scaledOriginX = _mm_set1_ps(ray.originTimesInverseDirection[0]);
+        const __m128 scaledOriginY = _mm_set1_ps(ray.originTimesInverseDirection[1]);
+        const __m128 scaledOriginZ = _mm_set1_ps(ray.originTimesInverseDirection[2]);
+
+        UINT mask = 0;
+        for (UINT i = 0; i < Width; i += 4)
+        {
+            const __m128 nearX = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(&node.bounds[nx][0][i]), inverseDirectionX), scaledOriginX);
+            const __m128 nearY = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(&node.bounds[ny][1][i]), inverseDirectionY), scaledOriginY);
+            const __m128 nearZ = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(&node.bounds[nz][2][i]), inverseDirectionZ), scaledOriginZ);
+            const __m128 farX = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(&node.bounds[1 - nx][0][i]), inverseDirectionX), scaledOriginX);
+            const __m128 farY = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(&node.bounds[1 - ny][1][i]), inverseDirectionY), scaledOriginY);
+            const __m128 farZ = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(&node.bounds[1 - nz][2][i]), inverseDirectionZ), scaledOriginZ);
+
+            const __m128 entry = _mm_max_ps(_mm_max_ps(nearX, nearY), _mm_max_ps(nearZ, _mm_set1_ps(tMin)));
+            const __m128 exit = _mm_min_ps(_mm_min_ps(farX, farY), _mm_min_ps(farZ, _mm_set1_ps(tMax)));
+            _mm_storeu_ps(pDistances + i, entry);
+            mask |= (UINT)_mm_movemask_ps(_mm_cmple_ps(entry, exit)) << i;
+        }
+        return mask;
+    }
+
+    static
+        UINT IntersectWideNodeAvx(
+            const WideBVHNode<8> &node,
+            const CpuRayData &ray,
+            float tMin,
+            float tMax,
+            float *pDistances)
+    {
+        const UINT nx = ray.nearSide[0], ny = ray.nearSide[1], nz = ray.nearSide[2];
+        const __m256 inverseDirectionX = _mm256_broadcast_ss(&ray.inverseDirection[0]);
+        const __m256 inverseDirectionY = _mm256_broadcast_ss(&ray.inverseDirection[1]);
+        const __m256 inverseDirectionZ = _mm256_broadcast_ss(&ray.inverseDirection[2]);
+        const __m256 scaledOriginX = _mm256_broadcast_ss(&ray.originTimesInverseDirection[0]);
+        const __m256 scaledOriginY = _mm256_broadcast_ss(&ray.originTimesInverseDirection[1]);
+        const __m256 scaledOriginZ = _mm256_broadcast_ss(&ray.originTimesInverseDirection[2]);
+
+        const __m256 nearX = _mm256_sub_ps(_mm256_mul_ps(_mm256_loadu_ps(node.bounds[nx][0]), inverseDirectionX), scaledOriginX);
+        const __m256 nearY = _mm256_sub_ps(_mm256_mul_ps(_mm256_loadu_ps(node.bounds[ny][1]), inverseDirectionY), scaledOriginY);
+        const __m256 nearZ = _mm256_sub_ps(_mm256_mul_ps(_mm256_loadu_ps(node.bounds[nz][2]), inverseDirectionZ), scaledOriginZ);
+        const __m256 farX = _mm256_sub_ps(_mm256_mul_ps(_mm256_loadu_ps(node.bounds[1 - nx][0]), inverseDirectionX), scaledOriginX);
+        const __m256 farY = _mm256_sub_ps(_mm256_mul_ps(_mm256_loadu_ps(node.bounds[1 - ny][1]), inverseDirectionY), scaledOriginY);
+        const __m256 farZ = _mm256_sub_ps(_mm256_mul_ps(_mm256_loadu_ps(node.bounds[1 - nz][2]), inverseDirectionZ), scaledOriginZ);
+
+        const __m256 entry = _mm256_max_ps(_mm256_max_ps(nearX, nearY), _mm256_max_ps(nearZ, _mm256_set1_ps(tMin)));
+        const __m256 exit = _mm256_min_ps(_mm256_min_ps(farX, farY), _mm256_min_ps(farZ, _mm256_set1_ps(tMax)));
+        _mm256_storeu_ps(pDistances, entry);
+        const UINT mask = (UINT)_mm256_movemask_ps(_mm256_cmp_ps(entry, exit, _CMP_LE_OQ));
+
+        // Avoids the AVX to SSE transition penalty in the caller
+        _mm256_zeroupper();
+        return mask;
+    }
+
+    static
+        UINT IntersectWideNode(
+            const WideBVHNode<4> &node,
+            const CpuRayData &ray,
+            float tMin,
+            float tMax,
+            float *pDistances)
+    {
+        return IntersectWideNodeSse(node, ray, tMin, tMax, pDistances);
+    }
+
+    static
+        UINT IntersectWideNode(
+            const WideBVHNode<8> &node,
+            const CpuRayData &ray,
+            float tMin,
+            float tMax,
+            float *pDistances)
+    {
+        if (IsAvxSupported())
+        {
+            return IntersectWideNodeAvx(node, ray, tMin, tMax, pDistances);
+        }
+        return IntersectWideNodeSse(node, ray, tMin, tMax, pDistances);
+    }
+
+    static
+        float SurfaceArea(const AABBNode &node)
+    {
+        return node.halfDim[0] * node.halfDim[1] + node.halfDim[1] * node.halfDim[2] + node.halfDim[2] * node.halfDim[0];
+    }
+
+    template<UINT Width>
+    static
+        void InitEmptyWideBVHNode(WideBVHNode<Width> &node)
+    {
+        for (UINT i = 0; i < Width; i++)
+        {
+            for (UINT axis = 0; axis < 3; axis++)
+            {
+                node.bounds[0][axis][i] = FLT_MAX;
+                node.bounds[1][axis][i] = -FLT_MAX;
+            }
+            node.children[i] = WideBVHEmptyChild;
+        }
+    }
+
+    template<UINT Width>
+    bool WideBVH<Width>::Collapse(const BYTE *pAccelerationStructure, UINT maxPrimitivesInLeaf)
+    {
+        const BVHOffsets &offsets = *(const BVHOffsets *)pAccelerationStructure;
+        const AABBNode *pNodes = (const AABBNode *)(pAccelerationStructure + offsets.offsetToBoxes);
+        m_pPrimitives = (const Primitive *)(pAccelerationStructure + offsets.offsetToVertices);
+        m_pMetaData = (const PrimitiveMetaData *)(pAccelerationStructure + offsets.offsetToPrimitiveMetaData);
+        maxPrimitivesInLeaf = std::min(std::max(maxPrimitivesInLeaf, 1u), WideBVHMaxPrimitivesInLeaf);
+
+        //
+        // Find the primitive range of every subtree. Leaves of a subtree cover a
+        // contiguous range when the builder lays them out depth first, and only
+        // then can the subtree be turned into one leaf.
+        //
+        std::vector<UINT> preorder;
+        std::vector<UINT> nodeStack(1, 0);
+        UINT numBvh2Nodes = 0;
+        while (!nodeStack.empty())
+        {
+            const UINT nodeIndex = nodeStack.back();
+            nodeStack.pop_back();
+            preorder.push_back(nodeIndex);
+            numBvh2Nodes = std::max(numBvh2Nodes, nodeIndex + 1);
+            if (!pNodes[nodeIndex].leaf)
+            {
+                nodeStack.push_back(pNodes[nodeIndex].internalNode.leftNodeIndex);
+                nodeStack.push_back(pNodes[nodeIndex].rightNodeIndex);
+            }
+        }
+
+        std::vector<UINT> firstPrimitive(numBvh2Nodes), endPrimitive(numBvh2Nodes), numPrimitives(numBvh2Nodes);
+        for (auto it = preorder.rbegin(); it != preorder.rend(); ++it)
+        {
+            const AABBNode &node = pNodes[*it];
+            if (node.leaf)
+            {
+                firstPrimitive[*it] = node.leafNode.firstTriangleId;
+                numPrimitives[*it] = std::max((UINT)node.leafNode.numTriangleIds, 1u);
+                endPrimitive[*it] = firstPrimitive[*it] + numPrimitives[*it];
+            }
+            else
+            {
+                const UINT left = node.internalNode.leftNodeIndex;
+                const UINT right = node.rightNodeIndex;
+                firstPrimitive[*it] = std::min(firstPrimitive[left], firstPrimitive[right]);
+                endPrimitive[*it] = std::max(endPrimitive[left], endPrimitive[right]);
+                numPrimitives[*it] = numPrimitives[left] + numPrimitives[right];
+            }
+        }
+
+        auto BecomesLeaf = [&](UINT nodeIndex)
+        {
+            return pNodes[nodeIndex].leaf ||
+                (numPrimitives[nodeIndex] <= maxPrimitivesInLeaf &&
+                 endPrimitive[nodeIndex] - firstPrimitive[nodeIndex] == numPrimitives[nodeIndex]);
+        };
+
+        //
+        // Greedy collapse: starting from the two children of a BVH2 node, keep
+        // opening the child with the largest surface area until the wide node
+        // is full. Big children are the likeliest to be hit, so they are the
+        // ones worth testing at once.
+        //
+        struct CollapseTask
+        {
+            UINT bvh2NodeIndex;
+            UINT wideNodeIndex;
+            UINT depth;
+        };
+
+        m_nodes.clear();
+        m_nodes.reserve(numBvh2Nodes / (Width - 1) + 1);
+        m_nodes.emplace_back();
+        InitEmptyWideBVHNode(m_nodes[0]);
+        m_numLeaves = 0;
+        m_depth = 1;
+
+        std::vector<CollapseTask> tasks;
+        tasks.push_back({ 0, 0, 1 });
+        while (!tasks.empty())
+        {
+            const CollapseTask task = tasks.back();
+            tasks.pop_back();
+
+            UINT slots[Width];
+            UINT numSlots = 1;
+            slots[0] = task.bvh2NodeIndex;
+            while (numSlots < Width)
+            {
+                // Slots left over once every subtree is down to a leaf split the merged leaves
+                // again: that costs no extra nodes and saves primitive tests.
+                int slotToOpen = -1;
+                bool isOpeningLeaf = true;
+                float largestArea = -1.0f;
+                for (UINT i = 0; i < numSlots; i++)
+                {
+                    const AABBNode &node = pNodes[slots[i]];
+                    const bool becomesLeaf = BecomesLeaf(slots[i]);
+                    if (node.leaf || (becomesLeaf && !isOpeningLeaf))
+                    {
+                        continue;
+                    }
+                    if ((isOpeningLeaf && !becomesLeaf) || SurfaceArea(node) > largestArea)
+                    {
+                        largestArea = SurfaceArea(node);
+                        slotToOpen = i;
+                        isOpeningLeaf = becomesLeaf;
+                    }
+                }
+                if (slotToOpen < 0)
+                {
+                    break;
+                }
+
+                const AABBNode &node = pNodes[slots[slotToOpen]];
+                slots[slotToOpen] = node.internalNode.leftNodeIndex;
+                slots[numSlots++] = node.rightNodeIndex;
+            }
+
+            for (UINT i = 0; i < numSlots; i++)
+            {
+                AABB box;
+                DecompressAABB(box, pNodes[slots[i]]);
+
+                UINT child;
+                if (BecomesLeaf(slots[i]))
+                {
+                    child = WideBVHLeafFlag | (numPrimitives[slots[i]] << 24) | firstPrimitive[slots[i]];
+                    m_numLeaves++;
+                }
+                else
+                {
+                    child = (UINT)m_nodes.size();
+                    m_nodes.emplace_back();
+                    InitEmptyWideBVHNode(m_nodes.back());
+                    tasks.push_back({ slots[i], child, task.depth + 1 });
+                    m_depth = std::max(m_depth, task.depth + 1);
+                }
+
+                WideBVHNode<Width> &wideNode = m_nodes[task.wideNodeIndex];
+                for (UINT axis = 0; axis < 3; axis++)
+                {
+                    wideNode.bounds[0][axis][i] = box.minArr[axis];
+                    wideNode.bounds[1][axis][i] = box.maxArr[axis];
+                }
+                wideNode.children[i] = child;
+            }
+        }
+
+        // Each level deeper leaves at most Width - 1 siblings behind on the stack
+        return 1 + m_depth * (Width - 1) <= WideBVHMaxStackSize;
+    }
+
+    template<UINT Width>
+    bool WideBVH<Width>::TraceClosestHit(const CpuRay &ray, CpuRayHit &hit, CpuTraversalStats *pStats) const
+    {
+        struct StackEntry
+        {
+            UINT nodeIndex;
+            float t;
+        };
+
+        CpuRayData rayData;
+        GetCpuRayData(rayData, ray.origin, ray.direction);
+
+        StackEntry stack[WideBVHMaxStackSize];
+        UINT stackSize = 0;
+        stack[stackSize++] = { 0, ray.tMin };
+
+        bool isHit = false;
+        float closestT = ray.tMax;
+        UINT bvhPrimitiveIndex = 0;
+        float2 barycentrics;
+        UINT hitKind;
+        UINT64 nodesVisited = 0, primitivesTested = 0;
+        while (stackSize > 0)
+        {
+            const StackEntry entry = stack[--stackSize];
+            if (entry.t > closestT)
+            {
+                continue;
+            }
+
+            const WideBVHNode<Width> &node = m_nodes[entry.nodeIndex];
+            nodesVisited++;
+
+            float distances[Width];
+            UINT mask = IntersectWideNode(node, rayData, ray.tMin, closestT, distances);
+
+            StackEntry innerNodes[Width];
+            UINT numInnerNodes = 0;
+            while (mask)
+            {
+                unsigned long i;
+                _BitScanForward(&i, mask);
+                mask &= mask - 1;
+
+                const UINT child = node.children[i];
+                if (!(child & WideBVHLeafFlag))
+                {
+                    innerNodes[numInnerNodes++] = { child, distances[i] };
+                    continue;
+                }
+
+                const UINT first = GetWideBVHLeafFirstPrimitive(child);
+                const UINT end = first + GetWideBVHLeafNumPrimitives(child);
+                for (UINT primitiveIndex = first; primitiveIndex < end; primitiveIndex++)
+                {
+                    primitivesTested++;
+                    const Primitive &primitive = m_pPrimitives[primitiveIndex];
+                    if (primitive.PrimitiveType == TRIANGLE_TYPE &&
+                        IntersectTriangle(closestT, barycentrics, hitKind, rayData, ray.tMin, primitive.triangle, 0, 0))
+                    {
+                        isHit = true;
+                        bvhPrimitiveIndex = primitiveIndex;
+                    }
+                }
+            }
+
+            // Farthest first, so that the nearest child is popped next
+            for (UINT i = 1; i < numInnerNodes; i++)
+            {
+                const StackEntry innerNode = innerNodes[i];
+                UINT j = i;
+                for (; j > 0 && innerNodes[j - 1].t < innerNode.t; j--)
+                {
+                    innerNodes[j] = innerNodes[j - 1];
+                }
+                innerNodes[j] = innerNode;
+            }
+            for (UINT i = 0; i < numInnerNodes; i++)
+            {
+                stack[stackSize++] = innerNodes[i];
+            }
+        }
+
+        if (pStats)
+        {
+            pStats->nodesVisited += nodesVisited;
+            pStats->primitivesTested += primitivesTested;
+        }
+
+        if (isHit)
+        {
+            const PrimitiveMetaData &metaData = m_pMetaData[bvhPrimitiveIndex];
+            hit = {};
+            hit.t = closestT;
+            hit.barycentrics = barycentrics;
+            hit.hitKind = hitKind;
+            hit.primitiveIndex = metaData.PrimitiveIndex;
+            hit.geometryContributionToHitGroupIndex = metaData.GeometryContributionToHitGroupIndex;
+            hit.bvhPrimitiveIndex = bvhPrimitiveIndex;
+        }
+        return isHit;
+    }
+
+    template class WideBVH<4>;
+    template class WideBVH<8>;
+}
@@ -0,0 +1,73 @@
+//*********************************************************
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+//*********************************************************
+#pragma once
+namespace FallbackLayer
+{
+    //
+    // A child slot of a wide node holds one of:
+    //  - WideBVHEmptyChild
+    //  - a leaf: WideBVHLeafFlag | numPrimitives << 24 | firstPrimitive
+    //  - the index of another wide node
+    //
+    static const UINT WideBVHEmptyChild = 0xFFFFFFFF;
+    static const UINT WideBVHLeafFlag = 0x80000000;
+    static const UINT WideBVHMaxPrimitivesInLeaf = 0x7F;
+    static const UINT WideBVHMaxStackSize = 512;
+
+    inline bool IsWideBVHLeaf(UINT child) { return child != WideBVHEmptyChild && (child & WideBVHLeafFlag); }
+    inline UINT GetWideBVHLeafFirstPrimitive(UINT child) { return child & 0xFFFFFF; }
+    inline UINT GetWideBVHLeafNumPrimitives(UINT child) { return (child >> 24) & WideBVHMaxPrimitivesInLeaf; }
+
+    //
+    // Bounds are stored structure of arrays so that a ray is tested against
+    // every child with one SIMD instruction sequence. Empty slots have
+    // inverted bounds that no ray can hit.
+    //
+    template<UINT Width>
+    struct WideBVHNode
+    {
+        float bounds[2][3][Width];      // [min, max][x, y, z][child]
+        UINT children[Width];
+    };
+
+    //
+    // Collapses the BVH2 of a bottom level built by BuildRaytracingAccelerationStructureOnCpu
+    // into Width-wide nodes for tracing on the CPU. Width is 4 (SSE) or 8 (AVX when the CPU
+    // has it, SSE otherwise).
+    //
+    template<UINT Width>
+    class WideBVH
+    {
+    public:
+        // The acceleration structure must outlive this, primitives are read straight from it.
+        // Subtrees of at most maxPrimitivesInLeaf primitives become a single leaf.
+        // Returns false if the result is too deep for the traversal stack.
+        bool Collapse(const BYTE *pAccelerationStructure, UINT maxPrimitivesInLeaf = 4);
+
+        // Closest triangle hit in [tMin, tMax] with no ray or instance flags, like TraceRayOnCpuBottomLevel()
+        bool TraceClosestHit(const CpuRay &ray, CpuRayHit &hit, CpuTraversalStats *pStats = nullptr) const;
+
+        const std::vector<WideBVHNode<Width>> &GetNodes() const { return m_nodes; }
+        UINT GetNumLeaves() const { return m_numLeaves; }
+        UINT GetDepth() const { return m_depth; }
+        UINT64 GetSizeInBytes() const { return m_nodes.size() * sizeof(WideBVHNode<Width>); }
+
+    private:
+        std::vector<WideBVHNode<Width>> m_nodes;
+        const Primitive *m_pPrimitives = nullptr;
+        const PrimitiveMetaData *m_pMetaData = nullptr;
+        UINT m_numLeaves = 0;
+        UINT m_depth = 0;
+    };
+
+    typedef WideBVH<4> WideBVH4;
+    typedef WideBVH<8> WideBVH8;
+}
@@ -10,6 +10,7 @@
 //*********************************************************
 #include "stdafx.h"
 #include "CppUnitTest.h"
+#include <ppl.h>
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
 using namespace FallbackLayer;
@@ -671,52 +672,273 @@ namespace FallbackLayerUnitTests
 
         TEST_METHOD(StressBottomLevelGpuBVHBuilder)
         {
-            std::vector<float> AutoGeneratedReferenceVertices;
-            std::vector<UINT16> AutoGeneratedReferenceIndicies;
-            for (UINT i = 0; i < 500; i++)
+            std::vector<float> vertices;
+            std::vector<UINT16> indices;
+            GenerateReferenceChain(500, vertices, indices);
+            CpuGeometryDescriptor testCase(vertices.data(), (UINT)(vertices.size() / 3), indices.data(), (UINT)indices.size());
+
+            TestGpuBvh2Builder(
+                testCase);
+        }
+
+        TEST_METHOD(StressBottomLevelCpuBVHBuilder)
+        {
+            std::vector<float> vertices;
+            std::vector<UINT16> indices;
+            GenerateReferenceChain(1000, vertices, indices);
+            CpuGeometryDescriptor testCase(vertices.data(), (UINT)(vertices.size() / 3), indices.data(), (UINT)indices.size());
+
+            TestCpuBvh2Builder(
+                testCase);
+        }
+
+        TEST_METHOD(FastBuildBottomLevelCpuBVHBuilder)
+        {
+            std::vector<float> vertices;
+            std::vector<UINT16> indices;
+            GenerateReferenceChain(1000, vertices, indices);
+            CpuGeometryDescriptor testCases[] =
             {
-                for (float f : ReferenceVerticies0)
-                {
-                    AutoGeneratedReferenceVertices.push_back(f + i);
-                }
+                CpuGeometryDescriptor(ReferenceVerticies0, VERTEX_COUNT(ReferenceVerticies0), ReferenceIndices0, ARRAYSIZE(ReferenceIndices0)),
+                CpuGeometryDescriptor(ReferenceVerticies1, VERTEX_COUNT(ReferenceVerticies1), ReferenceIndices1, ARRAYSIZE(ReferenceIndices1)),
+                CpuGeometryDescriptor(vertices.data(), (UINT)(vertices.size() / 3), indices.data(), (UINT)indices.size())
+            };
 
-                for (UINT16 index : ReferenceIndices0)
+            for (UINT testIndex = 0; testIndex < ARRAYSIZE(testCases); testIndex++)
+            {
+                TestCpuBvh2Builder(&testCases[testIndex], 1, D3D12_ELEMENTS_LAYOUT_ARRAY, D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_BUILD);
+            }
+        }
+
+        TEST_METHOD(LargeFastBuildBottomLevelCpuBVHBuilder)
+        {
+            // Enough triangles for the LBVH to emit its subtrees in parallel, shuffled so they
+            // aren't already in Morton order
+            std::vector<float> vertices;
+            std::vector<UINT16> indices;
+            GenerateReferenceChain(5000, vertices, indices, 389);
+            CpuGeometryDescriptor testCase(vertices.data(), (UINT)(vertices.size() / 3), indices.data(), (UINT)indices.size());
+
+            TestCpuBvh2Builder(&testCase, 1, D3D12_ELEMENTS_LAYOUT_ARRAY, D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_BUILD);
+        }
+
+        TEST_METHOD(ParallelBottomLevelCpuBVHBuilder)
+        {
+            // More triangles than a 16-bit index buffer holds, so the top nodes bin theirs in
+            // chunks and hand their subtrees to other tasks. Scaled down so the far end of the
+            // chain keeps the precision the validator expects.
+            std::vector<float> vertices;
+            std::vector<UINT32> indices;
+            GenerateReferenceChain(33000, vertices, indices, 389);
+            for (float &f : vertices)
+            {
+                f *= 1.0f / 64.0f;
+            }
+            CpuGeometryDescriptor testCase(vertices.data(), (UINT)(vertices.size() / 3), indices.data(), (UINT)indices.size());
+
+            const UINT accelerationStructureSize = GetBottomLevelSize((UINT)indices.size() / 3);
+            std::unique_ptr<BYTE[]> pData = std::unique_ptr<BYTE[]>(new BYTE[accelerationStructureSize]);
+            std::unique_ptr<BYTE[]> pSerialData = std::unique_ptr<BYTE[]>(new BYTE[accelerationStructureSize]);
+
+            const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS buildFlags[] =
+            {
+                D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_NONE,
+                D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE,
+                D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_BUILD,
+            };
+
+            BvhValidator validator;
+            for (auto flags : buildFlags)
+            {
+                const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc = GetBottomLevelDesc(vertices, indices, flags);
+                BuildOnCpuScheduler(4, desc, pData.get());
+                BuildOnCpuScheduler(1, desc, pSerialData.get());
+
+                std::wstring errorMessage;
+                if (!validator.VerifyBottomLevelOutput(&testCase, 1, pData.get(), errorMessage))
                 {
-                    AutoGeneratedReferenceIndicies.push_back(index + (UINT16)ARRAYSIZE(ReferenceIndices0) * i);
+                    Assert::Fail(errorMessage.c_str());
                 }
+                Assert::IsTrue(memcmp(pData.get(), pSerialData.get(), accelerationStructureSize) == 0,
+                    L"Parallel build doesn't match the build on one thread");
             }
-            CpuGeometryDescriptor testCase(AutoGeneratedReferenceVertices.data(),
-                (UINT)(AutoGeneratedReferenceVertices.size() / 3),
-                AutoGeneratedReferenceIndicies.data(),
-                (UINT)AutoGeneratedReferenceIndicies.size());
+        }
 
-            TestGpuBvh2Builder(
-                testCase);
+        TEST_METHOD(ParallelUpdateBottomLevelCpuBVHBuilder)
+        {
+            // Enough nodes for the refit to hand subtrees to other tasks
+            std::vector<float> vertices;
+            std::vector<UINT32> indices;
+            GenerateReferenceChain(33000, vertices, indices, 389);
+            for (float &f : vertices)
+            {
+                f *= 1.0f / 64.0f;
+            }
+            CpuGeometryDescriptor testCase(vertices.data(), (UINT)(vertices.size() / 3), indices.data(), (UINT)indices.size());
+
+            const UINT accelerationStructureSize = GetBottomLevelSize((UINT)indices.size() / 3);
+            std::unique_ptr<BYTE[]> pSourceData = std::unique_ptr<BYTE[]>(new BYTE[accelerationStructureSize]);
+            std::unique_ptr<BYTE[]> pData = std::unique_ptr<BYTE[]>(new BYTE[accelerationStructureSize]);
+            std::unique_ptr<BYTE[]> pSerialData = std::unique_ptr<BYTE[]>(new BYTE[accelerationStructureSize]);
+
+            D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc = GetBottomLevelDesc(vertices, indices,
+                D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE);
+            BuildRaytracingAccelerationStructureOnCpu(&desc, pSourceData.get());
+
+            for (UINT i = 1; i < vertices.size(); i += 3)
+            {
+                vertices[i] += std::sin(vertices[i - 1] * 64.0f);
+            }
+            desc.Inputs.Flags |= D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE;
+            desc.SourceAccelerationStructureData = (D3D12_GPU_VIRTUAL_ADDRESS)pSourceData.get();
+            BuildOnCpuScheduler(4, desc, pData.get());
+            BuildOnCpuScheduler(1, desc, pSerialData.get());
+
+            BvhValidator validator;
+            std::wstring errorMessage;
+            if (!validator.VerifyBottomLevelOutput(&testCase, 1, pData.get(), errorMessage))
+            {
+                Assert::Fail(errorMessage.c_str());
+            }
+            Assert::IsTrue(memcmp(pData.get(), pSerialData.get(), accelerationStructureSize) == 0,
+                L"Parallel update doesn't match the update on one thread");
         }
 
-        TEST_METHOD(StressBottomLevelCpuBVHBuilder)
+        TEST_METHOD(UpdateBottomLevelCpuBVHBuilder)
         {
-            std::vector<float> AutoGeneratedReferenceVertices;
-            std::vector<UINT16> AutoGeneratedReferenceIndicies;
-            for (UINT i = 0; i < 1000; i++)
+            // The stress test's chain of triangles, bent and folded in half a bit more every frame, then shuffled
+            std::vector<float> referenceVertices;
+            std::vector<UINT16> indices;
+            GenerateReferenceChain(1000, referenceVertices, indices);
+            std::vector<float> vertices = referenceVertices;
+            CpuGeometryDescriptor testCase(vertices.data(), (UINT)(vertices.size() / 3), indices.data(), (UINT)indices.size());
+
+            const UINT accelerationStructureSize = GetBottomLevelSize((UINT)indices.size() / 3);
+            std::unique_ptr<BYTE[]> pData = std::unique_ptr<BYTE[]>(new BYTE[accelerationStructureSize]);
+            std::unique_ptr<BYTE[]> pUpdatedData = std::unique_ptr<BYTE[]>(new BYTE[accelerationStructureSize]);
+
+            D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc = GetBottomLevelDesc(vertices, indices,
+                D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE);
+            BuildRaytracingAccelerationStructureOnCpu(&desc, pData.get());
+            const float builtCost = GetAccelerationStructureSahCostOnCpu(pData.get());
+
+            // With nothing moved an update keeps the quality of the build
+            desc.Inputs.Flags |= D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE;
+            desc.SourceAccelerationStructureData = (D3D12_GPU_VIRTUAL_ADDRESS)pData.get();
+            BuildRaytracingAccelerationStructureOnCpu(&desc, pData.get());
+            Assert::IsTrue(GetAccelerationStructureSahCostOnCpu(pData.get()) == builtCost,
+                L"Update without any change lost quality");
+
+            BvhValidator validator;
+            float updatedCost = builtCost;
+            for (UINT frame = 1; frame <= 4; frame++)
             {
-                for (float f : ReferenceVerticies0)
+                const float fold = frame / 4.0f;
+                for (UINT i = 0; i < vertices.size(); i += 3)
                 {
-                    AutoGeneratedReferenceVertices.push_back(f + i);
+                    const float x = referenceVertices[i] - 500.0f;
+                    vertices[i] = 500.0f + x * (1.0f - fold) + std::abs(x) * fold;
+                    vertices[i + 1] = referenceVertices[i + 1] + 10.0f * frame * std::sin(x * 0.1f);
                 }
 
-                for (UINT16 index : ReferenceIndices0)
+                // Updating into another buffer and in place give the same result
+                BuildRaytracingAccelerationStructureOnCpu(&desc, pUpdatedData.get());
+                BuildRaytracingAccelerationStructureOnCpu(&desc, pData.get());
+                Assert::IsTrue(memcmp(pData.get(), pUpdatedData.get(), accelerationStructureSize) == 0,
+                    L"Update in place doesn't match update from a source");
+
+                std::wstring errorMessage;
+                if (!validator.VerifyBottomLevelOutput(&testCase, 1, pData.get(), errorMessage))
                 {
-                    AutoGeneratedReferenceIndicies.push_back(index + (UINT16)ARRAYSIZE(ReferenceIndices0) * i);
+                    Assert::Fail(errorMessage.c_str());
                 }
+                updatedCost = GetAccelerationStructureSahCostOnCpu(pData.get());
             }
-            CpuGeometryDescriptor testCase(AutoGeneratedReferenceVertices.data(),
-                (UINT)(AutoGeneratedReferenceVertices.size() / 3),
-                AutoGeneratedReferenceIndicies.data(),
-                (UINT)AutoGeneratedReferenceIndicies.size());
+            Assert::IsTrue(updatedCost > builtCost, L"SAH cost doesn't grow as the chain folds");
 
-            TestCpuBvh2Builder(
-                testCase);
+            // Shuffled along the chain, every node of the old tree spans most of it and a new tree is much better
+            const UINT floatsPerCopy = ARRAYSIZE(ReferenceVerticies0);
+            for (UINT i = 0; i < vertices.size(); i++)
+            {
+                const UINT copy = i / floatsPerCopy;
+                vertices[i] = referenceVertices[i] + (float)((copy * 389) % 1000) - (float)copy;
+            }
+            BuildRaytracingAccelerationStructureOnCpu(&desc, pData.get());
+
+            std::wstring errorMessage;
+            if (!validator.VerifyBottomLevelOutput(&testCase, 1, pData.get(), errorMessage))
+            {
+                Assert::Fail(errorMessage.c_str());
+            }
+            updatedCost = GetAccelerationStructureSahCostOnCpu(pData.get());
+
+            desc.Inputs.Flags = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE;
+            BuildRaytracingAccelerationStructureOnCpu(&desc, pUpdatedData.get());
+            Assert::IsTrue(GetAccelerationStructureSahCostOnCpu(pUpdatedData.get()) * 1.5f < updatedCost,
+                L"SAH cost doesn't show the quality lost to the update");
+        }
+
+        TEST_METHOD(ReorderTreeletsBottomLevelCpuBVHBuilder)
+        {
+            TestCpuTreeletReorder(1000);
+        }
+
+        TEST_METHOD(LargeReorderTreeletsBottomLevelCpuBVHBuilder)
+        {
+            // Enough triangles for treelets to be reordered and emitted in parallel
+            TestCpuTreeletReorder(5000);
+        }
+
+        void TestCpuTreeletReorder(UINT numCopies)
+        {
+            // The stress test's chain of triangles, shuffled along the chain
+            std::vector<float> vertices;
+            std::vector<UINT16> indices;
+            GenerateReferenceChain(numCopies, vertices, indices, 389);
+            CpuGeometryDescriptor testCase(vertices.data(), (UINT)(vertices.size() / 3), indices.data(), (UINT)indices.size());
+
+            std::unique_ptr<BYTE[]> pData = std::unique_ptr<BYTE[]>(new BYTE[GetBottomLevelSize((UINT)indices.size() / 3)]);
+
+            D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc = GetBottomLevelDesc(vertices, indices);
+            BuildRaytracingAccelerationStructureOnCpu(&desc, pData.get());
+            const float builtCost = GetAccelerationStructureSahCostOnCpu(pData.get());
+
+            BvhValidator validator;
+            std::wstring errorMessage;
+            desc.Inputs.Flags = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE;
+            BuildRaytracingAccelerationStructureOnCpu(&desc, pData.get());
+            if (!validator.VerifyBottomLevelOutput(&testCase, 1, pData.get(), errorMessage))
+            {
+                Assert::Fail(errorMessage.c_str());
+            }
+            Assert::IsTrue(GetAccelerationStructureSahCostOnCpu(pData.get()) <= builtCost, L"Reordering treelets raised the SAH cost");
+
+            // An LBVH has a lot more to gain, and the reduction reported is the one in the SAH cost
+            desc.Inputs.Flags = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_BUILD;
+            BuildRaytracingAccelerationStructureOnCpu(&desc, pData.get());
+            const float fastBuildCost = GetAccelerationStructureSahCostOnCpu(pData.get());
+            const float costReduction = ReorderAccelerationStructureTreeletsOnCpu(pData.get());
+            const float reorderedCost = GetAccelerationStructureSahCostOnCpu(pData.get());
+            Assert::IsTrue(costReduction > 0.0f, L"Reordering the treelets of an LBVH didn't lower its SAH cost");
+            Assert::IsTrue(std::abs(fastBuildCost - costReduction - reorderedCost) <= 0.001f * fastBuildCost, L"Reported SAH cost reduction is wrong");
+            if (!validator.VerifyBottomLevelOutput(&testCase, 1, pData.get(), errorMessage))
+            {
+                Assert::Fail(errorMessage.c_str());
+            }
+
+            // The reordered nodes can still be updated
+            for (UINT i = 1; i < vertices.size(); i += 3)
+            {
+                vertices[i] += std::sin(vertices[i - 1]);
+            }
+            desc.Inputs.Flags = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE |
+                D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE;
+            desc.SourceAccelerationStructureData = (D3D12_GPU_VIRTUAL_ADDRESS)pData.get();
+            BuildRaytracingAccelerationStructureOnCpu(&desc, pData.get());
+            if (!validator.VerifyBottomLevelOutput(&testCase, 1, pData.get(), errorMessage))
+            {
+                Assert::Fail(errorMessage.c_str());
+            }
         }
 
         void GenerateRandomTranformation(float *pMatrix)
@@ -888,6 +1110,26 @@ namespace FallbackLayerUnitTests
             SimpleTopLevelGpuBVHBuilder<50>(D3D12_ELEMENTS_LAYOUT_ARRAY_OF_POINTERS, true);
         }
 
+        TEST_METHOD(SimpleTopLevelCpuBVHBuilder_ArrayLayout)
+        {
+            TestCpuTopLevelBvh2Builder<50>(D3D12_ELEMENTS_LAYOUT_ARRAY, false);
+        }
+
+        TEST_METHOD(SimpleTopLevelCpuBVHBuilder_ArrayOfPointersLayout)
+        {
+            TestCpuTopLevelBvh2Builder<50>(D3D12_ELEMENTS_LAYOUT_ARRAY_OF_POINTERS, false);
+        }
+
+        TEST_METHOD(TopLevelCpuBVHBuilderWithInstanceTransforms)
+        {
+            TestCpuTopLevelBvh2Builder<50>(D3D12_ELEMENTS_LAYOUT_ARRAY, true);
+        }
+
+        TEST_METHOD(UpdateTopLevelCpuBVHBuilder)
+        {
+            TestCpuTopLevelBvh2Builder<50>(D3D12_ELEMENTS_LAYOUT_ARRAY_OF_POINTERS, false, true);
+        }
+
         TEST_METHOD(EmitRaytracingAccelerationStructurePostBuildInfoTest)
         {
             const UINT numBottomLevels = 70;
@@ -1053,7 +1295,8 @@ namespace FallbackLayerUnitTests
             }
         }
 
-        void TestCpuBvh2Builder(CpuGeometryDescriptor *pGeomDescs, UINT numGeoms, D3D12_ELEMENTS_LAYOUT layoutToTest = D3D12_ELEMENTS_LAYOUT_ARRAY)
+        void TestCpuBvh2Builder(CpuGeometryDescriptor *pGeomDescs, UINT numGeoms, D3D12_ELEMENTS_LAYOUT layoutToTest = D3D12_ELEMENTS_LAYOUT_ARRAY,
+            D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS buildFlags = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_NONE)
         {
             ID3D12Device &device = m_d3d12Context.GetDevice();
             std::unique_ptr<FallbackLayer::IAccelerationStructureBuilder> pBuilder =
@@ -1088,6 +1331,7 @@ namespace FallbackLayerUnitTests
             desc.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
             desc.NumDescs = numGeoms;
             desc.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL;
+            desc.Flags = buildFlags;
             desc.pGeometryDescs = geomDescs.data();
 
             BuildRaytracingAccelerationStructureOnCpu(&desc, pData.get());
@@ -1104,6 +1348,188 @@ namespace FallbackLayerUnitTests
             TestCpuBvh2Builder(&geomDesc, 1);
         }
 
+        // ReferenceVerticies0 repeated numCopies times along a chain, copy i moved by
+        // (i * shuffleStride) % numCopies on every axis. A stride other than 1 that is
+        // coprime with numCopies shuffles the copies along the chain.
+        template <typename IndexType>
+        void GenerateReferenceChain(UINT numCopies, std::vector<float> &vertices, std::vector<IndexType> &indices, UINT shuffleStride = 1)
+        {
+            for (UINT i = 0; i < numCopies; i++)
+            {
+                const float offset = (float)((UINT64)i * shuffleStride % numCopies);
+                for (float f : ReferenceVerticies0)
+                {
+                    vertices.push_back(f + offset);
+                }
+
+                for (UINT16 index : ReferenceIndices0)
+                {
+                    indices.push_back((IndexType)(index + ARRAYSIZE(ReferenceIndices0) * i));
+                }
+            }
+        }
+
+        template <typename IndexType>
+        D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC GetBottomLevelDesc(
+            const std::vector<float> &vertices,
+            const std::vector<IndexType> &indices,
+            D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS buildFlags = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_NONE)
+        {
+            m_geometryDesc = {};
+            m_geometryDesc.Type = D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES;
+            m_geometryDesc.Triangles.IndexBuffer = (D3D12_GPU_VIRTUAL_ADDRESS)indices.data();
+            m_geometryDesc.Triangles.VertexBuffer.StartAddress = (D3D12_GPU_VIRTUAL_ADDRESS)vertices.data();
+            m_geometryDesc.Triangles.IndexFormat = sizeof(IndexType) == sizeof(UINT16) ? DXGI_FORMAT_R16_UINT : DXGI_FORMAT_R32_UINT;
+            m_geometryDesc.Triangles.IndexCount = (UINT)indices.size();
+            m_geometryDesc.Triangles.VertexCount = (UINT)vertices.size() / 3;
+            m_geometryDesc.Triangles.VertexBuffer.StrideInBytes = sizeof(float) * 3;
+
+            D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc = {};
+            desc.Inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL;
+            desc.Inputs.Flags = buildFlags;
+            desc.Inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+            desc.Inputs.NumDescs = 1;
+            desc.Inputs.pGeometryDescs = &m_geometryDesc;
+            return desc;
+        }
+
+        // Builds on a scheduler with this many virtual processors, however many cores the machine has.
+        // With one the builder takes its serial path.
+        void BuildOnCpuScheduler(UINT numVirtualProcessors, const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC &desc, BYTE *pData)
+        {
+            concurrency::CurrentScheduler::Create(concurrency::SchedulerPolicy(2,
+                concurrency::MinConcurrency, numVirtualProcessors,
+                concurrency::MaxConcurrency, numVirtualProcessors));
+            BuildRaytracingAccelerationStructureOnCpu(&desc, pData);
+            concurrency::CurrentScheduler::Detach();
+        }
+
+        UINT GetBottomLevelSize(UINT numTriangles)
+        {
+            return GetOffsetToPrimitives(numTriangles) +
+                GetOffsetFromPrimitivesToPrimitiveMetaData(numTriangles) +
+                numTriangles * SizeOfPrimitiveMetaData;
+        }
+
+        template <UINT numInstances>
+        void TestCpuTopLevelBvh2Builder(D3D12_ELEMENTS_LAYOUT layoutToTest, bool applyRandomInstanceTransforms, bool updateInstanceTransforms = false)
+        {
+            // Single bottom level built on the CPU and shared by every instance
+            const UINT numTriangles = ARRAYSIZE(ReferenceIndices0) / 3;
+            D3D12_RAYTRACING_GEOMETRY_DESC geomDesc = {};
+            geomDesc.Type = D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES;
+            geomDesc.Triangles.IndexBuffer = (D3D12_GPU_VIRTUAL_ADDRESS)ReferenceIndices0;
+            geomDesc.Triangles.VertexBuffer.StartAddress = (D3D12_GPU_VIRTUAL_ADDRESS)ReferenceVerticies0;
+            geomDesc.Triangles.IndexFormat = DXGI_FORMAT_R16_UINT;
+            geomDesc.Triangles.IndexCount = ARRAYSIZE(ReferenceIndices0);
+            geomDesc.Triangles.VertexCount = VERTEX_COUNT(ReferenceVerticies0);
+            geomDesc.Triangles.VertexBuffer.StrideInBytes = sizeof(float) * 3;
+
+            const UINT bottomLevelSize = GetOffsetToPrimitives(numTriangles) +
+                GetOffsetFromPrimitivesToPrimitiveMetaData(numTriangles) +
+                numTriangles * SizeOfPrimitiveMetaData;
+            std::unique_ptr<BYTE[]> pBottomLevelData = std::unique_ptr<BYTE[]>(new BYTE[bottomLevelSize]);
+
+            D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC bottomLevelDesc = {};
+            bottomLevelDesc.Inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL;
+            bottomLevelDesc.Inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+            bottomLevelDesc.Inputs.NumDescs = 1;
+            bottomLevelDesc.Inputs.pGeometryDescs = &geomDesc;
+            BuildRaytracingAccelerationStructureOnCpu(&bottomLevelDesc, pBottomLevelData.get());
+
+            AABB containingBox;
+            for (UINT axis = 0; axis < 3; axis++)
+            {
+                containingBox.minArr[axis] = FLT_MAX;
+                containingBox.maxArr[axis] = -FLT_MAX;
+            }
+            for (UINT i = 0; i < ARRAYSIZE(ReferenceVerticies0); i++)
+            {
+                UINT axis = i % 3;
+                containingBox.minArr[axis] = std::min(ReferenceVerticies0[i], containingBox.minArr[axis]);
+                containingBox.maxArr[axis] = std::max(ReferenceVerticies0[i], containingBox.maxArr[axis]);
+            }
+
+            srand(10);
+            AABB containingBoxes[numInstances];
+            float transformations[numInstances][FloatsPerMatrix];
+            float *pTransformations[numInstances];
+            D3D12_RAYTRACING_FALLBACK_INSTANCE_DESC instanceDescs[numInstances] = {};
+            D3D12_RAYTRACING_FALLBACK_INSTANCE_DESC *pInstanceDescs[numInstances];
+            for (UINT i = 0; i < numInstances; i++)
+            {
+                // Offset every instance so the top level has something to split
+                containingBoxes[i] = containingBox;
+                pTransformations[i] = transformations[i];
+                if (applyRandomInstanceTransforms)
+                {
+                    GenerateRandomTranformation(transformations[i]);
+                }
+                else
+                {
+                    ZeroMemory(transformations[i], sizeof(transformations[i]));
+                    transformations[i][0] = transformations[i][5] = transformations[i][10] = 1;
+                    transformations[i][3] = (float)i;
+                }
+
+                memcpy(instanceDescs[i].Transform, transformations[i], sizeof(instanceDescs[i].Transform));
+                instanceDescs[i].InstanceID = i;
+                instanceDescs[i].InstanceMask = 1;
+                instanceDescs[i].AccelerationStructure.GpuVA = (D3D12_GPU_VIRTUAL_ADDRESS)pBottomLevelData.get();
+                pInstanceDescs[i] = &instanceDescs[i];
+            }
+
+            D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC topLevelDesc = {};
+            topLevelDesc.Inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL;
+            topLevelDesc.Inputs.DescsLayout = layoutToTest;
+            topLevelDesc.Inputs.NumDescs = numInstances;
+            topLevelDesc.Inputs.InstanceDescs = layoutToTest == D3D12_ELEMENTS_LAYOUT_ARRAY ?
+                (D3D12_GPU_VIRTUAL_ADDRESS)instanceDescs : (D3D12_GPU_VIRTUAL_ADDRESS)pInstanceDescs;
+
+            std::unique_ptr<BYTE[]> pData = std::unique_ptr<BYTE[]>(new BYTE[GetOffsetToBVHSortedIndices(numInstances)]);
+            BuildRaytracingAccelerationStructureOnCpu(&topLevelDesc, pData.get());
+
+            const UINT numBuilds = updateInstanceTransforms ? 2 : 1;
+            for (UINT build = 0; build < numBuilds; build++)
+            {
+                // Move every instance somewhere else and refit the top level to them
+                if (build > 0)
+                {
+                    for (UINT i = 0; i < numInstances; i++)
+                    {
+                        GenerateRandomTranformation(transformations[i]);
+                        memcpy(instanceDescs[i].Transform, transformations[i], sizeof(instanceDescs[i].Transform));
+                    }
+
+                    topLevelDesc.Inputs.Flags = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE;
+                    topLevelDesc.SourceAccelerationStructureData = (D3D12_GPU_VIRTUAL_ADDRESS)pData.get();
+                    BuildRaytracingAccelerationStructureOnCpu(&topLevelDesc, pData.get());
+                }
+
+                std::wstring errorMessage;
+                BvhValidator validator;
+                if (!validator.VerifyTopLevelOutput(containingBoxes, pTransformations, numInstances, pData.get(), errorMessage))
+                {
+                    Assert::Fail(errorMessage.c_str());
+                }
+
+                // Every instance must show up exactly once in the leaf metadata with an inverted transform
+                BVHOffsets offsets = *(BVHOffsets*)pData.get();
+                BVHMetadata *pMetadata = (BVHMetadata *)(pData.get() + offsets.offsetToVertices);
+                bool isInstanceFound[numInstances] = {};
+                for (UINT i = 0; i < numInstances; i++)
+                {
+                    const UINT instanceIndex = pMetadata[i].InstanceIndex;
+                    Assert::IsTrue(instanceIndex < numInstances && !isInstanceFound[instanceIndex], L"Instance metadata missing or duplicated");
+                    isInstanceFound[instanceIndex] = true;
+
+                    Assert::AreEqual(instanceIndex, (UINT)pMetadata[i].instanceDesc.InstanceID, L"Instance desc doesn't match its metadata");
+                    Assert::IsTrue(IsFloatArrayEqual((float *)pMetadata[i].ObjectToWorld, transformations[instanceIndex], FloatsPerMatrix),
+                        L"ObjectToWorld doesn't match the instance transform");
+                }
+            }
+        }
+
         void TestGpuBvh2Builder(CpuGeometryDescriptor *pGeomDescs, UINT numGeoms, D3D12_ELEMENTS_LAYOUT layoutToTest = D3D12_ELEMENTS_LAYOUT_ARRAY)
         {
             ID3D12Device &device = m_d3d12Context.GetDevice();
@@ -1154,6 +1580,7 @@ namespace FallbackLayerUnitTests
         D3D12Context m_d3d12Context;
         std::unique_ptr<DescriptorHeapStack> m_pDescriptorHeapStack;
         std::unique_ptr<AccelerationStructureBuilderHelper> m_pBuilderHelper;
+        D3D12_RAYTRACING_GEOMETRY_DESC m_geometryDesc;
     };
 
 void AllocateUAVBuffer(ID3D12Device &d3d12device, UINT64 bufferSize, ID3D12Resource **ppResource)
@@ -2490,7 +2917,96 @@ void AllocateUAVBuffer(ID3D12Device &d3d12device, UINT64 bufferSize, ID3D12Resou
                 Assert::IsTrue(IsMortonCodeEqual(expectedMortonCodes[i].MortonCode, calculatedMortonCodes[i]), L"Calculated morton code is incorrect");
             }
 
+            // The CPU passes should agree with the GPU ones
+            std::vector<float3> centroids(numElements);
+            for (UINT i = 0; i < numElements; i++)
+            {
+                if (sceneType == SceneType::Triangles)
+                {
+                    Triangle &tri = ((Primitive *)outputData.data())[i].triangle;
+                    centroids[i] = (tri.v0 + tri.v1 + tri.v2) / 3.0;
+                }
+                else
+                {
+                    AABBNode &box = ((AABBNode *)outputData.data())[i];
+                    centroids[i] = { box.center[0], box.center[1], box.center[2] };
+                }
+            }
+
+            std::vector<UINT32> cpuMortonCodes(numElements);
+            std::vector<UINT32> cpuIndices(numElements);
+            CalculateMortonCodesOnCpu(centroids.data(), numElements, sceneAABB, cpuMortonCodes.data(), cpuIndices.data());
+            for (UINT i = 0; i < numElements; i++)
+            {
+                Assert::IsTrue(i == cpuIndices[i] && IsMortonCodeEqual(calculatedMortonCodes[i], cpuMortonCodes[i]), L"Morton code calculated on the CPU is incorrect");
+            }
+
             TestSortingMortonCodes(numElements, expectedMortonCodes, pOutputMortonCodeBuffer, pOutputIndexBuffer);
+
+            SortMortonCodesOnCpu(cpuMortonCodes.data(), cpuIndices.data(), numElements);
+            for (UINT i = 0; i < numElements; i++)
+            {
+                Assert::IsTrue(expectedMortonCodes[i].Index == cpuIndices[i] && IsMortonCodeEqual(expectedMortonCodes[i].MortonCode, cpuMortonCodes[i]), L"Morton codes sorted on the CPU incorrect");
+            }
+        }
+
+        TEST_METHOD(ConstructHierarchyMatchesCpu)
+        {
+            TestConstructHierarchy(300);
+            TestConstructHierarchy(5000);
+        }
+
+        void TestConstructHierarchy(UINT numElements)
+        {
+            AABB sceneAABB;
+            std::vector<byte> outputData;
+            std::vector<MortonCodeIndexPair> mortonCodes;
+            GenerateSceneData(numElements, SceneType::Triangles, outputData, sceneAABB, &mortonCodes);
+            std::sort(mortonCodes.begin(), mortonCodes.end());
+
+            // Dropping the low bits leaves plenty of elements with the same code
+            std::vector<UINT32> sortedMortonCodes(numElements);
+            for (UINT i = 0; i < numElements; i++)
+            {
+                sortedMortonCodes[i] = mortonCodes[i].MortonCode & ~0xfff;
+            }
+
+            const UINT numNodes = numElements + GetNumInternalNodes(numElements);
+            std::vector<HierarchyNode> calculatedHierarchy(numNodes);
+            std::vector<HierarchyNode> cpuHierarchy(numNodes);
+
+            CComPtr<ID3D12Resource> pMortonCodeBuffer;
+            m_d3d12Context.CreateResourceWithInitialData(
+                sortedMortonCodes.data(),
+                (UINT)(sortedMortonCodes.size() * sizeof(*sortedMortonCodes.data())),
+                &pMortonCodeBuffer);
+
+            CComPtr<ID3D12Resource> pHierarchyBuffer;
+            m_d3d12Context.CreateResourceWithInitialData(
+                calculatedHierarchy.data(),
+                (UINT)(calculatedHierarchy.size() * sizeof(*calculatedHierarchy.data())),
+                &pHierarchyBuffer);
+
+            CComPtr<ID3D12GraphicsCommandList> pCommandList;
+            m_d3d12Context.GetGraphicsCommandList(&pCommandList);
+
+            ConstructHierarchyPass constructHierarchyPass(&m_d3d12Context.GetDevice(), 0);
+            constructHierarchyPass.ConstructHierarchy(
+                pCommandList,
+                SceneType::Triangles,
+                pMortonCodeBuffer->GetGPUVirtualAddress(),
+                pHierarchyBuffer->GetGPUVirtualAddress(),
+                {},
+                numElements);
+
+            pCommandList->Close();
+            m_d3d12Context.ExecuteCommandList(pCommandList);
+
+            m_d3d12Context.ReadbackResource(pHierarchyBuffer, calculatedHierarchy.data(), (UINT)(calculatedHierarchy.size() * sizeof(*calculatedHierarchy.data())));
+
+            ConstructHierarchyOnCpu(sortedMortonCodes.data(), numElements, cpuHierarchy.data());
+            Assert::IsTrue(memcmp(calculatedHierarchy.data(), cpuHierarchy.data(), calculatedHierarchy.size() * sizeof(*calculatedHierarchy.data())) == 0,
+                L"Hierarchy constructed on the CPU doesn't match the GPU's");
         }
 
         TEST_METHOD(TreeletReorderingFastTrace)
@@ -2791,6 +3307,554 @@ void AllocateUAVBuffer(ID3D12Device &d3d12device, UINT64 bufferSize, ID3D12Resou
     private:
         D3D12Context m_d3d12Context;
     };
+    TEST_CLASS(CpuTraversalTests)
+    {
+    public:
+        TEST_METHOD(WideBVH4CollapseAndTrace)
+        {
+            TestWideBVH<4>(1);
+            TestWideBVH<4>(4);
+        }
+
+        TEST_METHOD(WideBVH8CollapseAndTrace)
+        {
+            TestWideBVH<8>(1);
+            TestWideBVH<8>(4);
+        }
+
+        TEST_METHOD(CpuTraversalBottomLevelFlags)
+        {
+            srand(44);
+            std::unique_ptr<BYTE[]> pBottomLevel = BuildSphereBottomLevel();
+            for (UINT i = 0; i < 500; i++)
+            {
+                const CpuRay ray = GenerateRandomRay(i);
+                float expectedT;
+                const bool expectedHit = BruteForceClosestHit(ray, expectedT);
+
+                CpuRayHit hit;
+                const bool isHit = TraceRayOnCpuBottomLevel(pBottomLevel.get(), D3D12_RAY_FLAG_NONE, ray, hit);
+                Assert::AreEqual(expectedHit, isHit, L"CPU traversal disagrees with brute force");
+                if (!isHit) continue;
+                Assert::IsTrue(std::abs(hit.t - expectedT) <= 0.0001f * std::max(1.0f, expectedT), L"CPU traversal returned the wrong closest hit");
+
+                // The closest hit is either the closest front face or the closest back face
+                CpuRayHit frontHit, backHit;
+                const bool isFrontHit = TraceRayOnCpuBottomLevel(pBottomLevel.get(), D3D12_RAY_FLAG_CULL_BACK_FACING_TRIANGLES, ray, frontHit);
+                const bool isBackHit = TraceRayOnCpuBottomLevel(pBottomLevel.get(), D3D12_RAY_FLAG_CULL_FRONT_FACING_TRIANGLES, ray, backHit);
+                Assert::IsTrue(!isFrontHit || frontHit.hitKind == CpuHitKindTriangleFrontFace, L"Back face not culled");
+                Assert::IsTrue(!isBackHit || backHit.hitKind == CpuHitKindTriangleBackFace, L"Front face not culled");
+                const CpuRayHit &closerHit = isFrontHit && (!isBackHit || frontHit.t <= backHit.t) ? frontHit : backHit;
+                Assert::IsTrue((isFrontHit || isBackHit) && closerHit.t == hit.t && closerHit.hitKind == hit.hitKind,
+                    L"Culling changed the closest hit");
+
+                // Any hit will do, but it has to be a real one
+                CpuRayHit anyHit;
+                Assert::IsTrue(TraceRayOnCpuBottomLevel(pBottomLevel.get(), D3D12_RAY_FLAG_ACCEPT_FIRST_HIT_AND_END_SEARCH, ray, anyHit),
+                    L"First hit search missed");
+                Assert::IsTrue(anyHit.t >= hit.t && anyHit.t <= ray.tMax && anyHit.primitiveIndex < m_indices.size() / 3,
+                    L"First hit search returned an invalid hit");
+
+                Assert::IsFalse(TraceRayOnCpuBottomLevel(pBottomLevel.get(), D3D12_RAY_FLAG_CULL_OPAQUE | D3D12_RAY_FLAG_FORCE_OPAQUE, ray, anyHit),
+                    L"Opaque geometry not culled");
+            }
+        }
+
+        TEST_METHOD(CpuTraversalTopLevel)
+        {
+            srand(45);
+            std::unique_ptr<BYTE[]> pBottomLevel = BuildSphereBottomLevel();
+
+            // A row of spheres, every other one only visible to instance mask 2
+            const UINT numInstances = 6;
+            D3D12_RAYTRACING_FALLBACK_INSTANCE_DESC instanceDescs[numInstances] = {};
+            for (UINT i = 0; i < numInstances; i++)
+            {
+                const float scale = 0.5f + 0.25f * i;
+                instanceDescs[i].Transform[0][0] = instanceDescs[i].Transform[1][1] = instanceDescs[i].Transform[2][2] = scale;
+                instanceDescs[i].Transform[0][3] = 3.0f * i - 7.5f;
+                instanceDescs[i].Transform[2][3] = (float)(i % 3);
+                instanceDescs[i].InstanceID = 100 + i;
+                instanceDescs[i].InstanceMask = i % 2 ? 2 : 3;
+                instanceDescs[i].AccelerationStructure.GpuVA = (D3D12_GPU_VIRTUAL_ADDRESS)pBottomLevel.get();
+            }
+
+            D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC topLevelDesc = {};
+            topLevelDesc.Inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL;
+            topLevelDesc.Inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+            topLevelDesc.Inputs.NumDescs = numInstances;
+            topLevelDesc.Inputs.InstanceDescs = (D3D12_GPU_VIRTUAL_ADDRESS)instanceDescs;
+            std::unique_ptr<BYTE[]> pTopLevel = std::unique_ptr<BYTE[]>(new BYTE[GetOffsetToBVHSortedIndices(numInstances)]);
+            BuildRaytracingAccelerationStructureOnCpu(&topLevelDesc, pTopLevel.get());
+
+            CpuRay rays[CpuRayPacketSize];
+            CpuRayHit hits[CpuRayPacketSize];
+            UINT hitMask = 0;
+            for (UINT i = 0; i < 512; i++)
+            {
+                const UINT lane = i % CpuRayPacketSize;
+                const UINT instanceMask = (i / CpuRayPacketSize) % 2 ? 1 : 0xFF;
+                const float3 origin = { RandomFloat(-10.0f, 10.0f), RandomFloat(-4.0f, 4.0f), -6.0f };
+                const float3 target = { RandomFloat(-9.0f, 9.0f), RandomFloat(-1.5f, 1.5f), RandomFloat(0.0f, 2.0f) };
+                const CpuRay &ray = rays[lane] = { origin, target - origin, 0.0f, FLT_MAX };
+
+                float expectedT = ray.tMax;
+                UINT expectedInstance = numInstances;
+                for (UINT instance = 0; instance < numInstances; instance++)
+                {
+                    float instanceT;
+                    if ((instanceDescs[instance].InstanceMask & instanceMask) &&
+                        BruteForceClosestHit(ray, instanceT, instanceDescs[instance].Transform) && instanceT < expectedT)
+                    {
+                        expectedT = instanceT;
+                        expectedInstance = instance;
+                    }
+                }
+
+                CpuRayHit hit;
+                const bool isHit = TraceRayOnCpu(pTopLevel.get(), D3D12_RAY_FLAG_NONE, instanceMask, ray, hit);
+                Assert::AreEqual(expectedInstance < numInstances, isHit, L"Top level traversal disagrees with brute force");
+                if (isHit)
+                {
+                    Assert::IsTrue(std::abs(hit.t - expectedT) <= 0.0001f * std::max(1.0f, expectedT), L"Top level traversal returned the wrong closest hit");
+                    Assert::AreEqual(expectedInstance, hit.instanceIndex, L"Hit reported on the wrong instance");
+                    Assert::AreEqual(100 + expectedInstance, hit.instanceID, L"Hit reported with the wrong instance ID");
+                }
+                hits[lane] = hit;
+                hitMask |= isHit ? 1 << lane : 0;
+
+                // The same rays as a packet
+                if (lane == CpuRayPacketSize - 1)
+                {
+                    CpuRayHit packetHits[CpuRayPacketSize];
+                    const UINT packetHitMask = TraceRayPacketOnCpu(pTopLevel.get(), D3D12_RAY_FLAG_NONE, instanceMask, rays, 0xFF, packetHits);
+                    Assert::AreEqual(hitMask, packetHitMask, L"Top level packet traversal disagrees with single ray traversal");
+                    for (UINT packetLane = 0; packetLane < CpuRayPacketSize; packetLane++)
+                    {
+                        if (!(hitMask & (1 << packetLane))) continue;
+
+                        Assert::AreEqual(hits[packetLane].t, packetHits[packetLane].t, L"Top level packet traversal returned a different closest hit");
+                        Assert::AreEqual(hits[packetLane].instanceIndex, packetHits[packetLane].instanceIndex, L"Top level packet traversal hit a different instance");
+                    }
+                    hitMask = 0;
+                }
+            }
+        }
+
+        TEST_METHOD(CpuTraversalPacketsMatchSingleRays)
+        {
+            srand(46);
+            std::unique_ptr<BYTE[]> pBottomLevel = BuildSphereBottomLevel();
+            const UINT rayFlags[] = { D3D12_RAY_FLAG_NONE, D3D12_RAY_FLAG_CULL_BACK_FACING_TRIANGLES, D3D12_RAY_FLAG_CULL_FRONT_FACING_TRIANGLES };
+
+            CpuTraversalStats singleRayStats = {}, packetStats = {};
+            for (UINT packetIndex = 0; packetIndex < 200; packetIndex++)
+            {
+                // Mostly coherent packets: a small pinhole camera tile, sometimes with rays left out
+                CpuRay rays[CpuRayPacketSize];
+                const bool isCoherent = packetIndex % 4 != 0;
+                const float3 eye = { RandomFloat(-3.0f, 3.0f), RandomFloat(-3.0f, 3.0f), -4.0f };
+                const float3 target = { RandomFloat(-1.0f, 1.0f), RandomFloat(-1.5f, 1.5f), 0.0f };
+                for (UINT lane = 0; lane < CpuRayPacketSize; lane++)
+                {
+                    rays[lane] = isCoherent ? CpuRay{ eye, target - eye, 0.0f, FLT_MAX } : GenerateRandomRay(lane);
+                    if (isCoherent)
+                    {
+                        rays[lane].direction.x += 0.02f * (lane % 4);
+                        rays[lane].direction.y += 0.02f * (lane / 4);
+                    }
+                }
+                const UINT activeMask = packetIndex % 3 ? 0xFF : (UINT)rand() & 0xFF;
+                const UINT flags = rayFlags[packetIndex % ARRAYSIZE(rayFlags)];
+
+                CpuRayHit hits[CpuRayPacketSize];
+                const UINT hitMask = TraceRayPacketOnCpuBottomLevel(pBottomLevel.get(), flags, rays, activeMask, hits, &packetStats);
+                Assert::AreEqual(0u, hitMask & ~activeMask, L"Inactive ray reported a hit");
+                for (UINT lane = 0; lane < CpuRayPacketSize; lane++)
+                {
+                    if (!(activeMask & (1 << lane))) continue;
+
+                    CpuRayHit hit;
+                    const bool isHit = TraceRayOnCpuBottomLevel(pBottomLevel.get(), flags, rays[lane], hit, &singleRayStats);
+                    Assert::AreEqual(isHit, (hitMask & (1 << lane)) != 0, L"Packet traversal disagrees with single ray traversal");
+                    if (isHit)
+                    {
+                        Assert::AreEqual(hit.t, hits[lane].t, L"Packet traversal returned a different closest hit");
+                        Assert::AreEqual(hit.hitKind, hits[lane].hitKind, L"Packet traversal returned a different hit kind");
+                    }
+                }
+            }
+            Assert::IsTrue(packetStats.nodesVisited < singleRayStats.nodesVisited, L"Packets should share node visits");
+        }
+
+        TEST_METHOD(SpatialSplitsBottomLevel)
+        {
+            // Long slivers at an angle to every axis, whose boxes object splits can't pull apart
+            srand(47);
+            CreateSphereMesh(256, 4);
+            for (UINT i = 0; i < m_vertices.size(); i += 3)
+            {
+                const float y = m_vertices[i + 1] * cos(0.6f) - m_vertices[i + 2] * sin(0.6f);
+                m_vertices[i + 2] = m_vertices[i + 1] * sin(0.6f) + m_vertices[i + 2] * cos(0.6f);
+                m_vertices[i + 1] = m_vertices[i] * sin(0.5f) + y * cos(0.5f);
+                m_vertices[i] = m_vertices[i] * cos(0.5f) - y * sin(0.5f);
+            }
+            const UINT numTriangles = (UINT)m_indices.size() / 3;
+            D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc = GetBottomLevelDesc();
+
+            std::unique_ptr<BYTE[]> pObjectSplits = std::unique_ptr<BYTE[]>(new BYTE[GetOffsetToPrimitives(numTriangles) +
+                GetOffsetFromPrimitivesToPrimitiveMetaData(numTriangles) +
+                numTriangles * SizeOfPrimitiveMetaData]);
+            BuildRaytracingAccelerationStructureOnCpu(&desc, pObjectSplits.get());
+
+            const float duplicateBudget = 1.0f;
+            std::unique_ptr<BYTE[]> pData = std::unique_ptr<BYTE[]>(new BYTE[GetSpatialSplitAccelerationStructureSizeOnCpu(numTriangles, duplicateBudget)]);
+            BuildRaytracingAccelerationStructureWithSpatialSplitsOnCpu(&desc, 1e-5f, duplicateBudget, pData.get());
+
+            const BVHOffsets &offsets = *(BVHOffsets *)pData.get();
+            const UINT numReferences = (UINT)((offsets.offsetToPrimitiveMetaData - offsets.offsetToVertices) / sizeof(Primitive));
+            Assert::IsTrue(numReferences > numTriangles, L"No triangle was split");
+            Assert::IsTrue(numReferences <= numTriangles * (1.0f + duplicateBudget), L"Duplicate budget exceeded");
+            Assert::IsTrue(GetAccelerationStructureSahCostOnCpu(pData.get()) < 0.9f * GetAccelerationStructureSahCostOnCpu(pObjectSplits.get()),
+                L"Spatial splits should lower the SAH cost of slivers");
+
+            for (UINT pass = 0; pass < 2; pass++)
+            {
+                for (UINT i = 0; i < 300; i++)
+                {
+                    const CpuRay ray = GenerateRandomRay(i);
+                    float expectedT;
+                    const bool expectedHit = BruteForceClosestHit(ray, expectedT);
+
+                    CpuRayHit hit;
+                    const bool isHit = TraceRayOnCpuBottomLevel(pData.get(), D3D12_RAY_FLAG_NONE, ray, hit);
+                    Assert::AreEqual(expectedHit, isHit, L"Spatial split BVH disagrees with brute force");
+                    if (!isHit) continue;
+                    Assert::IsTrue(std::abs(hit.t - expectedT) <= 0.0001f * std::max(1.0f, expectedT), L"Spatial split BVH returned the wrong closest hit");
+                    Assert::IsTrue(hit.primitiveIndex < numTriangles, L"Hit reported on a reference instead of its triangle");
+                }
+
+                // Refit to a stretched mesh, the split leaves get their whole triangle back
+                for (UINT i = 1; i < m_vertices.size(); i += 3)
+                {
+                    m_vertices[i] *= 1.2f;
+                }
+                desc.Inputs.Flags = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE;
+                desc.SourceAccelerationStructureData = (D3D12_GPU_VIRTUAL_ADDRESS)pData.get();
+                BuildRaytracingAccelerationStructureOnCpu(&desc, pData.get());
+            }
+        }
+
+        TEST_METHOD(CompressedBVHValidateAndTrace)
+        {
+            srand(48);
+            std::unique_ptr<BYTE[]> pData = BuildSphereBottomLevel();
+            const UINT numTriangles = (UINT)m_indices.size() / 3;
+
+            CompressedBVH compressedBvh;
+            Assert::IsTrue(compressedBvh.Compress(pData.get()), L"Compressed BVH too deep to traverse");
+            Assert::IsTrue(compressedBvh.Validate(), L"Primitive outside of its decoded box");
+
+            const BVHOffsets &offsets = *(BVHOffsets *)pData.get();
+            const UINT64 bvh2Size = offsets.offsetToVertices - offsets.offsetToBoxes;
+            Assert::IsTrue(2 * compressedBvh.GetSizeInBytes() <= bvh2Size, L"Compressed BVH should take at most half the memory of the BVH2");
+
+            CpuTraversalStats bvh2Stats = {}, compressedStats = {};
+            for (UINT i = 0; i < 500; i++)
+            {
+                const CpuRay ray = GenerateRandomRay(i);
+                float expectedT;
+                const bool expectedHit = BruteForceClosestHit(ray, expectedT);
+
+                CpuRayHit hit, bvh2Hit;
+                const bool isHit = compressedBvh.TraceClosestHit(ray, hit, &compressedStats);
+                TraceRayOnCpuBottomLevel(pData.get(), D3D12_RAY_FLAG_NONE, ray, bvh2Hit, &bvh2Stats);
+                Assert::AreEqual(expectedHit, isHit, L"Compressed BVH traversal disagrees with brute force");
+                if (isHit)
+                {
+                    Assert::IsTrue(std::abs(hit.t - expectedT) <= 0.0001f * std::max(1.0f, expectedT), L"Compressed BVH returned the wrong closest hit");
+                    Assert::IsTrue(hit.primitiveIndex < numTriangles, L"Hit metadata out of range");
+                }
+            }
+
+            // Rounding the planes outwards loosens the boxes, but only by a step of their parent's
+            Assert::IsTrue(compressedStats.primitivesTested < 2 * bvh2Stats.primitivesTested, L"Decoded boxes too loose");
+        }
+
+        TEST_METHOD(AccelerationStructureQualityReport)
+        {
+            srand(50);
+            std::unique_ptr<BYTE[]> pData = BuildSphereBottomLevel();
+            const UINT numTriangles = (UINT)m_indices.size() / 3;
+
+            AccelerationStructureQuality quality;
+            GetAccelerationStructureQualityOnCpu(pData.get(), quality);
+            Assert::AreEqual(numTriangles, quality.numPrimitives, L"Every triangle should be in exactly one leaf");
+            Assert::AreEqual(2 * quality.numLeaves - 1, quality.numNodes, L"A BVH2 has one less internal node than leaves");
+            Assert::AreEqual(GetAccelerationStructureSahCostOnCpu(pData.get()), quality.sahCost);
+            Assert::IsTrue(quality.siblingOverlap >= 0.0f, L"Negative sibling overlap");
+
+            UINT leavesAtDepth = 0, leavesWithNumPrimitives = 0, primitives = 0;
+            for (UINT count : quality.leavesAtDepth) leavesAtDepth += count;
+            for (UINT i = 0; i < quality.leavesWithNumPrimitives.size(); i++)
+            {
+                leavesWithNumPrimitives += quality.leavesWithNumPrimitives[i];
+                primitives += i * quality.leavesWithNumPrimitives[i];
+            }
+            Assert::AreEqual(quality.numLeaves, leavesAtDepth, L"Depth histogram misses leaves");
+            Assert::AreEqual(quality.numLeaves, leavesWithNumPrimitives, L"Leaf size histogram misses leaves");
+            Assert::AreEqual(numTriangles, primitives, L"Leaf size histogram misses primitives");
+
+            // The report reads 32 bit indices
+            const std::vector<UINT> indices(m_indices.begin(), m_indices.end());
+            const AccelerationStructureReportMesh mesh = { "sphere", m_vertices.data(), (UINT)m_vertices.size() / 3, indices.data(), (UINT)indices.size() };
+            std::ostringstream report;
+            WriteAccelerationStructureBuildReportOnCpu(&mesh, 1, 2, report);
+            const std::string json = report.str();
+            for (const char *pMode : { "\"sah\"", "\"fast_build\"", "\"fast_trace\"", "\"spatial_splits\"", "\"update\"" })
+            {
+                Assert::IsTrue(json.find(pMode) != std::string::npos, L"Build mode missing from the report");
+            }
+            const std::string primitiveCount = "\"primitives\": " + std::to_string(numTriangles);
+            Assert::IsTrue(json.find(primitiveCount) != std::string::npos, L"Report quality doesn't match the mesh");
+        }
+
+    private:
+        // A lumpy UV sphere, standing in for a creature mesh
+        void CreateSphereMesh(UINT segments, UINT rings)
+        {
+            const float pi = 3.14159265f;
+            m_vertices.clear();
+            m_indices.clear();
+            for (UINT ring = 0; ring <= rings; ring++)
+            {
+                for (UINT segment = 0; segment <= segments; segment++)
+                {
+                    const float theta = pi * ring / rings;
+                    const float phi = 2.0f * pi * segment / segments;
+                    const float radius = 1.0f + 0.04f * (rand() / (float)RAND_MAX - 0.5f);
+                    m_vertices.push_back(radius * sin(theta) * cos(phi));
+                    m_vertices.push_back(1.5f * radius * cos(theta));
+                    m_vertices.push_back(radius * sin(theta) * sin(phi));
+                }
+            }
+
+            for (UINT ring = 0; ring < rings; ring++)
+            {
+                for (UINT segment = 0; segment < segments; segment++)
+                {
+                    const UINT16 a = (UINT16)(ring * (segments + 1) + segment);
+                    const UINT16 b = (UINT16)(a + segments + 1);
+                    const UINT16 quad[] = { a, b, (UINT16)(a + 1), (UINT16)(a + 1), b, (UINT16)(b + 1) };
+                    m_indices.insert(m_indices.end(), quad, quad + ARRAYSIZE(quad));
+                }
+            }
+        }
+
+        std::unique_ptr<BYTE[]> BuildSphereBottomLevel()
+        {
+            CreateSphereMesh(64, 32);
+            const UINT numTriangles = (UINT)m_indices.size() / 3;
+
+            const UINT accelerationStructureSize = GetOffsetToPrimitives(numTriangles) +
+                GetOffsetFromPrimitivesToPrimitiveMetaData(numTriangles) +
+                numTriangles * SizeOfPrimitiveMetaData;
+            std::unique_ptr<BYTE[]> pData = std::unique_ptr<BYTE[]>(new BYTE[accelerationStructureSize]);
+
+            const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc = GetBottomLevelDesc();
+            BuildRaytracingAccelerationStructureOnCpu(&desc, pData.get());
+            return pData;
+        }
+
+        D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC GetBottomLevelDesc()
+        {
+            m_geometryDesc = {};
+            m_geometryDesc.Type = D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES;
+            m_geometryDesc.Triangles.IndexBuffer = (D3D12_GPU_VIRTUAL_ADDRESS)m_indices.data();
+            m_geometryDesc.Triangles.VertexBuffer.StartAddress = (D3D12_GPU_VIRTUAL_ADDRESS)m_vertices.data();
+            m_geometryDesc.Triangles.IndexFormat = DXGI_FORMAT_R16_UINT;
+            m_geometryDesc.Triangles.IndexCount = (UINT)m_indices.size();
+            m_geometryDesc.Triangles.VertexCount = (UINT)m_vertices.size() / 3;
+            m_geometryDesc.Triangles.VertexBuffer.StrideInBytes = sizeof(float) * 3;
+
+            D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc = {};
+            desc.Inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL;
+            desc.Inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+            desc.Inputs.NumDescs = 1;
+            desc.Inputs.pGeometryDescs = &m_geometryDesc;
+            return desc;
+        }
+
+        // Rays from around the mesh, most aimed at it
+        CpuRay GenerateRandomRay(UINT i)
+        {
+            const float3 origin = { RandomFloat(-3.0f, 3.0f), RandomFloat(-3.0f, 3.0f), RandomFloat(-3.0f, 3.0f) };
+            const float spread = i % 8 ? 1.2f : 5.0f;
+            const float3 target = { RandomFloat(-spread, spread), RandomFloat(-spread, spread), RandomFloat(-spread, spread) };
+            return CpuRay{ origin, target - origin, 0.0f, FLT_MAX };
+        }
+
+        float3 Transform(const FLOAT transform[3][4], const float *pVertex)
+        {
+            if (!transform) return float3{ pVertex[0], pVertex[1], pVertex[2] };
+
+            return float3
+            {
+                transform[0][0] * pVertex[0] + transform[0][1] * pVertex[1] + transform[0][2] * pVertex[2] + transform[0][3],
+                transform[1][0] * pVertex[0] + transform[1][1] * pVertex[1] + transform[1][2] * pVertex[2] + transform[1][3],
+                transform[2][0] * pVertex[0] + transform[2][1] * pVertex[1] + transform[2][2] * pVertex[2] + transform[2][3]
+            };
+        }
+
+        // Moller-Trumbore over every triangle of the mesh, placed with objectToWorld if given
+        bool BruteForceClosestHit(const CpuRay &ray, float &closestT, const FLOAT objectToWorld[3][4] = nullptr)
+        {
+            bool isHit = false;
+            closestT = ray.tMax;
+            for (UINT i = 0; i < m_indices.size(); i += 3)
+            {
+                const float3 v0 = Transform(objectToWorld, &m_vertices[m_indices[i] * 3]);
+                const float3 v1 = Transform(objectToWorld, &m_vertices[m_indices[i + 1] * 3]);
+                const float3 v2 = Transform(objectToWorld, &m_vertices[m_indices[i + 2] * 3]);
+                const float3 edge1 = v1 - v0;
+                const float3 edge2 = v2 - v0;
+                const float3 p = cross(ray.direction, edge2);
+                const float det = dot(edge1, p);
+                if (std::abs(det) < 1e-12f) continue;
+
+                const float3 s = ray.origin - v0;
+                const float u = dot(s, p) / det;
+                const float3 q = cross(s, edge1);
+                const float v = dot(ray.direction, q) / det;
+                const float t = dot(edge2, q) / det;
+                if (u >= 0.0f && v >= 0.0f && u + v <= 1.0f && t >= ray.tMin && t < closestT)
+                {
+                    closestT = t;
+                    isHit = true;
+                }
+            }
+            return isHit;
+        }
+
+        template<UINT Width>
+        void TestWideBVH(UINT maxPrimitivesInLeaf)
+        {
+            srand(43);
+            std::unique_ptr<BYTE[]> pData = BuildSphereBottomLevel();
+            const UINT numTriangles = (UINT)m_indices.size() / 3;
+
+            WideBVH<Width> wideBvh;
+            Assert::IsTrue(wideBvh.Collapse(pData.get(), maxPrimitivesInLeaf), L"Wide BVH too deep to traverse");
+
+            // Every primitive sits in exactly one leaf, and every child box holds what is below it
+            const BVHOffsets &offsets = *(BVHOffsets *)pData.get();
+            const Primitive *pPrimitives = (const Primitive *)(pData.get() + offsets.offsetToVertices);
+            const auto &nodes = wideBvh.GetNodes();
+            std::vector<UINT> leafCount(numTriangles);
+            for (const WideBVHNode<Width> &node : nodes)
+            {
+                for (UINT slot = 0; slot < Width; slot++)
+                {
+                    const UINT child = node.children[slot];
+                    if (child == WideBVHEmptyChild) continue;
+
+                    AABB box;
+                    for (UINT axis = 0; axis < 3; axis++)
+                    {
+                        box.minArr[axis] = node.bounds[0][axis][slot];
+                        box.maxArr[axis] = node.bounds[1][axis][slot];
+                    }
+
+                    if (!IsWideBVHLeaf(child))
+                    {
+                        Assert::IsTrue(child < nodes.size(), L"Child node index out of range");
+                        for (UINT childSlot = 0; childSlot < Width; childSlot++)
+                        {
+                            if (nodes[child].children[childSlot] == WideBVHEmptyChild) continue;
+
+                            AABB childBox;
+                            for (UINT axis = 0; axis < 3; axis++)
+                            {
+                                childBox.minArr[axis] = nodes[child].bounds[0][axis][childSlot];
+                                childBox.maxArr[axis] = nodes[child].bounds[1][axis][childSlot];
+                            }
+                            Assert::IsTrue(IsContained(box, childBox), L"Child box not contained by its parent");
+                        }
+                        continue;
+                    }
+
+                    const UINT firstPrimitive = GetWideBVHLeafFirstPrimitive(child);
+                    const UINT numPrimitives = GetWideBVHLeafNumPrimitives(child);
+                    Assert::IsTrue(numPrimitives >= 1 && numPrimitives <= std::max(maxPrimitivesInLeaf, 1u), L"Unexpected leaf size");
+                    for (UINT i = firstPrimitive; i < firstPrimitive + numPrimitives; i++)
+                    {
+                        Assert::IsTrue(i < numTriangles, L"Leaf primitive out of range");
+                        leafCount[i]++;
+
+                        AABB triangleBox;
+                        for (UINT axis = 0; axis < 3; axis++)
+                        {
+                            const Triangle &triangle = pPrimitives[i].triangle;
+                            triangleBox.minArr[axis] = std::min(std::min((&triangle.v0.x)[axis], (&triangle.v1.x)[axis]), (&triangle.v2.x)[axis]);
+                            triangleBox.maxArr[axis] = std::max(std::max((&triangle.v0.x)[axis], (&triangle.v1.x)[axis]), (&triangle.v2.x)[axis]);
+                        }
+                        Assert::IsTrue(IsContained(box, triangleBox), L"Triangle not contained by its leaf");
+                    }
+                }
+            }
+            for (UINT i = 0; i < numTriangles; i++)
+            {
+                Assert::AreEqual(1u, leafCount[i], L"Primitive missing or duplicated in the wide BVH");
+            }
+
+            if (maxPrimitivesInLeaf > 1)
+            {
+                const UINT64 bvh2Size = offsets.offsetToVertices - offsets.offsetToBoxes;
+                Assert::IsTrue(wideBvh.GetSizeInBytes() < bvh2Size, L"Wide BVH should take less memory than the BVH2");
+            }
+
+            CpuTraversalStats stats = {};
+            for (UINT i = 0; i < 500; i++)
+            {
+                const CpuRay ray = GenerateRandomRay(i);
+
+                float expectedT;
+                const bool expectedHit = BruteForceClosestHit(ray, expectedT);
+
+                CpuRayHit hit;
+                const bool isHit = wideBvh.TraceClosestHit(ray, hit, &stats);
+                Assert::AreEqual(expectedHit, isHit, L"Wide BVH traversal disagrees with brute force");
+                if (isHit)
+                {
+                    Assert::IsTrue(std::abs(hit.t - expectedT) <= 0.0001f * std::max(1.0f, expectedT), L"Wide BVH returned the wrong closest hit");
+                    Assert::IsTrue(hit.primitiveIndex < numTriangles, L"Hit metadata out of range");
+                }
+            }
+            Assert::IsTrue(stats.nodesVisited > 0 && stats.primitivesTested < 500ull * numTriangles, L"Traversal didn't cull anything");
+        }
+
+        bool IsContained(const AABB &parent, const AABB &child)
+        {
+            const float epsilon = 0.0001f;
+            for (UINT axis = 0; axis < 3; axis++)
+            {
+                if (child.minArr[axis] < parent.minArr[axis] - epsilon || child.maxArr[axis] > parent.maxArr[axis] + epsilon)
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        float RandomFloat(float low, float high)
+        {
+            return low + (high - low) * (rand() / (float)RAND_MAX);
+        }
+
+        std::vector<float> m_vertices;
+        std::vector<UINT16> m_indices;
+        D3D12_RAYTRACING_GEOMETRY_DESC m_geometryDesc;
+    };
 
     TEST_CLASS(TracingTests)
     {
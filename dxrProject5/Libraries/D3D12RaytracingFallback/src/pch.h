@@ -25,6 +25,7 @@
 #include <unordered_set>
 #include <map>
 #include <deque>
+#include <ppl.h>
 #include <string>
 #include <strsafe.h>
 #include "d3d12_1.h"
@@ -86,6 +87,10 @@
 #include "GpuBvh2Copy.h"
 #include "TreeletReorder.h"
 #include "GpuBvh2Builder.h"
+#include "CpuTraversal.h"
+#include "WideBvh.h"
+#include "CpuLBVHBuilder.h"
+#include "CompressedBvh.h"
 
 // Dispatchers
 #include "UberShaderBindings.h"
@@ -0,0 +1,1093 @@
+#include "stdafx.h"
+#include "BlockCompression.h"
+#include "ModelHelper.h"
+
+#include <algorithm>
+#include <limits>
+#include <thread>
+
+using namespace Model;
+
+namespace
+{
+	// BC7 two subset partitions, bit i set when texel i is in subset 1, and the texel of subset 1 whose index
+	// has its top bit implied (subset 0's is always texel 0)
+	const UINT16 c_partitions[64] =
+	{
+		0xCCCC, 0x8888, 0xEEEE, 0xECC8, 0xC880, 0xFEEC, 0xFEC8, 0xEC80, 0xC800, 0xFFEC, 0xFE80, 0xE800, 0xFFE8, 0xFF00, 0xFFF0, 0xF000,
+		0xF710, 0x008E, 0x7100, 0x08CE, 0x008C, 0x7310, 0x3100, 0x8CCE, 0x088C, 0x3110, 0x6666, 0x366C, 0x17E8, 0x0FF0, 0x718E, 0x399C,
+		0xAAAA, 0xF0F0, 0x5A5A, 0x33CC, 0x3C3C, 0x55AA, 0x9696, 0xA55A, 0x73CE, 0x13C8, 0x324C, 0x3BDC, 0x6996, 0xC33C, 0x9966, 0x0660,
+		0x0272, 0x04E4, 0x4E40, 0x2720, 0xC936, 0x936C, 0x39C6, 0x639C, 0x9336, 0x9CC6, 0x817E, 0xE718, 0xCCF0, 0x0FCC, 0x7744, 0xEE22,
+	};
+	const UINT8 c_anchors[64] =
+	{
+		15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+		15, 2, 8, 2, 2, 8, 8, 15, 2, 8, 2, 2, 8, 8, 2, 2,
+		15, 15, 6, 8, 2, 8, 15, 15, 2, 8, 2, 2, 2, 15, 15, 6,
+		6, 2, 6, 8, 15, 15, 2, 2, 15, 15, 15, 15, 15, 2, 2, 15,
+	};
+	const int c_weights3[8] = { 0, 9, 18, 27, 37, 46, 55, 64 };
+	const int c_weights4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+	inline int clamp_int(int value, int low, int high)
+	{
+		return (value < low) ? low : ((value > high) ? high : value);
+	}
+
+	// A 128 bit block, written and read from its least significant bit up
+	struct BlockBits
+	{
+		UINT8* data;
+		UINT position;
+
+		explicit BlockBits(UINT8* block) : data(block), position(0) {}
+
+		void put(UINT value, UINT count)
+		{
+			for (UINT i = 0; i < count; i++, position++)
+			{
+				data[position >> 3] |= UINT8(((value >> i) & 1) << (position & 7));
+			}
+		}
+
+		UINT get(UINT count)
+		{
+			UINT value = 0;
+			for (UINT i = 0; i < count; i++, position++)
+			{
+				value |= UINT((data[position >> 3] >> (position & 7)) & 1) << i;
+			}
+			return value;
+		}
+	};
+
+	struct Texels
+	{
+		float value[16][4];
+	};
+
+	// Line through the texels in members (a bit mask) along their principal axis, as far as they reach.
+	// Fills e0 and e1 with the first channels of the two ends.
+	void principal_endpoints(const Texels& texels, UINT members, UINT channels, float* e0, float* e1)
+	{
+		float mean[4] = {};
+		UINT count = 0;
+		for (UINT i = 0; i < 16; i++)
+		{
+			if (members & (1 << i))
+			{
+				for (UINT c = 0; c < channels; c++)
+				{
+					mean[c] += texels.value[i][c];
+				}
+				count++;
+			}
+		}
+		for (UINT c = 0; c < channels; c++)
+		{
+			mean[c] /= float(max(count, 1u));
+		}
+
+		float covariance[4][4] = {};
+		for (UINT i = 0; i < 16; i++)
+		{
+			if (members & (1 << i))
+			{
+				for (UINT a = 0; a < channels; a++)
+				{
+					for (UINT b = 0; b < channels; b++)
+					{
+						covariance[a][b] += (texels.value[i][a] - mean[a]) * (texels.value[i][b] - mean[b]);
+					}
+				}
+			}
+		}
+
+		// Power iteration, from the channel with the most variance
+		float axis[4] = {};
+		UINT widest = 0;
+		for (UINT c = 1; c < channels; c++)
+		{
+			widest = (covariance[c][c] > covariance[widest][widest]) ? c : widest;
+		}
+		axis[widest] = 1.0f;
+		for (int iteration = 0; iteration < 8; iteration++)
+		{
+			float next[4] = {};
+			float length = 0.0f;
+			for (UINT a = 0; a < channels; a++)
+			{
+				for (UINT b = 0; b < channels; b++)
+				{
+					next[a] += covariance[a][b] * axis[b];
+				}
+				length += next[a] * next[a];
+			}
+			if (length <= 1e-12f)
+			{
+				break;
+			}
+			length = sqrtf(length);
+			for (UINT c = 0; c < channels; c++)
+			{
+				axis[c] = next[c] / length;
+			}
+		}
+
+		float low = FLT_MAX;
+		float high = -FLT_MAX;
+		for (UINT i = 0; i < 16; i++)
+		{
+			if (members & (1 << i))
+			{
+				float t = 0.0f;
+				for (UINT c = 0; c < channels; c++)
+				{
+					t += (texels.value[i][c] - mean[c]) * axis[c];
+				}
+				low = min(low, t);
+				high = max(high, t);
+			}
+		}
+		if (count == 0)
+		{
+			low = high = 0.0f;
+		}
+		for (UINT c = 0; c < channels; c++)
+		{
+			e0[c] = min(max(mean[c] + low * axis[c], 0.0f), 255.0f);
+			e1[c] = min(max(mean[c] + high * axis[c], 0.0f), 255.0f);
+		}
+	}
+
+	// The endpoints that best reproduce the members, given how far towards e1 each sits (weight[i] in [0, 1]).
+	// Returns false when the weights cannot tell the two ends apart.
+	bool least_squares_endpoints(const Texels& texels, UINT members, UINT channels, const float* weight, float* e0, float* e1)
+	{
+		float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+		float ax[4] = {}, bx[4] = {};
+		for (UINT i = 0; i < 16; i++)
+		{
+			if (members & (1 << i))
+			{
+				float b = weight[i];
+				float a = 1.0f - b;
+				aa += a * a;
+				ab += a * b;
+				bb += b * b;
+				for (UINT c = 0; c < channels; c++)
+				{
+					ax[c] += a * texels.value[i][c];
+					bx[c] += b * texels.value[i][c];
+				}
+			}
+		}
+		float determinant = aa * bb - ab * ab;
+		if (fabsf(determinant) < 1e-6f)
+		{
+			return false;
+		}
+		for (UINT c = 0; c < channels; c++)
+		{
+			e0[c] = min(max((ax[c] * bb - bx[c] * ab) / determinant, 0.0f), 255.0f);
+			e1[c] = min(max((bx[c] * aa - ax[c] * ab) / determinant, 0.0f), 255.0f);
+		}
+		return true;
+	}
+
+	// Picks the closest of palette_size colours for every member texel. Returns the squared error.
+	float assign_indices(const Texels& texels, UINT members, UINT channels, const int palette[][4], UINT palette_size, UINT8* indices)
+	{
+		float total = 0.0f;
+		for (UINT i = 0; i < 16; i++)
+		{
+			if (!(members & (1 << i)))
+			{
+				continue;
+			}
+			float best = FLT_MAX;
+			for (UINT p = 0; p < palette_size; p++)
+			{
+				float error = 0.0f;
+				for (UINT c = 0; c < channels; c++)
+				{
+					float d = texels.value[i][c] - float(palette[p][c]);
+					error += d * d;
+				}
+				if (error < best)
+				{
+					best = error;
+					indices[i] = UINT8(p);
+				}
+			}
+			total += best;
+		}
+		return total;
+	}
+
+	Texels load_texels(const UINT8* texels)
+	{
+		Texels result;
+		for (UINT i = 0; i < 16; i++)
+		{
+			for (UINT c = 0; c < 4; c++)
+			{
+				result.value[i][c] = float(texels[i * 4 + c]);
+			}
+		}
+		return result;
+	}
+
+	UINT refinements(UINT quality)
+	{
+		return (quality == 0) ? 0 : ((quality == 1) ? 1 : 3);
+	}
+
+	//------------------------------------------------------------------------------------------------------------
+	// BC1
+
+	UINT16 to_565(const float* color)
+	{
+		UINT r = UINT(clamp_int(int(color[0] * 31.0f / 255.0f + 0.5f), 0, 31));
+		UINT g = UINT(clamp_int(int(color[1] * 63.0f / 255.0f + 0.5f), 0, 63));
+		UINT b = UINT(clamp_int(int(color[2] * 31.0f / 255.0f + 0.5f), 0, 31));
+		return UINT16((r << 11) | (g << 5) | b);
+	}
+
+	void from_565(UINT16 packed, int* color)
+	{
+		int r = (packed >> 11) & 31;
+		int g = (packed >> 5) & 63;
+		int b = packed & 31;
+		color[0] = (r << 3) | (r >> 2);
+		color[1] = (g << 2) | (g >> 4);
+		color[2] = (b << 3) | (b >> 2);
+		color[3] = 255;
+	}
+
+	void bc1_palette(UINT16 c0, UINT16 c1, int palette[4][4])
+	{
+		from_565(c0, palette[0]);
+		from_565(c1, palette[1]);
+		for (int c = 0; c < 4; c++)
+		{
+			if (c0 > c1)
+			{
+				palette[2][c] = (2 * palette[0][c] + palette[1][c] + 1) / 3;
+				palette[3][c] = (palette[0][c] + 2 * palette[1][c] + 1) / 3;
+			}
+			else
+			{
+				palette[2][c] = (palette[0][c] + palette[1][c] + 1) / 2;
+				palette[3][c] = 0;
+			}
+		}
+	}
+
+	void encode_bc1(const Texels& texels, UINT quality, UINT8* block)
+	{
+		// How far towards c1 each index is
+		const float c_toward_c1[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f };
+		float e0[4], e1[4];
+		principal_endpoints(texels, 0xFFFF, 3, e0, e1);
+
+		float best_error = FLT_MAX;
+		UINT16 best_c0 = 0, best_c1 = 0;
+		UINT8 best_indices[16] = {};
+		for (UINT iteration = 0; iteration <= refinements(quality); iteration++)
+		{
+			// Four colour blocks need c0 > c1. Equal ends can only be a three colour block: every index 0.
+			UINT16 c0 = to_565(e0);
+			UINT16 c1 = to_565(e1);
+			if (c0 < c1)
+			{
+				std::swap(c0, c1);
+				std::swap(e0, e1);
+			}
+			int palette[4][4];
+			bc1_palette(c0, c1, palette);
+			UINT8 indices[16] = {};
+			float error = assign_indices(texels, 0xFFFF, 3, palette, (c0 == c1) ? 1 : 4, indices);
+			if (error < best_error)
+			{
+				best_error = error;
+				best_c0 = c0;
+				best_c1 = c1;
+				memcpy(best_indices, indices, sizeof(indices));
+			}
+			if (c0 == c1)
+			{
+				break;
+			}
+
+			float weight[16];
+			for (UINT i = 0; i < 16; i++)
+			{
+				weight[i] = c_toward_c1[indices[i]];
+			}
+			if (!least_squares_endpoints(texels, 0xFFFF, 3, weight, e0, e1))
+			{
+				break;
+			}
+		}
+
+		memcpy(block, &best_c0, 2);
+		memcpy(block + 2, &best_c1, 2);
+		UINT bits = 0;
+		for (UINT i = 0; i < 16; i++)
+		{
+			bits |= UINT(best_indices[i]) << (2 * i);
+		}
+		memcpy(block + 4, &bits, 4);
+	}
+
+	void decode_bc1(const UINT8* block, UINT8* texels)
+	{
+		UINT16 c0, c1;
+		UINT bits;
+		memcpy(&c0, block, 2);
+		memcpy(&c1, block + 2, 2);
+		memcpy(&bits, block + 4, 4);
+		int palette[4][4];
+		bc1_palette(c0, c1, palette);
+		for (UINT i = 0; i < 16; i++)
+		{
+			UINT index = (bits >> (2 * i)) & 3;
+			for (UINT c = 0; c < 3; c++)
+			{
+				texels[i * 4 + c] = UINT8(palette[index][c]);
+			}
+			texels[i * 4 + 3] = (c0 <= c1 && index == 3) ? 0 : 255;
+		}
+	}
+
+	//------------------------------------------------------------------------------------------------------------
+	// BC4
+
+	void bc4_palette(int r0, int r1, int palette[8][4])
+	{
+		palette[0][0] = r0;
+		palette[1][0] = r1;
+		if (r0 > r1)
+		{
+			for (int i = 2; i < 8; i++)
+			{
+				palette[i][0] = ((8 - i) * r0 + (i - 1) * r1 + 3) / 7;
+			}
+		}
+		else
+		{
+			for (int i = 2; i < 6; i++)
+			{
+				palette[i][0] = ((6 - i) * r0 + (i - 1) * r1 + 2) / 5;
+			}
+			palette[6][0] = 0;
+			palette[7][0] = 255;
+		}
+	}
+
+	// Error and indices of the block with ends r0 and r1
+	float try_bc4(const Texels& texels, int r0, int r1, UINT8* indices)
+	{
+		int palette[8][4];
+		bc4_palette(r0, r1, palette);
+		return assign_indices(texels, 0xFFFF, 1, palette, 8, indices);
+	}
+
+	void encode_bc4(const Texels& texels, UINT quality, UINT8* block)
+	{
+		// Eight value blocks span the texels. Six value blocks have exact 0 and 255 besides, so they span the rest.
+		float low = 255.0f, high = 0.0f, inner_low = 255.0f, inner_high = 0.0f;
+		for (UINT i = 0; i < 16; i++)
+		{
+			float value = texels.value[i][0];
+			low = min(low, value);
+			high = max(high, value);
+			if (value > 0.0f && value < 255.0f)
+			{
+				inner_low = min(inner_low, value);
+				inner_high = max(inner_high, value);
+			}
+		}
+
+		int best_r0 = int(high), best_r1 = int(low);
+		UINT8 best_indices[16] = {};
+		float best_error = FLT_MAX;
+		auto Try = [&](int r0, int r1)
+		{
+			UINT8 indices[16];
+			float error = try_bc4(texels, r0, r1, indices);
+			if (error < best_error)
+			{
+				best_error = error;
+				best_r0 = r0;
+				best_r1 = r1;
+				memcpy(best_indices, indices, sizeof(indices));
+			}
+		};
+
+		Try(int(high), int(low));
+		if (quality > 0)
+		{
+			if (inner_low <= inner_high)
+			{
+				Try(int(inner_low), int(inner_high));
+			}
+
+			float e0 = high, e1 = low;
+			for (UINT iteration = 0; iteration < refinements(quality) && best_r0 > best_r1; iteration++)
+			{
+				float weight[16];
+				for (UINT i = 0; i < 16; i++)
+				{
+					UINT index = best_indices[i];
+					weight[i] = (index == 0) ? 0.0f : ((index == 1) ? 1.0f : (index - 1) / 7.0f);
+				}
+				if (!least_squares_endpoints(texels, 0xFFFF, 1, weight, &e0, &e1))
+				{
+					break;
+				}
+				int r0 = int(e0 + 0.5f), r1 = int(e1 + 0.5f);
+				if (r0 <= r1)
+				{
+					break;
+				}
+				Try(r0, r1);
+			}
+		}
+
+		block[0] = UINT8(best_r0);
+		block[1] = UINT8(best_r1);
+		UINT64 bits = 0;
+		for (UINT i = 0; i < 16; i++)
+		{
+			bits |= UINT64(best_indices[i]) << (3 * i);
+		}
+		memcpy(block + 2, &bits, 6);
+	}
+
+	void decode_bc4(const UINT8* block, UINT8* texels)
+	{
+		int palette[8][4];
+		bc4_palette(block[0], block[1], palette);
+		UINT64 bits = 0;
+		memcpy(&bits, block + 2, 6);
+		for (UINT i = 0; i < 16; i++)
+		{
+			texels[i * 4] = UINT8(palette[(bits >> (3 * i)) & 7][0]);
+			texels[i * 4 + 1] = 0;
+			texels[i * 4 + 2] = 0;
+			texels[i * 4 + 3] = 255;
+		}
+	}
+
+	//------------------------------------------------------------------------------------------------------------
+	// BC7
+
+	inline int interpolate(int a, int b, int weight)
+	{
+		return ((64 - weight) * a + weight * b + 32) >> 6;
+	}
+
+	// Mode 6: 7 bit RGBA endpoints, each with its own low bit (p bit), and 4 bit indices
+	struct Mode6
+	{
+		int endpoint[2][4];		// 7 bit values
+		int parity[2];
+		UINT8 indices[16];
+		float error;
+	};
+
+	float mode6_fit(const Texels& texels, const float* e0, const float* e1, int p0, int p1, Mode6& mode)
+	{
+		const float* ends[2] = { e0, e1 };
+		int parity[2] = { p0, p1 };
+		int palette[16][4];
+		int color[2][4];
+		for (int e = 0; e < 2; e++)
+		{
+			mode.parity[e] = parity[e];
+			for (int c = 0; c < 4; c++)
+			{
+				mode.endpoint[e][c] = clamp_int(int(floorf((ends[e][c] - parity[e]) * 0.5f + 0.5f)), 0, 127);
+				color[e][c] = (mode.endpoint[e][c] << 1) | parity[e];
+			}
+		}
+		for (int i = 0; i < 16; i++)
+		{
+			for (int c = 0; c < 4; c++)
+			{
+				palette[i][c] = interpolate(color[0][c], color[1][c], c_weights4[i]);
+			}
+		}
+		mode.error = assign_indices(texels, 0xFFFF, 4, palette, 16, mode.indices);
+		return mode.error;
+	}
+
+	Mode6 encode_mode6(const Texels& texels, UINT quality)
+	{
+		float e0[4], e1[4];
+		principal_endpoints(texels, 0xFFFF, 4, e0, e1);
+
+		Mode6 best;
+		best.error = FLT_MAX;
+		for (UINT iteration = 0; iteration <= refinements(quality); iteration++)
+		{
+			if (quality >= 2)
+			{
+				for (int parity = 0; parity < 4; parity++)
+				{
+					Mode6 mode;
+					if (mode6_fit(texels, e0, e1, parity & 1, parity >> 1, mode) < best.error)
+					{
+						best = mode;
+					}
+				}
+			}
+			else
+			{
+				// The parity closest to each endpoint's own low bits on average
+				float sum0 = 0.0f, sum1 = 0.0f;
+				for (int c = 0; c < 4; c++)
+				{
+					sum0 += e0[c] - 2.0f * floorf(e0[c] * 0.5f);
+					sum1 += e1[c] - 2.0f * floorf(e1[c] * 0.5f);
+				}
+				Mode6 mode;
+				if (mode6_fit(texels, e0, e1, sum0 >= 2.0f ? 1 : 0, sum1 >= 2.0f ? 1 : 0, mode) < best.error)
+				{
+					best = mode;
+				}
+			}
+
+			float weight[16];
+			for (int i = 0; i < 16; i++)
+			{
+				weight[i] = c_weights4[best.indices[i]] / 64.0f;
+			}
+			if (iteration == refinements(quality) || !least_squares_endpoints(texels, 0xFFFF, 4, weight, e0, e1))
+			{
+				break;
+			}
+		}
+		return best;
+	}
+
+	void write_mode6(Mode6 mode, UINT8* block)
+	{
+		// Texel 0's index has its top bit implied zero: flip the block around if it is set
+		if (mode.indices[0] >= 8)
+		{
+			for (int c = 0; c < 4; c++)
+			{
+				std::swap(mode.endpoint[0][c], mode.endpoint[1][c]);
+			}
+			std::swap(mode.parity[0], mode.parity[1]);
+			for (int i = 0; i < 16; i++)
+			{
+				mode.indices[i] = UINT8(15 - mode.indices[i]);
+			}
+		}
+
+		memset(block, 0, 16);
+		BlockBits bits(block);
+		bits.put(1 << 6, 7);
+		for (int c = 0; c < 4; c++)
+		{
+			bits.put(mode.endpoint[0][c], 7);
+			bits.put(mode.endpoint[1][c], 7);
+		}
+		bits.put(mode.parity[0], 1);
+		bits.put(mode.parity[1], 1);
+		for (int i = 0; i < 16; i++)
+		{
+			bits.put(mode.indices[i], (i == 0) ? 3 : 4);
+		}
+	}
+
+	// Mode 1: two RGB subsets with 6 bit endpoints, a low bit shared within each subset, and 3 bit indices
+	struct Mode1
+	{
+		int partition;
+		int endpoint[2][2][3];	// [subset][end][channel], 6 bit values
+		int parity[2];
+		UINT8 indices[16];
+		float error;
+	};
+
+	inline int expand_mode1(int value, int parity)
+	{
+		int seven = (value << 1) | parity;
+		return (seven << 1) | (seven >> 6);
+	}
+
+	int quantize_mode1(float value, int parity)
+	{
+		int guess = clamp_int(int(floorf((value * 127.0f / 255.0f - parity) * 0.5f + 0.5f)), 0, 63);
+		int best = guess;
+		for (int candidate = max(guess - 1, 0); candidate <= min(guess + 1, 63); candidate++)
+		{
+			if (fabsf(expand_mode1(candidate, parity) - value) < fabsf(expand_mode1(best, parity) - value))
+			{
+				best = candidate;
+			}
+		}
+		return best;
+	}
+
+	// Fits one subset, with its endpoints refined quality dependent times
+	float mode1_subset(const Texels& texels, UINT members, UINT quality, Mode1& mode, int subset)
+	{
+		float e0[3], e1[3];
+		principal_endpoints(texels, members, 3, e0, e1);
+
+		float best_error = FLT_MAX;
+		for (UINT iteration = 0; iteration <= refinements(quality); iteration++)
+		{
+			// Below quality 2 only the parity most of the endpoints' 7 bit values have is tried
+			int parities[2] = { 0, 1 };
+			int parity_count = 2;
+			if (quality < 2)
+			{
+				int odd = 0;
+				for (int c = 0; c < 3; c++)
+				{
+					odd += (int(e0[c] * 127.0f / 255.0f + 0.5f) & 1) + (int(e1[c] * 127.0f / 255.0f + 0.5f) & 1);
+				}
+				parities[0] = (odd >= 3) ? 1 : 0;
+				parity_count = 1;
+			}
+			for (int k = 0; k < parity_count; k++)
+			{
+				int p = parities[k];
+				int ends[2][3];
+				int color[2][4] = {};
+				for (int c = 0; c < 3; c++)
+				{
+					ends[0][c] = quantize_mode1(e0[c], p);
+					ends[1][c] = quantize_mode1(e1[c], p);
+					color[0][c] = expand_mode1(ends[0][c], p);
+					color[1][c] = expand_mode1(ends[1][c], p);
+				}
+				int palette[8][4];
+				for (int i = 0; i < 8; i++)
+				{
+					for (int c = 0; c < 3; c++)
+					{
+						palette[i][c] = interpolate(color[0][c], color[1][c], c_weights3[i]);
+					}
+				}
+				UINT8 indices[16];
+				float error = assign_indices(texels, members, 3, palette, 8, indices);
+				if (error < best_error)
+				{
+					best_error = error;
+					memcpy(mode.endpoint[subset], ends, sizeof(ends));
+					mode.parity[subset] = p;
+					for (int i = 0; i < 16; i++)
+					{
+						if (members & (1 << i))
+						{
+							mode.indices[i] = indices[i];
+						}
+					}
+				}
+			}
+
+			float weight[16] = {};
+			for (int i = 0; i < 16; i++)
+			{
+				if (members & (1 << i))
+				{
+					weight[i] = c_weights3[mode.indices[i]] / 64.0f;
+				}
+			}
+			if (iteration == refinements(quality) || !least_squares_endpoints(texels, members, 3, weight, e0, e1))
+			{
+				break;
+			}
+		}
+		return best_error;
+	}
+
+	// Sums of the RGB values of a set of texels and of their pairwise products, from which its covariance follows
+	struct Moments
+	{
+		float count;
+		float sum[3];
+		float product[6];	// rr, rg, rb, gg, gb, bb
+
+		void add(const float* value, float sign)
+		{
+			count += sign;
+			for (int c = 0; c < 3; c++)
+			{
+				sum[c] += sign * value[c];
+			}
+			product[0] += sign * value[0] * value[0];
+			product[1] += sign * value[0] * value[1];
+			product[2] += sign * value[0] * value[2];
+			product[3] += sign * value[1] * value[1];
+			product[4] += sign * value[1] * value[2];
+			product[5] += sign * value[2] * value[2];
+		}
+
+		// Variance left off the principal axis, times the count: roughly what the best line through them misses by
+		float residual() const
+		{
+			if (count <= 1.0f)
+			{
+				return 0.0f;
+			}
+			float mean[3] = { sum[0] / count, sum[1] / count, sum[2] / count };
+			float m[3][3];
+			m[0][0] = product[0] - mean[0] * sum[0];
+			m[0][1] = m[1][0] = product[1] - mean[0] * sum[1];
+			m[0][2] = m[2][0] = product[2] - mean[0] * sum[2];
+			m[1][1] = product[3] - mean[1] * sum[1];
+			m[1][2] = m[2][1] = product[4] - mean[1] * sum[2];
+			m[2][2] = product[5] - mean[2] * sum[2];
+			float trace = m[0][0] + m[1][1] + m[2][2];
+
+			float axis[3] = { 1.0f, 1.0f, 1.0f };
+			float eigenvalue = 0.0f;
+			for (int iteration = 0; iteration < 4; iteration++)
+			{
+				float next[3];
+				for (int a = 0; a < 3; a++)
+				{
+					next[a] = m[a][0] * axis[0] + m[a][1] * axis[1] + m[a][2] * axis[2];
+				}
+				float length = sqrtf(next[0] * next[0] + next[1] * next[1] + next[2] * next[2]);
+				if (length <= 1e-6f)
+				{
+					break;
+				}
+				for (int a = 0; a < 3; a++)
+				{
+					axis[a] = next[a] / length;
+				}
+				eigenvalue = length;
+			}
+			return max(trace - eigenvalue, 0.0f);
+		}
+	};
+
+	Mode1 encode_mode1(const Texels& texels, UINT quality)
+	{
+		// Rank the partitions cheaply, then encode the most promising for real
+		Moments all = {};
+		for (int i = 0; i < 16; i++)
+		{
+			all.add(texels.value[i], 1.0f);
+		}
+		std::pair<float, int> ranked[64];
+		for (int p = 0; p < 64; p++)
+		{
+			Moments subset1 = {};
+			for (int i = 0; i < 16; i++)
+			{
+				if (c_partitions[p] & (1 << i))
+				{
+					subset1.add(texels.value[i], 1.0f);
+				}
+			}
+			Moments subset0 = all;
+			for (int i = 0; i < 16; i++)
+			{
+				if (c_partitions[p] & (1 << i))
+				{
+					subset0.add(texels.value[i], -1.0f);
+				}
+			}
+			ranked[p] = std::make_pair(subset0.residual() + subset1.residual(), p);
+		}
+		int tries = (quality >= 2) ? 8 : 2;
+		std::partial_sort(ranked, ranked + tries, ranked + 64);
+
+		Mode1 best;
+		best.error = FLT_MAX;
+		for (int t = 0; t < tries; t++)
+		{
+			Mode1 mode;
+			mode.partition = ranked[t].second;
+			UINT subset1 = c_partitions[mode.partition];
+			mode.error = mode1_subset(texels, ~subset1 & 0xFFFF, quality, mode, 0) + mode1_subset(texels, subset1, quality, mode, 1);
+			if (mode.error < best.error)
+			{
+				best = mode;
+			}
+		}
+		return best;
+	}
+
+	void write_mode1(Mode1 mode, UINT8* block)
+	{
+		// Each subset's anchor texel has the top bit of its index implied zero
+		UINT subset1 = c_partitions[mode.partition];
+		int anchors[2] = { 0, c_anchors[mode.partition] };
+		for (int subset = 0; subset < 2; subset++)
+		{
+			if (mode.indices[anchors[subset]] >= 4)
+			{
+				for (int c = 0; c < 3; c++)
+				{
+					std::swap(mode.endpoint[subset][0][c], mode.endpoint[subset][1][c]);
+				}
+				for (int i = 0; i < 16; i++)
+				{
+					if (int((subset1 >> i) & 1) == subset)
+					{
+						mode.indices[i] = UINT8(7 - mode.indices[i]);
+					}
+				}
+			}
+		}
+
+		memset(block, 0, 16);
+		BlockBits bits(block);
+		bits.put(1 << 1, 2);
+		bits.put(mode.partition, 6);
+		for (int c = 0; c < 3; c++)
+		{
+			for (int subset = 0; subset < 2; subset++)
+			{
+				bits.put(mode.endpoint[subset][0][c], 6);
+				bits.put(mode.endpoint[subset][1][c], 6);
+			}
+		}
+		bits.put(mode.parity[0], 1);
+		bits.put(mode.parity[1], 1);
+		for (int i = 0; i < 16; i++)
+		{
+			bits.put(mode.indices[i], (i == anchors[0] || i == anchors[1]) ? 2 : 3);
+		}
+	}
+
+	void encode_bc7(const Texels& texels, UINT quality, UINT8* block)
+	{
+		Mode6 mode6 = encode_mode6(texels, quality);
+		bool opaque = true;
+		for (int i = 0; i < 16; i++)
+		{
+			opaque = opaque && texels.value[i][3] == 255.0f;
+		}
+		// Below quality 2 blocks that mode 6 already gets within 1 per channel (RMS) skip the partition search:
+		// two subsets rarely beat that, and most blocks of smooth textures are such blocks
+		float good_enough = (quality >= 2) ? 0.0f : 16.0f * 4.0f;
+		if (quality > 0 && opaque && mode6.error > good_enough)
+		{
+			Mode1 mode1 = encode_mode1(texels, quality);
+			// Mode 6's error counts alpha too, mode 1 reproduces the opaque alpha exactly
+			if (mode1.error < mode6.error)
+			{
+				write_mode1(mode1, block);
+				return;
+			}
+		}
+		write_mode6(mode6, block);
+	}
+
+	void decode_bc7(const UINT8* block, UINT8* texels)
+	{
+		UINT8 copy[16];
+		memcpy(copy, block, sizeof(copy));
+		BlockBits bits(copy);
+		int mode = 0;
+		while (mode < 8 && bits.get(1) == 0)
+		{
+			mode++;
+		}
+
+		if (mode == 6)
+		{
+			int color[2][4];
+			int raw[2][4];
+			for (int c = 0; c < 4; c++)
+			{
+				raw[0][c] = bits.get(7);
+				raw[1][c] = bits.get(7);
+			}
+			int parity[2] = { int(bits.get(1)), int(bits.get(1)) };
+			for (int e = 0; e < 2; e++)
+			{
+				for (int c = 0; c < 4; c++)
+				{
+					color[e][c] = (raw[e][c] << 1) | parity[e];
+				}
+			}
+			for (int i = 0; i < 16; i++)
+			{
+				int index = bits.get((i == 0) ? 3 : 4);
+				for (int c = 0; c < 4; c++)
+				{
+					texels[i * 4 + c] = UINT8(interpolate(color[0][c], color[1][c], c_weights4[index]));
+				}
+			}
+		}
+		else if (mode == 1)
+		{
+			int partition = bits.get(6);
+			int raw[2][2][3];
+			for (int c = 0; c < 3; c++)
+			{
+				for (int subset = 0; subset < 2; subset++)
+				{
+					raw[subset][0][c] = bits.get(6);
+					raw[subset][1][c] = bits.get(6);
+				}
+			}
+			int parity[2] = { int(bits.get(1)), int(bits.get(1)) };
+			int anchor = c_anchors[partition];
+			for (int i = 0; i < 16; i++)
+			{
+				int subset = (c_partitions[partition] >> i) & 1;
+				int index = bits.get((i == 0 || i == anchor) ? 2 : 3);
+				for (int c = 0; c < 3; c++)
+				{
+					texels[i * 4 + c] = UINT8(interpolate(expand_mode1(raw[subset][0][c], parity[subset]),
+						expand_mode1(raw[subset][1][c], parity[subset]), c_weights3[index]));
+				}
+				texels[i * 4 + 3] = 255;
+			}
+		}
+		else
+		{
+			for (int i = 0; i < 16; i++)
+			{
+				texels[i * 4] = texels[i * 4 + 1] = texels[i * 4 + 2] = 0;
+				texels[i * 4 + 3] = 255;
+			}
+		}
+	}
+
+	// The 4x4 texels of block (x, y) of a level, repeating the last row and column past its edges
+	void gather_block(const UINT8* level, const TextureSubresource& layout, UINT x, UINT y, UINT8* texels)
+	{
+		for (UINT row = 0; row < 4; row++)
+		{
+			const UINT8* source = level + UINT64(min(y * 4 + row, layout.height - 1)) * layout.row_pitch;
+			for (UINT column = 0; column < 4; column++)
+			{
+				memcpy(texels + (row * 4 + column) * 4, source + min(x * 4 + column, layout.width - 1) * 4, 4);
+			}
+		}
+	}
+}
+
+UINT Model::block_bytes(BlockFormat format)
+{
+	return (format == BlockFormat::BC7) ? 16 : 8;
+}
+
+DXGI_FORMAT Model::dxgi_format(BlockFormat format, bool srgb)
+{
+	switch (format)
+	{
+	case BlockFormat::BC1: return srgb ? DXGI_FORMAT_BC1_UNORM_SRGB : DXGI_FORMAT_BC1_UNORM;
+	case BlockFormat::BC4: return DXGI_FORMAT_BC4_UNORM;
+	default: return srgb ? DXGI_FORMAT_BC7_UNORM_SRGB : DXGI_FORMAT_BC7_UNORM;
+	}
+}
+
+void Model::encode_block(BlockFormat format, const UINT8* texels, UINT quality, UINT8* block)
+{
+	Texels values = load_texels(texels);
+	switch (format)
+	{
+	case BlockFormat::BC1: encode_bc1(values, quality, block); break;
+	case BlockFormat::BC4: encode_bc4(values, quality, block); break;
+	default: encode_bc7(values, quality, block); break;
+	}
+}
+
+void Model::decode_block(BlockFormat format, const UINT8* block, UINT8* texels)
+{
+	switch (format)
+	{
+	case BlockFormat::BC1: decode_bc1(block, texels); break;
+	case BlockFormat::BC4: decode_bc4(block, texels); break;
+	default: decode_bc7(block, texels); break;
+	}
+}
+
+bool Model::compress_texture(const TextureData& texture, const BlockCompressOptions& options, TextureData& compressed)
+{
+	if (texture.mips.empty() || texture.mips[0].width % 4 != 0 || texture.mips[0].height % 4 != 0)
+	{
+		return false;
+	}
+	UINT num_threads = options.num_threads ? options.num_threads : max(1u, std::thread::hardware_concurrency());
+	const UINT bytes = block_bytes(options.format);
+
+	compressed.mips = texture.mips;
+	compressed.srgb = texture.srgb;
+	UINT64 size = 0;
+	for (TextureSubresource& level : compressed.mips)
+	{
+		level.row_pitch = UINT(align(UINT64((level.width + 3) / 4) * bytes, D3D12_TEXTURE_DATA_PITCH_ALIGNMENT));
+		level.offset = align(size, D3D12_TEXTURE_DATA_PLACEMENT_ALIGNMENT);
+		size = level.offset + UINT64(level.row_pitch) * ((level.height + 3) / 4);
+	}
+	compressed.pixels.reset(new UINT8[size_t(size)]);
+	compressed.size = size;
+
+	for (UINT mip = 0; mip < UINT(texture.mips.size()); mip++)
+	{
+		const TextureSubresource& source = texture.mips[mip];
+		const TextureSubresource& level = compressed.mips[mip];
+		UINT8* destination = compressed.pixels.get() + level.offset;
+		parallel_for((level.height + 3) / 4, num_threads, [&](UINT y)
+		{
+			UINT8 texels[64];
+			UINT8* row = destination + UINT64(y) * level.row_pitch;
+			for (UINT x = 0; x < (level.width + 3) / 4; x++)
+			{
+				gather_block(texture.data(mip), source, x, y, texels);
+				encode_block(options.format, texels, options.quality, row + x * bytes);
+			}
+		});
+	}
+	return true;
+}
+
+float Model::compression_psnr(const TextureData& texture, const TextureData& compressed, BlockFormat format)
+{
+	const UINT channels = (format == BlockFormat::BC4) ? 1 : ((format == BlockFormat::BC1) ? 3 : 4);
+	const UINT bytes = block_bytes(format);
+	double squared_error = 0.0;
+	UINT64 samples = 0;
+	for (UINT mip = 0; mip < UINT(texture.mips.size()); mip++)
+	{
+		const TextureSubresource& source = texture.mips[mip];
+		const TextureSubresource& level = compressed.mips[mip];
+		for (UINT y = 0; y < (level.height + 3) / 4; y++)
+		{
+			for (UINT x = 0; x < (level.width + 3) / 4; x++)
+			{
+				UINT8 original[64], decoded[64];
+				gather_block(texture.data(mip), source, x, y, original);
+				decode_block(format, compressed.data(mip) + UINT64(y) * level.row_pitch + x * bytes, decoded);
+				for (UINT i = 0; i < 16; i++)
+				{
+					// Only texels inside the level count, the repeated edge would count twice
+					if (x * 4 + i % 4 >= level.width || y * 4 + i / 4 >= level.height)
+					{
+						continue;
+					}
+					for (UINT c = 0; c < channels; c++)
+					{
+						double d = double(original[i * 4 + c]) - double(decoded[i * 4 + c]);
+						squared_error += d * d;
+					}
+					samples += channels;
+				}
+			}
+		}
+	}
+	if (squared_error == 0.0)
+	{
+		return std::numeric_limits<float>::infinity();
+	}
+	return float(10.0 * log10(255.0 * 255.0 * samples / squared_error));
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "TextureIngest.h"
+
+namespace Model
+{
+	// Block compressed formats, 4x4 texels a block
+	enum class BlockFormat
+	{
+		BC1,	// RGB in 8 bytes: 565 endpoints, 2 bit indices. Alpha is dropped.
+		BC4,	// Red in 8 bytes: 8 bit endpoints, 3 bit indices
+		BC7,	// RGBA in 16 bytes. Written with mode 6 (one RGBA subset) and mode 1 (two RGB subsets).
+	};
+
+	struct BlockCompressOptions
+	{
+		BlockFormat format = BlockFormat::BC7;
+		// 0: endpoints from the principal axis only, BC7 uses mode 6 alone.
+		// 1: one least squares refinement, BC7 also tries the two most promising mode 1 partitions where mode 6
+		//    is off by more than 1 per channel.
+		// 2: three refinements and every endpoint parity, BC7 tries the eight most promising partitions.
+		UINT quality = 1;
+		UINT num_threads = 0;	// 0 for one per hardware thread
+	};
+
+	UINT block_bytes(BlockFormat format);
+
+	// BC4 has no sRGB form: it keeps whatever the red channel holds, sRGB encoded or not
+	DXGI_FORMAT dxgi_format(BlockFormat format, bool srgb);
+
+	// texels: four rows of four RGBA8 texels
+	void encode_block(BlockFormat format, const UINT8* texels, UINT quality, UINT8* block);
+	// Decodes what encode_block() writes; BC7 blocks of other modes come out black. BC4 fills red only.
+	void decode_block(BlockFormat format, const UINT8* block, UINT8* texels);
+
+	// Compresses every mip of texture. compressed has the same layout, except that rows are rows of blocks:
+	// row_pitch is the bytes between them. Blocks past the edge of a level repeat its last row and column.
+	// Returns false unless the top level is a multiple of 4 texels on both axes, as D3D12 requires.
+	bool compress_texture(const TextureData& texture, const BlockCompressOptions& options, TextureData& compressed);
+
+	// Peak signal to noise ratio of all the compressed mips against texture's, in dB, over the channels the format
+	// keeps. Infinite for a lossless result.
+	float compression_psnr(const TextureData& texture, const TextureData& compressed, BlockFormat format);
+}
@@ -110,29 +110,13 @@ void Creature::generate(int numTextures, int numLimbSets, int headType) {
         //for as many joints in each limb
         for (int l = 0; l < limbLengths[k] - 1; l++) {
 
-            XMVECTOR a = XMVectorSet(0.0, 1.0, 0.0, 0.0);
-            XMVECTOR b = XMVectorSet(jointLocations[start + 3] - jointLocations[start],
-                jointLocations[start + 4] - jointLocations[start + 1],
-                jointLocations[start + 5] - jointLocations[start + 2], 0.0);
-            b = XMVector3Normalize(b);
-
-            /*XMVECTOR q = XMVector3Cross(a, b);
-            float w = pow(XMVectorGetX(XMVector3Length(a)), 2) * pow(XMVectorGetX(XMVector3Length(b)), 2) + XMVectorGetX(XMVector3Dot(a, b));
-            q = XMVectorSetW(q, sqrt(w));
-            XMMATRIX m4 = XMMatrixRotationQuaternion(q);*/
-
-            float angle = acos(XMVectorGetX(XMVector3Dot(a, b)));
-            XMVECTOR axis = XMVector3Normalize(XMVector3Cross(a, b));
-
-            jointRots.push_back(angle);
-            jointRots.push_back(XMVectorGetX(axis));
-            jointRots.push_back(XMVectorGetY(axis));
-            jointRots.push_back(XMVectorGetZ(axis));
+            float rotation[4];
+            jointRotation(&jointLocations[start], &jointLocations[start + 3], rotation);
+
+            jointRots.insert(jointRots.end(), rotation, rotation + 4);
             if (l == limbLengths[k] - 2) {
-                jointRots.push_back(angle);
-                jointRots.push_back(XMVectorGetX(axis));
-                jointRots.push_back(XMVectorGetY(axis));
-                jointRots.push_back(XMVectorGetZ(axis));
+                // The appendage on the last joint shares the rotation of the last segment
+                jointRots.insert(jointRots.end(), rotation, rotation + 4);
                 appenRads.push_back(jointRadii[start / 3]);
             }
 
@@ -143,3 +127,64 @@ void Creature::generate(int numTextures, int numLimbSets, int headType) {
 
     }
 }
+
+void Creature::fillBuffers(HeadSpineInfoBuffer& headSpine, AppendageInfoBuffer& appen, LimbInfoBuffer& limb, RotationInfoBuffer& rot) const {
+    for (int h = 0; h < min(HEAD_COUNT, head->headData.size()); h++)
+    {
+        headSpine.headData[h] = head->headData[h];
+    }
+    for (int sl = 0; sl < min(SPINE_LOC_COUNT, spineLocations.size()); sl++)
+    {
+        headSpine.spineLocData[sl] = spineLocations[sl];
+    }
+    for (int sr = 0; sr < min(SPINE_RAD_COUNT, spine->metaBallRadii.size()); sr++)
+    {
+        headSpine.spineRadData[sr] = spine->metaBallRadii[sr];
+    }
+
+    appen.numAppen = appendages->appendageData[0];
+    for (int a = 0; a < min(APPEN_COUNT, appenBools.size()); a++)
+    {
+        appen.appenBools[a] = appenBools[a];
+        appen.appenRads[a] = appenRads[a];
+    }
+
+    for (int l = 0; l < min(LIMBLEN_COUNT, limbLengths.size()); l++)
+    {
+        limb.limbLengths[l] = limbLengths[l];
+    }
+    for (int jl = 0; jl < min(JOINT_LOC_COUNT, jointLocations.size()); jl++)
+    {
+        limb.jointLocData[jl] = jointLocations[jl];
+    }
+    for (int jr = 0; jr < min(JOINT_RAD_COUNT, jointRadii.size()); jr++)
+    {
+        limb.jointRadData[jr] = jointRadii[jr];
+    }
+
+    for (int r = 0; r < min(ROT_COUNT, jointRots.size()); r++)
+    {
+        rot.rotations[r] = jointRots[r];
+    }
+}
+
+void Creature::jointRotation(const float joint0[3], const float joint1[3], float rotation[4]) {
+    XMVECTOR a = XMVectorSet(0.0, 1.0, 0.0, 0.0);
+    XMVECTOR b = XMVectorSet(joint1[0] - joint0[0], joint1[1] - joint0[1], joint1[2] - joint0[2], 0.0);
+    b = XMVector3Normalize(b);
+
+    /*XMVECTOR q = XMVector3Cross(a, b);
+    float w = pow(XMVectorGetX(XMVector3Length(a)), 2) * pow(XMVectorGetX(XMVector3Length(b)), 2) + XMVectorGetX(XMVector3Dot(a, b));
+    q = XMVectorSetW(q, sqrt(w));
+    XMMATRIX m4 = XMMatrixRotationQuaternion(q);*/
+
+    float angle = acos(max(-1.0f, min(1.0f, XMVectorGetX(XMVector3Dot(a, b)))));
+    XMVECTOR axis = XMVector3Cross(a, b);
+    // Straight up or down has no rotation axis of its own, any one perpendicular to y does
+    axis = (XMVectorGetX(XMVector3LengthSq(axis)) > 1e-12f) ? XMVector3Normalize(axis) : XMVectorSet(1.0, 0.0, 0.0, 0.0);
+
+    rotation[0] = angle;
+    rotation[1] = XMVectorGetX(axis);
+    rotation[2] = XMVectorGetY(axis);
+    rotation[3] = XMVectorGetZ(axis);
+}
@@ -32,5 +32,12 @@ public:
 	Creature();
 	~Creature();
 	void generate(int numTextures, int numLimbSets, int headType);
+
+	// Copies the generated creature into one slot of the buffers the SDFs read, which have to be zeroed beforehand.
+	// Anything beyond the fixed buffer sizes is dropped.
+	void fillBuffers(HeadSpineInfoBuffer& headSpine, AppendageInfoBuffer& appen, LimbInfoBuffer& limb, RotationInfoBuffer& rot) const;
+
+	// Axis-angle rotation (angle, axis x, y, z) taking +y to the direction from joint0 to joint1, as stored in jointRots
+	static void jointRotation(const float joint0[3], const float joint1[3], float rotation[4]);
 };
 
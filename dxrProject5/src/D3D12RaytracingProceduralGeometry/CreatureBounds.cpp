@@ -0,0 +1,234 @@
+#include "stdafx.h"
+#include "CreatureBounds.h"
+
+// Smooth min constants of the SDFs (SDFfucns.h and Raytracing.hlsl)
+static const float c_spineSmin = 0.06f;		// between spine metaballs
+static const float c_headSpineSmin = 0.1f;	// head with spine
+static const float c_armSmin = 0.2f;		// joint spheres with cone sections
+static const float c_limbAppenSmin = 0.2f;	// limbs with hands and feet
+static const float c_sceneSmin = 0.1f;		// limbs and appendages with head and spine
+static const float c_appenSmin = 0.13f;		// hand or foot base with its fingers/toes (the larger of the two)
+
+// Bounding sphere radius of each head type in units of the head radius (headData[3]), measured from the head center.
+// The farthest features are the mandibles (bug), the front teeth (dino) and the bottom teeth (troll).
+static const float c_headExtent[3] = { 2.11f, 3.03f, 2.49f };
+// Internal smooth mins of each head type
+static const float c_headSlack[3] = { 0.0125f, 0.03f, 0.01f };
+
+// Bounding sphere radius of hands and feet in units of the appendage radius, measured from the last joint.
+// The middle toes of the claw foot and the two long fingers of the hand reach the farthest.
+static const float c_footExtent = 4.39f;
+static const float c_handExtent = 3.08f;
+static const float c_handRounding = 0.08f;	// handSDF's udRoundBox rounding does not scale with the hand
+
+// How far a smooth min can pull the surface past the plain union
+static float sminSlack(float k)
+{
+	return 0.25f * k;
+}
+
+static D3D12_RAYTRACING_AABB emptyAABB()
+{
+	return { FLT_MAX, FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX };
+}
+
+static bool isEmpty(const D3D12_RAYTRACING_AABB& aabb)
+{
+	return aabb.MinX > aabb.MaxX;
+}
+
+// The SDFs evaluate p + position, so a primitive at position actually sits at -position.
+static void addSphere(D3D12_RAYTRACING_AABB& aabb, const float position[3], float radius)
+{
+	aabb.MinX = min(aabb.MinX, -position[0] - radius);
+	aabb.MinY = min(aabb.MinY, -position[1] - radius);
+	aabb.MinZ = min(aabb.MinZ, -position[2] - radius);
+	aabb.MaxX = max(aabb.MaxX, -position[0] + radius);
+	aabb.MaxY = max(aabb.MaxY, -position[1] + radius);
+	aabb.MaxZ = max(aabb.MaxZ, -position[2] + radius);
+}
+
+static void inflate(D3D12_RAYTRACING_AABB& aabb, float amount)
+{
+	if (isEmpty(aabb))
+	{
+		return;
+	}
+	aabb.MinX -= amount;
+	aabb.MinY -= amount;
+	aabb.MinZ -= amount;
+	aabb.MaxX += amount;
+	aabb.MaxY += amount;
+	aabb.MaxZ += amount;
+}
+
+static D3D12_RAYTRACING_AABB unionAABB(const D3D12_RAYTRACING_AABB& a, const D3D12_RAYTRACING_AABB& b)
+{
+	return {
+		min(a.MinX, b.MinX), min(a.MinY, b.MinY), min(a.MinZ, b.MinZ),
+		max(a.MaxX, b.MaxX), max(a.MaxY, b.MaxY), max(a.MaxZ, b.MaxZ) };
+}
+
+static bool contains(const D3D12_RAYTRACING_AABB& aabb, float x, float y, float z)
+{
+	return x >= aabb.MinX && x <= aabb.MaxX
+		&& y >= aabb.MinY && y <= aabb.MaxY
+		&& z >= aabb.MinZ && z <= aabb.MaxZ;
+}
+
+CreatureBounds::CreatureBounds(const HeadSpineInfoBuffer& headSpineAttr, const AppendageInfoBuffer& appenAttr, const LimbInfoBuffer& limbAttr, bool animatedLimbs) :
+	head(emptyAABB()),
+	spine(emptyAABB())
+{
+	// Spine: a chain of smooth min'd metaballs, see spineSDF(). Zero positions are unused slots.
+	int numMetaballs = 0;
+	for (int i = 0; i < SPINE_LOC_COUNT; i += 3)
+	{
+		const float* position = &headSpineAttr.spineLocData[i];
+		if (position[0] == 0.0f && position[1] == 0.0f && position[2] == 0.0f) continue;
+		addSphere(spine, position, headSpineAttr.spineRadData[i / 3]);
+		numMetaballs++;
+	}
+	inflate(spine, numMetaballs * sminSlack(c_spineSmin) + sminSlack(c_headSpineSmin) + sminSlack(c_sceneSmin) + EPSILON);
+
+	// Head. Its rotation is about its own center, so a sphere around the center bounds every orientation.
+	int headType = int(headSpineAttr.headData[4]);
+	if (headType >= 0 && headType < 3)
+	{
+		addSphere(head, headSpineAttr.headData, c_headExtent[headType] * headSpineAttr.headData[3]);
+		inflate(head, c_headSlack[headType] + sminSlack(c_headSpineSmin) + sminSlack(c_sceneSmin) + EPSILON);
+	}
+
+	// Limbs: joint spheres and the cone sections between them, see armSDF()
+	int numJoints = 0;
+	for (int l = 0; l < LIMBLEN_COUNT; l++)
+	{
+		numJoints += int(limbAttr.limbLengths[l]);
+	}
+	std::vector<float> reaches;	// Length of every limb's chain of joints
+	int start = 0;
+	for (int l = 0; l < LIMBLEN_COUNT && start < numJoints * 3; l++)
+	{
+		int count = int(limbAttr.limbLengths[l]);
+		D3D12_RAYTRACING_AABB limb = emptyAABB();
+		float reach = 0.0f;
+		float maxRadius = 0.0f;
+		for (int i = start; i < start + count * 3; i += 3)
+		{
+			addSphere(limb, &limbAttr.jointLocData[i], limbAttr.jointRadData[i / 3]);
+			maxRadius = max(maxRadius, limbAttr.jointRadData[i / 3]);
+		}
+		for (int i = start; i < start + (count - 1) * 3; i += 3)
+		{
+			// The cone section is centered between the joints and rotated about that midpoint
+			const float* point0 = &limbAttr.jointLocData[i];
+			const float* point1 = &limbAttr.jointLocData[i + 3];
+			float midpoint[3] = { 0.5f * (point0[0] + point1[0]), 0.5f * (point0[1] + point1[1]), 0.5f * (point0[2] + point1[2]) };
+			float halfLength = 0.5f * length(vec3(point1[0] - point0[0], point1[1] - point0[1], point1[2] - point0[2]));
+			float radius = max(limbAttr.jointRadData[i / 3], limbAttr.jointRadData[(i + 3) / 3]);
+			addSphere(limb, midpoint, std::sqrt(halfLength * halfLength + radius * radius));
+			reach += 2.0f * halfLength;
+		}
+		if (animatedLimbs && count > 0)
+		{
+			// Every joint stays within reach of the root, and every cone section within its radius of them
+			addSphere(limb, &limbAttr.jointLocData[start], reach + maxRadius);
+		}
+		reaches.push_back(reach);
+		inflate(limb, sminSlack(c_armSmin) + sminSlack(c_limbAppenSmin) + sminSlack(c_sceneSmin) + EPSILON);
+		limbs.push_back(limb);
+		start += count * 3;
+	}
+
+	// Hands and feet sit on the last joint of their limb, see appendagesSDF()
+	bool armsNow = false;
+	int startPos = 0;
+	for (int i = 0; i < int(appenAttr.numAppen) && i < int(limbs.size()); i++)
+	{
+		int thisPos = startPos + 3 * (int(limbAttr.limbLengths[i]) - 1);
+		if (appenAttr.appenBools[i] == 1)
+		{
+			armsNow = true;
+		}
+		float size = appenAttr.appenRads[i];
+		float extent = armsNow ? c_handExtent * size + c_handRounding : c_footExtent * size;
+
+		D3D12_RAYTRACING_AABB appendage = emptyAABB();
+		if (animatedLimbs)
+		{
+			// The last joint can be anywhere within reach of the root
+			addSphere(appendage, &limbAttr.jointLocData[startPos], reaches[i] + extent);
+		}
+		else
+		{
+			addSphere(appendage, &limbAttr.jointLocData[thisPos], extent);
+		}
+		inflate(appendage, sminSlack(c_appenSmin) + sminSlack(c_limbAppenSmin) + sminSlack(c_sceneSmin) + EPSILON);
+		limbs[i] = unionAABB(limbs[i], appendage);
+
+		startPos = thisPos + 3;
+	}
+}
+
+D3D12_RAYTRACING_AABB CreatureBounds::creature() const
+{
+	D3D12_RAYTRACING_AABB aabb = unionAABB(head, spine);
+	for (auto& limb : limbs)
+	{
+		aabb = unionAABB(aabb, limb);
+	}
+	return aabb;
+}
+
+std::vector<D3D12_RAYTRACING_AABB> CreatureBounds::parts() const
+{
+	std::vector<D3D12_RAYTRACING_AABB> boxes;
+	if (!isEmpty(head)) boxes.push_back(head);
+	if (!isEmpty(spine)) boxes.push_back(spine);
+	for (auto& limb : limbs)
+	{
+		if (!isEmpty(limb)) boxes.push_back(limb);
+	}
+	return boxes;
+}
+
+bool CreatureBounds::isConservative(SDF& sdf, const std::vector<D3D12_RAYTRACING_AABB>& boxes, int resolution)
+{
+	D3D12_RAYTRACING_AABB all = emptyAABB();
+	for (auto& box : boxes)
+	{
+		all = unionAABB(all, box);
+	}
+	if (isEmpty(all))
+	{
+		return true;
+	}
+
+	// Sample a region twice the size of the boxes so there is plenty of room around them
+	float center[3] = { 0.5f * (all.MinX + all.MaxX), 0.5f * (all.MinY + all.MaxY), 0.5f * (all.MinZ + all.MaxZ) };
+	float size[3] = { 2.0f * (all.MaxX - all.MinX), 2.0f * (all.MaxY - all.MinY), 2.0f * (all.MaxZ - all.MinZ) };
+	for (int x = 0; x < resolution; x++)
+	{
+		for (int y = 0; y < resolution; y++)
+		{
+			for (int z = 0; z < resolution; z++)
+			{
+				vec3 p = vec3(
+					center[0] + size[0] * ((x + 0.5f) / resolution - 0.5f),
+					center[1] + size[1] * ((y + 0.5f) / resolution - 0.5f),
+					center[2] + size[2] * ((z + 0.5f) / resolution - 0.5f));
+
+				bool inside = false;
+				for (auto& box : boxes)
+				{
+					inside = inside || contains(box, p[0], p[1], p[2]);
+				}
+				if (!inside && sdf.creatureSDF(p) < EPSILON)
+				{
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "SDFfucns.h"
+
+// Conservative creature space bounds of a generated creature, computed from the same buffers the SDFs read.
+//	* Every primitive (spine metaball, head, joint sphere, limb cone section, hand or foot) is bounded by a sphere,
+//	  so joint and appendage rotations never matter.
+//	* Each box is inflated by the most the smooth mins around its primitives can pull the surface outwards
+//	  (k / 4 per smin), plus EPSILON since march() stops at sceneSDF < EPSILON rather than at the zero set.
+//	* With animatedLimbs, each limb is bounded by everything it can reach from its root (see CreatureGait),
+//	  so the boxes stay valid while the joints move.
+class CreatureBounds
+{
+public:
+	D3D12_RAYTRACING_AABB head;
+	D3D12_RAYTRACING_AABB spine;
+	std::vector<D3D12_RAYTRACING_AABB> limbs;	// Each limb together with its hand or foot
+
+	CreatureBounds(const HeadSpineInfoBuffer& headSpineAttr, const AppendageInfoBuffer& appenAttr, const LimbInfoBuffer& limbAttr, bool animatedLimbs = false);
+
+	// One box around the whole creature
+	D3D12_RAYTRACING_AABB creature() const;
+	// Head, spine and then every limb. Empty parts are left out.
+	std::vector<D3D12_RAYTRACING_AABB> parts() const;
+
+	// Samples sdf.creatureSDF() on a grid around the boxes and checks that no sample outside all of them
+	// is closer to the surface than EPSILON, i.e. that march() can never hit anything outside the boxes.
+	static bool isConservative(SDF& sdf, const std::vector<D3D12_RAYTRACING_AABB>& boxes, int resolution = 24);
+};
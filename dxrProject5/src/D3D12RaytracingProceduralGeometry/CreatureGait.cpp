@@ -0,0 +1,182 @@
+#include "stdafx.h"
+#include "CreatureGait.h"
+#include "Creature.h"
+
+// Step size in units of the limb's reach. Arms swing along but never leave the ground.
+static const float c_legStride = 0.3f;
+static const float c_legLift = 0.15f;
+static const float c_armStride = 0.15f;
+
+static const int c_fabrikIterations = 4;	// Warm started from the previous frame, so a few are plenty
+static const float c_fabrikTolerance = 1e-3f;
+static const float c_moveEpsilon = 1e-5f;	// Joints moving less than this keep their buffer values
+
+static XMFLOAT3 jointAt(const LimbInfoBuffer& limbAttr, int joint)
+{
+	return XMFLOAT3(limbAttr.jointLocData[3 * joint], limbAttr.jointLocData[3 * joint + 1], limbAttr.jointLocData[3 * joint + 2]);
+}
+
+// Puts a joint length away from another one, towards a third. Falls back to the rest direction if they coincide.
+static XMVECTOR placeJoint(XMVECTOR from, XMVECTOR towards, float length, XMVECTOR restFrom, XMVECTOR restTowards)
+{
+	XMVECTOR direction = towards - from;
+	if (XMVectorGetX(XMVector3LengthSq(direction)) < 1e-12f)
+	{
+		direction = restTowards - restFrom;
+	}
+	return from + XMVector3Normalize(direction) * length;
+}
+
+CreatureGait::CreatureGait() :
+	cycleSeconds(1.2f)
+{
+}
+
+void CreatureGait::reset(const AppendageInfoBuffer& appenAttr, const LimbInfoBuffer& limbAttr)
+{
+	limbs.clear();
+
+	// Limbs are laid out the same way armSDF() walks them, arms after legs (see appendagesSDF())
+	int numJoints = 0;
+	for (int l = 0; l < LIMBLEN_COUNT; l++)
+	{
+		numJoints += int(limbAttr.limbLengths[l]);
+	}
+	bool armsNow = false;
+	int start = 0;
+	for (int l = 0; l < LIMBLEN_COUNT && start < numJoints; l++)
+	{
+		int count = int(limbAttr.limbLengths[l]);
+		if (l < int(appenAttr.numAppen) && appenAttr.appenBools[l] == 1)
+		{
+			armsNow = true;
+		}
+		if (count >= 2 && 3 * (start + count) <= JOINT_LOC_COUNT)
+		{
+			GaitLimb limb;
+			limb.firstJoint = start;
+			for (int j = 0; j < count; j++)
+			{
+				limb.restJoints.push_back(jointAt(limbAttr, start + j));
+			}
+			limb.joints = limb.restJoints;
+			limb.reach = 0.0f;
+			for (int j = 0; j < count - 1; j++)
+			{
+				float length = XMVectorGetX(XMVector3Length(XMLoadFloat3(&limb.restJoints[j + 1]) - XMLoadFloat3(&limb.restJoints[j])));
+				limb.segmentLengths.push_back(length);
+				limb.reach += length;
+			}
+
+			// Limbs come in mirrored pairs: the two sides step in opposition, and so do consecutive pairs
+			limb.phase = XM_PI * float(l % 2) + XM_PI * float((l / 2) % 2);
+			limb.stride = (armsNow ? c_armStride : c_legStride) * limb.reach;
+			limb.lift = armsNow ? 0.0f : c_legLift * limb.reach;
+			limbs.push_back(limb);
+		}
+		start += count;
+	}
+}
+
+void CreatureGait::update(float time, LimbInfoBuffer& limbAttr, RotationInfoBuffer& rotAttr, DirtyRange& jointLocs, DirtyRange& rotations)
+{
+	float cycle = XM_2PI * time / cycleSeconds;
+	for (auto& limb : limbs)
+	{
+		float step = cycle + limb.phase;
+		XMVECTOR target = XMLoadFloat3(&limb.restJoints.back())
+			+ XMVectorSet(0.5f * limb.stride * std::cos(step), -limb.lift * max(0.0f, std::sin(step)), 0.0f, 0.0f);
+		solve(limb, target);
+		write(limb, limbAttr, rotAttr, jointLocs, rotations);
+	}
+}
+
+void CreatureGait::restore(LimbInfoBuffer& limbAttr, RotationInfoBuffer& rotAttr, DirtyRange& jointLocs, DirtyRange& rotations)
+{
+	for (auto& limb : limbs)
+	{
+		limb.joints = limb.restJoints;
+		write(limb, limbAttr, rotAttr, jointLocs, rotations);
+	}
+}
+
+// FABRIK: alternately drag the chain from the target back to the root and from the root out to the target
+void CreatureGait::solve(GaitLimb& limb, XMVECTOR target) const
+{
+	int last = int(limb.joints.size()) - 1;
+	XMVECTOR root = XMLoadFloat3(&limb.restJoints[0]);
+
+	// Out of reach, stretch towards it instead
+	XMVECTOR toTarget = target - root;
+	float distance = XMVectorGetX(XMVector3Length(toTarget));
+	if (distance > limb.reach)
+	{
+		target = root + toTarget * (limb.reach / distance);
+	}
+
+	auto Rest = [&](int j) { return XMLoadFloat3(&limb.restJoints[j]); };
+	for (int iteration = 0; iteration < c_fabrikIterations; iteration++)
+	{
+		if (XMVectorGetX(XMVector3LengthSq(XMLoadFloat3(&limb.joints[last]) - target)) < c_fabrikTolerance * c_fabrikTolerance)
+		{
+			break;
+		}
+
+		XMStoreFloat3(&limb.joints[last], target);
+		for (int j = last - 1; j >= 0; j--)
+		{
+			XMVECTOR joint = placeJoint(XMLoadFloat3(&limb.joints[j + 1]), XMLoadFloat3(&limb.joints[j]), limb.segmentLengths[j], Rest(j + 1), Rest(j));
+			XMStoreFloat3(&limb.joints[j], joint);
+		}
+
+		XMStoreFloat3(&limb.joints[0], root);
+		for (int j = 0; j < last; j++)
+		{
+			XMVECTOR joint = placeJoint(XMLoadFloat3(&limb.joints[j]), XMLoadFloat3(&limb.joints[j + 1]), limb.segmentLengths[j], Rest(j), Rest(j + 1));
+			XMStoreFloat3(&limb.joints[j + 1], joint);
+		}
+	}
+}
+
+void CreatureGait::write(GaitLimb& limb, LimbInfoBuffer& limbAttr, RotationInfoBuffer& rotAttr, DirtyRange& jointLocs, DirtyRange& rotations) const
+{
+	int last = int(limb.joints.size()) - 1;
+
+	// Joints of this limb that moved
+	DirtyRange moved;
+	for (int j = 1; j <= last; j++)
+	{
+		float* position = &limbAttr.jointLocData[3 * (limb.firstJoint + j)];
+		const XMFLOAT3& joint = limb.joints[j];
+		if (abs(joint.x - position[0]) > c_moveEpsilon || abs(joint.y - position[1]) > c_moveEpsilon || abs(joint.z - position[2]) > c_moveEpsilon)
+		{
+			position[0] = joint.x;
+			position[1] = joint.y;
+			position[2] = joint.z;
+			moved.add(j, 1);
+		}
+	}
+	if (moved.empty())
+	{
+		return;
+	}
+	jointLocs.add(3 * (limb.firstJoint + moved.begin), 3 * (moved.end - moved.begin));
+
+	// Segment s runs from joint s to joint s + 1 and its rotation is stored with joint s.
+	// The last joint holds a copy of the last segment's rotation for the hand or foot.
+	int firstSegment = max(moved.begin - 1, 0);
+	int lastSegment = min(moved.end - 1, last - 1);
+	for (int s = firstSegment; s <= lastSegment; s++)
+	{
+		int joint = limb.firstJoint + s;
+		Creature::jointRotation(&limbAttr.jointLocData[3 * joint], &limbAttr.jointLocData[3 * (joint + 1)], &rotAttr.rotations[4 * joint]);
+	}
+	int rotationCount = lastSegment - firstSegment + 1;
+	if (lastSegment == last - 1)
+	{
+		float* lastSegmentRotation = &rotAttr.rotations[4 * (limb.firstJoint + lastSegment)];
+		std::copy(lastSegmentRotation, lastSegmentRotation + 4, &rotAttr.rotations[4 * (limb.firstJoint + last)]);
+		rotationCount++;
+	}
+	rotations.add(4 * (limb.firstJoint + firstSegment), 4 * rotationCount);
+}
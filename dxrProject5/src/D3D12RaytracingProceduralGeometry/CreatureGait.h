@@ -0,0 +1,58 @@
+#pragma once
+
+#include "SDFfucns.h"
+
+using namespace DirectX;
+
+// Floats [begin, end) of a buffer array that changed. Empty until something is added.
+struct DirtyRange
+{
+	int begin;
+	int end;
+
+	DirtyRange() : begin(INT_MAX), end(0) {}
+	void add(int first, int count) { begin = min(begin, first); end = max(end, first + count); }
+	bool empty() const { return begin >= end; }
+};
+
+// Procedural walk cycle of a creature's limbs, stepped on the CPU every frame.
+//	* Every hand or foot follows a step around where it rests: along x and lifted on one half of the cycle,
+//	  back on the ground on the other. Mirrored limbs and consecutive limb pairs step in opposition.
+//	* The joints in between are solved with FABRIK starting from last frame's pose, the limb root staying on the body.
+//	* Only joints that actually moved are written back, and only the rotations (jointRots) of the segments touching
+//	  them are recomputed, so update() reports exactly what has to be uploaded.
+// Everything is in buffer coordinates, i.e. the SDFs' -position, where the feet point down +y.
+class CreatureGait
+{
+	struct GaitLimb
+	{
+		int firstJoint;		// Index of the limb's first joint, jointLocData[3 * firstJoint]
+		float phase;		// Offset in the walk cycle, in radians
+		float stride;
+		float lift;
+		std::vector<XMFLOAT3> restJoints;
+		std::vector<XMFLOAT3> joints;		// Last solved pose
+		std::vector<float> segmentLengths;
+		float reach;						// Sum of segmentLengths
+	};
+	std::vector<GaitLimb> limbs;
+
+public:
+	float cycleSeconds;		// Duration of one step
+
+	CreatureGait();
+
+	// Captures the rest pose of a generated creature
+	void reset(const AppendageInfoBuffer& appenAttr, const LimbInfoBuffer& limbAttr);
+
+	// Poses the limbs at time and writes what moved into the buffers, adding the floats it wrote to
+	// jointLocs (jointLocData) and rotations (rotations)
+	void update(float time, LimbInfoBuffer& limbAttr, RotationInfoBuffer& rotAttr, DirtyRange& jointLocs, DirtyRange& rotations);
+
+	// Puts the limbs back in their rest pose, the same way update() does
+	void restore(LimbInfoBuffer& limbAttr, RotationInfoBuffer& rotAttr, DirtyRange& jointLocs, DirtyRange& rotations);
+
+private:
+	void solve(GaitLimb& limb, XMVECTOR target) const;
+	void write(GaitLimb& limb, LimbInfoBuffer& limbAttr, RotationInfoBuffer& rotAttr, DirtyRange& jointLocs, DirtyRange& rotations) const;
+};
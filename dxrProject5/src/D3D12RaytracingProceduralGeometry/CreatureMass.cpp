@@ -0,0 +1,238 @@
+#include "stdafx.h"
+#include "CreatureMass.h"
+#include "ModelHelper.h"
+
+static const int c_rootCells = 4;	// Per axis. Their children are the first level, so it starts at 8^3 cells.
+static const UINT c_maxLevels = 7;	// Down to cells 1 / 512 of the bounds
+static const UINT c_cellsPerTask = 64;
+static const double c_levelErrorRatio = 4.0;	// The surface estimate gets this much better every level
+
+// Volume, first and second moments of the occupied space, accumulated in double since there are millions of cells
+struct Moments
+{
+	double volume;
+	double first[3];
+	double second[6];	// xx, yy, zz, xy, xz, yz
+
+	Moments() : volume(0.0), first(), second() {}
+
+	// A box of half size h around c, scaled by the fraction of it that is occupied
+	void addBox(const XMFLOAT3& c, const XMFLOAT3& h, double fraction)
+	{
+		double v = 8.0 * h.x * h.y * h.z * fraction;
+		volume += v;
+		first[0] += v * c.x;
+		first[1] += v * c.y;
+		first[2] += v * c.z;
+		second[0] += v * (c.x * c.x + h.x * h.x / 3.0);
+		second[1] += v * (c.y * c.y + h.y * h.y / 3.0);
+		second[2] += v * (c.z * c.z + h.z * h.z / 3.0);
+		second[3] += v * c.x * c.y;
+		second[4] += v * c.x * c.z;
+		second[5] += v * c.y * c.z;
+	}
+
+	void add(const Moments& m, double scale = 1.0)
+	{
+		volume += scale * m.volume;
+		for (int i = 0; i < 3; i++) first[i] += scale * m.first[i];
+		for (int i = 0; i < 6; i++) second[i] += scale * m.second[i];
+	}
+
+	// Center of mass, and the second moments moved to it with the parallel axis theorem
+	void central(double c[3], double centralSecond[6]) const
+	{
+		for (int i = 0; i < 3; i++) c[i] = first[i] / volume;
+		centralSecond[0] = second[0] - volume * c[0] * c[0];
+		centralSecond[1] = second[1] - volume * c[1] * c[1];
+		centralSecond[2] = second[2] - volume * c[2] * c[2];
+		centralSecond[3] = second[3] - volume * c[0] * c[1];
+		centralSecond[4] = second[4] - volume * c[0] * c[2];
+		centralSecond[5] = second[5] - volume * c[1] * c[2];
+	}
+};
+
+// Inertia tensor from central second moments
+static void inertiaTensor(const double s[6], double inertia[3][3])
+{
+	inertia[0][0] = s[1] + s[2];
+	inertia[1][1] = s[0] + s[2];
+	inertia[2][2] = s[0] + s[1];
+	inertia[0][1] = inertia[1][0] = -s[3];
+	inertia[0][2] = inertia[2][0] = -s[4];
+	inertia[1][2] = inertia[2][1] = -s[5];
+}
+
+static double frobeniusNorm(const double m[3][3])
+{
+	double sum = 0.0;
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = 0; j < 3; j++)
+		{
+			sum += m[i][j] * m[i][j];
+		}
+	}
+	return std::sqrt(sum);
+}
+
+// What one task finds among the children of its share of a level's cells
+struct LevelResult
+{
+	Moments inside;			// Children entirely inside
+	Moments surface;		// Estimate for the children the surface may cross
+	std::vector<XMFLOAT3> surfaceCells;
+};
+
+// Splits every cell of half size half into 8 and sorts the children by their distance to the surface
+static void classifyChildren(const std::function<float(const XMFLOAT3&)>& distanceTo, const XMFLOAT3* cells, size_t count, XMFLOAT3 half,
+	LevelResult& result)
+{
+	XMFLOAT3 childHalf(0.5f * half.x, 0.5f * half.y, 0.5f * half.z);
+	float halfDiagonal = std::sqrt(childHalf.x * childHalf.x + childHalf.y * childHalf.y + childHalf.z * childHalf.z);
+	float meanHalf = (childHalf.x + childHalf.y + childHalf.z) / 3.0f;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		for (int child = 0; child < 8; child++)
+		{
+			XMFLOAT3 center(
+				cells[i].x + ((child & 1) ? childHalf.x : -childHalf.x),
+				cells[i].y + ((child & 2) ? childHalf.y : -childHalf.y),
+				cells[i].z + ((child & 4) ? childHalf.z : -childHalf.z));
+			float distance = distanceTo(center);
+
+			if (distance < -halfDiagonal)
+			{
+				result.inside.addBox(center, childHalf, 1.0);
+			}
+			else if (distance <= halfDiagonal)
+			{
+				// As if the surface were a plane through the cell at that distance from its center
+				float fraction = max(0.0f, min(1.0f, 0.5f - 0.5f * distance / meanHalf));
+				result.surface.addBox(center, childHalf, fraction);
+				result.surfaceCells.push_back(center);
+			}
+		}
+	}
+}
+
+// creatureSDF() is not const but only reads the creature's buffers, so every thread can evaluate the same SDF
+CreatureMass::CreatureMass(const SDF& sdf, const D3D12_RAYTRACING_AABB& bounds, float tolerance, UINT numThreads) :
+	CreatureMass([&sdf](const XMFLOAT3& p) { return const_cast<SDF&>(sdf).creatureSDF(vec3(p.x, p.y, p.z)); }, bounds, tolerance, numThreads)
+{
+}
+
+CreatureMass::CreatureMass(const std::function<float(const XMFLOAT3&)>& distance, const D3D12_RAYTRACING_AABB& bounds, float tolerance,
+	UINT numThreads) :
+	volume(0.0f),
+	centroid(0.0f, 0.0f, 0.0f),
+	inertia(0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f),
+	volumeError(0.0f),
+	centroidError(0.0f),
+	inertiaError(0.0f),
+	levels(0)
+{
+	if (numThreads == 0)
+	{
+		numThreads = max(1u, std::thread::hardware_concurrency());
+	}
+
+	// Cubic cells over a cube around the bounds. The fraction of a cell the surface cuts off is only unbiased
+	// if the cell is as wide along the surface normal as across it.
+	float extent = max(max(bounds.MaxX - bounds.MinX, bounds.MaxY - bounds.MinY), bounds.MaxZ - bounds.MinZ);
+	float cellHalf = 0.5f * extent / c_rootCells;
+	XMFLOAT3 half(cellHalf, cellHalf, cellHalf);
+	XMFLOAT3 corner(
+		0.5f * (bounds.MinX + bounds.MaxX - extent),
+		0.5f * (bounds.MinY + bounds.MaxY - extent),
+		0.5f * (bounds.MinZ + bounds.MaxZ - extent));
+	std::vector<XMFLOAT3> cells;
+	for (int x = 0; x < c_rootCells; x++)
+	{
+		for (int y = 0; y < c_rootCells; y++)
+		{
+			for (int z = 0; z < c_rootCells; z++)
+			{
+				cells.push_back(XMFLOAT3(corner.x + (2 * x + 1) * cellHalf, corner.y + (2 * y + 1) * cellHalf, corner.z + (2 * z + 1) * cellHalf));
+			}
+		}
+	}
+
+	Moments inside;
+	Moments total;
+	Moments previous;
+	while (!cells.empty() && levels < c_maxLevels)
+	{
+		// Results are merged in task order, so they do not depend on the number of threads
+		UINT taskCount = UINT((cells.size() + c_cellsPerTask - 1) / c_cellsPerTask);
+		std::vector<LevelResult> results(taskCount);
+		Model::parallel_for(taskCount, numThreads, [&](UINT task)
+		{
+			size_t first = size_t(task) * c_cellsPerTask;
+			classifyChildren(distance, cells.data() + first, min(size_t(c_cellsPerTask), cells.size() - first), half, results[task]);
+		});
+
+		Moments surface;
+		cells.clear();
+		for (auto& result : results)
+		{
+			inside.add(result.inside);
+			surface.add(result.surface);
+			cells.insert(cells.end(), result.surfaceCells.begin(), result.surfaceCells.end());
+		}
+		half = XMFLOAT3(0.5f * half.x, 0.5f * half.y, 0.5f * half.z);
+		levels++;
+
+		previous = total;
+		total = inside;
+		total.add(surface);
+		if (levels < 2 || total.volume <= 0.0 || previous.volume <= 0.0)
+		{
+			continue;
+		}
+
+		// Richardson extrapolation: what is left of the error is about (total - previous) / (ratio - 1).
+		// The centroid and inertia are not linear in the moments, so their errors come from the change in them.
+		Moments change = total;
+		change.add(previous, -1.0);
+		double c[3], s[6], previousC[3], previousS[6], I[3][3], previousI[3][3], changeI[3][3];
+		total.central(c, s);
+		previous.central(previousC, previousS);
+		inertiaTensor(s, I);
+		inertiaTensor(previousS, previousI);
+		for (int i = 0; i < 3; i++)
+		{
+			for (int j = 0; j < 3; j++)
+			{
+				changeI[i][j] = I[i][j] - previousI[i][j];
+			}
+		}
+		double size = std::cbrt(total.volume);
+		volumeError = float(abs(change.volume) / (c_levelErrorRatio - 1.0));
+		centroidError = float(std::sqrt((c[0] - previousC[0]) * (c[0] - previousC[0]) + (c[1] - previousC[1]) * (c[1] - previousC[1]) +
+			(c[2] - previousC[2]) * (c[2] - previousC[2])) / (c_levelErrorRatio - 1.0));
+		inertiaError = float(frobeniusNorm(changeI) / (c_levelErrorRatio - 1.0));
+
+		bool converged = volumeError <= tolerance * total.volume && centroidError <= tolerance * size && inertiaError <= tolerance * frobeniusNorm(I);
+		if (converged || cells.empty() || levels == c_maxLevels)
+		{
+			total.add(change, 1.0 / (c_levelErrorRatio - 1.0));
+			break;
+		}
+	}
+
+	if (total.volume <= 0.0)
+	{
+		return;
+	}
+	volume = float(total.volume);
+	double c[3], s[6], I[3][3];
+	total.central(c, s);
+	inertiaTensor(s, I);
+	centroid = XMFLOAT3(float(c[0]), float(c[1]), float(c[2]));
+	inertia = XMFLOAT3X3(
+		float(I[0][0]), float(I[0][1]), float(I[0][2]),
+		float(I[1][0]), float(I[1][1]), float(I[1][2]),
+		float(I[2][0]), float(I[2][1]), float(I[2][2]));
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "SDFfucns.h"
+#include <functional>
+
+using namespace DirectX;
+
+// Volume, center of mass and inertia tensor of a creature of unit density, in creature (SDF) space.
+// Integrates the occupancy of sdf.creatureSDF() <= 0 over bounds with an adaptive octree:
+//	* a cell farther from the surface than its half diagonal is entirely inside or outside, so its moments are exact
+//	* cells the surface may cross are split, one level at a time, and counted by how far their center is inside
+//	* the error of that estimate shrinks about 4x per level, so the change from one level to the next gives both
+//	  an error estimate and a Richardson extrapolation of the result
+// It stops once the volume, centroid and inertia are all within tolerance: relative for the volume and inertia,
+// and in units of the creature's size (the cube root of its volume) for the centroid.
+// Every level is split across threads with Model::parallel_for.
+class CreatureMass
+{
+public:
+	float volume;
+	XMFLOAT3 centroid;
+	XMFLOAT3X3 inertia;		// About the centroid
+	float volumeError;		// Estimated error of volume
+	float centroidError;	// Estimated distance from centroid to the exact one
+	float inertiaError;		// Estimated error of inertia, as a Frobenius norm
+	UINT levels;			// Octree levels that were evaluated
+
+	CreatureMass(const SDF& sdf, const D3D12_RAYTRACING_AABB& bounds, float tolerance = 0.01f, UINT numThreads = 0);
+	// Any shape, distance being its signed distance (negative inside). It is called from several threads at once.
+	CreatureMass(const std::function<float(const XMFLOAT3&)>& distance, const D3D12_RAYTRACING_AABB& bounds, float tolerance = 0.01f,
+		UINT numThreads = 0);
+};
@@ -0,0 +1,178 @@
+#include "stdafx.h"
+#include "CreatureScene.h"
+
+// The original single-creature scene used a 20x20x20 AABB scaled by 6, i.e. this half-width in creature space.
+static const float c_defaultHalfExtent = 10.0f / 6.0f;
+
+CreatureScene::CreatureScene()
+{
+	reset(1);
+}
+
+CreatureScene::~CreatureScene()
+{
+}
+
+void CreatureScene::reset(UINT numSlots)
+{
+	D3D12_RAYTRACING_AABB defaultBounds = {
+		-c_defaultHalfExtent, -c_defaultHalfExtent, -c_defaultHalfExtent,
+		c_defaultHalfExtent, c_defaultHalfExtent, c_defaultHalfExtent };
+
+	instances.clear();
+	slotBounds.assign(max(numSlots, 1u), { defaultBounds });
+	rebuildBoxes();
+}
+
+UINT CreatureScene::addInstance(UINT bufferSlot, XMFLOAT3 position, float yaw, float scale)
+{
+	assert(bufferSlot < slotCount());
+
+	CreatureInstance instance;
+	instance.position = position;
+	instance.yaw = yaw;
+	instance.scale = scale;
+	instance.bufferSlot = bufferSlot;
+	instances.push_back(instance);
+	rebuildBoxes();
+	return instanceCount() - 1;
+}
+
+void CreatureScene::scatter(UINT numInstances, XMFLOAT3 center, float spacing, float scale)
+{
+	const UINT side = UINT(std::ceil(std::sqrt(float(numInstances))));
+	const float halfWidth = 0.5f * (side - 1) * spacing;
+
+	for (UINT i = 0; i < numInstances; i++)
+	{
+		UINT row = i / side;
+		UINT col = i % side;
+		XMFLOAT3 position = XMFLOAT3(center.x + col * spacing - halfWidth, center.y, center.z + row * spacing - halfWidth);
+
+		// Golden angle so neighbours never face the same way
+		float yaw = std::fmod(i * 137.5f, 360.0f);
+		addInstance(i % slotCount(), position, yaw, scale);
+	}
+}
+
+void CreatureScene::restOnGround(UINT slot, float lowestPoint, float groundHeight)
+{
+	for (CreatureInstance& instance : instances)
+	{
+		if (instance.bufferSlot == slot)
+		{
+			instance.position.y = groundHeight - instance.scale * lowestPoint;
+		}
+	}
+}
+
+void CreatureScene::setSlotBounds(UINT slot, const std::vector<D3D12_RAYTRACING_AABB>& bounds)
+{
+	assert(!bounds.empty());
+	slotBounds[slot] = bounds;
+	rebuildBoxes();
+}
+
+const std::vector<D3D12_RAYTRACING_AABB>& CreatureScene::getSlotBounds(UINT slot) const
+{
+	return slotBounds[slot];
+}
+
+// Boxes are ordered by instance, so all boxes of a creature are next to each other in the top-level AS
+void CreatureScene::rebuildBoxes()
+{
+	boxes.clear();
+	for (UINT i = 0; i < instanceCount(); i++)
+	{
+		for (UINT b = 0; b < slotBounds[instances[i].bufferSlot].size(); b++)
+		{
+			boxes.push_back({ i, b });
+		}
+	}
+}
+
+UINT CreatureScene::instanceCount() const
+{
+	return static_cast<UINT>(instances.size());
+}
+
+UINT CreatureScene::slotCount() const
+{
+	return static_cast<UINT>(slotBounds.size());
+}
+
+UINT CreatureScene::boxCount() const
+{
+	return static_cast<UINT>(boxes.size());
+}
+
+const CreatureInstance& CreatureScene::getInstance(UINT instanceIndex) const
+{
+	return instances[instanceIndex];
+}
+
+const CreatureBox& CreatureScene::getBox(UINT box) const
+{
+	return boxes[box];
+}
+
+XMMATRIX CreatureScene::creatureToWorld(UINT instanceIndex) const
+{
+	const CreatureInstance& instance = instances[instanceIndex];
+	XMMATRIX mScale = XMMatrixScaling(instance.scale, instance.scale, instance.scale);
+	XMMATRIX mRotation = XMMatrixRotationY(XMConvertToRadians(instance.yaw));
+	XMMATRIX mTranslation = XMMatrixTranslation(instance.position.x, instance.position.y, instance.position.z);
+	return mScale * mRotation * mTranslation;
+}
+
+XMMATRIX CreatureScene::boxToCreature(UINT box) const
+{
+	const CreatureBox& creatureBox = boxes[box];
+	const D3D12_RAYTRACING_AABB& bounds = slotBounds[instances[creatureBox.instanceIndex].bufferSlot][creatureBox.boxIndex];
+
+	// Guard against flat boxes so the transform stays invertible
+	const float minHalfExtent = 1e-4f;
+	XMMATRIX mScale = XMMatrixScaling(
+		max(0.5f * (bounds.MaxX - bounds.MinX), minHalfExtent),
+		max(0.5f * (bounds.MaxY - bounds.MinY), minHalfExtent),
+		max(0.5f * (bounds.MaxZ - bounds.MinZ), minHalfExtent));
+	XMMATRIX mTranslation = XMMatrixTranslation(
+		0.5f * (bounds.MinX + bounds.MaxX),
+		0.5f * (bounds.MinY + bounds.MaxY),
+		0.5f * (bounds.MinZ + bounds.MaxZ));
+	return mScale * mTranslation;
+}
+
+XMMATRIX CreatureScene::instanceTransform(UINT box) const
+{
+	return boxToCreature(box) * creatureToWorld(boxes[box].instanceIndex);
+}
+
+D3D12_RAYTRACING_AABB CreatureScene::worldBounds(UINT box) const
+{
+	// Transform the 8 corners of the unit box and take their extent
+	XMMATRIX mTransform = instanceTransform(box);
+	XMVECTOR vMin = XMVectorReplicate(FLT_MAX);
+	XMVECTOR vMax = XMVectorReplicate(-FLT_MAX);
+	for (int corner = 0; corner < 8; corner++)
+	{
+		XMVECTOR p = XMVectorSet(
+			(corner & 1) ? 1.0f : -1.0f,
+			(corner & 2) ? 1.0f : -1.0f,
+			(corner & 4) ? 1.0f : -1.0f,
+			1.0f);
+		p = XMVector3TransformCoord(p, mTransform);
+		vMin = XMVectorMin(vMin, p);
+		vMax = XMVectorMax(vMax, p);
+	}
+
+	D3D12_RAYTRACING_AABB aabb;
+	XMStoreFloat3(reinterpret_cast<XMFLOAT3*>(&aabb.MinX), vMin);
+	XMStoreFloat3(reinterpret_cast<XMFLOAT3*>(&aabb.MaxX), vMax);
+	return aabb;
+}
+
+D3D12_RAYTRACING_AABB CreatureScene::unitAABB()
+{
+	return { -1.0f, -1.0f, -1.0f, 1.0f, 1.0f, 1.0f };
+}
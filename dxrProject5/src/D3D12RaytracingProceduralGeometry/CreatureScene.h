@@ -0,0 +1,91 @@
+#pragma once
+
+using namespace DirectX;
+
+// One creature placed in the scene. Instances that share a buffer slot render the same
+// generated creature and only differ by their transform.
+struct CreatureInstance
+{
+	XMFLOAT3 position;	// World space
+	float yaw;			// Degrees about +y
+	float scale;		// Creature space to world space
+	UINT bufferSlot;	// Index into the creature structured buffers (InstanceID() in the shaders)
+};
+
+// One top-level instance: a single bounding box of a creature instance.
+struct CreatureBox
+{
+	UINT instanceIndex;	// Into the creature instances
+	UINT boxIndex;		// Into the bounds of the instance's buffer slot
+};
+
+// Holds every creature instance in the scene and builds the top-level instance descs for them.
+// Every buffer slot has one or more creature space boxes (the whole creature, or its head, spine and limbs),
+// and every box of every instance becomes one top-level instance. They all reference the same procedural
+// BLAS: a single unit AABB ([-1, 1] on every axis) that each instance transform stretches over its box.
+// The shaders then use
+//	* InstanceIndex() to find the per-box attributes (unit box <-> creature space)
+//	* InstanceID() to find the creature buffers (head/spine, appendages, limbs, rotations)
+// so a whole crowd is traced in one DispatchRays with a fixed number of shader records.
+class CreatureScene
+{
+private:
+	std::vector<CreatureInstance> instances;
+	std::vector<std::vector<D3D12_RAYTRACING_AABB>> slotBounds;	// Creature space boxes per buffer slot
+	std::vector<CreatureBox> boxes;									// Every box of every instance, in top-level order
+
+	void rebuildBoxes();
+
+public:
+	CreatureScene();
+	~CreatureScene();
+
+	// Removes every instance and resizes the slots, resetting their bounds to a single default box
+	void reset(UINT numSlots);
+	UINT addInstance(UINT bufferSlot, XMFLOAT3 position, float yaw, float scale);
+
+	// Places numInstances creatures on a square grid centered on center, cycling through the slots
+	void scatter(UINT numInstances, XMFLOAT3 center, float spacing, float scale);
+	// Moves every instance of the slot up or down so that lowestPoint (creature space y) sits at groundHeight
+	void restOnGround(UINT slot, float lowestPoint, float groundHeight);
+
+	// Every instance of the slot gets one top-level instance per box
+	void setSlotBounds(UINT slot, const std::vector<D3D12_RAYTRACING_AABB>& bounds);
+	const std::vector<D3D12_RAYTRACING_AABB>& getSlotBounds(UINT slot) const;
+
+	UINT instanceCount() const;
+	UINT slotCount() const;
+	// Number of top-level creature instances, i.e. boxes over all instances
+	UINT boxCount() const;
+	const CreatureInstance& getInstance(UINT instanceIndex) const;
+	const CreatureBox& getBox(UINT box) const;
+
+	// Creature space -> world space
+	XMMATRIX creatureToWorld(UINT instanceIndex) const;
+	// Unit box (BLAS space) -> creature space
+	XMMATRIX boxToCreature(UINT box) const;
+	// Unit box (BLAS space) -> world space. This is the instance desc transform.
+	XMMATRIX instanceTransform(UINT box) const;
+	// World space bounds of a box; the same box the top-level build computes per leaf
+	D3D12_RAYTRACING_AABB worldBounds(UINT box) const;
+
+	static D3D12_RAYTRACING_AABB unitAABB();
+
+	// Fills instanceDescs[0 .. boxCount()) for either D3D12_RAYTRACING_INSTANCE_DESC (DXR) or
+	// D3D12_RAYTRACING_FALLBACK_INSTANCE_DESC (Fallback Layer). This is CPU only, so the output can
+	// also be handed to the Fallback Layer's CPU builder with blasAddress holding a CPU pointer.
+	template <class InstanceDescType, class BLASPtrType>
+	void buildInstanceDescs(BLASPtrType blasAddress, UINT hitGroupIndex, InstanceDescType* instanceDescs) const
+	{
+		for (UINT i = 0; i < boxCount(); i++)
+		{
+			auto& instanceDesc = instanceDescs[i];
+			instanceDesc = {};
+			instanceDesc.InstanceID = instances[boxes[i].instanceIndex].bufferSlot;
+			instanceDesc.InstanceMask = 1;
+			instanceDesc.InstanceContributionToHitGroupIndex = hitGroupIndex;
+			instanceDesc.AccelerationStructure = blasAddress;
+			XMStoreFloat3x4(reinterpret_cast<XMFLOAT3X4*>(instanceDesc.Transform), instanceTransform(i));
+		}
+	}
+};
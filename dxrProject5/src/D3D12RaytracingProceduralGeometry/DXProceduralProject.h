@@ -13,7 +13,15 @@
 #include "DirectXRaytracingHelper.h"
 #include "PerformanceTimers.h"
 #include "MeshLoader.h"
+#include "MeshCache.h"
+#include "GltfExporter.h"
+#include "VertexPacking.h"
+#include "TextureCache.h"
 #include "March.h"
+#include "CreatureScene.h"
+#include "Skeleton.h"
+#include "CreatureGait.h"
+#include "CreatureMass.h"
 
 // Fallback Layer uses DirectX Raytracing if a driver and OS supports it. 
 // Otherwise, it falls back to compute pipeline to emulate raytracing.
@@ -41,6 +49,11 @@ public:
 
 	// Marching Cubes
 	void OnMarchCubes();
+	// Writes the marched creature, its material and its skin to a .glb file, and while the gait runs the
+	// current frame skinned on the CPU to creature_posed.glb
+	void OnExportGltf();
+	// Writes the quality and build times of the creature's BVH at several resolutions to bvh_report.json
+	void OnBvhReport();
 
     virtual IDXGISwapChain* GetSwapchain() { return m_deviceResources->GetSwapChain(); }
 
@@ -48,6 +61,15 @@ private:
 	// For Marching Cubes
 	Cases cases;
 	SDF sdf;
+	// The marched mesh skinned to the creature's skeleton, so posing it does not need another march
+	Skeleton m_skeleton;
+	Skin m_creatureSkin;
+	std::vector<UINT> m_creatureIndices;	// Triangles of the marched mesh, into the skin's vertices
+	// Coarser triangle lists of the marched mesh for distant creatures and previews, exported next to
+	// creature.glb as creature_lod1.glb and on. They index the same vertices as the full mesh.
+	std::vector<Model::MeshLod> m_creatureLods;
+	const bool c_exportQuantized = true;	// KHR_mesh_quantization: about 30% smaller files, for viewers that support it
+	bool m_exportWhileMarching;				// Stream creature.ply and creature.stl out as the mesher goes
 
     static const UINT FrameCount = 3;
 
@@ -88,6 +110,21 @@ private:
 	int m_numLimbs;
 	int m_headType;
 
+	// Creature instances in the TLAS. Each one references the unit AABB in the procedural BLAS.
+	CreatureScene m_creatureScene;
+	UINT m_crowdSize;					// Number of creatures in crowd mode, 0 = single creature
+	const UINT c_crowdCreatures = 64;	// Crowd size the N key switches to
+	const UINT c_crowdSlots = 4;		// Distinct creatures generated for a crowd
+	const float c_crowdScale = 2.0f;	// Creature space to world space scale in a crowd
+	const float c_crowdSpacing = 8.0f;	// Distance between neighbouring creatures in a crowd
+	bool m_creaturesGenerated;			// False until the creature buffers hold a creature for every slot
+	bool m_creatureBoundsChanged;		// The top-level AS has to be rebuilt around the new bounds
+	bool m_splitCreatureParts;			// One box per head, spine and limb instead of one per creature
+	std::vector<CreatureGait> m_gaits;	// Walk cycle of every buffer slot
+	std::vector<CreatureMass> m_creatureMass;	// Of every buffer slot, in its rest pose
+	bool m_animateGait;
+	float m_gaitTime;
+
     StructuredBuffer<HeadSpineInfoBuffer> m_headSpineBuffer;
     StructuredBuffer<AppendageInfoBuffer> m_appenBuffer;
     StructuredBuffer<LimbInfoBuffer> m_limbBuffer;
@@ -96,6 +133,9 @@ private:
 	D3DBuffer m_textureBuffer;
 	ID3D12Resource* m_textureBufferUploadHeap;
 	D3D12_RESOURCE_DESC m_textureDesc;
+	const bool c_compressTextures = true;	// Upload images block compressed, cached next to them, when their size allows
+	const Model::BlockFormat c_textureFormat = Model::BlockFormat::BC7;
+	const bool c_textureMips = false;	// Build the full mip chain; the top level alone ingests a 4K image in under half the time
 
     // Local root constant buffers
     PrimitiveConstantBuffer m_planeMaterialCB;
@@ -104,12 +144,21 @@ private:
     // Geometry
     D3DBuffer m_indexBuffer;
     D3DBuffer m_vertexBuffer;
+    UINT m_indexCount;
+    std::string m_meshPath;	// OBJ loaded in place of the plane, set with -mesh. Empty for the plane.
+    DXGI_FORMAT m_indexFormat;	// DXGI_FORMAT_R16_UINT or DXGI_FORMAT_R32_UINT, whichever the loaded mesh needed
+    const bool c_packMeshVertices = false;	// Upload imported meshes as 12 byte PackedVertex instead of 32 byte Vertex
+    bool m_verticesPacked;					// m_vertexBuffer holds PackedVertex, relative to m_vertexPacking
+    Model::PackingBounds m_vertexPacking;
+    ComPtr<ID3D12Resource> m_positionBuffer;	// Float positions of a packed mesh, for the bottom-level AS build only
     D3DBuffer m_aabbBuffer;
 
     // Acceleration structure
     ComPtr<ID3D12Resource> m_bottomLevelAS[BottomLevelASType::Count];
     ComPtr<ID3D12Resource> m_topLevelAS; // if DXR
 	WRAPPED_GPU_POINTER m_fallbackTopLevelAccelerationStructurePointer; // else, we use this one for the FL
+	// Descriptors of the FL's wrapped pointers, kept so that rebuilding the top-level AS reuses them
+	UINT m_accelerationStructureDescriptorHeapIndices[BottomLevelASType::Count + 1];
 
     // Raytracing output (i.e a frame buffer)
     ComPtr<ID3D12Resource> m_raytracingOutput;
@@ -153,10 +202,16 @@ private:
 	void CreateConstantBuffers();
 	void CreateAABBPrimitiveAttributesBuffers();
     void CreateCreatureBuffers();
-	void CreateTextureBuffers(std::string file);
+	void CreateTextureBuffers(std::string file);	// Not called yet: no shader samples g_texture
 	void UpdateCameraMatrices();
 	void UpdateAABBPrimitiveAttributes(float animationTime);
     void UpdateCreatureAttributes();
+    void UpdateCreatureBounds();
+	void UpdateCreatureGaits(float animationTime);
+	void RestCreatureGaits();
+	void MarkCreatureGaitDirty(UINT slot, const DirtyRange& jointLocs, const DirtyRange& rotations);
+    void BuildCreatureScene();
+	void PlaceCrowd();
 
 	// DXR-RootSignature.cpp
 	void CreateRootSignatures();
@@ -181,6 +236,7 @@ private:
 	void BuildBottomLevelASInstanceDescs(BLASPtrType *bottomLevelASaddresses, ComPtr<ID3D12Resource>* instanceDescsResource);
 	AccelerationStructureBuffers BuildTopLevelAS(AccelerationStructureBuffers bottomLevelAS[BottomLevelASType::Count], D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS buildFlags = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE);
 	void BuildAccelerationStructures();
+	void RebuildTopLevelAS();
 
 	// DXR-ShaderTable.cpp
 	void BuildShaderTables();
@@ -189,13 +245,13 @@ private:
 	void DoRaytracing();
 
 	// DXR-Common.cpp
-	void AllocateUploadBuffer(ID3D12Device* pDevice, void *pData, UINT64 datasize, ID3D12Resource **ppResource,
+	void AllocateUploadBuffer(ID3D12Device* pDevice, const void *pData, UINT64 datasize, ID3D12Resource **ppResource,
 		const wchar_t* resourceName = nullptr);
 	void AllocateUAVBuffer(ID3D12Device* pDevice, UINT64 bufferSize, ID3D12Resource **ppResource,
 		D3D12_RESOURCE_STATES initialResourceState = D3D12_RESOURCE_STATE_COMMON, const wchar_t* resourceName = nullptr);
 	UINT AllocateDescriptor(D3D12_CPU_DESCRIPTOR_HANDLE* cpuDescriptor, UINT descriptorIndexToUse = UINT_MAX);
 	UINT CreateBufferSRV(D3DBuffer* buffer, UINT numElements, UINT elementSize);
-	WRAPPED_GPU_POINTER CreateFallbackWrappedPointer(ID3D12Resource* resource, UINT bufferNumElements);
+	WRAPPED_GPU_POINTER CreateFallbackWrappedPointer(ID3D12Resource* resource, UINT bufferNumElements, UINT* descriptorHeapIndex = nullptr);
     
 	// DXR-Other.cpp
 	void CreateRaytracingInterfaces();
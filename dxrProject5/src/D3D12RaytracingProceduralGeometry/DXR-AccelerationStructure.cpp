@@ -35,13 +35,16 @@ void DXProceduralProject::BuildGeometryDescsForBottomLevelAS(array<vector<D3D12_
 		geometryDesc.Type = D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES;
 		geometryDesc.Flags = geometryFlags;
 		geometryDesc.Triangles.Transform3x4 = NULL; // assuming vertices given world space positions
-        geometryDesc.Triangles.IndexFormat = DXGI_FORMAT_R16_UINT;
+        geometryDesc.Triangles.IndexFormat = m_indexFormat;
         geometryDesc.Triangles.VertexFormat = DXGI_FORMAT_R32G32B32_FLOAT;
-		geometryDesc.Triangles.IndexCount = m_indexBuffer.resource->GetDesc().Width / sizeof(Index);
-		geometryDesc.Triangles.VertexCount = m_vertexBuffer.resource->GetDesc().Width / sizeof(Vertex);
+		geometryDesc.Triangles.IndexCount = m_indexCount;
 		geometryDesc.Triangles.IndexBuffer = m_indexBuffer.resource->GetGPUVirtualAddress();
-		geometryDesc.Triangles.VertexBuffer.StartAddress = m_vertexBuffer.resource->GetGPUVirtualAddress();
-		geometryDesc.Triangles.VertexBuffer.StrideInBytes = sizeof(Vertex);
+		// Packed vertices are built from their decoded float positions, see BuildMeshGeometry()
+		ID3D12Resource* positions = m_verticesPacked ? m_positionBuffer.Get() : m_vertexBuffer.resource.Get();
+		UINT positionStride = m_verticesPacked ? sizeof(XMFLOAT3) : sizeof(Vertex);
+		geometryDesc.Triangles.VertexCount = UINT(positions->GetDesc().Width / positionStride);
+		geometryDesc.Triangles.VertexBuffer.StartAddress = positions->GetGPUVirtualAddress();
+		geometryDesc.Triangles.VertexBuffer.StrideInBytes = positionStride;
 	}
 
 	{
@@ -166,8 +169,11 @@ void DXProceduralProject::BuildBottomLevelASInstanceDescs(BLASPtrType *bottomLev
 {
 	auto device = m_deviceResources->GetD3DDevice();
 
+	// Creature boxes come first so that InstanceIndex() in the shaders indexes m_aabbPrimitiveAttributeBuffer directly.
+	// The plane goes last.
+	const UINT numCreatureBoxes = m_creatureScene.boxCount();
 	vector<InstanceDescType> instanceDescs;
-	instanceDescs.resize(NUM_BLAS);
+	instanceDescs.resize(numCreatureBoxes + 1);
 
 	// Bottom-level AS for the plane instance.
 	{
@@ -179,7 +185,7 @@ void DXProceduralProject::BuildBottomLevelASInstanceDescs(BLASPtrType *bottomLev
 			NUM_AABB.z * c_aabbWidth + (NUM_AABB.z - 1) * c_aabbDistance);
 		const XMVECTOR vWidth = XMLoadFloat3(&fWidth);
 
-		auto& instanceDesc = instanceDescs[BottomLevelASType::Triangle];
+		auto& instanceDesc = instanceDescs[numCreatureBoxes];
 		instanceDesc = {};
 		instanceDesc.InstanceMask = 1;
 		instanceDesc.InstanceContributionToHitGroupIndex = 0;
@@ -195,6 +201,12 @@ void DXProceduralProject::BuildBottomLevelASInstanceDescs(BLASPtrType *bottomLev
 		XMMATRIX mTranslation = XMMatrixTranslationFromVector(vBasePosition);
 		XMMATRIX mTransform = mScale * mTranslation;
 
+		// A mesh loaded with -mesh keeps its own coordinates
+		if (!m_meshPath.empty())
+		{
+			mTransform = XMMatrixIdentity();
+		}
+
 		// Store the transform in the instanceDesc.
 		XMStoreFloat3x4(reinterpret_cast<XMFLOAT3X4*>(instanceDesc.Transform), mTransform);
 	}
@@ -204,18 +216,8 @@ void DXProceduralProject::BuildBottomLevelASInstanceDescs(BLASPtrType *bottomLev
 	//		For triangles, we have 1 shader record for radiance rays, and another for shadow rays.
 	//		Where do you think procedural shader records would start then? Hint: right after.
 	// * Make each instance hover above the ground by ~ half its width
-	{
-		auto& instanceDesc = instanceDescs[BottomLevelASType::AABB];
-		instanceDesc = {};
-		instanceDesc.InstanceMask = 1;
-		instanceDesc.InstanceContributionToHitGroupIndex = 2;
-		instanceDesc.AccelerationStructure = bottomLevelASaddresses[BottomLevelASType::AABB];
-
-		const XMVECTOR hoverPos = XMLoadFloat3(&XMFLOAT3(0.0f, c_aabbWidth * 0.5f, 0.0f));
-		XMMATRIX mTranslation = XMMatrixTranslationFromVector(hoverPos);
-		// Store the transform in the instanceDesc.
-		XMStoreFloat3x4(reinterpret_cast<XMFLOAT3X4*>(instanceDesc.Transform), mTranslation);
-	}
+	// Every creature box is an instance of the same unit AABB, see CreatureScene::buildInstanceDescs().
+	m_creatureScene.buildInstanceDescs(bottomLevelASaddresses[BottomLevelASType::AABB], RayType::Count, instanceDescs.data());
 
 	// Upload all these instances to the GPU, and make sure the resouce is set to instanceDescsResource.
 	UINT64 bufferSize = static_cast<UINT64>(instanceDescs.size() * sizeof(instanceDescs[0]));
@@ -239,7 +241,7 @@ AccelerationStructureBuffers DXProceduralProject::BuildTopLevelAS(AccelerationSt
 	D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS &topLevelInputs = topLevelBuildDesc.Inputs;
 	topLevelInputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL;
 	topLevelInputs.Flags = buildFlags;
-	topLevelInputs.NumDescs = 2;
+	topLevelInputs.NumDescs = m_creatureScene.boxCount() + 1; // creature boxes + plane
 	topLevelInputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
 	//topLevelInputs.InstanceDescs = ; DO DOWN BELOW
 
@@ -293,8 +295,8 @@ AccelerationStructureBuffers DXProceduralProject::BuildTopLevelAS(AccelerationSt
 		D3D12_RAYTRACING_FALLBACK_INSTANCE_DESC instanceDescs[BottomLevelASType::Count] = {};
 		WRAPPED_GPU_POINTER bottomLevelASaddresses[BottomLevelASType::Count] =
 		{
-			CreateFallbackWrappedPointer(bottomLevelAS[0].accelerationStructure.Get(), static_cast<UINT>(bottomLevelAS[0].ResultDataMaxSizeInBytes) / sizeof(UINT32)),
-			CreateFallbackWrappedPointer(bottomLevelAS[1].accelerationStructure.Get(), static_cast<UINT>(bottomLevelAS[1].ResultDataMaxSizeInBytes) / sizeof(UINT32))
+			CreateFallbackWrappedPointer(bottomLevelAS[0].accelerationStructure.Get(), static_cast<UINT>(bottomLevelAS[0].ResultDataMaxSizeInBytes) / sizeof(UINT32), &m_accelerationStructureDescriptorHeapIndices[0]),
+			CreateFallbackWrappedPointer(bottomLevelAS[1].accelerationStructure.Get(), static_cast<UINT>(bottomLevelAS[1].ResultDataMaxSizeInBytes) / sizeof(UINT32), &m_accelerationStructureDescriptorHeapIndices[1])
 		};
 
 		// TODO-2.6: Call the fallback-templated version of BuildBottomLevelASInstanceDescs() you completed above.
@@ -317,7 +319,7 @@ AccelerationStructureBuffers DXProceduralProject::BuildTopLevelAS(AccelerationSt
 	if (m_raytracingAPI == RaytracingAPI::FallbackLayer)
 	{
 		UINT numBufferElements = static_cast<UINT>(topLevelPrebuildInfo.ResultDataMaxSizeInBytes) / sizeof(UINT32);
-		m_fallbackTopLevelAccelerationStructurePointer = CreateFallbackWrappedPointer(topLevelAS.Get(), numBufferElements);
+		m_fallbackTopLevelAccelerationStructurePointer = CreateFallbackWrappedPointer(topLevelAS.Get(), numBufferElements, &m_accelerationStructureDescriptorHeapIndices[BottomLevelASType::Count]);
 	}
 
 	// TODO-2.6: fill in the topLevelBuildDesc. Read about D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC.
@@ -399,4 +401,32 @@ void DXProceduralProject::BuildAccelerationStructures()
 	m_bottomLevelAS[0] = bottomLevelAS[0].accelerationStructure;
 	m_bottomLevelAS[1] = bottomLevelAS[1].accelerationStructure;
 	m_topLevelAS = topLevelAS.accelerationStructure;
-}
\ No newline at end of file
+
+	// Only the build read the float positions of a packed mesh
+	m_positionBuffer.Reset();
+}
+
+// The creature boxes moved but there are as many of them, so only the instance transforms changed. The bottom-level
+// ASes (the plane and the unit box every creature box instances) and everything else stay, only the top-level AS is
+// rebuilt. m_aabbPrimitiveAttributeBuffer follows the boxes on its own, it is rewritten every frame.
+void DXProceduralProject::RebuildTopLevelAS()
+{
+	auto commandList = m_deviceResources->GetCommandList();
+	auto commandAllocator = m_deviceResources->GetCommandAllocator();
+
+	// The frame in flight may still be tracing the old one
+	m_deviceResources->WaitForGpu();
+	commandList->Reset(commandAllocator, nullptr);
+
+	AccelerationStructureBuffers bottomLevelAS[BottomLevelASType::Count];
+	for (UINT i = 0; i < BottomLevelASType::Count; i++)
+	{
+		bottomLevelAS[i].accelerationStructure = m_bottomLevelAS[i];
+		bottomLevelAS[i].ResultDataMaxSizeInBytes = m_bottomLevelAS[i]->GetDesc().Width;
+	}
+	AccelerationStructureBuffers topLevelAS = BuildTopLevelAS(bottomLevelAS);
+
+	m_deviceResources->ExecuteCommandList();
+	m_deviceResources->WaitForGpu();
+	m_topLevelAS = topLevelAS.accelerationStructure;
+}
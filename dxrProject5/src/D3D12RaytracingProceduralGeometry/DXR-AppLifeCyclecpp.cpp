@@ -2,6 +2,9 @@
 #include "DXProceduralProject.h"
 #include "CompiledShaders\Raytracing.hlsl.h"
 #include "Mesh.h"
+#include "CreatureBounds.h"
+#include <fstream>
+#include "..\..\Libraries\D3D12RaytracingFallback\src\RaytracingCompatibilityDebug.h"
 //#include "SDFfucns.h"
 //#include "CubePieces.h"
 
@@ -30,12 +33,11 @@ void DXProceduralProject::OnInit()
 	m_deviceResources->CreateWindowSizeDependentResources();
 
 	InitializeScene();
+	BuildCreatureScene();
 
 	CreateDeviceDependentResources();
 	CreateWindowSizeDependentResources();
 
-    UpdateCreatureAttributes();
-
 	//std::vector<Model::Mesh> meshes = Model::MeshLoader::load_obj();
 }
 
@@ -80,6 +82,13 @@ void DXProceduralProject::OnUpdate()
 	}
 	UpdateAABBPrimitiveAttributes(m_animateGeometryTime);
 	m_sceneCB->elapsedTime = m_animateGeometryTime;
+
+	// Walk the creatures' limbs.
+	if (m_animateGait)
+	{
+		m_gaitTime += elapsedTime;
+		UpdateCreatureGaits(m_gaitTime);
+	}
 }
 
 // LOOKAT-1.8.0: Render the scene. Note the very important call to DoRaytracing() that you 
@@ -142,10 +151,35 @@ void DXProceduralProject::OnMarchCubes() {
 	setAppenBuffer(m_appenBuffer);
 	setLimbBuffer(m_limbBuffer);
 	setLimbBuffer(m_rotBuffer);*/
-	March currMarch = March(vec3(1.7, 1.7, 1.8), vec3(0.0, -0.1, -0.2), 10.0, &cases, &sdf);
+	// Over the whole creature, limbs included. Any coarser and the thinnest legs fall between the grid points.
+	CreatureBounds bounds(m_headSpineBuffer[0], m_appenBuffer[0], m_limbBuffer[0]);
+	March currMarch = March(bounds.creature(), 20.0, &cases, &sdf);
 	currMarch.testVertexSDFs();
 	currMarch.testBoxValues();
-	currMarch.setTriangles();
+	Model::PlyWriter ply;
+	Model::StlWriter stl;
+	std::vector<Model::MeshStreamWriter*> writers;
+	if (m_exportWhileMarching) {
+		if (ply.open("creature.ply", true)) writers.push_back(&ply);
+		if (stl.open("creature.stl")) writers.push_back(&stl);
+	}
+	currMarch.setTriangles(writers);
+	for (Model::MeshStreamWriter* writer : writers) {
+		if (!writer->close()) {
+			OutputDebugStringA((writer == &ply) ? "Could not write creature.ply\n" : "Could not write creature.stl\n");
+		}
+	}
+	Model::MeshOptimizeReport report = currMarch.optimizeTriangles();
+	OutputDebugStringA(Model::format_report("Marched creature", report).c_str());
+	m_creatureLods = currMarch.buildLods({ 0.5f, 0.25f, 0.125f });
+	for (auto& lod : m_creatureLods) {
+		OutputDebugStringA(("Creature LOD " + to_string(lod.ratio) + ": " + to_string(lod.indices.size() / 3) +
+			" triangles, error " + to_string(lod.error) + "\n").c_str());
+	}
+
+	m_skeleton = Skeleton(m_headSpineBuffer[0], m_limbBuffer[0]);
+	m_creatureSkin.bind(m_skeleton, currMarch.triVerts, currMarch.triNorms);
+	m_creatureIndices = currMarch.triIndices;
 
 	float num = sdf.sceneSDF(vec3(0.0, 0.0, 0.0));
 	float num2 = sdf.sceneSDF(vec3(15.0, 10.0, 0.0));
@@ -155,12 +189,155 @@ void DXProceduralProject::OnMarchCubes() {
 	OutputDebugStringA(LPCSTR((to_string(num2) + "\n").c_str()));
 }
 
+void DXProceduralProject::OnExportGltf() {
+	if (m_creatureIndices.empty()) {
+		OutputDebugStringA("Nothing to export, march the creature first\n");
+		return;
+	}
+
+	// The creature's material, with what the shaders use that glTF has no field for kept in the extras
+	const PrimitiveConstantBuffer& attributes = m_aabbMaterialCB[0];
+	Model::GltfMaterial material;
+	material.name = "creature";
+	material.base_color = attributes.albedo0;
+	material.metallic = 0.0f;
+	// Blinn-Phong exponent to GGX alpha, and alpha to perceptual roughness
+	material.roughness = sqrtf(sqrtf(2.0f / (attributes.specularPower + 2.0f)));
+	auto Color = [](const XMFLOAT4& c) { return std::vector<float>{ c.x, c.y, c.z, c.w }; };
+	material.extras = {
+		{ "albedo0", Color(attributes.albedo0) },
+		{ "albedo1", Color(attributes.albedo1) },
+		{ "albedo2", Color(attributes.albedo2) },
+		{ "albedo3", Color(attributes.albedo3) },
+		{ "whichNoise0", { float(attributes.whichNoise0) } },
+		{ "whichNoise1", { float(attributes.whichNoise1) } },
+		{ "reflectanceCoef", { attributes.reflectanceCoef } },
+		{ "diffuseCoef", { attributes.diffuseCoef } },
+		{ "specularCoef", { attributes.specularCoef } },
+		{ "specularPower", { attributes.specularPower } },
+	};
+
+	// Skinned to the skeleton it was bound to, a joint at the head of every bone, so viewers can pose it
+	static_assert(c_maxBoneInfluences == 4, "glTF skins take four joints per vertex");
+	Model::GltfSkin skin;
+	for (size_t i = 0; i < m_skeleton.bones.size(); i++) {
+		const Bone& bone = m_skeleton.bones[i];
+		skin.joints.push_back({ "bone" + to_string(i), bone.parent, bone.head });
+	}
+	skin.stride = sizeof(SkinWeights);
+
+	// The full creature, then every level of detail in a file of its own with only the vertices it uses.
+	// Without weights the mesh is exported unskinned.
+	auto Export = [&](const std::string& name, const std::vector<XMFLOAT3>& positions, const std::vector<XMFLOAT3>& normals,
+		const std::vector<SkinWeights>& weights, const std::vector<UINT>& indices) {
+		if (!weights.empty()) {
+			skin.vertex_joints = weights[0].bones;
+			skin.vertex_weights = weights[0].weights;
+		}
+		Model::GltfMesh mesh;
+		mesh.name = name;
+		mesh.vertices.positions = &positions[0].x;
+		mesh.vertices.normals = &normals[0].x;
+		mesh.vertices.stride = 3;
+		mesh.vertices.vertex_count = UINT(positions.size());
+		mesh.tex_coords = nullptr;
+		mesh.indices = indices.data();
+		mesh.index_count = UINT(indices.size());
+		mesh.index_size = sizeof(UINT);
+		mesh.material = 0;
+		mesh.skin = (skin.joints.empty() || weights.empty()) ? nullptr : &skin;
+
+		LARGE_INTEGER frequency, start, end;
+		QueryPerformanceFrequency(&frequency);
+		QueryPerformanceCounter(&start);
+		bool written = Model::write_glb(name + ".glb", { mesh }, { material }, c_exportQuantized);
+		QueryPerformanceCounter(&end);
+		double milliseconds = 1000.0 * double(end.QuadPart - start.QuadPart) / double(frequency.QuadPart);
+		OutputDebugStringA(written ? ("Exported " + name + ".glb, " + to_string(mesh.index_count / 3) + " triangles in " + to_string(milliseconds) + " ms\n").c_str()
+			: ("Could not write " + name + ".glb\n").c_str());
+	};
+
+	Export("creature", m_creatureSkin.bindPositions, m_creatureSkin.bindNormals, m_creatureSkin.vertexWeights, m_creatureIndices);
+	for (size_t i = 0; i < m_creatureLods.size(); i++) {
+		if (m_creatureLods[i].indices.empty()) {
+			continue;
+		}
+		std::vector<UINT> indices = m_creatureLods[i].indices;
+		std::vector<UINT> remap;
+		UINT used = Model::optimize_vertex_fetch(indices, m_creatureSkin.vertexCount(), remap);
+		std::vector<XMFLOAT3> positions = m_creatureSkin.bindPositions;
+		std::vector<XMFLOAT3> normals = m_creatureSkin.bindNormals;
+		std::vector<SkinWeights> weights = m_creatureSkin.vertexWeights;
+		Model::remap_vertices(positions, remap, used);
+		Model::remap_vertices(normals, remap, used);
+		Model::remap_vertices(weights, remap, used);
+		Export("creature_lod" + to_string(i + 1), positions, normals, weights, indices);
+	}
+
+	// The frame the gait is at, deformed from the bind pose on the CPU instead of marched again
+	if (m_animateGait) {
+		std::vector<XMFLOAT4> rotations;
+		std::vector<XMFLOAT4X4> skinMatrices;
+		m_skeleton.poseLimbs(m_limbBuffer[0], rotations);
+		m_skeleton.computeSkinMatrices(rotations, skinMatrices);
+		std::vector<XMFLOAT3> positions, normals;
+
+		LARGE_INTEGER frequency, start, end;
+		QueryPerformanceFrequency(&frequency);
+		QueryPerformanceCounter(&start);
+		m_creatureSkin.deform(skinMatrices, positions, normals);
+		QueryPerformanceCounter(&end);
+		double microseconds = 1e6 * double(end.QuadPart - start.QuadPart) / double(frequency.QuadPart);
+		OutputDebugStringA(("Deformed " + to_string(positions.size()) + " vertices in " + to_string(microseconds) + " us\n").c_str());
+		Export("creature_posed", positions, normals, {}, m_creatureIndices);
+	}
+}
+
+void DXProceduralProject::OnBvhReport() {
+	// The current creature marched at several resolutions, built in every CPU builder mode
+	const float divisions[] = { 10.0f, 20.0f, 40.0f, 60.0f };
+	const UINT repeats = 5;
+	sdf = SDF(m_headSpineBuffer, m_appenBuffer, m_limbBuffer, m_rotBuffer);
+	CreatureBounds bounds(m_headSpineBuffer[0], m_appenBuffer[0], m_limbBuffer[0]);
+	std::vector<std::string> names;
+	std::vector<std::vector<float>> vertices;
+	std::vector<std::vector<UINT>> indices;
+	for (float divs : divisions) {
+		March currMarch = March(bounds.creature(), divs, &cases, &sdf);
+		currMarch.testVertexSDFs();
+		currMarch.testBoxValues();
+		currMarch.setTriangles();
+		std::vector<float> positions;
+		positions.reserve(currMarch.triVerts.size() * 3);
+		for (const vec3& v : currMarch.triVerts) {
+			positions.insert(positions.end(), { v[0], v[1], v[2] });
+		}
+		names.push_back("creature_" + to_string(int(divs)));
+		vertices.push_back(std::move(positions));
+		indices.push_back(std::move(currMarch.triIndices));
+	}
+
+	std::vector<AccelerationStructureReportMesh> meshes;
+	for (size_t i = 0; i < names.size(); ++i) {
+		meshes.push_back({ names[i].c_str(), vertices[i].data(), UINT(vertices[i].size() / 3), indices[i].data(), UINT(indices[i].size()) });
+	}
+	std::ofstream output("bvh_report.json");
+	if (!output) {
+		OutputDebugStringA("Could not write bvh_report.json\n");
+		return;
+	}
+	WriteAccelerationStructureBuildReportOnCpu(meshes.data(), UINT(meshes.size()), repeats, output);
+	OutputDebugStringA(("Wrote bvh_report.json, " + to_string(meshes.size()) + " creature meshes\n").c_str());
+}
+
 // Handles all keyboard inputs. You can add fun camera controls here if you wish to.
 void DXProceduralProject::OnKeyDown(UINT8 key)
 {
 	// Store previous values.
 	RaytracingAPI previousRaytracingAPI = m_raytracingAPI;
 	bool previousForceComputeFallback = m_forceComputeFallback;
+	UINT previousCrowdSize = m_crowdSize;
+	UINT previousBoxCount = m_creatureScene.boxCount();
 
 	switch (key)
 	{
@@ -198,12 +375,24 @@ void DXProceduralProject::OnKeyDown(UINT8 key)
 		UpdateCreatureAttributes();
 		break;
 	// more controls
-	case 'M':
-		// insert load a mesh (for demo)
-		UpdateCreatureAttributes();
-		break;
 	case 'E':
-		// insert export to gltf func
+		OnExportGltf();
+		break;
+	case 'Q':
+		OnBvhReport();
+		break;
+	case 'S':
+		m_exportWhileMarching = !m_exportWhileMarching;
+		break;
+	// single creature vs crowd
+	case 'N':
+		m_crowdSize = (m_crowdSize == 0) ? c_crowdCreatures : 0;
+		BuildCreatureScene();
+		break;
+	// one box per creature vs one per head, spine and limb
+	case 'P':
+		m_splitCreatureParts = !m_splitCreatureParts;
+		UpdateCreatureBounds();
 		break;
 	// animation controls
 	case 'C':
@@ -218,6 +407,15 @@ void DXProceduralProject::OnKeyDown(UINT8 key)
 	case 'L':
 		m_animateLight = !m_animateLight;
 		break;
+	// walking limbs need boxes around everything they can reach
+	case 'W':
+		m_animateGait = !m_animateGait;
+		if (!m_animateGait)
+		{
+			RestCreatureGaits();
+		}
+		UpdateCreatureBounds();
+		break;
 	// fallback vs dxr
 	case 'F': // Fallback Layer
 		m_forceComputeFallback = false;
@@ -230,11 +428,19 @@ void DXProceduralProject::OnKeyDown(UINT8 key)
 	}
 
 	if (m_raytracingAPI != previousRaytracingAPI ||
-		m_forceComputeFallback != previousForceComputeFallback)
+		m_forceComputeFallback != previousForceComputeFallback ||
+		m_crowdSize != previousCrowdSize ||
+		m_creatureScene.boxCount() != previousBoxCount)
 	{
-		// Raytracing API selection changed, recreate everything.
+		// Raytracing API selection, creature instances or their number of boxes changed, recreate everything.
 		RecreateD3D();
 	}
+	else if (m_creatureBoundsChanged)
+	{
+		// Only the boxes moved
+		RebuildTopLevelAS();
+		m_creatureBoundsChanged = false;
+	}
 }
 
 // Handle OnSizeChanged message event
@@ -6,7 +6,7 @@ using namespace DX;
 
 // LOOKAT-1.8.1: Allocates an upload buffer. This will take care of transferring data from the CPU to the GPU, and is typically used
 // for data that doesn't change over time. Best use cases are for triangle data (indices + vertices)
-void DXProceduralProject::AllocateUploadBuffer(ID3D12Device* pDevice, void *pData, UINT64 datasize, 
+void DXProceduralProject::AllocateUploadBuffer(ID3D12Device* pDevice, const void *pData, UINT64 datasize, 
 												ID3D12Resource **ppResource, 
 												const wchar_t* resourceName)
 {
@@ -100,7 +100,8 @@ UINT DXProceduralProject::CreateBufferSRV(D3DBuffer* buffer, UINT numElements, U
 }
 
 // Create a wrapped pointer for the Fallback Layer path.
-WRAPPED_GPU_POINTER DXProceduralProject::CreateFallbackWrappedPointer(ID3D12Resource* resource, UINT bufferNumElements)
+// With descriptorHeapIndex, the descriptor it holds is reused and a newly allocated one is stored in it
+WRAPPED_GPU_POINTER DXProceduralProject::CreateFallbackWrappedPointer(ID3D12Resource* resource, UINT bufferNumElements, UINT* descriptorHeapIndex)
 {
 	auto device = m_deviceResources->GetD3DDevice();
 
@@ -113,11 +114,15 @@ WRAPPED_GPU_POINTER DXProceduralProject::CreateFallbackWrappedPointer(ID3D12Reso
 	D3D12_CPU_DESCRIPTOR_HANDLE bottomLevelDescriptor;
 
 	// Only compute fallback requires a valid descriptor index when creating a wrapped pointer.
-	UINT descriptorHeapIndex = 0;
+	UINT descriptorIndex = 0;
 	if (!m_fallbackDevice->UsingRaytracingDriver())
 	{
-		descriptorHeapIndex = AllocateDescriptor(&bottomLevelDescriptor);
+		descriptorIndex = AllocateDescriptor(&bottomLevelDescriptor, descriptorHeapIndex ? *descriptorHeapIndex : UINT_MAX);
 		device->CreateUnorderedAccessView(resource, nullptr, &rawBufferUavDesc, bottomLevelDescriptor);
+		if (descriptorHeapIndex)
+		{
+			*descriptorHeapIndex = descriptorIndex;
+		}
 	}
-	return m_fallbackDevice->GetWrappedPointerSimple(descriptorHeapIndex, resource->GetGPUVirtualAddress());
+	return m_fallbackDevice->GetWrappedPointerSimple(descriptorIndex, resource->GetGPUVirtualAddress());
 }
@@ -29,9 +29,10 @@ void DXProceduralProject::DoRaytracing()
     commandList->SetComputeRootShaderResourceView(GlobalRootSignature::Slot::HeadSpineBuffer, m_headSpineBuffer.GpuVirtualAddress(frameIndex));
     m_appenBuffer.CopyStagingToGpu(frameIndex);
     commandList->SetComputeRootShaderResourceView(GlobalRootSignature::Slot::AppendageBuffer, m_appenBuffer.GpuVirtualAddress(frameIndex));
-    m_limbBuffer.CopyStagingToGpu(frameIndex);
+    // Limbs and rotations change every frame while walking, so only what moved is copied (see UpdateCreatureGaits())
+    m_limbBuffer.CopyDirtyStagingToGpu(frameIndex);
     commandList->SetComputeRootShaderResourceView(GlobalRootSignature::Slot::LimbBuffer, m_limbBuffer.GpuVirtualAddress(frameIndex));
-    m_rotBuffer.CopyStagingToGpu(frameIndex);
+    m_rotBuffer.CopyDirtyStagingToGpu(frameIndex);
     commandList->SetComputeRootShaderResourceView(GlobalRootSignature::Slot::RotBuffer, m_rotBuffer.GpuVirtualAddress(frameIndex));
 
 	// Bind the descriptor heaps.
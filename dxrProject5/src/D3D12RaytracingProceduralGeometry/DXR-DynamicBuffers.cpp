@@ -2,6 +2,7 @@
 #include "DXProceduralProject.h"
 #include "CompiledShaders\Raytracing.hlsl.h"
 #include "Creature.h"
+#include "CreatureBounds.h"
 #include <random>
 
 #define STB_IMAGE_IMPLEMENTATION
@@ -139,8 +140,8 @@ void DXProceduralProject::CreateAABBPrimitiveAttributesBuffers()
 	auto device = m_deviceResources->GetD3DDevice();
 	auto frameCount = m_deviceResources->GetBackBufferCount();
 
-	// second param is num_Elements, the number of aabbs stored in the buffer
-	m_aabbPrimitiveAttributeBuffer.Create(device, IntersectionShaderType::TotalPrimitiveCount, frameCount, L"AABB Primitive Attribute Buffer");
+	// second param is num_Elements, the number of creature boxes in the TLAS (indexed by InstanceIndex())
+	m_aabbPrimitiveAttributeBuffer.Create(device, m_creatureScene.boxCount(), frameCount, L"AABB Primitive Attribute Buffer");
 }
 
 // LOOKAT-2.1: Update camera matrices stored in m_sceneCB.
@@ -169,57 +170,14 @@ void DXProceduralProject::UpdateAABBPrimitiveAttributes(float animationTime)
 {
 	auto frameIndex = m_deviceResources->GetCurrentFrameIndex();
 
-	XMMATRIX mIdentity = XMMatrixIdentity();
-
-	// Different scale matrices
-	XMMATRIX mScale = XMMatrixScaling(6, 6, 6);
-	//XMMATRIX mScale15 = XMMatrixScaling(1.5, 1.5, 1.5);
-	//XMMATRIX mScale2 = XMMatrixScaling(2, 2, 2);
-
-	// Rotation matrix that changes over time
-	XMMATRIX mRotation = XMMatrixRotationY(XMConvertToRadians(0.0f));
-
-	
-	auto SetTransformForAABB = [&](UINT primitiveIndex, XMMATRIX& mScale, XMMATRIX& mRotation)
-	{
-		XMVECTOR vTranslation =
-			0.5f * (XMLoadFloat3(reinterpret_cast<XMFLOAT3*>(&m_aabbs[primitiveIndex].MinX))
-				+ XMLoadFloat3(reinterpret_cast<XMFLOAT3*>(&m_aabbs[primitiveIndex].MaxX))); // i.e middle of AABB.
-		XMMATRIX mTranslation = XMMatrixTranslationFromVector(vTranslation);
-
-		// TODO-2.1: Fill in this lambda function.
-		// It should create a transform matrix that is equal to scale * rotation * translation.
-		// This matrix would transform the AABB from local space to bottom level AS space.
-		// You can infer what the bottom level AS space to local space transform should be.
-		// The intersection shader tests in this project work with local space, but the geometries are provided in bottom level 
-		// AS space. So this data will be used to convert back and forth from these spaces.
-		XMMATRIX locToBLAS = mScale * mRotation * mTranslation;
-		m_aabbPrimitiveAttributeBuffer[primitiveIndex].localSpaceToBottomLevelAS = locToBLAS;
-		m_aabbPrimitiveAttributeBuffer[primitiveIndex].bottomLevelASToLocalSpace = XMMatrixInverse(nullptr, locToBLAS);
-
-        /*m_aabbPrimitiveAttributeBuffer[primitiveIndex].ballPositions[0] = XMFLOAT3(-2, -2, -2);
-        m_aabbPrimitiveAttributeBuffer[primitiveIndex].ballPositions[1] = XMFLOAT3(1, 1, 1);
-        m_aabbPrimitiveAttributeBuffer[primitiveIndex].ballPositions[2] = XMFLOAT3(-1, -1, -1);
-        m_aabbPrimitiveAttributeBuffer[primitiveIndex].ballRadii[0] = 1;
-        m_aabbPrimitiveAttributeBuffer[primitiveIndex].ballRadii[1] = 2;
-        m_aabbPrimitiveAttributeBuffer[primitiveIndex].ballRadii[2] = 1;
-        m_aabbPrimitiveAttributeBuffer[primitiveIndex].numBalls = 3;*/
-	};
-
-	/*UINT offset = 0;
-	// Analytic primitives.
-	{
-		using namespace AnalyticPrimitive;
-		SetTransformForAABB(offset + AABB, mScale15y, mIdentity);
-		SetTransformForAABB(offset + Spheres, mScale15, mRotation);
-		offset += AnalyticPrimitive::Count;
-	}*/
-
-	// Volumetric primitives.
+	// Every creature box shares the unit AABB in the bottom-level AS, and the instance transform
+	// already takes it to world space. So the bottom level AS space here is the unit box, and the local
+	// space is the creature space the SDF is defined in.
+	for (UINT i = 0; i < m_creatureScene.boxCount(); i++)
 	{
-		using namespace VolumetricPrimitive;
-		SetTransformForAABB(Metaballs, mScale, mIdentity);
-		//offset += VolumetricPrimitive::Count;
+		XMMATRIX boxToCreature = m_creatureScene.boxToCreature(i);
+		m_aabbPrimitiveAttributeBuffer[i].localSpaceToBottomLevelAS = XMMatrixInverse(nullptr, boxToCreature);
+		m_aabbPrimitiveAttributeBuffer[i].bottomLevelASToLocalSpace = boxToCreature;
 	}
 }
 
@@ -228,11 +186,12 @@ void DXProceduralProject::CreateCreatureBuffers()
     auto device = m_deviceResources->GetD3DDevice();
     auto frameCount = m_deviceResources->GetBackBufferCount();
 
-    // second param is num_Elements, the number of aabbs stored in the buffer
-    m_headSpineBuffer.Create(device, IntersectionShaderType::TotalPrimitiveCount, frameCount, L"Head Spine Info Buffer");
-    m_appenBuffer.Create(device, IntersectionShaderType::TotalPrimitiveCount, frameCount, L"Head Spine Info Buffer");
-    m_limbBuffer.Create(device, IntersectionShaderType::TotalPrimitiveCount, frameCount, L"Head Spine Info Buffer");
-    m_rotBuffer.Create(device, IntersectionShaderType::TotalPrimitiveCount, frameCount, L"Head Spine Info Buffer");
+    // second param is num_Elements, one per generated creature (indexed by InstanceID())
+    UINT numSlots = m_creatureScene.slotCount();
+    m_headSpineBuffer.Create(device, numSlots, frameCount, L"Head Spine Info Buffer");
+    m_appenBuffer.Create(device, numSlots, frameCount, L"Appendage Info Buffer");
+    m_limbBuffer.Create(device, numSlots, frameCount, L"Limb Info Buffer");
+    m_rotBuffer.Create(device, numSlots, frameCount, L"Rotation Info Buffer");
 }
 
 void DXProceduralProject::UpdateCreatureAttributes()
@@ -282,170 +241,215 @@ void DXProceduralProject::UpdateCreatureAttributes()
     {
         Creature *creature = new Creature();
         creature->generate(0, m_numLimbs, m_headType);
-
-        for (int h = 0; h < min(HEAD_COUNT, creature->head->headData.size()); h++)
-        {
-            m_headSpineBuffer[primitiveIndex].headData[h] = creature->head->headData[h];
-        }
-        for (int sl = 0; sl < min(SPINE_LOC_COUNT, creature->spineLocations.size()); sl++)
-        {
-            m_headSpineBuffer[primitiveIndex].spineLocData[sl] = creature->spineLocations[sl];
-        }
-        for (int sr = 0; sr < min(SPINE_RAD_COUNT, creature->spine->metaBallRadii.size()); sr++)
-        {
-            m_headSpineBuffer[primitiveIndex].spineRadData[sr] = creature->spine->metaBallRadii[sr];
-        }
-
-        m_appenBuffer[primitiveIndex].numAppen = creature->appendages->appendageData[0];
-        for (int a = 0; a < min(APPEN_COUNT, creature->appenBools.size()); a++)
-        {
-            m_appenBuffer[primitiveIndex].appenBools[a] = creature->appenBools[a];
-            m_appenBuffer[primitiveIndex].appenRads[a] = creature->appenRads[a];
-        }
-
-        for (int l = 0; l < min(LIMBLEN_COUNT, creature->limbLengths.size()); l++)
-        {
-            m_limbBuffer[primitiveIndex].limbLengths[l] = creature->limbLengths[l];
-        }
-        for (int jl = 0; jl < min(JOINT_LOC_COUNT, creature->jointLocations.size()); jl++)
-        {
-            m_limbBuffer[primitiveIndex].jointLocData[jl] = creature->jointLocations[jl];
-        }
-        for (int jr = 0; jr < min(JOINT_RAD_COUNT, creature->jointRadii.size()); jr++)
-        {
-            m_limbBuffer[primitiveIndex].jointRadData[jr] = creature->jointRadii[jr];
-        }
-
-        for (int r = 0; r < min(ROT_COUNT, creature->jointRots.size()); r++)
-        {
-            m_rotBuffer[primitiveIndex].rotations[r] = creature->jointRots[r];
-        }
+        creature->fillBuffers(m_headSpineBuffer[primitiveIndex], m_appenBuffer[primitiveIndex], m_limbBuffer[primitiveIndex], m_rotBuffer[primitiveIndex]);
 		delete(creature);
     };
 
-    /*UINT offset = 0;
-    // Analytic primitives.
+    // One creature per buffer slot. Instances sharing a slot render the same creature.
+    m_gaits.resize(m_creatureScene.slotCount());
+    m_creatureMass.clear();
+    for (UINT slot = 0; slot < m_creatureScene.slotCount(); slot++)
     {
-        using namespace AnalyticPrimitive;
-        SetTransformForAABB(offset + AABB, mScale15y, mIdentity);
-        SetTransformForAABB(offset + Spheres, mScale15, mRotation);
-        offset += AnalyticPrimitive::Count;
-    }*/
+        ResetBuffers(slot);
+        SetCreatureBuffers(slot);
+        m_gaits[slot].reset(m_appenBuffer[slot], m_limbBuffer[slot]);
 
-    // Volumetric primitives.
-    {
-        using namespace VolumetricPrimitive;
-		ResetBuffers(Metaballs);
-        SetCreatureBuffers(Metaballs);
-        //offset += VolumetricPrimitive::Count;
+        SDF sdf(m_headSpineBuffer, m_appenBuffer, m_limbBuffer, m_rotBuffer, slot);
+        CreatureBounds bounds(m_headSpineBuffer[slot], m_appenBuffer[slot], m_limbBuffer[slot]);
+        m_creatureMass.push_back(CreatureMass(sdf, bounds.creature()));
     }
+    m_limbBuffer.MarkDirty();
+    m_rotBuffer.MarkDirty();
+    m_creaturesGenerated = true;
+
+    UpdateCreatureBounds();
+    PlaceCrowd();
 }
 
-void DXProceduralProject::CreateTextureBuffers(std::string file)
+// Stands every creature of the crowd on the height the single creature's box rests on, now that their bounds are
+// known. The rest pose is used, so that starting or stopping the gait does not move the creatures.
+void DXProceduralProject::PlaceCrowd()
 {
-	//load image data from file
-	//int imageSize = TextureLoader::LoadImageDataFromFile(&imageData, textureDesc, wpath.c_str(), imageBytesPerRow);
-	int width, height, stride;
-	UINT8* pixels = stbi_load(file.c_str(), &width, &height, &stride, STBI_default);
-	
-	//put in correct format
-	if (!pixels)
+	if (m_crowdSize == 0)
+	{
+		return;
+	}
+	for (UINT slot = 0; slot < m_creatureScene.slotCount(); slot++)
 	{
-		int x = 0;
+		CreatureBounds bounds(m_headSpineBuffer[slot], m_appenBuffer[slot], m_limbBuffer[slot]);
+		m_creatureScene.restOnGround(slot, bounds.creature().MinY, 1.0f + c_aabbWidth * 0.5f);
 	}
+}
 
-	const int numPix = width*height;
-	const int oldStride = stride;
-	const int oldSize = numPix * stride;
-	const int newStride = 4;
-	const int newSize = numPix * newStride;
+// Fits the boxes of every buffer slot to its generated creature, either one box around the whole creature
+// or one per part (m_splitCreatureParts). Rays only march inside these boxes, so the acceleration structures
+// have to be rebuilt afterwards (m_creatureBoundsChanged).
+void DXProceduralProject::UpdateCreatureBounds()
+{
+	for (UINT slot = 0; slot < m_creatureScene.slotCount(); slot++)
+	{
+		CreatureBounds bounds(m_headSpineBuffer[slot], m_appenBuffer[slot], m_limbBuffer[slot], m_animateGait);
+		std::vector<D3D12_RAYTRACING_AABB> boxes = m_splitCreatureParts ? bounds.parts() : std::vector<D3D12_RAYTRACING_AABB>{ bounds.creature() };
+
+#ifdef _DEBUG
+		// Anything the boxes miss would be cut off by the intersection shader
+		SDF sdf(m_headSpineBuffer, m_appenBuffer, m_limbBuffer, m_rotBuffer, slot);
+		assert(CreatureBounds::isConservative(sdf, boxes));
+#endif
+		m_creatureScene.setSlotBounds(slot, boxes);
+	}
+	m_creatureBoundsChanged = true;
+}
 
-	std::vector<UINT8> imgData;
-	for (int i = 0; i < numPix; i++)
+// Steps the walk cycle of every buffer slot. Instances sharing a slot walk in step, so the cost only grows
+// with the number of distinct creatures, and only the joints and rotations that moved are uploaded.
+void DXProceduralProject::UpdateCreatureGaits(float animationTime)
+{
+	for (UINT slot = 0; slot < m_gaits.size(); slot++)
 	{
-		imgData.push_back(pixels[i*oldStride]); //R
-		imgData.push_back(pixels[i*oldStride + 1]); //G
-		imgData.push_back(pixels[i*oldStride + 2]); //B
-		imgData.push_back(0xFF); //A (always 1)
+		DirtyRange jointLocs, rotations;
+		m_gaits[slot].update(animationTime, m_limbBuffer[slot], m_rotBuffer[slot], jointLocs, rotations);
+		MarkCreatureGaitDirty(slot, jointLocs, rotations);
 	}
-	stride = newStride;
+}
 
-	stbi_image_free(pixels);
+// Puts every creature back in its generated pose
+void DXProceduralProject::RestCreatureGaits()
+{
+	for (UINT slot = 0; slot < m_gaits.size(); slot++)
+	{
+		DirtyRange jointLocs, rotations;
+		m_gaits[slot].restore(m_limbBuffer[slot], m_rotBuffer[slot], jointLocs, rotations);
+		MarkCreatureGaitDirty(slot, jointLocs, rotations);
+	}
+}
 
+void DXProceduralProject::MarkCreatureGaitDirty(UINT slot, const DirtyRange& jointLocs, const DirtyRange& rotations)
+{
+	if (!jointLocs.empty())
+	{
+		size_t offset = slot * sizeof(LimbInfoBuffer) + offsetof(LimbInfoBuffer, jointLocData);
+		m_limbBuffer.MarkDirty(offset + jointLocs.begin * sizeof(float), (jointLocs.end - jointLocs.begin) * sizeof(float));
+	}
+	if (!rotations.empty())
+	{
+		size_t offset = slot * sizeof(RotationInfoBuffer) + offsetof(RotationInfoBuffer, rotations);
+		m_rotBuffer.MarkDirty(offset + rotations.begin * sizeof(float), (rotations.end - rotations.begin) * sizeof(float));
+	}
+}
+
+// Places the creature instances: the single creature of the original scene, or a crowd of m_crowdSize
+// instances sharing c_crowdSlots generated creatures. Buffers and acceleration structures are sized from
+// m_creatureScene, so this has to run before CreateDeviceDependentResources(), which also generates the creatures.
+// The crowd only gets its heights once they are generated, see PlaceCrowd().
+void DXProceduralProject::BuildCreatureScene()
+{
+	m_creaturesGenerated = false;
+
+	if (m_crowdSize == 0)
+	{
+		m_creatureScene.reset(1);
+		// Matches the original 20x20x20 AABB at [1, 21] scaled by 6 and hovering by half an AABB width.
+		m_creatureScene.addInstance(0, XMFLOAT3(11.0f, 11.0f + c_aabbWidth * 0.5f, 11.0f), 0.0f, 6.0f);
+	}
+	else
+	{
+		m_creatureScene.reset(min(c_crowdSlots, m_crowdSize));
+		m_creatureScene.scatter(m_crowdSize, XMFLOAT3(11.0f, 0.0f, 11.0f), c_crowdSpacing, c_crowdScale);
+	}
+}
+
+void DXProceduralProject::CreateTextureBuffers(std::string file)
+{
+	LARGE_INTEGER frequency, start, end;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+	Model::TextureIngestOptions options;
+	options.generate_mips = c_textureMips;
+	char message[256];
+
+	// Block compressed from the cache next to the image when it can be, else RGBA8 with its mip chain.
+	// Either way, laid out the way the copies below read it.
+	Model::TextureCache cache;
+	Model::TextureData texture;
+	Model::BlockCompressOptions compression;
+	compression.format = c_textureFormat;
+	bool compressed = c_compressTextures && cache.load(file, options, compression);
+	std::vector<Model::TextureSubresource> mips;
+	DXGI_FORMAT format;
+	if (compressed)
+	{
+		QueryPerformanceCounter(&end);
+		mips = cache.mips();
+		format = Model::dxgi_format(cache.format(), cache.srgb());
+		snprintf(message, sizeof(message), "%s %s: %ux%u, %u mips, %.1f dB in %.1f ms\n", cache.was_cached() ? "Loaded cached" : "Compressed",
+			file.c_str(), cache.width(), cache.height(), UINT(mips.size()), cache.psnr(),
+			1000.0 * (end.QuadPart - start.QuadPart) / frequency.QuadPart);
+	}
+	else
+	{
+		int width, height, channels;
+		UINT8* pixels = stbi_load(file.c_str(), &width, &height, &channels, STBI_default);
+		ThrowIfFalse(pixels != nullptr, L"Could not load the texture image");
+
+		bool ingested = Model::ingest_texture(pixels, width, height, channels, width * channels, options, texture);
+		QueryPerformanceCounter(&end);
+		stbi_image_free(pixels);
+		ThrowIfFalse(ingested, L"Unsupported texture image");
+
+		mips = texture.mips;
+		// The mips were filtered in linear space, so the sampler has to decode them as sRGB too
+		format = texture.srgb ? DXGI_FORMAT_R8G8B8A8_UNORM_SRGB : DXGI_FORMAT_R8G8B8A8_UNORM;
+		snprintf(message, sizeof(message), "Ingested %s: %dx%d, %d channels, %u mips in %.1f ms\n", file.c_str(), width, height,
+			channels, UINT(mips.size()), 1000.0 * (end.QuadPart - start.QuadPart) / frequency.QuadPart);
+	}
+	OutputDebugStringA(message);
+
+	const UINT mipCount = UINT(mips.size());
 	m_textureDesc = {};
 	m_textureDesc.Dimension = D3D12_RESOURCE_DIMENSION_TEXTURE2D;
 	m_textureDesc.Alignment = 0;
-	m_textureDesc.Width = width;
-	m_textureDesc.Height = height;
+	m_textureDesc.Width = mips[0].width;
+	m_textureDesc.Height = mips[0].height;
 	m_textureDesc.DepthOrArraySize = 1;
-	m_textureDesc.MipLevels = 1;
-	m_textureDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+	m_textureDesc.MipLevels = mipCount;
+	m_textureDesc.Format = format;
 	m_textureDesc.SampleDesc.Count = 1;
 	m_textureDesc.SampleDesc.Quality = 0;
 	m_textureDesc.Layout = D3D12_TEXTURE_LAYOUT_UNKNOWN;
 	m_textureDesc.Flags = D3D12_RESOURCE_FLAG_NONE;
 
-	//allocate buffer on gpu - top of Scene.cpp
-	//AllocateBufferOnGpu(imageData, imageBytesPerRow, &(newTexture.texBuffer.resource), utilityCore::stringAndId(L"Diffuse Texture", id), &CD3DX12_RESOURCE_DESC(textureDesc));
-	//::free(imageData);
-
 	CD3DX12_HEAP_PROPERTIES defaultHeapProps = CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT);
 	CD3DX12_HEAP_PROPERTIES uploadHeapProps = CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_UPLOAD);
 	auto device = m_deviceResources->GetD3DDevice();
 
-	device->CreateCommittedResource(&defaultHeapProps, D3D12_HEAP_FLAG_NONE,
-		&CD3DX12_RESOURCE_DESC(m_textureDesc), D3D12_RESOURCE_STATE_COPY_DEST, 
-		nullptr, IID_PPV_ARGS(&m_textureBuffer.resource));
+	ThrowIfFailed(device->CreateCommittedResource(&defaultHeapProps, D3D12_HEAP_FLAG_NONE,
+		&CD3DX12_RESOURCE_DESC(m_textureDesc), D3D12_RESOURCE_STATE_COPY_DEST,
+		nullptr, IID_PPV_ARGS(&m_textureBuffer.resource)));
 
-	UINT64 textureUploadBufferSize = width*height*stride;
-	device->GetCopyableFootprints(&m_textureDesc, 0, 1, 0, nullptr, nullptr, nullptr, &textureUploadBufferSize);
+	UINT64 textureUploadBufferSize = 0;
+	device->GetCopyableFootprints(&m_textureDesc, 0, mipCount, 0, nullptr, nullptr, nullptr, &textureUploadBufferSize);
 
-	device->CreateCommittedResource(&uploadHeapProps, D3D12_HEAP_FLAG_NONE,
+	ThrowIfFailed(device->CreateCommittedResource(&uploadHeapProps, D3D12_HEAP_FLAG_NONE,
 		&CD3DX12_RESOURCE_DESC::Buffer(textureUploadBufferSize), D3D12_RESOURCE_STATE_GENERIC_READ,
-		nullptr, IID_PPV_ARGS(&m_textureBufferUploadHeap));
+		nullptr, IID_PPV_ARGS(&m_textureBufferUploadHeap)));
 
-	UINT8* pData;
-	m_textureBufferUploadHeap->Map(0, nullptr, reinterpret_cast<void**>(&pData));
-	memcpy(pData, imgData.data(), textureUploadBufferSize);
-	m_textureBufferUploadHeap->Unmap(0, nullptr);
+	// One subresource per mip, each with its own row pitch. Compressed rows are rows of 4x4 blocks.
+	std::vector<D3D12_SUBRESOURCE_DATA> texData(mipCount);
+	for (UINT mip = 0; mip < mipCount; mip++)
+	{
+		const Model::TextureSubresource& level = mips[mip];
+		UINT rows = compressed ? (level.height + 3) / 4 : level.height;
+		texData[mip].pData = compressed ? cache.data(mip) : texture.data(mip);
+		texData[mip].RowPitch = level.row_pitch;
+		texData[mip].SlicePitch = LONG_PTR(level.row_pitch) * rows;
+	}
 
 	auto cmdList = m_deviceResources->GetCommandList();
 	auto cmdAllocator = m_deviceResources->GetCommandAllocator();
-
-	/*D3D12_SUBRESOURCE_FOOTPRINT subresource = {};
-	subresource.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
-	subresource.Width = width;
-	subresource.Height = height;
-	subresource.RowPitch = (width * stride);
-	subresource.Depth = 1;
-
-	D3D12_PLACED_SUBRESOURCE_FOOTPRINT footprint = {};
-	footprint.Offset = 0;
-	footprint.Footprint = subresource;
-
-	D3D12_TEXTURE_COPY_LOCATION source = {};
-	source.pResource = m_textureBufferUploadHeap;
-	source.PlacedFootprint = footprint;
-	source.Type = D3D12_TEXTURE_COPY_TYPE_PLACED_FOOTPRINT;
-
-	// Describe the default heap resource location for the copy
-	D3D12_TEXTURE_COPY_LOCATION destination = {};
-	destination.pResource = m_textureBuffer.resource.Get();
-	destination.SubresourceIndex = 0;
-	destination.Type = D3D12_TEXTURE_COPY_TYPE_SUBRESOURCE_INDEX;
-
-	// Copy the buffer resource from the upload heap to the texture resource on the default heap
-	cmdList->CopyTextureRegion(&destination, 0, 0, 0, &source, nullptr);*/
-
-
-	D3D12_SUBRESOURCE_DATA texData = {};
-	texData.pData = pData;
-	texData.RowPitch = width;
-	texData.SlicePitch = width * height;
-
 	cmdList->Reset(cmdAllocator, nullptr);
 
-	UpdateSubresources(cmdList, m_textureBuffer.resource.Get(), m_textureBufferUploadHeap, 0, 0, 1, &texData);
+	UpdateSubresources(cmdList, m_textureBuffer.resource.Get(), m_textureBufferUploadHeap, 0, 0, mipCount, texData.data());
 	cmdList->ResourceBarrier(1,
 		&CD3DX12_RESOURCE_BARRIER::Transition(m_textureBuffer.resource.Get(), D3D12_RESOURCE_STATE_COPY_DEST,
 			D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE | D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE));
@@ -457,8 +461,7 @@ void DXProceduralProject::CreateTextureBuffers(std::string file)
 	srvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
 	srvDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
 	srvDesc.Format = m_textureDesc.Format;
-	srvDesc.Texture2D.MipLevels = 1;
-	
+	srvDesc.Texture2D.MipLevels = mipCount;
 
 	UINT descriptorIndex = AllocateDescriptor(&m_textureBuffer.cpuDescriptorHandle);
 	// Tell the device where to find the data, how to use it (descriptor), where it lives on the CPU.
@@ -469,7 +472,7 @@ void DXProceduralProject::CreateTextureBuffers(std::string file)
 
 	auto& attributes = m_aabbMaterialCB[0];
 	attributes.hasTexture = true;
-	attributes.textureResolution = width;
+	attributes.textureResolution = float(mips[0].width);
 
 	/*D3D12_STATIC_SAMPLER_DESC samp = {};
 	samp.Filter = D3D12_FILTER_MIN_MAG_MIP_POINT;
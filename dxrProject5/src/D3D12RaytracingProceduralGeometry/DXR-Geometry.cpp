@@ -44,12 +44,16 @@ void DXProceduralProject::BuildPlaneGeometry()
         { XMFLOAT3(0.0f, 0.0f, 1.0f), XMFLOAT3(0.0f, 1.0f, 0.0f) }, // vertex 3
     };
 
+	m_indexCount = ARRAYSIZE(indices);
+	m_indexFormat = DXGI_FORMAT_R16_UINT;
 	AllocateUploadBuffer(device, indices, sizeof(indices), &m_indexBuffer.resource);
 	AllocateUploadBuffer(device, vertices, sizeof(vertices), &m_vertexBuffer.resource);
+	m_verticesPacked = false;
 
 	// Vertex buffer is passed to the shader along with index buffer as a descriptor range.
+	// Both are raw views, g_vertices holds either Vertex or PackedVertex.
 	UINT descriptorIndexIB = CreateBufferSRV(&m_indexBuffer, sizeof(indices) / 4, 0);
-	UINT descriptorIndexVB = CreateBufferSRV(&m_vertexBuffer, sizeof(vertices) / sizeof(vertices[0]), sizeof(vertices[0]));
+	UINT descriptorIndexVB = CreateBufferSRV(&m_vertexBuffer, sizeof(vertices) / 4, 0);
     ThrowIfFalse(descriptorIndexVB == descriptorIndexIB + 1, L"Vertex Buffer descriptor index must follow that of Index Buffer descriptor index");
 }
 
@@ -67,31 +71,57 @@ void DXProceduralProject::BuildMeshGeometry(std::string basePath, std::string ob
 	// If you look at the positions of these vertices below, you will notice 
 	// that triangle cross products point up, which needed if we want the plane to face upwards
 	// i.e have a normal vector pointing up.
-	std::vector<Model::Mesh> meshes = Model::MeshLoader::load_obj(basePath, objectName);
-	std::vector<Model::Index> indexVector = meshes[0].vertex_indices;
-	std::vector<Model::Vertex> vertexVector = meshes[0].vertices;
-	Index *indices = new Index[indexVector.size()];
-	Vertex *vertices = new Vertex[vertexVector.size()];
-	for (int i = 0; i < vertexVector.size(); i++) {
-		Model::Vertex v = vertexVector[i];
-		Vertex newV;
-		newV.position = v.position;
-		newV.normal = v.normal;
-		vertices[i] = newV;
-	}
-	for (int j = 0; j < indexVector.size(); j++) {
-		indices[j] = indexVector[j];
+	// After the first run the meshes come from a binary cache next to the OBJ, mapped and uploaded as they are.
+	static_assert(sizeof(Vertex) == sizeof(Model::Vertex), "The cache holds Model::Vertex, the shaders read Vertex");
+	Model::MeshCache cache;
+	cache.load_obj(basePath, objectName);
+	const Model::MeshView& mesh = cache.meshes()[0];
+	for (size_t i = 0; i < cache.optimize_reports().size(); i++)
+	{
+		OutputDebugStringA(Model::format_report(cache.meshes()[i].name, cache.optimize_reports()[i]).c_str());
 	}
 
-	AllocateUploadBuffer(device, indices, indexVector.size() * sizeof(Index), &m_indexBuffer.resource);
-	AllocateUploadBuffer(device, vertices, vertexVector.size() * sizeof(Vertex), &m_vertexBuffer.resource);
+	// The mesh picked 16 or 32 bit indices. g_indices is a ByteAddressBuffer, which is read a word at a time,
+	// so the cache pads the index data to a whole number of words.
+	m_indexCount = mesh.index_count;
+	m_indexFormat = mesh.index_format;
+
+	AllocateUploadBuffer(device, mesh.indices, mesh.index_data_size, &m_indexBuffer.resource);
+
+	// Packed, the shaders read 12 bytes a vertex instead of 32. The Fallback Layer only builds from float
+	// positions, so the decoded ones go into a buffer that BuildAccelerationStructures() drops when it is done.
+	// The acceleration structure then holds exactly the positions the shaders decode.
+	m_verticesPacked = c_packMeshVertices;
+	UINT vertexDataSize = mesh.vertex_count * sizeof(Vertex);
+	if (m_verticesPacked)
+	{
+		vector<PackedVertex> packed;
+		m_vertexPacking = Model::pack_vertices(mesh.vertices, mesh.vertex_count, packed);
+		vertexDataSize = mesh.vertex_count * sizeof(PackedVertex);
+		AllocateUploadBuffer(device, packed.data(), vertexDataSize, &m_vertexBuffer.resource);
+
+		vector<XMFLOAT3> positions(mesh.vertex_count);
+		for (UINT i = 0; i < mesh.vertex_count; i++)
+		{
+			positions[i] = Model::unpack_vertex(packed[i], m_vertexPacking).position;
+		}
+		AllocateUploadBuffer(device, positions.data(), positions.size() * sizeof(XMFLOAT3), &m_positionBuffer);
+
+		Model::PackingError error = Model::packing_error(mesh.vertices, packed.data(), mesh.vertex_count, m_vertexPacking);
+		char message[256];
+		snprintf(message, sizeof(message), "Packed %u vertices: %u bytes instead of %u, error %g units, %.2f degrees, %g texture units\n",
+			mesh.vertex_count, vertexDataSize, UINT(mesh.vertex_count * sizeof(Vertex)), error.position, error.normal_degrees, error.tex_coord);
+		OutputDebugStringA(message);
+	}
+	else
+	{
+		AllocateUploadBuffer(device, mesh.vertices, vertexDataSize, &m_vertexBuffer.resource);
+	}
 
 	// Vertex buffer is passed to the shader along with index buffer as a descriptor range.
-	UINT descriptorIndexIB = CreateBufferSRV(&m_indexBuffer, indexVector.size(), sizeof(indices[0]));
-	UINT descriptorIndexVB = CreateBufferSRV(&m_vertexBuffer, vertexVector.size(), sizeof(vertices[0]));
+	UINT descriptorIndexIB = CreateBufferSRV(&m_indexBuffer, mesh.index_data_size / 4, 0);
+	UINT descriptorIndexVB = CreateBufferSRV(&m_vertexBuffer, vertexDataSize / 4, 0);
 
-	free(vertices);
-	free(indices);
 	ThrowIfFalse(descriptorIndexVB == descriptorIndexIB + 1, L"Vertex Buffer descriptor index must follow that of Index Buffer descriptor index");
 }
 
@@ -150,21 +180,30 @@ void DXProceduralProject::BuildProceduralGeometryAABBs()
         // Volumetric primitives.
         {
             using namespace VolumetricPrimitive;
-            m_aabbs[Metaballs] = InitializeAABB(XMINT3(0, 0, 0), XMFLOAT3(20, 20, 20));
+            // A unit box shared by every creature instance. The instance transforms built by
+            // m_creatureScene stretch it over each creature's bounds.
+            m_aabbs[Metaballs] = CreatureScene::unitAABB();
             //offset += VolumetricPrimitive::Count;
         }
 
         // TODO-2.5: Allocate an upload buffer for this AABB data.
         // The base data lives in m_aabbs.data() (the stuff you filled in!), but the allocationg should be pointed
         // towards m_aabbBuffer.resource (the actual D3D12 resource that will hold all of our AABB data as a contiguous buffer).
-        AllocateUploadBuffer(device, m_aabbs.data(), m_aabbs.size() * sizeof(m_aabbs), &m_aabbBuffer.resource);
+        AllocateUploadBuffer(device, m_aabbs.data(), m_aabbs.size() * sizeof(m_aabbs[0]), &m_aabbBuffer.resource);
     }
 }
 
 // TODO-2.5: Build geometry used in the project. As easy as calling both functions above :)
 void DXProceduralProject::BuildGeometry()
 {
-    BuildPlaneGeometry();
-	//BuildMeshGeometry("objects/", "suzanne.obj");
+	if (m_meshPath.empty())
+	{
+		BuildPlaneGeometry();
+	}
+	else
+	{
+		size_t nameStart = m_meshPath.find_last_of("\\/") + 1;
+		BuildMeshGeometry(m_meshPath.substr(0, nameStart), m_meshPath.substr(nameStart));
+	}
     BuildProceduralGeometryAABBs();
 }
\ No newline at end of file
@@ -21,8 +21,16 @@ DXProceduralProject::DXProceduralProject(UINT width, UINT height, std::wstring n
 	m_missShaderTableStrideInBytes(UINT_MAX),
 	m_hitGroupShaderTableStrideInBytes(UINT_MAX),
 	m_forceComputeFallback(false),
+	m_crowdSize(0),
+	m_creaturesGenerated(false),
+	m_creatureBoundsChanged(false),
+	m_splitCreatureParts(false),
+	m_animateGait(false),
+	m_gaitTime(0.0f),
+	m_exportWhileMarching(false),
 	cases(Cases())
 {
+	std::fill(std::begin(m_accelerationStructureDescriptorHeapIndices), std::end(m_accelerationStructureDescriptorHeapIndices), UINT_MAX);
 	m_forceComputeFallback = false;
 	SelectRaytracingAPI(RaytracingAPI::FallbackLayer);
 	UpdateForSizeChange(width, height);
@@ -73,8 +81,17 @@ void DXProceduralProject::CreateDeviceDependentResources()
     // Build geometry to be used in the project.
     BuildGeometry();
 
+    // Create the creature buffers and generate the creatures. The acceleration structures below are built
+    // around their bounds. The buffers keep their CPU copies, so recreating the device does not regenerate.
+    CreateCreatureBuffers();
+    if (!m_creaturesGenerated)
+    {
+        UpdateCreatureAttributes();
+    }
+
     // Build raytracing acceleration structures from the generated geometry.
     BuildAccelerationStructures();
+    m_creatureBoundsChanged = false;
 
     // Create constant buffers for the geometry and the scene.
     CreateConstantBuffers();
@@ -82,8 +99,6 @@ void DXProceduralProject::CreateDeviceDependentResources()
     // Create AABB primitive attribute buffers.
     CreateAABBPrimitiveAttributesBuffers();
 
-    CreateCreatureBuffers();
-
     // Build shader tables, which define shaders and their local root arguments.
     BuildShaderTables();
 
@@ -214,6 +229,22 @@ void DXProceduralProject::ParseCommandLineArgs(WCHAR* argv[], int argc)
             m_raytracingAPI = RaytracingAPI::DirectXRaytracing;
         }
     }
+
+    // -creatures N: start with a crowd of N creature instances
+    for (int i = 1; i < argc - 1; i++)
+    {
+        if (_wcsicmp(argv[i], L"-creatures") == 0)
+        {
+            m_crowdSize = static_cast<UINT>(max(_wtoi(argv[i + 1]), 0));
+        }
+        // -mesh path: draw an OBJ, e.g. objects/suzanne.obj, instead of the plane
+        else if (_wcsicmp(argv[i], L"-mesh") == 0)
+        {
+            char path[MAX_PATH];
+            WideCharToMultiByte(CP_UTF8, 0, argv[i + 1], -1, path, MAX_PATH, nullptr, nullptr);
+            m_meshPath = path;
+        }
+    }
 }
 
 // Update the application state with the new resolution.
@@ -300,6 +331,7 @@ void DXProceduralProject::ReleaseDeviceDependentResources()
     m_rotBuffer.Release();
     m_indexBuffer.resource.Reset();
     m_vertexBuffer.resource.Reset();
+    m_positionBuffer.Reset();
     m_aabbBuffer.resource.Reset();
 
 	//m_textureBuffer.resource.Reset();
@@ -307,6 +339,7 @@ void DXProceduralProject::ReleaseDeviceDependentResources()
 
     ResetComPtrArray(&m_bottomLevelAS);
     m_topLevelAS.Reset();
+    std::fill(std::begin(m_accelerationStructureDescriptorHeapIndices), std::end(m_accelerationStructureDescriptorHeapIndices), UINT_MAX);
 
     m_raytracingOutput.Reset();
     m_raytracingOutputResourceUAVDescriptorHeapIndex = UINT_MAX;
@@ -371,6 +404,10 @@ void DXProceduralProject::CalculateFrameStats()
             << L"    DispatchRays(): " << raytracingTime << "ms"
             << L"     ~Million Primary Rays/s: " << MRaysPerSecond
             << L"    GPU[" << m_deviceResources->GetAdapterID() << L"]: " << m_deviceResources->GetAdapterDescription();
+        if (!m_creatureMass.empty())
+        {
+            windowText << L"    Creature volume: " << m_creatureMass[0].volume;
+        }
         SetCustomWindowText(windowText.str().c_str());
     }
 }
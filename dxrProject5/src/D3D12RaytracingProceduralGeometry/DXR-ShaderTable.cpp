@@ -137,6 +137,15 @@ void DXProceduralProject::BuildShaderTables()
 			// We finally get to assign the root arguments needed for the triangle hitgroup: the plane material properties!
 			LocalRootSignature::Triangle::RootArguments rootArgs;
 			rootArgs.materialCb = m_planeMaterialCB;
+			rootArgs.materialCb.indexSizeInBytes = m_indexFormat == DXGI_FORMAT_R32_UINT ? 4 : 2;
+			rootArgs.materialCb.packedVertices = m_verticesPacked ? 1 : 0;
+			if (m_verticesPacked)
+			{
+				const XMFLOAT3& low = m_vertexPacking.min;
+				const XMFLOAT3& extent = m_vertexPacking.extent;
+				rootArgs.materialCb.positionMin = XMFLOAT4(low.x, low.y, low.z, 0.0f);
+				rootArgs.materialCb.positionExtent = XMFLOAT4(extent.x, extent.y, extent.z, 0.0f);
+			}
 
 			for (auto& hitGroupShaderID : hitGroupShaderIDs_TriangleGeometry)
 			{
@@ -118,12 +118,14 @@ public:
 //    sb[index].var = ... ; 
 //    sb.CopyStagingToGPU(...);
 //    Set...View(..., sb.GputVirtualAddress());
+// Buffers that only change in small pieces can instead sb.MarkDirty(...) what they change and sb.CopyDirtyStagingToGpu(...).
 template <class T>
 class StructuredBuffer : public GpuUploadBuffer
 {
 	T* m_mappedBuffers;
 	std::vector<T> m_staging;
 	UINT m_numInstances;
+	std::vector<std::pair<size_t, size_t>> m_dirtyRanges; // Per instance, the staging bytes [first, second) it is missing
 
 public:
 	// Performance tip: Align structures on sizeof(float4) boundary.
@@ -137,6 +139,7 @@ public:
 		UINT bufferSize = numInstances * numElements * sizeof(T);
 		Allocate(device, bufferSize, resourceName);
 		m_mappedBuffers = reinterpret_cast<T*>(MapCpuWriteOnly());
+		m_dirtyRanges.assign(numInstances, std::make_pair(size_t(0), InstanceSize()));
 	}
 
 	void CopyStagingToGpu(UINT instanceIndex = 0)
@@ -144,6 +147,29 @@ public:
 		memcpy(m_mappedBuffers + instanceIndex * NumElementsPerInstance(), &m_staging[0], InstanceSize());
 	}
 
+	// Records staging bytes that changed. Every instance copies them the next time it is updated.
+	void MarkDirty(size_t byteOffset, size_t byteCount)
+	{
+		for (auto& range : m_dirtyRanges)
+		{
+			range.first = min(range.first, byteOffset);
+			range.second = max(range.second, byteOffset + byteCount);
+		}
+	}
+	void MarkDirty() { MarkDirty(0, InstanceSize()); }
+
+	// Copies only the bytes marked dirty since this instance was last updated
+	void CopyDirtyStagingToGpu(UINT instanceIndex = 0)
+	{
+		auto& range = m_dirtyRanges[instanceIndex];
+		if (range.first < range.second)
+		{
+			uint8_t* mappedInstance = reinterpret_cast<uint8_t*>(m_mappedBuffers + instanceIndex * NumElementsPerInstance());
+			memcpy(mappedInstance + range.first, reinterpret_cast<uint8_t*>(&m_staging[0]) + range.first, range.second - range.first);
+		}
+		range = std::make_pair(InstanceSize(), size_t(0));
+	}
+
 	// Accessors
 	T& operator[](UINT elementIndex) { return m_staging[elementIndex]; }
 	size_t NumElementsPerInstance() { return m_staging.size(); }
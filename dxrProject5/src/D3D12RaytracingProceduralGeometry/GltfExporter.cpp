@@ -0,0 +1,749 @@
+#include "stdafx.h"
+#include "GltfExporter.h"
+
+#include <fstream>
+
+using namespace Model;
+
+namespace
+{
+	const UINT c_glb_magic = 0x46546C67;		// "glTF"
+	const UINT c_json_chunk = 0x4E4F534A;		// "JSON"
+	const UINT c_bin_chunk = 0x004E4942;		// "BIN\0"
+	const size_t c_block_bytes = 1 << 20;		// Of encoded data per write
+	const UINT c_skin_influences = 4;			// Joints and weights per vertex, JOINTS_0 and WEIGHTS_0 are vec4s
+
+	enum ComponentType
+	{
+		Byte = 5120,
+		UnsignedShort = 5123,
+		UnsignedInt = 5125,
+		Float = 5126,
+	};
+
+	enum BufferTarget
+	{
+		NoTarget = 0,				// Data that is not a vertex attribute or index, e.g. inverse bind matrices
+		ArrayBuffer = 34962,
+		ElementArrayBuffer = 34963,
+	};
+
+	// Where one mesh's data goes in the binary chunk, and how it is encoded
+	struct MeshLayout
+	{
+		float min[3];
+		float max[3];
+		float scale;				// Quantized positions: one grid step
+		bool unorm_tex_coords;		// All texture coordinates are in [0, 1]
+		bool index16;
+
+		size_t position_offset, position_size;
+		size_t normal_offset, normal_size;
+		size_t tex_coord_offset, tex_coord_size;
+		size_t joint_offset, joint_size;
+		size_t weight_offset, weight_size;
+		size_t index_offset, index_size;
+		size_t inverse_bind_offset, inverse_bind_size;
+	};
+
+	inline UINT16 quantize_unorm16(float value, float offset, float inv_scale)
+	{
+		float q = (value - offset) * inv_scale + 0.5f;
+		return static_cast<UINT16>(q <= 0.0f ? 0.0f : (q >= 65535.0f ? 65535.0f : q));
+	}
+
+	inline INT8 quantize_snorm8(float value)
+	{
+		float q = value * 127.0f;
+		q = q < -127.0f ? -127.0f : (q > 127.0f ? 127.0f : q);
+		return static_cast<INT8>(q < 0.0f ? q - 0.5f : q + 0.5f);
+	}
+
+	// glTF wants unit normals; degenerate ones point along +z
+	inline XMFLOAT3 unit_normal(const float* n)
+	{
+		float length = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+		if (length <= 0.0f) return XMFLOAT3(0.0f, 0.0f, 1.0f);
+		return XMFLOAT3(n[0] / length, n[1] / length, n[2] / length);
+	}
+
+	// Takes the mesh's vertices, on the quantization grid or not, from the mesh's space to the joint's. The joint is
+	// only offset in the bind pose, so that is the grid's scale and a translation, column major as glTF wants it.
+	void inverse_bind_matrix(const GltfJoint& joint, const MeshLayout& layout, bool quantize, float* m)
+	{
+		float scale = quantize ? layout.scale : 1.0f;
+		float origin[3] = { quantize ? layout.min[0] : 0.0f, quantize ? layout.min[1] : 0.0f, quantize ? layout.min[2] : 0.0f };
+		memset(m, 0, 16 * sizeof(float));
+		m[0] = m[5] = m[10] = scale;
+		m[12] = origin[0] - joint.position.x;
+		m[13] = origin[1] - joint.position.y;
+		m[14] = origin[2] - joint.position.z;
+		m[15] = 1.0f;
+	}
+
+	inline UINT read_index(const void* indices, UINT index_size, UINT i)
+	{
+		return (index_size == 2) ? static_cast<const UINT16*>(indices)[i] : static_cast<const UINT*>(indices)[i];
+	}
+
+	MeshLayout layout_mesh(const GltfMesh& mesh, bool quantize, size_t& offset)
+	{
+		const VertexStreams& v = mesh.vertices;
+		MeshLayout layout;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			layout.min[axis] = FLT_MAX;
+			layout.max[axis] = -FLT_MAX;
+		}
+		layout.unorm_tex_coords = true;
+		for (UINT i = 0; i < v.vertex_count; i++)
+		{
+			const float* p = v.positions + i * v.stride;
+			for (int axis = 0; axis < 3; axis++)
+			{
+				layout.min[axis] = min(layout.min[axis], p[axis]);
+				layout.max[axis] = max(layout.max[axis], p[axis]);
+			}
+			if (mesh.tex_coords)
+			{
+				const float* t = mesh.tex_coords + i * v.stride;
+				layout.unorm_tex_coords = layout.unorm_tex_coords && t[0] >= 0.0f && t[0] <= 1.0f && t[1] >= 0.0f && t[1] <= 1.0f;
+			}
+		}
+
+		// One uniform step for all axes, so the node's scale does not skew the normals
+		float extent = max(layout.max[0] - layout.min[0], max(layout.max[1] - layout.min[1], layout.max[2] - layout.min[2]));
+		layout.scale = (extent > 0.0f) ? extent / 65535.0f : 1.0f;
+
+		// The largest index of a type is reserved for primitive restart
+		layout.index16 = v.vertex_count <= 0xFFFF;
+
+		UINT n = v.vertex_count;
+		layout.position_offset = offset;
+		layout.position_size = size_t(n) * (quantize ? 4 * sizeof(UINT16) : 3 * sizeof(float));
+		offset += layout.position_size;
+		layout.normal_offset = offset;
+		layout.normal_size = v.normals ? size_t(n) * (quantize ? 4 * sizeof(INT8) : 3 * sizeof(float)) : 0;
+		offset += layout.normal_size;
+		layout.tex_coord_offset = offset;
+		layout.tex_coord_size = mesh.tex_coords ? size_t(n) * ((quantize && layout.unorm_tex_coords) ? 2 * sizeof(UINT16) : 2 * sizeof(float)) : 0;
+		offset += layout.tex_coord_size;
+		layout.joint_offset = offset;
+		layout.joint_size = mesh.skin ? size_t(n) * c_skin_influences * sizeof(UINT16) : 0;
+		offset += layout.joint_size;
+		layout.weight_offset = offset;
+		layout.weight_size = mesh.skin ? size_t(n) * c_skin_influences * sizeof(float) : 0;
+		offset += layout.weight_size;
+		layout.index_offset = offset;
+		layout.index_size = (size_t(mesh.index_count) * (layout.index16 ? 2 : 4) + 3) & ~size_t(3);
+		offset += layout.index_size;
+		layout.inverse_bind_offset = offset;
+		layout.inverse_bind_size = mesh.skin ? mesh.skin->joints.size() * 16 * sizeof(float) : 0;
+		offset += layout.inverse_bind_size;
+		return layout;
+	}
+
+	// Appends JSON text as it goes, there is no document to build first
+	class JsonWriter
+	{
+	public:
+		std::string text;
+
+		void raw(const char* s) { text += s; }
+
+		void number(double value)
+		{
+			char buffer[32];
+			snprintf(buffer, sizeof(buffer), "%.9g", value);
+			text += buffer;
+		}
+
+		void number(size_t value) { text += std::to_string(value); }
+
+		void string(const std::string& s)
+		{
+			text += '"';
+			for (char c : s)
+			{
+				if (c == '"' || c == '\\')
+				{
+					text += '\\';
+					text += c;
+				}
+				else if (static_cast<unsigned char>(c) < 0x20)
+				{
+					char buffer[8];
+					snprintf(buffer, sizeof(buffer), "\\u%04x", static_cast<unsigned char>(c));
+					text += buffer;
+				}
+				else
+				{
+					text += c;
+				}
+			}
+			text += '"';
+		}
+
+		void key(const char* name)
+		{
+			separate();
+			text += '"';
+			text += name;
+			text += "\":";
+		}
+
+		// A comma unless the last thing written opened an object or array
+		void separate()
+		{
+			if (!text.empty() && text.back() != '{' && text.back() != '[' && text.back() != ':')
+			{
+				text += ',';
+			}
+		}
+
+		void numbers(const float* values, int count)
+		{
+			raw("[");
+			for (int i = 0; i < count; i++)
+			{
+				if (i > 0) raw(",");
+				number(values[i]);
+			}
+			raw("]");
+		}
+	};
+
+	void write_accessor(JsonWriter& json, size_t buffer_view, ComponentType type, bool normalized, UINT count, const char* shape,
+		const float* min_values = nullptr, const float* max_values = nullptr, int components = 0)
+	{
+		json.separate();
+		json.raw("{");
+		json.key("bufferView"); json.number(buffer_view);
+		json.key("componentType"); json.number(size_t(type));
+		if (normalized)
+		{
+			json.key("normalized"); json.raw("true");
+		}
+		json.key("count"); json.number(size_t(count));
+		json.key("type"); json.string(shape);
+		if (min_values)
+		{
+			json.key("min"); json.numbers(min_values, components);
+			json.key("max"); json.numbers(max_values, components);
+		}
+		json.raw("}");
+	}
+
+	void write_buffer_view(JsonWriter& json, size_t offset, size_t length, size_t stride, BufferTarget target)
+	{
+		json.separate();
+		json.raw("{");
+		json.key("buffer"); json.number(size_t(0));
+		json.key("byteOffset"); json.number(offset);
+		json.key("byteLength"); json.number(length);
+		if (stride)
+		{
+			json.key("byteStride"); json.number(stride);
+		}
+		if (target != NoTarget)
+		{
+			json.key("target"); json.number(size_t(target));
+		}
+		json.raw("}");
+	}
+
+	std::string make_json(const std::vector<GltfMesh>& meshes, const std::vector<MeshLayout>& layouts,
+		const std::vector<GltfMaterial>& materials, bool quantize, size_t bin_size)
+	{
+		JsonWriter json;
+		json.raw("{");
+		json.key("asset"); json.raw("{");
+		json.key("version"); json.string("2.0");
+		json.key("generator"); json.string("DXR Procedural Creatures");
+		json.raw("}");
+		if (quantize)
+		{
+			json.key("extensionsUsed"); json.raw("[\"KHR_mesh_quantization\"]");
+			json.key("extensionsRequired"); json.raw("[\"KHR_mesh_quantization\"]");
+		}
+
+		// A node per mesh, then the joints of every skin in the order of the meshes
+		std::vector<size_t> first_joint(meshes.size());
+		size_t node_count = meshes.size();
+		for (size_t i = 0; i < meshes.size(); i++)
+		{
+			first_joint[i] = node_count;
+			node_count += meshes[i].skin ? meshes[i].skin->joints.size() : 0;
+		}
+
+		json.key("scene"); json.number(size_t(0));
+		json.key("scenes"); json.raw("[{");
+		json.key("nodes"); json.raw("[");
+		for (size_t i = 0; i < meshes.size(); i++)
+		{
+			json.separate();
+			json.number(i);
+			if (meshes[i].skin)
+			{
+				const std::vector<GltfJoint>& joints = meshes[i].skin->joints;
+				for (size_t j = 0; j < joints.size(); j++)
+				{
+					if (joints[j].parent < 0)
+					{
+						json.separate();
+						json.number(first_joint[i] + j);
+					}
+				}
+			}
+		}
+		json.raw("]}]");
+
+		json.key("nodes"); json.raw("[");
+		size_t skin_count = 0;
+		for (size_t i = 0; i < meshes.size(); i++)
+		{
+			json.separate();
+			json.raw("{");
+			json.key("name"); json.string(meshes[i].name);
+			json.key("mesh"); json.number(i);
+			if (meshes[i].skin)
+			{
+				json.key("skin"); json.number(skin_count++);
+			}
+			else if (quantize)
+			{
+				float scale[3] = { layouts[i].scale, layouts[i].scale, layouts[i].scale };
+				json.key("translation"); json.numbers(layouts[i].min, 3);
+				json.key("scale"); json.numbers(scale, 3);
+			}
+			json.raw("}");
+		}
+		for (size_t i = 0; i < meshes.size(); i++)
+		{
+			if (!meshes[i].skin)
+			{
+				continue;
+			}
+			const std::vector<GltfJoint>& joints = meshes[i].skin->joints;
+			for (size_t j = 0; j < joints.size(); j++)
+			{
+				const GltfJoint& joint = joints[j];
+				XMFLOAT3 translation = joint.position;
+				if (joint.parent >= 0)
+				{
+					const XMFLOAT3& parent = joints[joint.parent].position;
+					translation = XMFLOAT3(translation.x - parent.x, translation.y - parent.y, translation.z - parent.z);
+				}
+				json.separate();
+				json.raw("{");
+				json.key("name"); json.string(joint.name);
+				json.key("translation"); json.numbers(&translation.x, 3);
+				bool has_children = false;
+				for (size_t child = j + 1; child < joints.size(); child++)
+				{
+					if (joints[child].parent == int(j))
+					{
+						if (!has_children)
+						{
+							json.key("children"); json.raw("[");
+							has_children = true;
+						}
+						json.separate();
+						json.number(first_joint[i] + child);
+					}
+				}
+				if (has_children)
+				{
+					json.raw("]");
+				}
+				json.raw("}");
+			}
+		}
+		json.raw("]");
+
+		// Accessors and buffer views come in the same order: position, normal, texture coordinates, joints, weights,
+		// indices, inverse bind matrices
+		std::vector<size_t> inverse_bind_accessor(meshes.size());
+		json.key("meshes"); json.raw("[");
+		size_t accessor = 0;
+		for (size_t i = 0; i < meshes.size(); i++)
+		{
+			const GltfMesh& mesh = meshes[i];
+			json.separate();
+			json.raw("{");
+			json.key("name"); json.string(mesh.name);
+			json.key("primitives"); json.raw("[{");
+			json.key("attributes"); json.raw("{");
+			json.key("POSITION"); json.number(accessor++);
+			if (mesh.vertices.normals)
+			{
+				json.key("NORMAL"); json.number(accessor++);
+			}
+			if (mesh.tex_coords)
+			{
+				json.key("TEXCOORD_0"); json.number(accessor++);
+			}
+			if (mesh.skin)
+			{
+				json.key("JOINTS_0"); json.number(accessor++);
+				json.key("WEIGHTS_0"); json.number(accessor++);
+			}
+			json.raw("}");
+			json.key("indices"); json.number(accessor++);
+			if (mesh.skin)
+			{
+				inverse_bind_accessor[i] = accessor++;
+			}
+			if (mesh.material >= 0 && size_t(mesh.material) < materials.size())
+			{
+				json.key("material"); json.number(size_t(mesh.material));
+			}
+			json.raw("}]}");
+		}
+		json.raw("]");
+
+		if (!materials.empty())
+		{
+			json.key("materials"); json.raw("[");
+			for (const GltfMaterial& material : materials)
+			{
+				json.separate();
+				json.raw("{");
+				json.key("name"); json.string(material.name);
+				json.key("pbrMetallicRoughness"); json.raw("{");
+				json.key("baseColorFactor"); json.numbers(&material.base_color.x, 4);
+				json.key("metallicFactor"); json.number(material.metallic);
+				json.key("roughnessFactor"); json.number(material.roughness);
+				json.raw("}");
+				if (!material.extras.empty())
+				{
+					json.key("extras"); json.raw("{");
+					for (const GltfExtra& extra : material.extras)
+					{
+						json.separate();
+						json.string(extra.name);
+						json.raw(":");
+						if (extra.values.size() == 1)
+						{
+							json.number(extra.values[0]);
+						}
+						else
+						{
+							json.numbers(extra.values.data(), int(extra.values.size()));
+						}
+					}
+					json.raw("}");
+				}
+				json.raw("}");
+			}
+			json.raw("]");
+		}
+
+		if (skin_count > 0)
+		{
+			json.key("skins"); json.raw("[");
+			for (size_t i = 0; i < meshes.size(); i++)
+			{
+				if (!meshes[i].skin)
+				{
+					continue;
+				}
+				const std::vector<GltfJoint>& joints = meshes[i].skin->joints;
+				json.separate();
+				json.raw("{");
+				json.key("inverseBindMatrices"); json.number(inverse_bind_accessor[i]);
+				json.key("joints"); json.raw("[");
+				for (size_t j = 0; j < joints.size(); j++)
+				{
+					json.separate();
+					json.number(first_joint[i] + j);
+				}
+				json.raw("]");
+				json.raw("}");
+			}
+			json.raw("]");
+		}
+
+		json.key("accessors"); json.raw("[");
+		size_t view = 0;
+		for (size_t i = 0; i < meshes.size(); i++)
+		{
+			const GltfMesh& mesh = meshes[i];
+			const MeshLayout& layout = layouts[i];
+			UINT n = mesh.vertices.vertex_count;
+			if (quantize)
+			{
+				// The bounds in grid steps, worked out the same way as the data
+				float inv_scale = 1.0f / layout.scale;
+				float zero[3] = { 0.0f, 0.0f, 0.0f };
+				float steps[3];
+				for (int axis = 0; axis < 3; axis++)
+				{
+					steps[axis] = quantize_unorm16(layout.max[axis], layout.min[axis], inv_scale);
+				}
+				write_accessor(json, view++, UnsignedShort, false, n, "VEC3", zero, steps, 3);
+			}
+			else
+			{
+				write_accessor(json, view++, Float, false, n, "VEC3", layout.min, layout.max, 3);
+			}
+			if (mesh.vertices.normals)
+			{
+				write_accessor(json, view++, quantize ? Byte : Float, quantize, n, "VEC3");
+			}
+			if (mesh.tex_coords)
+			{
+				bool unorm = quantize && layout.unorm_tex_coords;
+				write_accessor(json, view++, unorm ? UnsignedShort : Float, unorm, n, "VEC2");
+			}
+			if (mesh.skin)
+			{
+				write_accessor(json, view++, UnsignedShort, false, n, "VEC4");
+				write_accessor(json, view++, Float, false, n, "VEC4");
+			}
+			write_accessor(json, view++, layout.index16 ? UnsignedShort : UnsignedInt, false, mesh.index_count, "SCALAR");
+			if (mesh.skin)
+			{
+				write_accessor(json, view++, Float, false, UINT(mesh.skin->joints.size()), "MAT4");
+			}
+		}
+		json.raw("]");
+
+		json.key("bufferViews"); json.raw("[");
+		for (size_t i = 0; i < meshes.size(); i++)
+		{
+			const GltfMesh& mesh = meshes[i];
+			const MeshLayout& layout = layouts[i];
+			// Quantized vec3s are padded to 4 byte elements, as vertex attributes have to be
+			write_buffer_view(json, layout.position_offset, layout.position_size, quantize ? 4 * sizeof(UINT16) : 0, ArrayBuffer);
+			if (mesh.vertices.normals)
+			{
+				write_buffer_view(json, layout.normal_offset, layout.normal_size, quantize ? 4 * sizeof(INT8) : 0, ArrayBuffer);
+			}
+			if (mesh.tex_coords)
+			{
+				write_buffer_view(json, layout.tex_coord_offset, layout.tex_coord_size, 0, ArrayBuffer);
+			}
+			if (mesh.skin)
+			{
+				write_buffer_view(json, layout.joint_offset, layout.joint_size, 0, ArrayBuffer);
+				write_buffer_view(json, layout.weight_offset, layout.weight_size, 0, ArrayBuffer);
+			}
+			write_buffer_view(json, layout.index_offset, mesh.index_count * (layout.index16 ? 2 : 4), 0, ElementArrayBuffer);
+			if (mesh.skin)
+			{
+				write_buffer_view(json, layout.inverse_bind_offset, layout.inverse_bind_size, 0, NoTarget);
+			}
+		}
+		json.raw("]");
+
+		json.key("buffers"); json.raw("[{");
+		json.key("byteLength"); json.number(bin_size);
+		json.raw("}]");
+		json.raw("}");
+		return json.text;
+	}
+
+	// Encodes count elements of element_size bytes with encode(index, destination), a block at a time
+	template <class Encode>
+	void stream(std::ofstream& out, std::vector<char>& block, UINT count, size_t element_size, Encode encode)
+	{
+		UINT block_count = UINT(block.size() / element_size);
+		for (UINT first = 0; first < count; first += block_count)
+		{
+			UINT n = min(block_count, count - first);
+			char* destination = block.data();
+			for (UINT i = 0; i < n; i++, destination += element_size)
+			{
+				encode(first + i, destination);
+			}
+			out.write(block.data(), n * element_size);
+		}
+	}
+
+	void write_mesh_data(std::ofstream& out, std::vector<char>& block, const GltfMesh& mesh, const MeshLayout& layout, bool quantize)
+	{
+		const VertexStreams& v = mesh.vertices;
+		UINT n = v.vertex_count;
+		if (quantize)
+		{
+			float inv_scale = 1.0f / layout.scale;
+			stream(out, block, n, 4 * sizeof(UINT16), [&](UINT i, char* destination)
+			{
+				const float* p = v.positions + i * v.stride;
+				UINT16 q[4] = {
+					quantize_unorm16(p[0], layout.min[0], inv_scale),
+					quantize_unorm16(p[1], layout.min[1], inv_scale),
+					quantize_unorm16(p[2], layout.min[2], inv_scale),
+					0 };
+				memcpy(destination, q, sizeof(q));
+			});
+			if (v.normals)
+			{
+				stream(out, block, n, 4 * sizeof(INT8), [&](UINT i, char* destination)
+				{
+					XMFLOAT3 normal = unit_normal(v.normals + i * v.stride);
+					INT8 q[4] = { quantize_snorm8(normal.x), quantize_snorm8(normal.y), quantize_snorm8(normal.z), 0 };
+					memcpy(destination, q, sizeof(q));
+				});
+			}
+		}
+		else
+		{
+			stream(out, block, n, 3 * sizeof(float), [&](UINT i, char* destination)
+			{
+				memcpy(destination, v.positions + i * v.stride, 3 * sizeof(float));
+			});
+			if (v.normals)
+			{
+				stream(out, block, n, 3 * sizeof(float), [&](UINT i, char* destination)
+				{
+					XMFLOAT3 normal = unit_normal(v.normals + i * v.stride);
+					memcpy(destination, &normal, sizeof(normal));
+				});
+			}
+		}
+
+		if (mesh.tex_coords)
+		{
+			if (quantize && layout.unorm_tex_coords)
+			{
+				stream(out, block, n, 2 * sizeof(UINT16), [&](UINT i, char* destination)
+				{
+					const float* t = mesh.tex_coords + i * v.stride;
+					UINT16 q[2] = { quantize_unorm16(t[0], 0.0f, 65535.0f), quantize_unorm16(t[1], 0.0f, 65535.0f) };
+					memcpy(destination, q, sizeof(q));
+				});
+			}
+			else
+			{
+				stream(out, block, n, 2 * sizeof(float), [&](UINT i, char* destination)
+				{
+					memcpy(destination, mesh.tex_coords + i * v.stride, 2 * sizeof(float));
+				});
+			}
+		}
+
+		if (const GltfSkin* skin = mesh.skin)
+		{
+			const char* influences = reinterpret_cast<const char*>(skin->vertex_joints);
+			stream(out, block, n, c_skin_influences * sizeof(UINT16), [&](UINT i, char* destination)
+			{
+				memcpy(destination, influences + size_t(i) * skin->stride, c_skin_influences * sizeof(UINT16));
+			});
+			influences = reinterpret_cast<const char*>(skin->vertex_weights);
+			stream(out, block, n, c_skin_influences * sizeof(float), [&](UINT i, char* destination)
+			{
+				memcpy(destination, influences + size_t(i) * skin->stride, c_skin_influences * sizeof(float));
+			});
+		}
+
+		if (layout.index16)
+		{
+			stream(out, block, mesh.index_count, sizeof(UINT16), [&](UINT i, char* destination)
+			{
+				UINT16 index = static_cast<UINT16>(read_index(mesh.indices, mesh.index_size, i));
+				memcpy(destination, &index, sizeof(index));
+			});
+		}
+		else
+		{
+			stream(out, block, mesh.index_count, sizeof(UINT), [&](UINT i, char* destination)
+			{
+				UINT index = read_index(mesh.indices, mesh.index_size, i);
+				memcpy(destination, &index, sizeof(index));
+			});
+		}
+		const char padding[4] = {};
+		out.write(padding, layout.index_size - size_t(mesh.index_count) * (layout.index16 ? 2 : 4));
+
+		if (mesh.skin)
+		{
+			stream(out, block, UINT(mesh.skin->joints.size()), 16 * sizeof(float), [&](UINT j, char* destination)
+			{
+				float m[16];
+				inverse_bind_matrix(mesh.skin->joints[j], layout, quantize, m);
+				memcpy(destination, m, sizeof(m));
+			});
+		}
+	}
+}
+
+GltfMesh GltfMesh::of(const Mesh& mesh)
+{
+	GltfMesh result;
+	result.name = mesh.name;
+	result.vertices = VertexStreams::of(mesh);
+	result.tex_coords = mesh.vertices.empty() ? nullptr : &mesh.vertices[0].texCoord.x;
+	result.indices = mesh.index_data();
+	result.index_count = mesh.index_count();
+	result.index_size = mesh.index_size();
+	result.material = -1;
+	result.skin = nullptr;
+	return result;
+}
+
+GltfMesh GltfMesh::of(const MeshView& mesh)
+{
+	static_assert(sizeof(Vertex) % sizeof(float) == 0, "Vertices are read as floats");
+	GltfMesh result;
+	result.name = mesh.name;
+	result.vertices.positions = &mesh.vertices[0].position.x;
+	result.vertices.normals = &mesh.vertices[0].normal.x;
+	result.vertices.stride = sizeof(Vertex) / sizeof(float);
+	result.vertices.vertex_count = mesh.vertex_count;
+	result.tex_coords = &mesh.vertices[0].texCoord.x;
+	result.indices = mesh.indices;
+	result.index_count = mesh.index_count;
+	result.index_size = (mesh.index_format == DXGI_FORMAT_R16_UINT) ? 2 : 4;
+	result.material = -1;
+	result.skin = nullptr;
+	return result;
+}
+
+bool Model::write_glb(const std::string& path, const std::vector<GltfMesh>& meshes, const std::vector<GltfMaterial>& materials,
+	bool quantize)
+{
+	// Accessors cannot be empty, so neither can the meshes
+	std::vector<GltfMesh> exported;
+	for (const GltfMesh& mesh : meshes)
+	{
+		if (mesh.vertices.vertex_count > 0 && mesh.index_count > 0)
+		{
+			exported.push_back(mesh);
+		}
+	}
+
+	std::vector<MeshLayout> layouts;
+	size_t bin_size = 0;
+	for (const GltfMesh& mesh : exported)
+	{
+		layouts.push_back(layout_mesh(mesh, quantize, bin_size));
+	}
+
+	std::string json = make_json(exported, layouts, materials, quantize, bin_size);
+	json.resize((json.size() + 3) & ~size_t(3), ' ');
+
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	if (!out)
+	{
+		return false;
+	}
+	UINT header[5] = {
+		c_glb_magic, 2, UINT(12 + 8 + json.size() + (bin_size > 0 ? 8 + bin_size : 0)),
+		UINT(json.size()), c_json_chunk };
+	out.write(reinterpret_cast<const char*>(header), sizeof(header));
+	out.write(json.data(), json.size());
+
+	if (bin_size > 0)
+	{
+		UINT chunk[2] = { UINT(bin_size), c_bin_chunk };
+		out.write(reinterpret_cast<const char*>(chunk), sizeof(chunk));
+		std::vector<char> block(c_block_bytes);
+		for (size_t i = 0; i < exported.size(); i++)
+		{
+			write_mesh_data(out, block, exported[i], layouts[i], quantize);
+		}
+	}
+	return bool(out);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "MeshSimplifier.h"
+#include "MeshCache.h"
+
+#include <string>
+
+namespace Model
+{
+	// A named number, or list of numbers, in a material's extras
+	struct GltfExtra
+	{
+		std::string name;
+		std::vector<float> values;		// A single value is written as a number, more as an array
+	};
+
+	struct GltfMaterial
+	{
+		std::string name;
+		XMFLOAT4 base_color;
+		float metallic;
+		float roughness;
+		std::vector<GltfExtra> extras;	// Whatever glTF has no field for, e.g. the creature's albedos and noise types
+	};
+
+	// A joint of a skin in the bind pose. Joints have no rotation of their own there, only an offset from their parent.
+	struct GltfJoint
+	{
+		std::string name;
+		int parent;					// Into the skin's joints, -1 for a root; parents come before their children
+		XMFLOAT3 position;			// In the mesh's space
+	};
+
+	// Linear blend skinning of a mesh: four joints and weights per vertex, read in place
+	struct GltfSkin
+	{
+		std::vector<GltfJoint> joints;
+		const UINT16* vertex_joints;	// Into the joints
+		const float* vertex_weights;	// Summing to 1
+		UINT stride;					// Bytes from one vertex's joints and weights to the next's
+	};
+
+	// One mesh to export, read in place
+	struct GltfMesh
+	{
+		std::string name;
+		VertexStreams vertices;
+		const float* tex_coords;	// Optional, float pairs vertices.stride floats apart
+		const void* indices;
+		UINT index_count;
+		UINT index_size;			// 2 or 4 bytes
+		int material;				// Into the materials, -1 for none
+		const GltfSkin* skin;		// Optional
+
+		static GltfMesh of(const Mesh& mesh);
+		static GltfMesh of(const MeshView& mesh);
+	};
+
+	// Writes a binary glTF 2.0 file with a node per mesh. The JSON chunk is written as text straight away, from the
+	// sizes and bounds of the meshes, then the vertex and index data is encoded in small blocks and streamed after it.
+	// With quantize the file uses KHR_mesh_quantization: positions as 16 bit integers on a grid over the mesh
+	// bounds (the node's translation and uniform scale undo it), normals as normalized bytes and texture
+	// coordinates in [0, 1] as normalized 16 bit integers. Indices are 16 bit whenever the vertex count allows.
+	// A skinned mesh gets its joints as nodes of their own and a skin; as viewers ignore the transform of a skinned
+	// mesh's node, the grid goes into the inverse bind matrices instead.
+	// Returns false if the file cannot be written.
+	bool write_glb(const std::string& path, const std::vector<GltfMesh>& meshes, const std::vector<GltfMaterial>& materials,
+		bool quantize);
+}
@@ -0,0 +1,104 @@
+#include "stdafx.h"
+#include "MappedFile.h"
+
+#include <fstream>
+
+using namespace Model;
+
+static UINT64 to_uint64(DWORD high, DWORD low)
+{
+	return (UINT64(high) << 32) | low;
+}
+
+MappedFile::MappedFile(const std::string& path) :
+	mapping(nullptr),
+	view(nullptr),
+	file_size(0),
+	last_write(0)
+{
+	file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	LARGE_INTEGER size;
+	if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size))
+	{
+		return;
+	}
+	FILETIME time;
+	if (GetFileTime(file, nullptr, nullptr, &time))
+	{
+		last_write = to_uint64(time.dwHighDateTime, time.dwLowDateTime);
+	}
+	if (size.QuadPart == 0)
+	{
+		// Empty files cannot be mapped
+		return;
+	}
+	file_size = size_t(size.QuadPart);
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping != nullptr)
+	{
+		view = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+	}
+}
+
+MappedFile::~MappedFile()
+{
+	if (view != nullptr) UnmapViewOfFile(view);
+	if (mapping != nullptr) CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+}
+
+bool Model::file_stamp(const std::string& path, UINT64& size, UINT64& write_time)
+{
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &attributes))
+	{
+		return false;
+	}
+	size = to_uint64(attributes.nFileSizeHigh, attributes.nFileSizeLow);
+	write_time = to_uint64(attributes.ftLastWriteTime.dwHighDateTime, attributes.ftLastWriteTime.dwLowDateTime);
+	return true;
+}
+
+UINT64 Model::hash_bytes(const char* data, size_t size)
+{
+	UINT64 hash = 14695981039346656037ull;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+	}
+	return hash;
+}
+
+bool Model::write_file(const std::string& path, const std::vector<char>& contents)
+{
+	std::string temp_path = path + ".tmp";
+	{
+		std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+		out.write(contents.data(), contents.size());
+		if (!out)
+		{
+			return false;
+		}
+	}
+	return MoveFileExA(temp_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+}
+
+bool Model::restamp_cache(std::unique_ptr<MappedFile>& cache, const std::string& cache_path, const std::string& source_path,
+	UINT64 source_hash, size_t write_time_offset, UINT64 write_time)
+{
+	{
+		MappedFile source(source_path);
+		if (!source.is_open() || hash_bytes(source.data(), source.size()) != source_hash)
+		{
+			return false;
+		}
+	}
+
+	// A mapped file cannot be replaced, so the restamped copy is written from memory and mapped again
+	std::vector<char> restamped(cache->data(), cache->data() + cache->size());
+	memcpy(restamped.data() + write_time_offset, &write_time, sizeof(write_time));
+	cache.reset();
+	write_file(cache_path, restamped);
+	cache.reset(new MappedFile(cache_path));
+	return cache->is_open();
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Model
+{
+	// Read-only view of a whole file, mapped for as long as the object lives
+	class MappedFile
+	{
+	public:
+		explicit MappedFile(const std::string& path);
+		~MappedFile();
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		// Empty files are open but have no view, there is nothing to read in them anyway
+		bool is_open() const { return file != INVALID_HANDLE_VALUE && (file_size == 0 || view != nullptr); }
+
+		const char* data() const { return view; }
+		size_t size() const { return file_size; }
+
+		// Last write time of the file, in 100 ns FILETIME units
+		UINT64 write_time() const { return last_write; }
+
+	private:
+		HANDLE file;
+		HANDLE mapping;
+		const char* view;
+		size_t file_size;
+		UINT64 last_write;
+	};
+
+	// Size and last write time of a file, without opening it. Returns false if there is no such file.
+	bool file_stamp(const std::string& path, UINT64& size, UINT64& write_time);
+
+	// FNV-1a
+	UINT64 hash_bytes(const char* data, size_t size);
+
+	// Writes next to path first, so a crash midway never leaves a broken file behind
+	bool write_file(const std::string& path, const std::vector<char>& contents);
+
+	// For a cache whose source was touched but maybe not changed. If the source still hashes to source_hash,
+	// stores write_time in the cache's UINT64 at write_time_offset, so later runs match without hashing, and
+	// maps the cache again. Returns false if the source changed or the cache could not be mapped.
+	bool restamp_cache(std::unique_ptr<MappedFile>& cache, const std::string& cache_path, const std::string& source_path,
+		UINT64 source_hash, size_t write_time_offset, UINT64 write_time);
+}
@@ -22,7 +22,8 @@ March::March(vec3 scale, vec3 trans, float divs, Cases* cases, SDF* sdfS) :
 	edges(),	 //new Map<string, Edge>();
 	
 	triVerts(),
-	triNorms()
+	triNorms(),
+	triIndices()
 {
 	// Allocate space
 	positions.resize(numVerts);
@@ -79,7 +80,7 @@ March::March(vec3 scale, vec3 trans, float divs, Cases* cases, SDF* sdfS) :
 				}
 
 				// z-axis edge
-				if (y < divisions) {
+				if (z < divisions) {
 					int index2 = (z + 1) +
 								(divisions + 1) * y +
 								(divisions + 1) * (divisions + 1) * x;
@@ -94,10 +95,10 @@ March::March(vec3 scale, vec3 trans, float divs, Cases* cases, SDF* sdfS) :
 	vec3 newScale = vec3(tempRefTrans[0] * 2.0 / divisions,
 						 tempRefTrans[1] * 2.0 / divisions,
 						 tempRefTrans[2] * 2.0 / divisions);
-	// Block loop
-	for (float x = 0.0; x <= divisions; x++) {
-		for (float y = 0.0; y <= divisions; y++) {
-			for (float z = 0.0; z <= divisions; z++) {
+	// Block loop, one block per cube between the vertices
+	for (float x = 0.0; x < divisions; x++) {
+		for (float y = 0.0; y < divisions; y++) {
+			for (float z = 0.0; z < divisions; z++) {
 				vec3 newPos = vec3(((x * delta - 1.0) + delta / 2) * tempRefScale[0] + tempRefTrans[0],
 								   ((y * delta - 1.0) + delta / 2) * tempRefScale[1] + tempRefTrans[1],
 								   ((z * delta - 1.0) + delta / 2) * tempRefScale[2] + tempRefTrans[2]);
@@ -123,16 +124,21 @@ March::March(vec3 scale, vec3 trans, float divs, Cases* cases, SDF* sdfS) :
 				}
 
 				int index = z +
-					(divisions + 1) * y +
-					(divisions + 1) * (divisions + 1) * x;
-				if (index <= numBlocks) {
-					blocks[index] = std::make_unique<Block>(vertArr, newPos, newScale);
-				}
+					divisions * y +
+					divisions * divisions * x;
+				blocks[index] = std::make_unique<Block>(vertArr, newPos, newScale);
 			}
 		}
 	}
 }
 
+March::March(const D3D12_RAYTRACING_AABB& bounds, float divs, Cases* cases, SDF* sdfS) :
+	March(vec3(0.5f * (bounds.MaxX - bounds.MinX), 0.5f * (bounds.MaxY - bounds.MinY), 0.5f * (bounds.MaxZ - bounds.MinZ)),
+		vec3(0.5f * (bounds.MinX + bounds.MaxX), 0.5f * (bounds.MinY + bounds.MaxY), 0.5f * (bounds.MinZ + bounds.MaxZ)),
+		divs, cases, sdfS)
+{
+}
+
 
 March::~March()
 {
@@ -157,7 +163,7 @@ void March::callMeshClass()
 void March::testVertexSDFs()
 {
 	for (int i = 0; i < numVerts; i++) {
-		weights[i] = sdf->sceneSDF(positions[i]);
+		weights[i] = sdf->creatureSDF(positions[i]);
 	}
 }
 
@@ -170,7 +176,7 @@ void March::resolveAmbiguities(std::vector<int> ambiguities, int blockNum)
 		}
 		avg /= ambiguities.size();
 
-		float result = sdf->sceneSDF(avg);
+		float result = sdf->creatureSDF(avg);
 		if (result <= 0) {
 			int cNum = blocks[blockNum]->caseNum;
 			blocks[blockNum]->caseNum = caseData->caseArray[cNum]->ambNum;
@@ -225,6 +231,12 @@ void March::testBoxValues()
 
 std::pair<int, int> March::edgeCheck(vec3 point)
 {
+	// The rotations leave the coordinates a rounding error off the half steps, which the tests below need exactly.
+	// Missing the edge would make the triangle use vertex 0 instead.
+	for (unsigned int i = 0; i < 3; i++) {
+		point[i] = roundf(point[i] * 2.0f) * 0.5f;
+	}
+
 	if (point[1] == -0.5 && point[2] == -0.5) { return std::make_pair<int, int>(0, 3); }
     if (point[1] == -0.5 && point[2] ==  0.5) { return std::make_pair<int, int>(1, 2); }
     if (point[1] ==  0.5 && point[2] ==  0.5) { return std::make_pair<int, int>(5, 6); }
@@ -243,14 +255,43 @@ std::pair<int, int> March::edgeCheck(vec3 point)
 	return std::make_pair<int, int>(0, 0);
 }
 
-void March::setTriangles()
+void March::setTriangles(const std::vector<Model::MeshStreamWriter*>& writers)
 {
 	vec3 center = vec3(0, 0, 0);
     vec3 scale = vec3(tempRefScale[0] * 2.0 / divisions,
                       tempRefScale[1] * 2.0 / divisions,
                       tempRefScale[2] * 2.0 / divisions);
 
+	// Blocks go one x slab at a time, and a slab only touches vertices on its two planes. So once slab x is done,
+	// the vertices made before it began (on planes x and below) and the triangles made with them are final.
+	int slabSize = int(divisions * divisions);
+	int slab = 0;
+	size_t slabFirstVert = 0, slabFirstIndex = 0;		// Where the current slab began
+	size_t streamedVerts = 0, streamedIndices = 0;
+	auto streamTo = [&](size_t vertEnd, size_t indexEnd) {
+		if (writers.empty() || (vertEnd == streamedVerts && indexEnd == streamedIndices)) {
+			return;
+		}
+		static_assert(sizeof(vec3) == 3 * sizeof(float), "vec3 is read as packed floats");
+		Model::VertexStreams streams;
+		streams.positions = triVerts.empty() ? nullptr : &triVerts[0][0];
+		streams.normals = triNorms.empty() ? nullptr : &triNorms[0][0];
+		streams.stride = 3;
+		streams.vertex_count = UINT(vertEnd);
+		for (Model::MeshStreamWriter* writer : writers) {
+			writer->add(streams, UINT(streamedVerts), triIndices.data() + streamedIndices, UINT(indexEnd - streamedIndices));
+		}
+		streamedVerts = vertEnd;
+		streamedIndices = indexEnd;
+	};
+
     for (int i = 0; i < blocks.size(); i++) {
+		if (i / slabSize != slab) {
+			streamTo(slabFirstVert, slabFirstIndex);
+			slab = i / slabSize;
+			slabFirstVert = triVerts.size();
+			slabFirstIndex = triIndices.size();
+		}
         int c = blocks[i]->caseNum;
         if (c != -1) {
             for (int t = 0; t < caseData->caseArray[c]->triangles.size(); t++) {
@@ -314,6 +355,7 @@ void March::setTriangles()
                 }
 
                 Triangle2* newTri = new Triangle2(currTriangle);
+                triIndices.insert(triIndices.end(), currTriangle.begin(), currTriangle.end());
                 // Flat normal of this triangle face
                 vec3 faceNorm = newTri->getNormal(triVerts[currTriangle[0]],
                                                   triVerts[currTriangle[1]],
@@ -340,4 +382,43 @@ void March::setTriangles()
             }
         }
     }
+	streamTo(triVerts.size(), triIndices.size());
+}
+
+Model::MeshOptimizeReport March::optimizeTriangles()
+{
+	Model::MeshOptimizeReport report;
+	UINT vertexCount = UINT(triVerts.size());
+	report.before = Model::analyze_vertex_cache(triIndices, vertexCount);
+	Model::optimize_vertex_cache(triIndices, vertexCount);
+
+	std::vector<UINT> remap;
+	UINT usedCount = Model::optimize_vertex_fetch(triIndices, vertexCount, remap);
+	Model::remap_vertices(triVerts, remap, usedCount);
+	Model::remap_vertices(triNorms, remap, usedCount);
+	report.after = Model::analyze_vertex_cache(triIndices, usedCount);
+
+	// Keep the blocks' triangles pointing at the same vertices
+	for (auto& block : blocks) {
+		if (!block) {
+			continue;
+		}
+		for (Triangle2* tri : block->triangles) {
+			for (int& index : tri->indices) {
+				index = int(remap[index]);
+			}
+		}
+	}
+	return report;
+}
+
+std::vector<Model::MeshLod> March::buildLods(const std::vector<float>& ratios)
+{
+	static_assert(sizeof(vec3) == 3 * sizeof(float), "vec3 is read as packed floats");
+	Model::VertexStreams streams;
+	streams.positions = triVerts.empty() ? nullptr : &triVerts[0][0];
+	streams.normals = triNorms.empty() ? nullptr : &triNorms[0][0];
+	streams.stride = 3;
+	streams.vertex_count = UINT(triVerts.size());
+	return Model::build_lod_chain(triIndices, streams, ratios);
 }
@@ -1,6 +1,9 @@
 #pragma once
 
 #include "Cases.h"
+#include "MeshOptimizer.h"
+#include "MeshSimplifier.h"
+#include "MeshStreamWriter.h"
 
 class March
 {
@@ -26,6 +29,7 @@ public:
     // Final triangle-vertices and normals (to pass into Mesh)
     std::vector<vec3> triVerts;
     std::vector<vec3> triNorms;
+    std::vector<UINT> triIndices; // Three per triangle, into triVerts and triNorms
 
     // The end result
     //finalMesh: Mesh;
@@ -33,6 +37,8 @@ public:
 
 	/// FUNCTIONS
 	March(vec3 scale, vec3 trans, float divs, Cases* cases, SDF* sdfS);
+	// Marches the grid over bounds, e.g. CreatureBounds::creature()
+	March(const D3D12_RAYTRACING_AABB& bounds, float divs, Cases* cases, SDF* sdfS);
 	~March();
 
 	// Immediately sends this data to Mesh
@@ -50,7 +56,15 @@ public:
 	// Check which marching-cube-edge a vertex falls on - pre-scale & translation
 	std::pair<int, int> edgeCheck(vec3 point);
 
-	// Determines the final triangle vertices for this mesh
-	void setTriangles();
+	// Determines the final triangle vertices for this mesh, handing each finished slab of blocks to the writers
+	// while the next ones are meshed
+	void setTriangles(const std::vector<Model::MeshStreamWriter*>& writers = {});
+
+	// Reorders triIndices for the vertex cache, then triVerts and triNorms in the order they are used.
+	// Returns the ACMR/ATVR before and after.
+	Model::MeshOptimizeReport optimizeTriangles();
+
+	// Simplified versions of triIndices at the given (decreasing) triangle ratios, sharing triVerts and triNorms
+	std::vector<Model::MeshLod> buildLods(const std::vector<float>& ratios);
 };
 
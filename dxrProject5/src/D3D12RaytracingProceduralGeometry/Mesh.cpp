@@ -1,2 +1,88 @@
 #include "stdafx.h"
 #include "Mesh.h"
+
+using namespace Model;
+
+static const UINT c_emptySlot = UINT_MAX;
+
+// The vertex as 8 words, with -0 turned into 0 so that both weld together
+static void vertex_words(const Vertex& vertex, UINT words[8])
+{
+	static_assert(sizeof(Vertex) == 8 * sizeof(float), "Vertex is expected to be 8 packed floats");
+	float values[8];
+	memcpy(values, &vertex, sizeof(values));
+	for (int i = 0; i < 8; i++)
+	{
+		values[i] += 0.0f;
+	}
+	memcpy(words, values, sizeof(values));
+}
+
+static UINT hash_words(const UINT words[8])
+{
+	// FNV-1a over the words, then a final mix so the low bits used for the slot depend on all of them
+	UINT hash = 2166136261u;
+	for (int i = 0; i < 8; i++)
+	{
+		hash = (hash ^ words[i]) * 16777619u;
+	}
+	hash ^= hash >> 15;
+	hash *= 0x2c1b3c6du;
+	hash ^= hash >> 12;
+	return hash;
+}
+
+void Mesh::set_triangles(const std::vector<Vertex>& triangle_vertices, const std::vector<UINT>& triangle_indices)
+{
+	vertices.clear();
+	vertex_indices.clear();
+	vertex_indices32.clear();
+
+	// Open addressing table of indices into vertices, at most half full
+	UINT table_size = 16;
+	while (table_size < 2 * triangle_vertices.size())
+	{
+		table_size *= 2;
+	}
+	std::vector<UINT> table(table_size, c_emptySlot);
+	std::vector<UINT> welded(triangle_vertices.size());
+	std::vector<UINT> keys;
+	keys.reserve(triangle_vertices.size() * 8);
+
+	for (size_t i = 0; i < triangle_vertices.size(); i++)
+	{
+		UINT words[8];
+		vertex_words(triangle_vertices[i], words);
+
+		UINT slot = hash_words(words) & (table_size - 1);
+		while (table[slot] != c_emptySlot && memcmp(&keys[table[slot] * 8], words, sizeof(words)) != 0)
+		{
+			slot = (slot + 1) & (table_size - 1);
+		}
+		if (table[slot] == c_emptySlot)
+		{
+			table[slot] = UINT(vertices.size());
+			vertices.push_back(triangle_vertices[i]);
+			keys.insert(keys.end(), words, words + 8);
+		}
+		welded[i] = table[slot];
+	}
+
+	// Every index from 0 to 0xffff is usable in a triangle list, so 16 bits reach 65536 vertices
+	if (vertices.size() <= 0x10000)
+	{
+		vertex_indices.reserve(triangle_indices.size());
+		for (UINT index : triangle_indices)
+		{
+			vertex_indices.push_back(Index(welded[index]));
+		}
+	}
+	else
+	{
+		vertex_indices32.reserve(triangle_indices.size());
+		for (UINT index : triangle_indices)
+		{
+			vertex_indices32.push_back(welded[index]);
+		}
+	}
+}
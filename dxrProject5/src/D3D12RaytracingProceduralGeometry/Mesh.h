@@ -184,6 +184,7 @@ namespace Model
 	};
 
 	using Index = UINT16;
+	using Index32 = UINT;
 
 	struct Mesh
 	{
@@ -191,7 +192,17 @@ namespace Model
 
 		std::vector<Vertex> vertices;
 
+		// Only one of these is filled: 16 bit indices when every vertex can be reached with them, 32 bit ones otherwise
 		std::vector<Index> vertex_indices;
+		std::vector<Index32> vertex_indices32;
 		//Material material;
+
+		// Replaces the mesh with an indexed triangle list, welding vertices whose position, normal and tex coord are identical
+		void set_triangles(const std::vector<Vertex>& triangle_vertices, const std::vector<UINT>& triangle_indices);
+
+		UINT index_count() const { return UINT(vertex_indices32.empty() ? vertex_indices.size() : vertex_indices32.size()); }
+		UINT index_size() const { return vertex_indices32.empty() ? sizeof(Index) : sizeof(Index32); }
+		DXGI_FORMAT index_format() const { return vertex_indices32.empty() ? DXGI_FORMAT_R16_UINT : DXGI_FORMAT_R32_UINT; }
+		const void* index_data() const { return vertex_indices32.empty() ? (const void*)vertex_indices.data() : (const void*)vertex_indices32.data(); }
 	};
 }
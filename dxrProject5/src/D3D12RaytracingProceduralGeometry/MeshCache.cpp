@@ -0,0 +1,194 @@
+#include "stdafx.h"
+#include "MeshCache.h"
+#include "MeshLoader.h"
+
+using namespace Model;
+
+namespace
+{
+	const char c_magic[4] = { 'M', 'C', 'S', 'H' };
+	const size_t c_block_alignment = 64;
+
+	struct CacheHeader
+	{
+		char magic[4];
+		UINT version;
+		UINT vertex_size;			// sizeof(Vertex) when it was written, a layout change invalidates the cache too
+		UINT mesh_count;
+		UINT64 source_size;
+		UINT64 source_write_time;
+		UINT64 source_hash;
+	};
+
+	struct CacheEntry
+	{
+		UINT64 vertex_offset;
+		UINT64 index_offset;
+		UINT vertex_count;
+		UINT index_count;
+		UINT index_size;
+		UINT index_data_size;
+		UINT name_offset;
+		UINT name_length;
+	};
+
+	size_t align_block(size_t offset)
+	{
+		return (offset + c_block_alignment - 1) & ~(c_block_alignment - 1);
+	}
+
+	std::vector<char> serialize(const std::vector<Mesh>& meshes, const CacheHeader& header)
+	{
+		// Lay out the file first: header, entries, names, then the blocks
+		std::vector<CacheEntry> entries(meshes.size());
+		size_t offset = sizeof(CacheHeader) + meshes.size() * sizeof(CacheEntry);
+		for (size_t i = 0; i < meshes.size(); i++)
+		{
+			entries[i].name_offset = UINT(offset);
+			entries[i].name_length = UINT(meshes[i].name.size());
+			offset += meshes[i].name.size();
+		}
+		for (size_t i = 0; i < meshes.size(); i++)
+		{
+			const Mesh& mesh = meshes[i];
+			CacheEntry& entry = entries[i];
+			entry.vertex_offset = align_block(offset);
+			entry.vertex_count = UINT(mesh.vertices.size());
+			entry.index_offset = align_block(entry.vertex_offset + mesh.vertices.size() * sizeof(Vertex));
+			entry.index_count = mesh.index_count();
+			entry.index_size = mesh.index_size();
+			entry.index_data_size = (entry.index_count * entry.index_size + 3) & ~3u;
+			offset = entry.index_offset + entry.index_data_size;
+		}
+
+		std::vector<char> image(offset, 0);
+		memcpy(image.data(), &header, sizeof(header));
+		if (!entries.empty())
+		{
+			memcpy(image.data() + sizeof(header), entries.data(), entries.size() * sizeof(CacheEntry));
+		}
+		for (size_t i = 0; i < meshes.size(); i++)
+		{
+			const Mesh& mesh = meshes[i];
+			const CacheEntry& entry = entries[i];
+			memcpy(image.data() + entry.name_offset, mesh.name.data(), mesh.name.size());
+			if (!mesh.vertices.empty())
+			{
+				memcpy(image.data() + entry.vertex_offset, mesh.vertices.data(), mesh.vertices.size() * sizeof(Vertex));
+			}
+			if (entry.index_count > 0)
+			{
+				memcpy(image.data() + entry.index_offset, mesh.index_data(), entry.index_count * entry.index_size);
+			}
+		}
+		return image;
+	}
+}
+
+void MeshCache::load_obj(const std::string& base_path, const std::string& object_name)
+{
+	std::string source_path = base_path + object_name;
+	std::string cache_path = source_path + ".meshcache";
+	if (open(cache_path, source_path))
+	{
+		return;
+	}
+
+	// Stamp the source before importing it, so a change while importing makes the next run import again
+	CacheHeader header{};
+	memcpy(header.magic, c_magic, sizeof(c_magic));
+	header.version = c_version;
+	header.vertex_size = sizeof(Vertex);
+	file_stamp(source_path, header.source_size, header.source_write_time);
+	{
+		MappedFile source(source_path);
+		header.source_hash = hash_bytes(source.data(), source.size());
+	}
+
+	std::vector<Mesh> meshes = MeshLoader::load_obj(base_path, object_name, &reports);
+	header.mesh_count = UINT(meshes.size());
+	image = serialize(meshes, header);
+
+	// Not being able to write the cache only costs the next run an import
+	write_file(cache_path, image);
+	parse(image.data(), image.size());
+}
+
+bool MeshCache::open(const std::string& cache_path, const std::string& source_path)
+{
+	UINT64 source_size, source_write_time;
+	if (!file_stamp(source_path, source_size, source_write_time))
+	{
+		return false;
+	}
+
+	std::unique_ptr<MappedFile> mapped(new MappedFile(cache_path));
+	if (!mapped->is_open() || mapped->size() < sizeof(CacheHeader))
+	{
+		return false;
+	}
+	const CacheHeader* header = reinterpret_cast<const CacheHeader*>(mapped->data());
+	if (header->source_size != source_size)
+	{
+		return false;
+	}
+	// Touched but not changed is as good as untouched
+	if (header->source_write_time != source_write_time &&
+		!restamp_cache(mapped, cache_path, source_path, header->source_hash, offsetof(CacheHeader, source_write_time), source_write_time))
+	{
+		return false;
+	}
+
+	if (!parse(mapped->data(), mapped->size()))
+	{
+		return false;
+	}
+	file = std::move(mapped);
+	return true;
+}
+
+bool MeshCache::parse(const char* data, size_t size)
+{
+	views.clear();
+
+	const CacheHeader* header = reinterpret_cast<const CacheHeader*>(data);
+	if (size < sizeof(CacheHeader) ||
+		memcmp(header->magic, c_magic, sizeof(c_magic)) != 0 ||
+		header->version != c_version ||
+		header->vertex_size != sizeof(Vertex) ||
+		header->mesh_count > (size - sizeof(CacheHeader)) / sizeof(CacheEntry))
+	{
+		return false;
+	}
+
+	// Every block has to lie within the file, a truncated cache is just an outdated one
+	const CacheEntry* entries = reinterpret_cast<const CacheEntry*>(data + sizeof(CacheHeader));
+	auto InFile = [&](UINT64 offset, UINT64 length)
+	{
+		return offset <= size && length <= size - offset;
+	};
+	for (UINT i = 0; i < header->mesh_count; i++)
+	{
+		const CacheEntry& entry = entries[i];
+		if (!InFile(entry.name_offset, entry.name_length) ||
+			!InFile(entry.vertex_offset, UINT64(entry.vertex_count) * sizeof(Vertex)) ||
+			!InFile(entry.index_offset, entry.index_data_size) ||
+			(entry.index_size != sizeof(Index) && entry.index_size != sizeof(Index32)) ||
+			UINT64(entry.index_count) * entry.index_size > entry.index_data_size)
+		{
+			views.clear();
+			return false;
+		}
+
+		MeshView view;
+		view.name.assign(data + entry.name_offset, entry.name_length);
+		view.vertices = reinterpret_cast<const Vertex*>(data + entry.vertex_offset);
+		view.vertex_count = entry.vertex_count;
+		view.indices = data + entry.index_offset;
+		view.index_count = entry.index_count;
+		view.index_data_size = entry.index_data_size;
+		view.index_format = (entry.index_size == sizeof(Index32)) ? DXGI_FORMAT_R32_UINT : DXGI_FORMAT_R16_UINT;
+		views.push_back(view);
+	}
+	return true;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "Mesh.h"
+#include "MappedFile.h"
+#include "MeshOptimizer.h"
+
+#include <memory>
+#include <string>
+
+namespace Model
+{
+	// One mesh of a cache, pointing straight into it
+	struct MeshView
+	{
+		std::string name;
+		const Vertex* vertices;
+		UINT vertex_count;
+		const void* indices;		// Padded with zeros to a multiple of 4 bytes, for ByteAddressBuffer loads
+		UINT index_count;
+		UINT index_data_size;		// Including the padding
+		DXGI_FORMAT index_format;
+	};
+
+	// Binary container of imported meshes, next to their source file (object_path + ".meshcache"):
+	//	header | mesh entries | names | per mesh: vertices, indices, each 64 byte aligned
+	// The header stores the source's size, last write time and content hash. A cache is used as long as the size
+	// and write time match, or failing that the hash does (the file was touched but not changed, and the cache is
+	// restamped with the new write time). Otherwise the source is imported again and the cache rewritten. A used
+	// cache is mapped, never parsed or copied.
+	class MeshCache
+	{
+	public:
+		// Maps the cache of base_path + object_name, or imports the OBJ with MeshLoader and writes the cache.
+		// Throws if there is neither a valid cache nor a loadable OBJ.
+		void load_obj(const std::string& base_path, const std::string& object_name);
+
+		const std::vector<MeshView>& meshes() const { return views; }
+		bool was_cached() const { return file != nullptr; }
+		// Optimizer reports of the meshes, only when they were imported this time
+		const std::vector<MeshOptimizeReport>& optimize_reports() const { return reports; }
+
+		static const UINT c_version = 2;	// 2: vertex cache and fetch optimized meshes
+
+	private:
+		bool open(const std::string& cache_path, const std::string& source_path);
+		bool parse(const char* data, size_t size);
+
+		std::unique_ptr<MappedFile> file;
+		std::vector<char> image;		// What was written, when the meshes were imported this time
+		std::vector<MeshView> views;
+		std::vector<MeshOptimizeReport> reports;
+	};
+}
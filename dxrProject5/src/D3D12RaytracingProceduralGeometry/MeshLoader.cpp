@@ -1,54 +1,122 @@
 ﻿#include "stdafx.h"
 #include "MeshLoader.h"
+#include "ObjParser.h"
+#include "MeshOptimizer.h"
 
 #define TINYOBJLOADER_IMPLEMENTATION 
 #include "include/tiny_obj_loader.h"
 
 using namespace Model;
 
-std::vector<Mesh> MeshLoader::load_obj(std::string base_path, std::string object_name)
+std::vector<Mesh> MeshLoader::load_obj(std::string base_path, std::string object_name, std::vector<MeshOptimizeReport>* reports)
 {
 	std::string object_path = base_path + object_name;
 
 	std::vector<Mesh> meshes;
 
-	objl::Loader loader;
-	bool ret = loader.LoadFile(object_path);
+	ObjData obj;
+	bool ret = parse_obj_file(object_path, obj);
 
 	if(!ret)
 	{
 		throw std::runtime_error("obj file could not be loaded\n");
 	}
 
-	for(int i = 0; i < loader.LoadedMeshes.size(); i++)
+	// Same meshes objl::Loader made: one per o or g line, and another one whenever usemtl comes after some faces.
+	// Every face corner is gathered as a vertex of its own, then identical ones are welded when the mesh is done.
+	// Unlike objl, the usemtl splits of a mesh are numbered _2, _3, ...: objl meant to, but named them all _2.
+	std::vector<Vertex> corners;
+	std::vector<UINT> triangles;
+	std::string mesh_name;
+	std::unordered_map<std::string, UINT> split_counts;
+	auto FinishMesh = [&](const std::string& name)
 	{
-		objl::Mesh& obj_mesh = loader.LoadedMeshes[i];
+		if (!corners.empty())
+		{
+			Mesh mesh;
+			mesh.name = name;
+			mesh.set_triangles(corners, triangles);
+			MeshOptimizeReport report = optimize_mesh(mesh);
+			if (reports)
+			{
+				reports->push_back(report);
+			}
+			meshes.emplace_back(std::move(mesh));
+			corners.clear();
+			triangles.clear();
+		}
+	};
 
-		Mesh mesh;
-		mesh.name = obj_mesh.MeshName;
+	size_t next_group = 0;
+	for(UINT f = 0; f < obj.face_count(); f++)
+	{
+		for(; next_group < obj.groups.size() && obj.groups[next_group].first_face <= f; next_group++)
+		{
+			const ObjGroup& group = obj.groups[next_group];
+			if (group.type == ObjGroup::Object)
+			{
+				FinishMesh(mesh_name);
+				mesh_name = group.name;
+			}
+			else if (!corners.empty())
+			{
+				FinishMesh(mesh_name + "_" + std::to_string(++split_counts[mesh_name] + 1));
+			}
+		}
 
-		for(auto j = 0; j < obj_mesh.Vertices.size(); j++)
+		UINT first_corner = obj.face_starts[f];
+		UINT corner_count = obj.face_starts[f + 1] - first_corner;
+		auto Position = [&](UINT c)
 		{
-			objl::Vertex& obj_vertex = obj_mesh.Vertices[j];
+			int index = obj.corners[first_corner + c].position;
+			return (index >= 0 && index < int(obj.positions.size())) ? obj.positions[index] : XMFLOAT3(0.0f, 0.0f, 0.0f);
+		};
 
-			Vertex vertex{};
-			vertex.position = XMFLOAT3(obj_vertex.Position.X, obj_vertex.Position.Y, obj_vertex.Position.Z);
-			vertex.normal = XMFLOAT3(obj_vertex.Normal.X, obj_vertex.Normal.Y, obj_vertex.Normal.Z);
-			vertex.texCoord = XMFLOAT2(obj_vertex.TextureCoordinate.X, obj_vertex.TextureCoordinate.Y);
-			
-			mesh.vertices.emplace_back(vertex);
+		// Faces missing a normal on any corner get the (unnormalized) face normal on all of them
+		bool has_normals = true;
+		for(UINT c = 0; c < corner_count; c++)
+		{
+			int index = obj.corners[first_corner + c].normal;
+			has_normals = has_normals && index >= 0 && index < int(obj.normals.size());
+		}
+		XMFLOAT3 face_normal;
+		if (!has_normals)
+		{
+			XMFLOAT3 p0 = Position(0), p1 = Position(1), p2 = Position(2);
+			XMVECTOR a = XMVectorSubtract(XMLoadFloat3(&p0), XMLoadFloat3(&p1));
+			XMVECTOR b = XMVectorSubtract(XMLoadFloat3(&p2), XMLoadFloat3(&p1));
+			XMStoreFloat3(&face_normal, XMVector3Cross(a, b));
 		}
 
-		for (auto j = 0; j < obj_mesh.Indices.size(); j++)
+		UINT first_vertex = UINT(corners.size());
+		for(UINT c = 0; c < corner_count; c++)
 		{
-			mesh.vertex_indices.emplace_back(j);
+			const ObjCorner& corner = obj.corners[first_corner + c];
+
+			Vertex vertex{};
+			vertex.position = Position(c);
+			vertex.normal = has_normals ? obj.normals[corner.normal] : face_normal;
+			bool has_tex_coord = corner.tex_coord >= 0 && corner.tex_coord < int(obj.tex_coords.size());
+			vertex.texCoord = has_tex_coord ? obj.tex_coords[corner.tex_coord] : XMFLOAT2(0.0f, 0.0f);
+
+			corners.emplace_back(vertex);
 		}
-		/*if (!obj_mesh.MeshMaterial.name.empty())
+
+		// Fan around the last corner, the same triangles objl's ear clipping makes of convex polygons. Concave
+		// faces, which objl ear clipped, can come out wrong here.
+		UINT last = first_vertex + corner_count - 1;
+		for(UINT c = 0; c + 2 < corner_count; c++)
 		{
-			Material material{ 0, obj_mesh.MeshMaterial };
-			mesh.material = std::move(material);
-		}*/
-		meshes.emplace_back(std::move(mesh));
+			triangles.emplace_back(first_vertex + c);
+			triangles.emplace_back(first_vertex + c + 1);
+			triangles.emplace_back(last);
+		}
+	}
+	FinishMesh(mesh_name);
+
+	if (meshes.empty())
+	{
+		throw std::runtime_error("obj file could not be loaded\n");
 	}
 
 	/*
@@ -2,6 +2,7 @@
 
 #include "include/tiny_obj_loader.h"
 #include "Mesh.h"
+#include "MeshOptimizer.h"
 
 #include <string>
 
@@ -12,7 +13,10 @@ namespace Model
 	class MeshLoader
 	{
 	public:
-		static std::vector<Mesh> MeshLoader::load_obj(std::string base_path, std::string object_name);
+		// Every mesh comes out vertex cache and fetch optimized. If reports is given, it gets the optimizer's
+		// report of each mesh, in the same order.
+		static std::vector<Mesh> MeshLoader::load_obj(std::string base_path, std::string object_name,
+			std::vector<MeshOptimizeReport>* reports = nullptr);
 		const MeshLoader& get() const;
 	private:
 		MeshLoader() = default;
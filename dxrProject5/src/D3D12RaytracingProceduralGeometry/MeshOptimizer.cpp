@@ -0,0 +1,197 @@
+#include "stdafx.h"
+#include "MeshOptimizer.h"
+
+using namespace Model;
+
+VertexCacheStats Model::analyze_vertex_cache(const std::vector<UINT>& indices, UINT vertex_count, UINT cache_size)
+{
+	// A vertex is in the FIFO if it entered it less than cache_size misses ago
+	std::vector<UINT> entered(vertex_count, 0);
+	UINT misses = 0;
+	for (UINT index : indices)
+	{
+		if (entered[index] == 0 || misses - entered[index] >= cache_size)
+		{
+			misses++;
+			entered[index] = misses;
+		}
+	}
+
+	UINT used = 0;
+	for (UINT time : entered)
+	{
+		used += (time != 0) ? 1 : 0;
+	}
+
+	VertexCacheStats stats;
+	stats.acmr = indices.empty() ? 0.0f : float(misses) / float(indices.size() / 3);
+	stats.atvr = (used == 0) ? 0.0f : float(misses) / float(used);
+	return stats;
+}
+
+void Model::optimize_vertex_cache(std::vector<UINT>& indices, UINT vertex_count, UINT cache_size)
+{
+	UINT triangle_count = UINT(indices.size() / 3);
+	if (triangle_count == 0)
+	{
+		return;
+	}
+
+	// Triangles around every vertex, as one array sliced by adjacency_start
+	std::vector<UINT> live(vertex_count, 0);
+	for (UINT index : indices)
+	{
+		live[index]++;
+	}
+	std::vector<UINT> adjacency_start(vertex_count + 1, 0);
+	for (UINT v = 0; v < vertex_count; v++)
+	{
+		adjacency_start[v + 1] = adjacency_start[v] + live[v];
+	}
+	std::vector<UINT> adjacency(indices.size());
+	{
+		std::vector<UINT> fill(adjacency_start.begin(), adjacency_start.end() - 1);
+		for (UINT i = 0; i < indices.size(); i++)
+		{
+			adjacency[fill[indices[i]]++] = i / 3;
+		}
+	}
+
+	std::vector<UINT> cache_time(vertex_count, 0);
+	std::vector<bool> emitted(triangle_count, false);
+	std::vector<UINT> dead_end;		// Vertices of emitted triangles, to fall back to once a fan has nowhere to go
+	std::vector<UINT> candidates;
+	std::vector<UINT> output;
+	output.reserve(indices.size());
+
+	UINT time = cache_size + 1;
+	UINT cursor = 0;				// Vertices before it have no live triangles left
+	int fan = int(indices[0]);
+	while (fan >= 0)
+	{
+		// Emit every remaining triangle around the fanning vertex
+		candidates.clear();
+		for (UINT a = adjacency_start[fan]; a < adjacency_start[fan + 1]; a++)
+		{
+			UINT t = adjacency[a];
+			if (emitted[t])
+			{
+				continue;
+			}
+			emitted[t] = true;
+			for (UINT c = 0; c < 3; c++)
+			{
+				UINT v = indices[3 * t + c];
+				output.push_back(v);
+				dead_end.push_back(v);
+				candidates.push_back(v);
+				live[v]--;
+				if (time - cache_time[v] > cache_size)
+				{
+					cache_time[v] = time++;
+				}
+			}
+		}
+
+		// Next, the candidate that stays in the cache longest while its remaining triangles are emitted
+		fan = -1;
+		int best_priority = -1;
+		for (UINT v : candidates)
+		{
+			if (live[v] == 0)
+			{
+				continue;
+			}
+			int priority = 0;
+			if (time - cache_time[v] + 2 * live[v] <= cache_size)
+			{
+				priority = int(time - cache_time[v]);
+			}
+			if (priority > best_priority)
+			{
+				best_priority = priority;
+				fan = int(v);
+			}
+		}
+
+		// Dead end: the most recent vertex with something left, else the next one in input order
+		while (fan < 0 && !dead_end.empty())
+		{
+			UINT v = dead_end.back();
+			dead_end.pop_back();
+			if (live[v] > 0)
+			{
+				fan = int(v);
+			}
+		}
+		while (fan < 0 && cursor < vertex_count)
+		{
+			if (live[cursor] > 0)
+			{
+				fan = int(cursor);
+			}
+			cursor++;
+		}
+	}
+
+	indices.swap(output);
+}
+
+UINT Model::optimize_vertex_fetch(std::vector<UINT>& indices, UINT vertex_count, std::vector<UINT>& remap)
+{
+	remap.assign(vertex_count, UINT_MAX);
+	UINT next = 0;
+	for (UINT& index : indices)
+	{
+		if (remap[index] == UINT_MAX)
+		{
+			remap[index] = next++;
+		}
+		index = remap[index];
+	}
+	return next;
+}
+
+MeshOptimizeReport Model::optimize_mesh(Mesh& mesh, UINT cache_size)
+{
+	std::vector<UINT> indices;
+	if (mesh.vertex_indices32.empty())
+	{
+		indices.assign(mesh.vertex_indices.begin(), mesh.vertex_indices.end());
+	}
+	else
+	{
+		indices.swap(mesh.vertex_indices32);
+	}
+
+	MeshOptimizeReport report;
+	UINT vertex_count = UINT(mesh.vertices.size());
+	report.before = analyze_vertex_cache(indices, vertex_count, cache_size);
+	optimize_vertex_cache(indices, vertex_count, cache_size);
+
+	std::vector<UINT> remap;
+	UINT used_count = optimize_vertex_fetch(indices, vertex_count, remap);
+	remap_vertices(mesh.vertices, remap, used_count);
+	report.after = analyze_vertex_cache(indices, used_count, cache_size);
+
+	// Dropping unused vertices can only bring a mesh back under the 16 bit limit, never over it
+	if (mesh.vertices.size() <= 0x10000)
+	{
+		mesh.vertex_indices.assign(indices.begin(), indices.end());
+		mesh.vertex_indices32.clear();
+	}
+	else
+	{
+		mesh.vertex_indices.clear();
+		mesh.vertex_indices32.swap(indices);
+	}
+	return report;
+}
+
+std::string Model::format_report(const std::string& name, const MeshOptimizeReport& report)
+{
+	char numbers[128];
+	snprintf(numbers, sizeof(numbers), ": ACMR %.2f -> %.2f, ATVR %.2f -> %.2f\n",
+		report.before.acmr, report.after.acmr, report.before.atvr, report.after.atvr);
+	return name + numbers;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "Mesh.h"
+
+namespace Model
+{
+	// Post-transform vertex cache efficiency of a triangle list, simulated with a FIFO cache
+	struct VertexCacheStats
+	{
+		float acmr;		// Average cache miss ratio: vertices transformed per triangle, 0.5 at best for large meshes, 3 at worst
+		float atvr;		// Average transform to vertex ratio: vertices transformed per vertex, 1 at best
+	};
+
+	VertexCacheStats analyze_vertex_cache(const std::vector<UINT>& indices, UINT vertex_count, UINT cache_size = 16);
+
+	// Reorders the triangles for a post-transform cache of cache_size vertices, with Tipsify
+	// (Sander, Nehab and Barczak, "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw").
+	// Runs in time linear in the number of triangles; the winding of each triangle is kept.
+	void optimize_vertex_cache(std::vector<UINT>& indices, UINT vertex_count, UINT cache_size = 16);
+
+	// Renumbers the vertices in the order the triangles first use them, so vertex fetches walk memory forwards.
+	// remap[old index] receives the new index, or UINT_MAX for unused vertices. Returns the number of used vertices.
+	UINT optimize_vertex_fetch(std::vector<UINT>& indices, UINT vertex_count, std::vector<UINT>& remap);
+
+	// Moves every used vertex to remap[its index] and drops the unused ones
+	template <class T>
+	void remap_vertices(std::vector<T>& vertices, const std::vector<UINT>& remap, UINT used_count)
+	{
+		std::vector<T> remapped(used_count);
+		for (size_t i = 0; i < vertices.size(); i++)
+		{
+			if (remap[i] != UINT_MAX)
+			{
+				remapped[remap[i]] = vertices[i];
+			}
+		}
+		vertices.swap(remapped);
+	}
+
+	struct MeshOptimizeReport
+	{
+		VertexCacheStats before;
+		VertexCacheStats after;
+	};
+
+	// Both passes, cache then fetch order, on a mesh's triangles and vertices
+	MeshOptimizeReport optimize_mesh(Mesh& mesh, UINT cache_size = 16);
+
+	// "name: ACMR 1.82 -> 0.71, ATVR 3.04 -> 1.19\n", for the debug output
+	std::string format_report(const std::string& name, const MeshOptimizeReport& report);
+}
@@ -0,0 +1,535 @@
+#include "stdafx.h"
+#include "MeshSimplifier.h"
+#include "ModelHelper.h"
+
+#include <thread>
+
+using namespace Model;
+
+namespace
+{
+	const UINT c_min_cluster_triangles = 20000;	// Smaller pieces of a mesh are not worth a thread
+	const UINT c_clusters_per_thread = 4;		// Clusters differ a lot in size, more of them balance the threads
+	const float c_min_normal_dot = 0.5f;		// Vertices whose normals are further apart than 60 degrees stay apart
+	const float c_min_flip_dot = 0.25f;			// Triangles may turn by at most ~75 degrees in one collapse
+
+	struct Quadric
+	{
+		float a00, a11, a22, a01, a02, a12;
+		float b0, b1, b2;
+		float c;
+		float weight;
+
+		void add(const Quadric& q)
+		{
+			a00 += q.a00; a11 += q.a11; a22 += q.a22;
+			a01 += q.a01; a02 += q.a02; a12 += q.a12;
+			b0 += q.b0; b1 += q.b1; b2 += q.b2;
+			c += q.c;
+			weight += q.weight;
+		}
+
+		// Plane n.p + d = 0 with a unit n, weighted by area
+		void add_plane(float nx, float ny, float nz, float d, float area)
+		{
+			a00 += area * nx * nx; a11 += area * ny * ny; a22 += area * nz * nz;
+			a01 += area * nx * ny; a02 += area * nx * nz; a12 += area * ny * nz;
+			b0 += area * nx * d; b1 += area * ny * d; b2 += area * nz * d;
+			c += area * d * d;
+			weight += area;
+		}
+
+		// Mean squared distance of p to the planes
+		float error(const float* p) const
+		{
+			float x = p[0], y = p[1], z = p[2];
+			float sum = a00 * x * x + a11 * y * y + a22 * z * z
+				+ 2.0f * (a01 * x * y + a02 * x * z + a12 * y * z)
+				+ 2.0f * (b0 * x + b1 * y + b2 * z) + c;
+			return (weight > 0.0f) ? max(sum, 0.0f) / weight : 0.0f;
+		}
+	};
+
+	inline void cross(const float* a, const float* b, const float* c, float* normal)
+	{
+		float e0[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+		float e1[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+		normal[0] = e0[1] * e1[2] - e0[2] * e1[1];
+		normal[1] = e0[2] * e1[0] - e0[0] * e1[2];
+		normal[2] = e0[0] * e1[1] - e0[1] * e1[0];
+	}
+
+	inline float dot(const float* a, const float* b)
+	{
+		return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+	}
+
+	// A triangle list on compact vertices of its own, the part of a mesh one thread simplifies
+	struct Region
+	{
+		std::vector<UINT> vertex_ids;		// Original index of every vertex
+		std::vector<UINT> indices;
+		std::vector<float> positions;		// 3 per vertex
+		std::vector<float> normals;			// 3 per vertex, or none
+		std::vector<unsigned char> locked;
+	};
+
+	// Copies the triangles and the vertices they use, locking the vertices shared_vertices marks
+	void extract_region(const UINT* indices, size_t index_count, const VertexStreams& vertices,
+		const std::vector<unsigned char>* shared_vertices, Region& region)
+	{
+		// Open addressing map from original to compact vertex index, at most half full
+		size_t table_size = 16;
+		while (table_size < index_count * 2)
+		{
+			table_size *= 2;
+		}
+		std::vector<UINT> table(table_size, UINT_MAX);
+
+		region.indices.resize(index_count);
+		for (size_t i = 0; i < index_count; i++)
+		{
+			UINT id = indices[i];
+			size_t slot = (id * 2654435761u) & (table_size - 1);
+			while (table[slot] != UINT_MAX && region.vertex_ids[table[slot]] != id)
+			{
+				slot = (slot + 1) & (table_size - 1);
+			}
+			if (table[slot] == UINT_MAX)
+			{
+				table[slot] = UINT(region.vertex_ids.size());
+				region.vertex_ids.push_back(id);
+			}
+			region.indices[i] = table[slot];
+		}
+
+		size_t count = region.vertex_ids.size();
+		region.positions.resize(3 * count);
+		region.normals.resize(vertices.normals ? 3 * count : 0);
+		region.locked.resize(count);
+		for (size_t v = 0; v < count; v++)
+		{
+			size_t id = region.vertex_ids[v];
+			memcpy(&region.positions[3 * v], vertices.positions + id * vertices.stride, 3 * sizeof(float));
+			if (vertices.normals)
+			{
+				memcpy(&region.normals[3 * v], vertices.normals + id * vertices.stride, 3 * sizeof(float));
+			}
+			region.locked[v] = (shared_vertices && (*shared_vertices)[id]) ? 1 : 0;
+		}
+	}
+
+	// Triangles around every vertex, as one array sliced by start
+	void build_adjacency(const std::vector<UINT>& indices, UINT vertex_count, std::vector<UINT>& start, std::vector<UINT>& triangles)
+	{
+		start.assign(vertex_count + 1, 0);
+		for (UINT index : indices)
+		{
+			start[index + 1]++;
+		}
+		for (UINT v = 0; v < vertex_count; v++)
+		{
+			start[v + 1] += start[v];
+		}
+		triangles.resize(indices.size());
+		for (size_t i = 0; i < indices.size(); i++)
+		{
+			triangles[start[indices[i]]++] = UINT(i / 3);
+		}
+		// The fill moved every start to the next one's
+		for (UINT v = vertex_count; v > 0; v--)
+		{
+			start[v] = start[v - 1];
+		}
+		start[0] = 0;
+	}
+
+	// A vertex is on a boundary if one of its edges has no triangle running the other way
+	void lock_boundaries(const std::vector<UINT>& indices, const std::vector<UINT>& start, const std::vector<UINT>& triangles,
+		std::vector<unsigned char>& locked)
+	{
+		auto Corner = [&](UINT t, UINT v, UINT offset)
+		{
+			const UINT* corners = &indices[3 * t];
+			UINT k = (corners[0] == v) ? 0 : (corners[1] == v) ? 1 : 2;
+			return corners[(k + offset) % 3];
+		};
+
+		for (UINT v = 0; v + 1 < UINT(start.size()); v++)
+		{
+			for (UINT i = start[v]; i < start[v + 1] && !locked[v]; i++)
+			{
+				UINT next = Corner(triangles[i], v, 1);
+				bool paired = false;
+				for (UINT j = start[v]; j < start[v + 1] && !paired; j++)
+				{
+					paired = Corner(triangles[j], v, 2) == next;
+				}
+				locked[v] = paired ? 0 : 1;
+			}
+		}
+	}
+
+	// Would moving a onto b turn one of a's remaining triangles over?
+	bool has_flips(UINT a, UINT b, const Region& region, const std::vector<UINT>& remap,
+		const std::vector<UINT>& start, const std::vector<UINT>& triangles)
+	{
+		const float* p = region.positions.data();
+		for (UINT i = start[a]; i < start[a + 1]; i++)
+		{
+			UINT t = triangles[i];
+			UINT v[3] = { remap[region.indices[3 * t]], remap[region.indices[3 * t + 1]], remap[region.indices[3 * t + 2]] };
+			if (v[0] == b || v[1] == b || v[2] == b)
+			{
+				continue;	// Collapses away
+			}
+			UINT k = (v[0] == a) ? 0 : (v[1] == a) ? 1 : 2;
+			const float* p1 = p + 3 * v[(k + 1) % 3];
+			const float* p2 = p + 3 * v[(k + 2) % 3];
+
+			float before[3], after[3];
+			cross(p + 3 * a, p1, p2, before);
+			cross(p + 3 * b, p1, p2, after);
+			float scale = std::sqrt(dot(before, before) * dot(after, after));
+			if (dot(before, after) < c_min_flip_dot * scale)
+			{
+				return true;
+			}
+
+			// Small turns add up over many collapses, so the triangle also has to keep facing b's side of the surface
+			const float* n = region.normals.empty() ? nullptr : &region.normals[3 * b];
+			if (n && dot(after, n) < 0.0f)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Collapses edges of the region, cheapest first, in passes that each move any vertex at most once.
+	// Returns the largest error of a collapse.
+	float simplify_region(Region& region, UINT target_index_count, float max_error)
+	{
+		std::vector<UINT>& indices = region.indices;
+		UINT vertex_count = UINT(region.vertex_ids.size());
+		const float* p = region.positions.data();
+		const float* n = region.normals.empty() ? nullptr : region.normals.data();
+
+		std::vector<UINT> start, triangles;
+		build_adjacency(indices, vertex_count, start, triangles);
+		lock_boundaries(indices, start, triangles, region.locked);
+
+		std::vector<Quadric> quadrics(vertex_count, Quadric{});
+		for (size_t i = 0; i < indices.size(); i += 3)
+		{
+			const float* p0 = p + 3 * indices[i];
+			float normal[3];
+			cross(p0, p + 3 * indices[i + 1], p + 3 * indices[i + 2], normal);
+			float length = std::sqrt(dot(normal, normal));
+			if (length == 0.0f)
+			{
+				continue;
+			}
+			normal[0] /= length; normal[1] /= length; normal[2] /= length;
+			for (int k = 0; k < 3; k++)
+			{
+				quadrics[indices[i + k]].add_plane(normal[0], normal[1], normal[2], -dot(normal, p0), 0.5f * length);
+			}
+		}
+
+		auto NormalsAgree = [&](UINT a, UINT b)
+		{
+			if (!n)
+			{
+				return true;
+			}
+			float d = dot(n + 3 * a, n + 3 * b);
+			return d >= c_min_normal_dot * std::sqrt(dot(n + 3 * a, n + 3 * a) * dot(n + 3 * b, n + 3 * b));
+		};
+
+		std::vector<UINT> remap(vertex_count);
+		for (UINT v = 0; v < vertex_count; v++)
+		{
+			remap[v] = v;
+		}
+		std::vector<UINT> target(vertex_count);
+		std::vector<float> target_error(vertex_count);
+		std::vector<unsigned char> pass_locked(vertex_count);
+		std::vector<UINT> histogram(1 << 15);
+		std::vector<UINT> candidates;
+		float error_limit = max_error * max_error;
+		float largest_error = 0.0f;
+		auto IsCandidate = [&](UINT v)
+		{
+			return target_error[v] < FLT_MAX && target_error[v] <= error_limit;
+		};
+
+		while (indices.size() > target_index_count)
+		{
+			// The cheapest collapse of every vertex, along any of its edges
+			std::fill(target_error.begin(), target_error.end(), FLT_MAX);
+			for (size_t i = 0; i < indices.size(); i += 3)
+			{
+				for (int k = 0; k < 3; k++)
+				{
+					UINT a = indices[i + k];
+					UINT b = indices[i + (k + 1) % 3];
+					for (int direction = 0; direction < 2; direction++, std::swap(a, b))
+					{
+						if (region.locked[a] || !NormalsAgree(a, b))
+						{
+							continue;
+						}
+						float error = quadrics[a].error(p + 3 * b);
+						if (error < target_error[a])
+						{
+							target_error[a] = error;
+							target[a] = b;
+						}
+					}
+				}
+			}
+
+			// Sorted by the top bits of the error, which for positive floats order like the floats do
+			std::fill(histogram.begin(), histogram.end(), 0);
+			UINT candidate_count = 0;
+			for (UINT v = 0; v < vertex_count; v++)
+			{
+				if (IsCandidate(v))
+				{
+					UINT bits;
+					memcpy(&bits, &target_error[v], sizeof(bits));
+					histogram[bits >> 16]++;
+					candidate_count++;
+				}
+			}
+			if (candidate_count == 0)
+			{
+				break;
+			}
+			UINT sum = 0;
+			for (UINT& bucket : histogram)
+			{
+				UINT count = bucket;
+				bucket = sum;
+				sum += count;
+			}
+			candidates.resize(candidate_count);
+			for (UINT v = 0; v < vertex_count; v++)
+			{
+				if (IsCandidate(v))
+				{
+					UINT bits;
+					memcpy(&bits, &target_error[v], sizeof(bits));
+					candidates[histogram[bits >> 16]++] = v;
+				}
+			}
+
+			// An interior collapse removes two triangles
+			size_t goal = (indices.size() - target_index_count) / 6 + 1;
+			size_t collapses = 0;
+			std::fill(pass_locked.begin(), pass_locked.end(), 0);
+			for (UINT a : candidates)
+			{
+				if (collapses >= goal)
+				{
+					break;
+				}
+				UINT b = target[a];
+				if (pass_locked[a] || pass_locked[b] || has_flips(a, b, region, remap, start, triangles))
+				{
+					continue;
+				}
+				remap[a] = b;
+				quadrics[b].add(quadrics[a]);
+				pass_locked[a] = 1;
+				pass_locked[b] = 1;
+				largest_error = max(largest_error, target_error[a]);
+				collapses++;
+			}
+			if (collapses == 0)
+			{
+				break;
+			}
+
+			size_t write = 0;
+			for (size_t i = 0; i < indices.size(); i += 3)
+			{
+				UINT a = remap[indices[i]], b = remap[indices[i + 1]], c = remap[indices[i + 2]];
+				if (a != b && b != c && a != c)
+				{
+					indices[write++] = a;
+					indices[write++] = b;
+					indices[write++] = c;
+				}
+			}
+			indices.resize(write);
+			build_adjacency(indices, vertex_count, start, triangles);
+		}
+
+		return std::sqrt(largest_error);
+	}
+}
+
+VertexStreams VertexStreams::of(const Mesh& mesh)
+{
+	VertexStreams streams;
+	streams.positions = mesh.vertices.empty() ? nullptr : &mesh.vertices[0].position.x;
+	streams.normals = mesh.vertices.empty() ? nullptr : &mesh.vertices[0].normal.x;
+	streams.stride = sizeof(Vertex) / sizeof(float);
+	streams.vertex_count = UINT(mesh.vertices.size());
+	return streams;
+}
+
+float Model::simplify(const std::vector<UINT>& indices, const VertexStreams& vertices, UINT target_index_count,
+	float max_error, std::vector<UINT>& result, UINT num_threads)
+{
+	if (num_threads == 0)
+	{
+		num_threads = max(1u, std::thread::hardware_concurrency());
+	}
+	target_index_count -= target_index_count % 3;
+	result = indices;
+	float error = 0.0f;
+
+	UINT triangle_count = UINT(indices.size() / 3);
+	UINT grid = 1;
+	while (grid * grid * grid < num_threads * c_clusters_per_thread && triangle_count / ((grid + 1) * (grid + 1) * (grid + 1)) >= c_min_cluster_triangles)
+	{
+		grid++;
+	}
+	if (num_threads > 1 && grid > 1)
+	{
+		// Clusters are cells of a grid over the vertices, holding the triangles whose first corner is in them
+		float low[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+		float high[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		for (UINT index : indices)
+		{
+			const float* p = vertices.positions + size_t(index) * vertices.stride;
+			for (int k = 0; k < 3; k++)
+			{
+				low[k] = min(low[k], p[k]);
+				high[k] = max(high[k], p[k]);
+			}
+		}
+		auto Cell = [&](UINT index)
+		{
+			const float* p = vertices.positions + size_t(index) * vertices.stride;
+			UINT cell = 0;
+			for (int k = 0; k < 3; k++)
+			{
+				float extent = high[k] - low[k];
+				UINT i = (extent > 0.0f) ? UINT((p[k] - low[k]) / extent * grid) : 0;
+				cell = cell * grid + min(i, grid - 1);
+			}
+			return cell;
+		};
+
+		UINT cluster_count = grid * grid * grid;
+		std::vector<UINT> cluster_start(cluster_count + 1, 0);
+		std::vector<UINT> triangle_cluster(triangle_count);
+		for (UINT t = 0; t < triangle_count; t++)
+		{
+			triangle_cluster[t] = Cell(indices[3 * t]);
+			cluster_start[triangle_cluster[t] + 1]++;
+		}
+		for (UINT c = 0; c < cluster_count; c++)
+		{
+			cluster_start[c + 1] += cluster_start[c];
+		}
+		std::vector<UINT> clustered(indices.size());
+		{
+			std::vector<UINT> fill(cluster_start.begin(), cluster_start.end() - 1);
+			for (UINT t = 0; t < triangle_count; t++)
+			{
+				UINT to = fill[triangle_cluster[t]]++;
+				memcpy(&clustered[3 * to], &indices[3 * t], 3 * sizeof(UINT));
+			}
+		}
+
+		// Vertices used by more than one cluster stay put until the clusters are simplified together
+		std::vector<UINT> owner(vertices.vertex_count, UINT_MAX);
+		std::vector<unsigned char> shared(vertices.vertex_count, 0);
+		for (UINT c = 0; c < cluster_count; c++)
+		{
+			for (UINT i = 3 * cluster_start[c]; i < 3 * cluster_start[c + 1]; i++)
+			{
+				UINT v = clustered[i];
+				if (owner[v] == UINT_MAX)
+				{
+					owner[v] = c;
+				}
+				else if (owner[v] != c)
+				{
+					shared[v] = 1;
+				}
+			}
+		}
+
+		double ratio = double(target_index_count) / double(indices.size());
+		std::vector<std::vector<UINT>> simplified(cluster_count);
+		std::vector<float> errors(cluster_count, 0.0f);
+		parallel_for(cluster_count, num_threads, [&](UINT c)
+		{
+			UINT first = 3 * cluster_start[c];
+			UINT count = 3 * cluster_start[c + 1] - first;
+			if (count == 0)
+			{
+				return;
+			}
+			Region region;
+			extract_region(&clustered[first], count, vertices, &shared, region);
+			UINT target = UINT(count * ratio);
+			errors[c] = simplify_region(region, target - target % 3, max_error);
+			simplified[c].resize(region.indices.size());
+			for (size_t i = 0; i < region.indices.size(); i++)
+			{
+				simplified[c][i] = region.vertex_ids[region.indices[i]];
+			}
+		});
+
+		result.clear();
+		for (UINT c = 0; c < cluster_count; c++)
+		{
+			result.insert(result.end(), simplified[c].begin(), simplified[c].end());
+			error = max(error, errors[c]);
+		}
+	}
+
+	// The whole mesh, which after the clusters is mostly their seams
+	if (result.size() > target_index_count)
+	{
+		Region region;
+		extract_region(result.data(), result.size(), vertices, nullptr, region);
+		// Not inside max(), which would simplify twice
+		float region_error = simplify_region(region, target_index_count, max_error);
+		error = max(error, region_error);
+		result.resize(region.indices.size());
+		for (size_t i = 0; i < region.indices.size(); i++)
+		{
+			result[i] = region.vertex_ids[region.indices[i]];
+		}
+	}
+	return error;
+}
+
+std::vector<MeshLod> Model::build_lod_chain(const std::vector<UINT>& indices, const VertexStreams& vertices,
+	const std::vector<float>& ratios, UINT num_threads)
+{
+	std::vector<MeshLod> lods;
+	lods.reserve(ratios.size());
+	const std::vector<UINT>* previous = &indices;
+	float error = 0.0f;
+	for (float ratio : ratios)
+	{
+		MeshLod lod;
+		lod.ratio = ratio;
+		UINT target = UINT(indices.size() / 3 * ratio) * 3;
+		float lod_error = simplify(*previous, vertices, target, FLT_MAX, lod.indices, num_threads);
+		error = max(error, lod_error);
+		lod.error = error;
+		lods.push_back(std::move(lod));
+		previous = &lods.back().indices;
+	}
+	return lods;
+}
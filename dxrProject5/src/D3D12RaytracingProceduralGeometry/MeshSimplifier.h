@@ -0,0 +1,39 @@
+#pragma once
+
+#include "Mesh.h"
+
+namespace Model
+{
+	// Where the simplifier reads vertex positions and normals: float triples, stride floats apart
+	struct VertexStreams
+	{
+		const float* positions;
+		const float* normals;		// Optional
+		size_t stride;
+		UINT vertex_count;
+
+		static VertexStreams of(const Mesh& mesh);
+	};
+
+	// Simplifies a triangle list by quadric error edge collapses (Garland and Heckbert), each vertex collapsing onto
+	// a neighbor so every remaining vertex keeps its own position and normal:
+	//	* vertices on open boundaries (including seams where welding kept vertices apart) never move
+	//	* collapses that flip a triangle, or join vertices whose normals are more than 60 degrees apart, are skipped
+	//	* large meshes are first simplified per spatial cluster on num_threads threads (0 = one per core),
+	//	  with the vertices shared between clusters locked, then once more as a whole to reach the target
+	// Stops at target_index_count indices, or when every remaining collapse would move the surface more than
+	// max_error. result receives indices into the same vertices. Returns the largest error of any collapse.
+	float simplify(const std::vector<UINT>& indices, const VertexStreams& vertices, UINT target_index_count,
+		float max_error, std::vector<UINT>& result, UINT num_threads = 0);
+
+	struct MeshLod
+	{
+		float ratio;				// Of the original triangle count that was asked for
+		float error;				// Largest error of the collapses that led to it, in position units
+		std::vector<UINT> indices;	// Into the original vertices
+	};
+
+	// One level of detail per ratio (decreasing), each simplified from the previous one
+	std::vector<MeshLod> build_lod_chain(const std::vector<UINT>& indices, const VertexStreams& vertices,
+		const std::vector<float>& ratios, UINT num_threads = 0);
+}
@@ -0,0 +1,287 @@
+#include "stdafx.h"
+#include "MeshStreamWriter.h"
+#include "MappedFile.h"
+
+using namespace Model;
+
+namespace
+{
+	const int c_count_digits = 10;		// Room for any UINT, zero padded so the header keeps its size when patched
+
+	std::string padded_count(UINT count)
+	{
+		char buffer[16];
+		snprintf(buffer, sizeof(buffer), "%010u", count);
+		return buffer;
+	}
+
+	inline void put_float3(char* destination, const float* values)
+	{
+		memcpy(destination, values, 3 * sizeof(float));
+	}
+}
+
+AsyncFileWriter::AsyncFileWriter() :
+	used(0),
+	back_size(0),
+	written(0),
+	pending(false),
+	stopping(false),
+	failed(false)
+{
+}
+
+AsyncFileWriter::~AsyncFileWriter()
+{
+	close();
+}
+
+bool AsyncFileWriter::open(const std::string& path)
+{
+	close();
+	out.open(path, std::ios::binary | std::ios::trunc);
+	if (!out)
+	{
+		return false;
+	}
+	front.resize(c_buffer_bytes);
+	back.resize(c_buffer_bytes);
+	used = 0;
+	written = 0;
+	pending = false;
+	stopping = false;
+	failed = false;
+	thread = std::thread(&AsyncFileWriter::run, this);
+	return true;
+}
+
+char* AsyncFileWriter::reserve(size_t bytes)
+{
+	if (used + bytes > front.size())
+	{
+		submit();
+	}
+	char* destination = front.data() + used;
+	used += bytes;
+	return destination;
+}
+
+void AsyncFileWriter::write(const void* data, size_t bytes)
+{
+	const char* source = static_cast<const char*>(data);
+	while (bytes > 0)
+	{
+		size_t count = min(bytes, front.size());
+		memcpy(reserve(count), source, count);
+		source += count;
+		bytes -= count;
+	}
+}
+
+// Hands the filled buffer to the thread, once it is done with the previous one
+void AsyncFileWriter::submit()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	changed.wait(lock, [this] { return !pending; });
+	front.swap(back);
+	back_size = used;
+	written += used;
+	used = 0;
+	pending = true;
+	changed.notify_all();
+}
+
+void AsyncFileWriter::run()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;)
+	{
+		changed.wait(lock, [this] { return pending || stopping; });
+		if (!pending)
+		{
+			break;
+		}
+		lock.unlock();
+		out.write(back.data(), back_size);
+		bool ok = bool(out);
+		lock.lock();
+		failed = failed || !ok;
+		pending = false;
+		changed.notify_all();
+	}
+}
+
+bool AsyncFileWriter::flush()
+{
+	if (!thread.joinable())
+	{
+		return false;
+	}
+	if (used > 0)
+	{
+		submit();
+	}
+	std::unique_lock<std::mutex> lock(mutex);
+	changed.wait(lock, [this] { return !pending; });
+	return !failed;
+}
+
+bool AsyncFileWriter::patch(UINT64 offset, const void* data, size_t bytes)
+{
+	// With the thread idle the stream is ours
+	if (!flush())
+	{
+		return false;
+	}
+	out.seekp(std::streamoff(offset));
+	out.write(static_cast<const char*>(data), bytes);
+	out.seekp(0, std::ios::end);
+	return bool(out);
+}
+
+bool AsyncFileWriter::close()
+{
+	if (!thread.joinable())
+	{
+		return false;
+	}
+	bool ok = flush();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+		changed.notify_all();
+	}
+	thread.join();
+	out.close();
+	return ok && bool(out);
+}
+
+bool PlyWriter::open(const std::string& path, bool normals)
+{
+	with_normals = normals;
+	vertex_count = 0;
+	face_count = 0;
+	faces_path = path + ".faces";
+	if (!out.open(path) || !faces.open(faces_path))
+	{
+		return false;
+	}
+
+	std::string header =
+		"ply\n"
+		"format binary_little_endian 1.0\n"
+		"comment DXR procedural creature\n"
+		"element vertex ";
+	vertex_count_offset = header.size();
+	header += padded_count(0) + "\n"
+		"property float x\n"
+		"property float y\n"
+		"property float z\n";
+	if (with_normals)
+	{
+		header +=
+			"property float nx\n"
+			"property float ny\n"
+			"property float nz\n";
+	}
+	header += "element face ";
+	face_count_offset = header.size();
+	header += padded_count(0) + "\n"
+		"property list uchar int vertex_indices\n"
+		"end_header\n";
+	out.write(header.data(), header.size());
+	return true;
+}
+
+void PlyWriter::add(const VertexStreams& vertices, UINT first_vertex, const UINT* indices, UINT index_count)
+{
+	size_t record = (with_normals ? 6 : 3) * sizeof(float);
+	for (UINT v = first_vertex; v < vertices.vertex_count; v++)
+	{
+		char* destination = out.reserve(record);
+		put_float3(destination, vertices.positions + v * vertices.stride);
+		if (with_normals)
+		{
+			put_float3(destination + 3 * sizeof(float), vertices.normals + v * vertices.stride);
+		}
+	}
+	vertex_count += max(vertices.vertex_count, first_vertex) - first_vertex;
+
+	const size_t face_record = 1 + 3 * sizeof(int);
+	for (UINT i = 0; i + 2 < index_count; i += 3)
+	{
+		char* destination = faces.reserve(face_record);
+		destination[0] = 3;
+		memcpy(destination + 1, indices + i, 3 * sizeof(int));
+	}
+	face_count += index_count / 3;
+}
+
+bool PlyWriter::close()
+{
+	bool ok = faces.close();
+	{
+		MappedFile face_data(faces_path);
+		ok = ok && face_data.is_open();
+		if (ok)
+		{
+			out.write(face_data.data(), face_data.size());
+		}
+	}
+	DeleteFileA(faces_path.c_str());
+
+	std::string count = padded_count(vertex_count);
+	ok = out.patch(vertex_count_offset, count.data(), c_count_digits) && ok;
+	count = padded_count(face_count);
+	ok = out.patch(face_count_offset, count.data(), c_count_digits) && ok;
+	return out.close() && ok;
+}
+
+bool StlWriter::open(const std::string& path)
+{
+	triangle_count = 0;
+	if (!out.open(path))
+	{
+		return false;
+	}
+
+	// Anything but "solid" at the start, which would make readers take it for an ASCII STL
+	char header[80] = {};
+	strncpy(header, "binary STL, DXR procedural creature", sizeof(header));
+	out.write(header, sizeof(header));
+	out.write(&triangle_count, sizeof(triangle_count));
+	return true;
+}
+
+void StlWriter::add(const VertexStreams& vertices, UINT first_vertex, const UINT* indices, UINT index_count)
+{
+	const size_t record = 12 * sizeof(float) + sizeof(UINT16);
+	for (UINT i = 0; i + 2 < index_count; i += 3)
+	{
+		const float* a = vertices.positions + indices[i] * vertices.stride;
+		const float* b = vertices.positions + indices[i + 1] * vertices.stride;
+		const float* c = vertices.positions + indices[i + 2] * vertices.stride;
+		float ab[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+		float ac[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+		float normal[3] = { ab[1] * ac[2] - ab[2] * ac[1], ab[2] * ac[0] - ab[0] * ac[2], ab[0] * ac[1] - ab[1] * ac[0] };
+		float length = sqrtf(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+		for (float& n : normal)
+		{
+			n = (length > 0.0f) ? n / length : 0.0f;
+		}
+
+		char* destination = out.reserve(record);
+		put_float3(destination, normal);
+		put_float3(destination + 3 * sizeof(float), a);
+		put_float3(destination + 6 * sizeof(float), b);
+		put_float3(destination + 9 * sizeof(float), c);
+		memset(destination + 12 * sizeof(float), 0, sizeof(UINT16));
+	}
+	triangle_count += index_count / 3;
+}
+
+bool StlWriter::close()
+{
+	bool ok = out.patch(80, &triangle_count, sizeof(triangle_count));
+	return out.close() && ok;
+}
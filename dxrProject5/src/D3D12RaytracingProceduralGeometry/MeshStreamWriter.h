@@ -0,0 +1,106 @@
+#pragma once
+
+#include "MeshSimplifier.h"
+
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace Model
+{
+	// Buffered file output written on a thread of its own: while one buffer goes to disk the caller fills the other
+	class AsyncFileWriter
+	{
+	public:
+		AsyncFileWriter();
+		~AsyncFileWriter();
+
+		AsyncFileWriter(const AsyncFileWriter&) = delete;
+		AsyncFileWriter& operator=(const AsyncFileWriter&) = delete;
+
+		bool open(const std::string& path);
+
+		// Room for bytes (at most c_buffer_bytes) in the current buffer, to be filled before the next call
+		char* reserve(size_t bytes);
+		void write(const void* data, size_t bytes);
+
+		UINT64 size() const { return written + used; }
+
+		// Waits until everything so far is on its way to the disk
+		bool flush();
+		// Overwrites bytes that were already written, e.g. a count in a header
+		bool patch(UINT64 offset, const void* data, size_t bytes);
+		bool close();
+
+		static const size_t c_buffer_bytes = 4 << 20;
+
+	private:
+		void submit();
+		void run();
+
+		std::ofstream out;
+		std::thread thread;
+		std::mutex mutex;
+		std::condition_variable changed;
+
+		std::vector<char> front;	// Filled by the caller
+		std::vector<char> back;		// Written by the thread
+		size_t used;				// Of front
+		size_t back_size;
+		UINT64 written;				// Handed to the thread so far
+		bool pending;				// back holds data to write
+		bool stopping;
+		bool failed;
+	};
+
+	// Receives a mesh a piece at a time, e.g. from the mesher as it finishes each region, and writes it to a file
+	class MeshStreamWriter
+	{
+	public:
+		virtual ~MeshStreamWriter() {}
+
+		// Vertices [first_vertex, vertices.vertex_count) are new and final. The triangles may use any vertex
+		// below vertices.vertex_count, numbered the same way across calls.
+		virtual void add(const VertexStreams& vertices, UINT first_vertex, const UINT* indices, UINT index_count) = 0;
+
+		// Fills in the counts and closes the file. Returns false if anything could not be written.
+		virtual bool close() = 0;
+	};
+
+	// Binary little endian PLY with shared vertices (and their normals, optionally). Faces have to come after all
+	// vertices in the file, so they are streamed to path + ".faces" and appended when the writer closes.
+	class PlyWriter : public MeshStreamWriter
+	{
+	public:
+		bool open(const std::string& path, bool normals);
+
+		void add(const VertexStreams& vertices, UINT first_vertex, const UINT* indices, UINT index_count) override;
+		bool close() override;
+
+	private:
+		std::string faces_path;
+		AsyncFileWriter out;
+		AsyncFileWriter faces;
+		bool with_normals;
+		UINT vertex_count;
+		UINT face_count;
+		size_t vertex_count_offset;		// Of the zero padded counts in the header
+		size_t face_count_offset;
+	};
+
+	// Binary STL: every triangle with its own corners and face normal
+	class StlWriter : public MeshStreamWriter
+	{
+	public:
+		bool open(const std::string& path);
+
+		void add(const VertexStreams& vertices, UINT first_vertex, const UINT* indices, UINT index_count) override;
+		bool close() override;
+
+	private:
+		AsyncFileWriter out;
+		UINT triangle_count;
+	};
+}
@@ -11,7 +11,7 @@ D3D12_RAYTRACING_GEOMETRY_DESC& ModelLoading::Model::GetGeomDesc()
         indices.resource->GetGPUVirtualAddress();
     geometryDesc.Triangles.IndexCount =
         static_cast<UINT>(indices.resource->GetDesc().Width) / sizeof(Index);
-    geometryDesc.Triangles.IndexFormat = DXGI_FORMAT_R32_UINT;
+    geometryDesc.Triangles.IndexFormat = sizeof(Index) == 4 ? DXGI_FORMAT_R32_UINT : DXGI_FORMAT_R16_UINT;
     geometryDesc.Triangles.Transform3x4 = 0;
     geometryDesc.Triangles.VertexFormat = DXGI_FORMAT_R32G32B32_FLOAT;
     geometryDesc.Triangles.VertexCount =
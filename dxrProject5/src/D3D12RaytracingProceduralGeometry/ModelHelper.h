@@ -0,0 +1,37 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace Model
+{
+	// Runs f(0) .. f(count - 1) on up to num_threads threads, the calling one included
+	template <class F>
+	void parallel_for(UINT count, UINT num_threads, F f)
+	{
+		std::atomic<UINT> next(0);
+		auto Work = [&]()
+		{
+			for (UINT i = next++; i < count; i = next++)
+			{
+				f(i);
+			}
+		};
+		std::vector<std::thread> threads;
+		for (UINT t = 1; t < min(count, num_threads); t++)
+		{
+			threads.push_back(std::thread(Work));
+		}
+		Work();
+		for (auto& thread : threads)
+		{
+			thread.join();
+		}
+	}
+
+	inline UINT64 align(UINT64 value, UINT64 alignment)
+	{
+		return (value + alignment - 1) / alignment * alignment;
+	}
+}
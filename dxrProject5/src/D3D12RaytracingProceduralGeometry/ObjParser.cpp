@@ -0,0 +1,343 @@
+#include "stdafx.h"
+#include "ObjParser.h"
+#include "MappedFile.h"
+#include "ModelHelper.h"
+
+using namespace Model;
+
+namespace
+{
+	const size_t c_min_chunk_bytes = 1 << 20;	// Smaller pieces of a file are not worth a thread
+
+	// Indices of a corner that are still relative to the end of its chunk's arrays, until the chunks are merged
+	enum RelativeIndex : unsigned char
+	{
+		RelativePosition = 1,
+		RelativeTexCoord = 2,
+		RelativeNormal = 4,
+	};
+
+	struct ObjChunk
+	{
+		ObjData data;							// face_starts has no end marker
+		std::vector<unsigned char> relative;	// RelativeIndex flags of every corner
+	};
+
+	inline bool is_space(char c)
+	{
+		return c == ' ' || c == '\t' || c == '\r';
+	}
+
+	inline const char* skip_spaces(const char* p, const char* end)
+	{
+		while (p < end && is_space(*p)) p++;
+		return p;
+	}
+
+	inline bool is_digit(const char* p, const char* end)
+	{
+		return p < end && *p >= '0' && *p <= '9';
+	}
+
+	// Like std::from_chars: returns the end of the number, or p if there is none
+	const char* parse_int(const char* p, const char* end, int& value)
+	{
+		const char* start = p;
+		bool negative = (p < end && *p == '-');
+		if (negative || (p < end && *p == '+')) p++;
+		if (!is_digit(p, end)) return start;
+
+		int result = 0;
+		while (is_digit(p, end))
+		{
+			result = result * 10 + (*p - '0');
+			p++;
+		}
+		value = negative ? -result : result;
+		return p;
+	}
+
+	// Like std::from_chars, which the v141 toolset only has for integers. Numbers with up to 15 significant
+	// digits and a power of ten a double holds exactly take one correctly rounded double operation, anything
+	// else (long mantissas, huge exponents, inf and nan) goes through strtod.
+	const char* parse_float(const char* p, const char* end, float& value)
+	{
+		static const double c_powers_of_10[] = {
+			1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+			1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+		const char* start = p;
+		bool negative = (p < end && *p == '-');
+		if (negative || (p < end && *p == '+')) p++;
+
+		uint64_t mantissa = 0;
+		int significant_digits = 0;
+		int exponent = 0;
+		bool any_digits = false;
+		for (; is_digit(p, end); p++)
+		{
+			any_digits = true;
+			if (mantissa == 0 && *p == '0') continue;
+			if (significant_digits < 19) mantissa = mantissa * 10 + (*p - '0');
+			else exponent++;
+			significant_digits++;
+		}
+		if (p < end && *p == '.')
+		{
+			p++;
+			for (; is_digit(p, end); p++)
+			{
+				any_digits = true;
+				exponent--;
+				if (mantissa == 0 && *p == '0') continue;
+				if (significant_digits < 19) mantissa = mantissa * 10 + (*p - '0');
+				else exponent++;
+				significant_digits++;
+			}
+		}
+
+		if (any_digits && p < end && (*p == 'e' || *p == 'E'))
+		{
+			int exponent_part;
+			const char* exponent_end = parse_int(p + 1, end, exponent_part);
+			if (exponent_end != p + 1)
+			{
+				exponent += exponent_part;
+				p = exponent_end;
+			}
+		}
+
+		if (any_digits && significant_digits <= 15 && exponent >= -22 && exponent <= 22)
+		{
+			double result = double(mantissa);
+			result = (exponent < 0) ? result / c_powers_of_10[-exponent] : result * c_powers_of_10[exponent];
+			value = float(negative ? -result : result);
+			return p;
+		}
+
+		// strtod needs a terminated string, and the mapped file is not
+		const char* token_end = start;
+		while (token_end < end && !is_space(*token_end) && *token_end != '\n') token_end++;
+		std::string token(start, token_end);
+		char* parsed_end = nullptr;
+		double result = strtod(token.c_str(), &parsed_end);
+		if (parsed_end == token.c_str()) return start;
+		value = float(result);
+		return start + (parsed_end - token.c_str());
+	}
+
+	// Reads up to count floats separated by spaces. Missing ones are left alone.
+	const char* parse_floats(const char* p, const char* end, float* values, int count)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			p = skip_spaces(p, end);
+			const char* next = parse_float(p, end, values[i]);
+			if (next == p) break;
+			p = next;
+		}
+		return p;
+	}
+
+	// OBJ indices start at 1, negative ones count back from the last element read so far
+	inline int resolve_index(int index, size_t count, unsigned char flag, unsigned char& relative)
+	{
+		if (index > 0) return index - 1;
+		if (index == 0) return -1;
+		relative |= flag;
+		return int(count) + index;
+	}
+
+	inline std::string rest_of_line(const char* p, const char* end)
+	{
+		while (end > p && is_space(end[-1])) end--;
+		return std::string(p, end);
+	}
+
+	void parse_chunk(const char* p, const char* end, ObjChunk& chunk)
+	{
+		ObjData& data = chunk.data;
+		while (p < end)
+		{
+			const char* line_end = static_cast<const char*>(memchr(p, '\n', end - p));
+			if (line_end == nullptr) line_end = end;
+
+			p = skip_spaces(p, line_end);
+			const char* keyword = p;
+			while (p < line_end && !is_space(*p)) p++;
+			size_t length = p - keyword;
+			p = skip_spaces(p, line_end);
+
+			if (length == 1 && keyword[0] == 'v')
+			{
+				XMFLOAT3 position(0.0f, 0.0f, 0.0f);
+				parse_floats(p, line_end, &position.x, 3);
+				data.positions.push_back(position);
+			}
+			else if (length == 2 && keyword[0] == 'v' && keyword[1] == 't')
+			{
+				XMFLOAT2 tex_coord(0.0f, 0.0f);
+				parse_floats(p, line_end, &tex_coord.x, 2);
+				data.tex_coords.push_back(tex_coord);
+			}
+			else if (length == 2 && keyword[0] == 'v' && keyword[1] == 'n')
+			{
+				XMFLOAT3 normal(0.0f, 0.0f, 0.0f);
+				parse_floats(p, line_end, &normal.x, 3);
+				data.normals.push_back(normal);
+			}
+			else if (length == 1 && keyword[0] == 'f')
+			{
+				size_t first_corner = data.corners.size();
+				while (p < line_end)
+				{
+					// v, v/vt, v//vn or v/vt/vn
+					ObjCorner corner = { -1, -1, -1 };
+					unsigned char relative = 0;
+					int index;
+					const char* next = parse_int(p, line_end, index);
+					if (next == p) break;
+					corner.position = resolve_index(index, data.positions.size(), RelativePosition, relative);
+					p = next;
+					if (p < line_end && *p == '/')
+					{
+						next = parse_int(++p, line_end, index);
+						if (next != p)
+						{
+							corner.tex_coord = resolve_index(index, data.tex_coords.size(), RelativeTexCoord, relative);
+							p = next;
+						}
+						if (p < line_end && *p == '/')
+						{
+							next = parse_int(++p, line_end, index);
+							if (next != p)
+							{
+								corner.normal = resolve_index(index, data.normals.size(), RelativeNormal, relative);
+								p = next;
+							}
+						}
+					}
+					data.corners.push_back(corner);
+					chunk.relative.push_back(relative);
+					p = skip_spaces(p, line_end);
+				}
+
+				// Points and lines have no triangles
+				if (data.corners.size() - first_corner >= 3)
+				{
+					data.face_starts.push_back(UINT(first_corner));
+				}
+				else
+				{
+					data.corners.resize(first_corner);
+					chunk.relative.resize(first_corner);
+				}
+			}
+			else if ((length == 1 && (keyword[0] == 'o' || keyword[0] == 'g')) || (length == 6 && strncmp(keyword, "usemtl", 6) == 0))
+			{
+				ObjGroup group;
+				group.type = (length == 1) ? ObjGroup::Object : ObjGroup::Material;
+				group.first_face = UINT(data.face_starts.size());
+				group.name = rest_of_line(p, line_end);
+				data.groups.push_back(group);
+			}
+
+			p = line_end + 1;
+		}
+	}
+
+}
+
+void Model::parse_obj(const char* begin, const char* end, ObjData& data, unsigned int num_threads)
+{
+	if (num_threads == 0)
+	{
+		num_threads = max(1u, std::thread::hardware_concurrency());
+	}
+
+	// Chunks end right after a newline so no line is split between two of them
+	size_t size = end - begin;
+	unsigned int chunk_count = static_cast<unsigned int>(max(size_t(1), min(size_t(num_threads), size / c_min_chunk_bytes)));
+	std::vector<const char*> chunk_bounds(chunk_count + 1, end);
+	chunk_bounds[0] = begin;
+	for (unsigned int i = 1; i < chunk_count; i++)
+	{
+		const char* bound = max(begin + size / chunk_count * i, chunk_bounds[i - 1]);
+		const char* newline = static_cast<const char*>(memchr(bound, '\n', end - bound));
+		chunk_bounds[i] = (newline != nullptr) ? newline + 1 : end;
+	}
+
+	std::vector<ObjChunk> chunks(chunk_count);
+	parallel_for(chunk_count, chunk_count, [&](unsigned int i)
+	{
+		parse_chunk(chunk_bounds[i], chunk_bounds[i + 1], chunks[i]);
+	});
+
+	// Where every chunk goes in the merged arrays
+	struct Offsets
+	{
+		size_t positions, tex_coords, normals, corners, faces;
+	};
+	std::vector<Offsets> offsets(chunk_count + 1);
+	offsets[0] = { 0, 0, 0, 0, 0 };
+	for (unsigned int i = 0; i < chunk_count; i++)
+	{
+		const ObjData& chunk = chunks[i].data;
+		offsets[i + 1].positions = offsets[i].positions + chunk.positions.size();
+		offsets[i + 1].tex_coords = offsets[i].tex_coords + chunk.tex_coords.size();
+		offsets[i + 1].normals = offsets[i].normals + chunk.normals.size();
+		offsets[i + 1].corners = offsets[i].corners + chunk.corners.size();
+		offsets[i + 1].faces = offsets[i].faces + chunk.face_starts.size();
+	}
+
+	const Offsets& total = offsets[chunk_count];
+	data.positions.resize(total.positions);
+	data.tex_coords.resize(total.tex_coords);
+	data.normals.resize(total.normals);
+	data.corners.resize(total.corners);
+	data.face_starts.resize(total.faces + 1);
+	data.face_starts[total.faces] = UINT(total.corners);
+	data.groups.clear();
+
+	parallel_for(chunk_count, chunk_count, [&](unsigned int i)
+	{
+		const ObjChunk& chunk = chunks[i];
+		const Offsets& offset = offsets[i];
+		std::copy(chunk.data.positions.begin(), chunk.data.positions.end(), data.positions.begin() + offset.positions);
+		std::copy(chunk.data.tex_coords.begin(), chunk.data.tex_coords.end(), data.tex_coords.begin() + offset.tex_coords);
+		std::copy(chunk.data.normals.begin(), chunk.data.normals.end(), data.normals.begin() + offset.normals);
+		for (size_t c = 0; c < chunk.data.corners.size(); c++)
+		{
+			ObjCorner corner = chunk.data.corners[c];
+			unsigned char relative = chunk.relative[c];
+			if (relative & RelativePosition) corner.position += int(offset.positions);
+			if (relative & RelativeTexCoord) corner.tex_coord += int(offset.tex_coords);
+			if (relative & RelativeNormal) corner.normal += int(offset.normals);
+			data.corners[offset.corners + c] = corner;
+		}
+		for (size_t f = 0; f < chunk.data.face_starts.size(); f++)
+		{
+			data.face_starts[offset.faces + f] = chunk.data.face_starts[f] + UINT(offset.corners);
+		}
+	});
+
+	for (unsigned int i = 0; i < chunk_count; i++)
+	{
+		for (ObjGroup group : chunks[i].data.groups)
+		{
+			group.first_face += UINT(offsets[i].faces);
+			data.groups.push_back(group);
+		}
+	}
+}
+
+bool Model::parse_obj_file(const std::string& path, ObjData& data, unsigned int num_threads)
+{
+	MappedFile file(path);
+	if (!file.is_open())
+	{
+		return false;
+	}
+	parse_obj(file.data(), file.data() + file.size(), data, num_threads);
+	return true;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "Mesh.h"
+
+#include <string>
+
+namespace Model
+{
+	// One corner of an OBJ face: 0 based indices into the position, texture coordinate and normal arrays, -1 if absent
+	struct ObjCorner
+	{
+		int position;
+		int tex_coord;
+		int normal;
+	};
+
+	// An o or g line (a new mesh) or a usemtl line (a new material within it), coming before face first_face
+	struct ObjGroup
+	{
+		enum Type { Object, Material };
+
+		Type type;
+		UINT first_face;
+		std::string name;
+	};
+
+	// The parts of an OBJ file the import path uses, in file order. Faces are kept as polygons.
+	struct ObjData
+	{
+		std::vector<XMFLOAT3> positions;
+		std::vector<XMFLOAT2> tex_coords;
+		std::vector<XMFLOAT3> normals;
+		std::vector<ObjCorner> corners;
+		std::vector<UINT> face_starts;		// First corner of every face, plus one past the last corner
+		std::vector<ObjGroup> groups;
+
+		UINT face_count() const { return face_starts.empty() ? 0 : UINT(face_starts.size() - 1); }
+	};
+
+	// Parses OBJ text. Large texts are split into newline aligned chunks parsed on num_threads threads
+	// (0 = one per core) and merged back in file order, negative (relative) indices included.
+	void parse_obj(const char* begin, const char* end, ObjData& data, unsigned int num_threads = 0);
+
+	// Memory maps the file and parses it in place. Returns false if the file cannot be opened.
+	bool parse_obj_file(const std::string& path, ObjData& data, unsigned int num_threads = 0);
+}
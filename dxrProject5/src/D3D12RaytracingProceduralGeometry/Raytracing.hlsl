@@ -24,13 +24,14 @@ ConstantBuffer<SceneConstantBuffer> g_sceneCB : register(b0); // camera projecti
 
 // Triangle resources
 ByteAddressBuffer g_indices : register(t1, space0); // triangle indices
-StructuredBuffer<Vertex> g_vertices : register(t2, space0); // triangle positions
+ByteAddressBuffer g_vertices : register(t2, space0); // triangle vertices, Vertex or PackedVertex (l_materialCB.packedVertices)
 
 // Procedural geometry resources
-StructuredBuffer<PrimitiveInstancePerFrameBuffer> g_AABBPrimitiveAttributes : register(t3, space0); // transforms per procedural
+StructuredBuffer<PrimitiveInstancePerFrameBuffer> g_AABBPrimitiveAttributes : register(t3, space0); // transforms per creature instance, indexed by InstanceIndex()
 ConstantBuffer<PrimitiveConstantBuffer> l_materialCB : register(b1); // material data per procedural
 ConstantBuffer<PrimitiveInstanceConstantBuffer> l_aabbCB: register(b2); // other meta-data: type, instance indices
 
+// Creature buffers, one element per generated creature. Indexed by InstanceID() so instances can share a creature.
 StructuredBuffer<HeadSpineInfoBuffer> g_headSpineBuffer: register(t4, space0);
 StructuredBuffer<AppendageInfoBuffer> g_appenBuffer: register(t5, space0);
 StructuredBuffer<LimbInfoBuffer> g_limbBuffer: register(t6, space0);
@@ -376,6 +377,19 @@ void MyRaygenShader()
     g_renderTarget[DispatchRaysIndex().xy] = col;
 }
 
+// Normal of a triangle vertex, in whichever form the mesh was uploaded
+float3 LoadVertexNormal(uint index)
+{
+    if (l_materialCB.packedVertices)
+    {
+        float3 position, normal;
+        float2 texCoord;
+        LoadPackedVertex(index, g_vertices, l_materialCB.positionMin.xyz, l_materialCB.positionExtent.xyz, position, normal, texCoord);
+        return normal;
+    }
+    return asfloat(g_vertices.Load3(index * VERTEX_SIZE_IN_BYTES + 12));
+}
+
 //***************************************************************************
 //******************------ Closest hit shaders -------***********************
 //***************************************************************************
@@ -387,19 +401,19 @@ void MyRaygenShader()
 [shader("closesthit")]
 void MyClosestHitShader_Triangle(inout RayPayload rayPayload, in BuiltInTriangleIntersectionAttributes attr)
 {
-    // Get the base index of the triangle's first 16 bit index.
-    uint indexSizeInBytes = 2;
+    // Get the base index of the triangle's first index. Meshes with more than 65536 vertices use 32 bit indices.
+    uint indexSizeInBytes = l_materialCB.indexSizeInBytes;
     uint indicesPerTriangle = 3;
     uint triangleIndexStride = indicesPerTriangle * indexSizeInBytes;
 
 	// PrimitiveIndex() is the triangle index within the mesh. For Procedural primitives, this is the index into the AABB array defining the geometry.
     uint baseIndex = PrimitiveIndex() * triangleIndexStride;
 
-    // Load up three 16 bit indices for the triangle.
-    const uint3 indices = Load3x16BitIndices(baseIndex, g_indices);
+    // Load up three indices for the triangle.
+    const uint3 indices = indexSizeInBytes == 4 ? Load3x32BitIndices(baseIndex, g_indices) : Load3x16BitIndices(baseIndex, g_indices);
 
     // Retrieve corresponding vertex normals for the triangle vertices.
-    float3 triangleNormal = g_vertices[indices[0]].normal;
+    float3 triangleNormal = LoadVertexNormal(indices[0]);
 
 	// This is the intersection point on the triangle.
 	float3 hitPosition = HitWorldPosition();
@@ -577,7 +591,7 @@ void MyMissShader_ShadowRay(inout ShadowRayPayload rayPayload)
 // Get ray in AABB's local space.
 Ray GetRayInAABBPrimitiveLocalSpace()
 {
-    PrimitiveInstancePerFrameBuffer attr = g_AABBPrimitiveAttributes[l_aabbCB.instanceIndex];
+    PrimitiveInstancePerFrameBuffer attr = g_AABBPrimitiveAttributes[InstanceIndex()];
 
     // Retrieve a ray origin position and direction in bottom level AS space 
     // and transform them into the AABB primitive's local space.
@@ -602,7 +616,7 @@ void MyIntersectionShader_AnalyticPrimitive()
     ProceduralPrimitiveAttributes attr;
     if (RayAnalyticGeometryIntersectionTest(localRay, primitiveType, thit, attr))
     {
-        PrimitiveInstancePerFrameBuffer aabbAttribute = g_AABBPrimitiveAttributes[l_aabbCB.instanceIndex];
+        PrimitiveInstancePerFrameBuffer aabbAttribute = g_AABBPrimitiveAttributes[InstanceIndex()];
 
 		// Make sure the normals are stored in BLAS space and not the local space
         attr.normal = mul(attr.normal, (float3x3) aabbAttribute.localSpaceToBottomLevelAS);
@@ -952,15 +966,12 @@ float sceneSDF(float3 p) {
 	float headSpine = smin(spine, headSDF, .1);
 	float limbs = armSDF(p);
 	float appendages = appendagesSDF(p);
-<<<<<<< HEAD
-	return headSpine;//smin(smin(limbs, appendages, .2), headSpine, .1);
-=======
 	return smin(smin(limbs, appendages, .2), headSpine, .1);
->>>>>>> 25563dc25b54e05cb73d027ef8fb273cf9dcbbaa
 }
 
 //~~~~~~~~~~~~~~~~~~~~ACTUAL RAY MARCHING STUFF~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
-float march(float3 rayOrigin, float3 direction) {
+// Returns MAX_DIST if nothing is hit before maxDist
+float march(float3 rayOrigin, float3 direction, float maxDist) {
     float dist = MIN_DIST;
     for (int i = 0; i < MAX_STEPS; i++) {
         float3 pos = rayOrigin + dist * direction;
@@ -969,7 +980,7 @@ float march(float3 rayOrigin, float3 direction) {
             return dist;
         }
         dist += dt;
-        if (dist >= MAX_DIST) {
+        if (dist >= maxDist) {
             return MAX_DIST;
         }
     }
@@ -1021,7 +1032,7 @@ void main() {
 
 void fillGlobals()
 {
-	HeadSpineInfoBuffer headSpineAttr = g_headSpineBuffer[l_aabbCB.instanceIndex];
+	HeadSpineInfoBuffer headSpineAttr = g_headSpineBuffer[InstanceID()];
 	
 	for (int h = 0; h < HEAD_COUNT; h++)
 	{
@@ -1036,7 +1047,7 @@ void fillGlobals()
 		spineRadData[sr] = headSpineAttr.spineRadData[sr];
 	}
 	
-	AppendageInfoBuffer appenAttr = g_appenBuffer[l_aabbCB.instanceIndex];
+	AppendageInfoBuffer appenAttr = g_appenBuffer[InstanceID()];
 	
 	numAppendages = appenAttr.numAppen;
 	for (int a = 0; a < APPEN_COUNT; a++)
@@ -1045,7 +1056,7 @@ void fillGlobals()
 		appenRads[a] = appenAttr.appenRads[a];
 	}
 	
-	LimbInfoBuffer limbAttr = g_limbBuffer[l_aabbCB.instanceIndex];
+	LimbInfoBuffer limbAttr = g_limbBuffer[InstanceID()];
 	
 	for (int l = 0; l < LIMBLEN_COUNT; l++)
 	{
@@ -1060,7 +1071,7 @@ void fillGlobals()
 		jointRadData[jr] = limbAttr.jointRadData[jr];
 	}
 	
-	RotationInfoBuffer rotAttr = g_rotBuffer[l_aabbCB.instanceIndex];
+	RotationInfoBuffer rotAttr = g_rotBuffer[InstanceID()];
 
 	for (int r = 0; r < ROT_COUNT; r++)
 	{
@@ -1076,7 +1087,7 @@ void MyIntersectionShader_VolumetricPrimitive()
 {
     Ray localRay = GetRayInAABBPrimitiveLocalSpace();
     VolumetricPrimitive::Enum primitiveType = (VolumetricPrimitive::Enum) l_aabbCB.primitiveType;
-    PrimitiveInstancePerFrameBuffer aabbAttribute = g_AABBPrimitiveAttributes[l_aabbCB.instanceIndex];
+    PrimitiveInstancePerFrameBuffer aabbAttribute = g_AABBPrimitiveAttributes[InstanceIndex()];
 
 	fillGlobals();
 
@@ -1088,13 +1099,24 @@ void MyIntersectionShader_VolumetricPrimitive()
         radii[i] = aabbAttribute.ballRadii[i];
     }*/
 
+    // The AABB conservatively bounds this creature (or one part of it, see CreatureBounds.h), so only march
+    // the stretch of the ray inside it. Any surface outside the box belongs to another box, whose own
+    // intersection shader finds it. t is the same in every space since the transforms are affine.
+    Ray objectRay;
+    objectRay.origin = ObjectRayOrigin();
+    objectRay.direction = ObjectRayDirection();
+    float3 unitAABB[2] = { float3(-1, -1, -1), float3(1, 1, 1) };
+    float tEnter, tExit;
+    RayBoxIntersectionTest(objectRay, unitAABB, tEnter, tExit);
+    tEnter = max(tEnter, RayTMin());
+
     float thit;
     ProceduralPrimitiveAttributes attr;
-    float distance = march(localRay.origin, localRay.direction);
+    float distance = march(localRay.origin + tEnter * localRay.direction, localRay.direction, tExit - tEnter + EPSILON);
     if (distance < MAX_DIST - 2.0 * EPSILON)
     {
-        float3 p = localRay.origin + distance * localRay.direction;
-        thit = distance;
+        thit = tEnter + distance;
+        float3 p = localRay.origin + thit * localRay.direction;
 
         // Make sure the normals are stored in BLAS space and not the local space
         attr.normal = normalize(normal(p));
@@ -69,12 +69,26 @@ struct ShadowRayPayload
     bool hit;
 };
 
+// Same layout as Model::Vertex, so imported meshes upload as they are.
 struct Vertex
 {
     XMFLOAT3 position;
     XMFLOAT3 normal;
+    XMFLOAT2 texCoord;
 };
 
+// Opt-in compact form of Vertex for imported meshes, 12 bytes instead of 32. Packed with Model::pack_vertices(),
+// read with LoadPackedVertex().
+struct PackedVertex
+{
+    UINT positionXY;        // 16 bit unorms, x in the low half, relative to the mesh bounds
+    UINT positionZNormal;   // 16 bit unorm z, then the normal's octahedral coordinates as two 8 bit snorms
+    UINT texCoord;          // Two halfs, u in the low half
+};
+
+#define VERTEX_SIZE_IN_BYTES 32
+#define PACKED_VERTEX_SIZE_IN_BYTES 12
+
 // Really this isn't a `constant` buffer, as in the contents may change but the buffer itself isn't dynamic.
 struct SceneConstantBuffer
 {
@@ -145,6 +159,11 @@ struct PrimitiveConstantBuffer
     float specularPower;
 	bool hasTexture;
 	float textureResolution;
+	UINT indexSizeInBytes;	// Of the triangle geometry's indices, 2 or 4
+	UINT packedVertices;	// The triangle geometry's vertices are PackedVertex rather than Vertex
+	XMFLOAT2 padding;		// Keeps the bounds in registers of their own, as HLSL places them
+	XMFLOAT4 positionMin;	// Packed positions are relative to these bounds (w unused)
+	XMFLOAT4 positionExtent;
 };
 
 // Attributes per primitive instance. An instance primitive actually exists in the scene and may be dynamic.
@@ -74,6 +74,30 @@ float CalculateAnimationInterpolant(in float elapsedTime, in float cycleDuration
 	return smoothstep(0, 1, interpolant);
 }
 
+// Decodes a normal from octahedral coordinates, two 8 bit snorms in the low bytes of packed
+// (Cigolle et al., "A Survey of Efficient Representations for Independent Unit Vectors").
+float3 UnpackOctNormal(uint packed)
+{
+    int2 snorms = int2(packed << 24, packed << 16) >> 24;
+    float2 e = max(float2(snorms) / 127.0, -1.0);
+    float3 n = float3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = saturate(-n.z);
+    n.xy += (n.xy >= 0.0) ? -t : t;
+    return normalize(n);
+}
+
+// Loads and decodes a PackedVertex (see RaytracingHlslCompat.h), the same way Model::unpack_vertex() does.
+static
+void LoadPackedVertex(uint index, ByteAddressBuffer vertices, float3 boundsMin, float3 boundsExtent,
+    out float3 position, out float3 normal, out float2 texCoord)
+{
+    uint3 packed = vertices.Load3(index * PACKED_VERTEX_SIZE_IN_BYTES);
+    float3 unorms = float3(packed.x & 0xffff, packed.x >> 16, packed.y & 0xffff) / 65535.0;
+    position = boundsMin + unorms * boundsExtent;
+    normal = UnpackOctNormal(packed.y >> 16);
+    texCoord = float2(f16tof32(packed.z & 0xffff), f16tof32(packed.z >> 16));
+}
+
 // Load three 2-byte indices from a ByteAddressBuffer.
 static
 uint3 Load3x16BitIndices(uint offsetBytes, ByteAddressBuffer Indices)
@@ -107,6 +131,13 @@ uint3 Load3x16BitIndices(uint offsetBytes, ByteAddressBuffer Indices)
     return indices;
 }
 
+// Load three 4-byte indices from a ByteAddressBuffer. These are always 4-byte aligned.
+static
+uint3 Load3x32BitIndices(uint offsetBytes, ByteAddressBuffer Indices)
+{
+    return Indices.Load3(offsetBytes);
+}
+
 // LOOKAT-1.9.1: Retrieve the intersection point in world coordinates.
 float3 HitWorldPosition()
 {
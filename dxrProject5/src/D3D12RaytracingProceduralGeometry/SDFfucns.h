@@ -276,33 +276,22 @@ vec2 operator*(const vec2 &v, const mat2 &m);
 
 class SDF {
 public:
-	StructuredBuffer<HeadSpineInfoBuffer> g_headSpineBuffer;
-	StructuredBuffer<AppendageInfoBuffer> g_appenBuffer;
-	StructuredBuffer<LimbInfoBuffer> g_limbBuffer;
-	StructuredBuffer<RotationInfoBuffer> g_rotBuffer;
+	// Copies of one creature's buffers, like the globals fillGlobals() sets up in Raytracing.hlsl
+	HeadSpineInfoBuffer headSpineInfo;
+	AppendageInfoBuffer appenInfo;
+	LimbInfoBuffer limbInfo;
+	RotationInfoBuffer rotInfo;
 	
 	SDF() {}
-	SDF(StructuredBuffer<HeadSpineInfoBuffer> m_headSpineBuffer,
-		StructuredBuffer<AppendageInfoBuffer> m_appenBuffer,
-		StructuredBuffer<LimbInfoBuffer> m_limbBuffer,
-		StructuredBuffer<RotationInfoBuffer> m_rotBuffer) :
-		g_headSpineBuffer(m_headSpineBuffer), g_appenBuffer(m_appenBuffer),
-		g_limbBuffer(m_limbBuffer), g_rotBuffer(m_rotBuffer)
+	SDF(StructuredBuffer<HeadSpineInfoBuffer>& m_headSpineBuffer,
+		StructuredBuffer<AppendageInfoBuffer>& m_appenBuffer,
+		StructuredBuffer<LimbInfoBuffer>& m_limbBuffer,
+		StructuredBuffer<RotationInfoBuffer>& m_rotBuffer,
+		UINT slot = 0) :
+		headSpineInfo(m_headSpineBuffer[slot]), appenInfo(m_appenBuffer[slot]),
+		limbInfo(m_limbBuffer[slot]), rotInfo(m_rotBuffer[slot])
 	{}
 	~SDF() {}
-
-	void setHeadBuffer(StructuredBuffer<HeadSpineInfoBuffer> m_headSpineBuffer) {
-		g_headSpineBuffer = m_headSpineBuffer;
-	}
-	void setAppenBuffer(StructuredBuffer<AppendageInfoBuffer> m_appenBuffer) {
-		g_appenBuffer = m_appenBuffer;
-	}
-	void setLimbBuffer(StructuredBuffer<LimbInfoBuffer> m_limbBuffer) {
-		g_limbBuffer = m_limbBuffer;
-	}
-	void setLimbBuffer(StructuredBuffer<RotationInfoBuffer> m_rotBuffer) {
-		g_rotBuffer = m_rotBuffer;
-	}
 	
 	
 	
@@ -456,7 +445,7 @@ public:
 	}
 	
 	//~~~~~HEAD SDFs~~~~~///
-	float bugHeadSDF(vec3 p, float u_Head[HEAD_COUNT]) {
+	float bugHeadSDF(vec3 p, const float u_Head[HEAD_COUNT]) {
 		p = p + vec3(u_Head[0], u_Head[1], u_Head[2]);
 		p = rotateY(p, -90.0);
 		float base = sphereSDF(p, u_Head[3]);
@@ -468,7 +457,7 @@ public:
 		return head;
 	}
 	
-	float dinoHeadSDF(vec3 p, float u_Head[HEAD_COUNT]) {
+	float dinoHeadSDF(vec3 p, const float u_Head[HEAD_COUNT]) {
 		p = p + vec3(u_Head[0], u_Head[1], u_Head[2]);
 		p = rotateY(p, -90.0);
 		float base = sphereSDF(p, u_Head[3]);
@@ -493,7 +482,7 @@ public:
 		return combine;
 	}
 	
-	float trollHeadSDF(vec3 p, float u_Head[HEAD_COUNT]) {
+	float trollHeadSDF(vec3 p, const float u_Head[HEAD_COUNT]) {
 		p = p + vec3(u_Head[0], u_Head[1], u_Head[2]);
 		p = rotateY(p, -270.0);
 		float base = sphereSDF(p, u_Head[3]);
@@ -539,9 +528,9 @@ public:
 	}
 	
 	float appendagesSDF(vec3 p) {
-		AppendageInfoBuffer appenAttr = g_appenBuffer[0];
-		LimbInfoBuffer limbAttr = g_limbBuffer[0];
-		RotationInfoBuffer rotAttr = g_rotBuffer[0];
+		const AppendageInfoBuffer& appenAttr = appenInfo;
+		const LimbInfoBuffer& limbAttr = limbInfo;
+		const RotationInfoBuffer& rotAttr = rotInfo;
 	
 		float all = MAX_DIST;
 		float angle = 35.0;
@@ -589,8 +578,8 @@ public:
 	
 	float armSDF(vec3 p) {
 	
-		LimbInfoBuffer limbAttr = g_limbBuffer[0];
-		RotationInfoBuffer rotAttr = g_rotBuffer[0];
+		const LimbInfoBuffer& limbAttr = limbInfo;
+		const RotationInfoBuffer& rotAttr = rotInfo;
 	
 		int countSegs = 0;
 	
@@ -653,7 +642,7 @@ public:
 	
 	
 	float spineSDF(vec3 p) {
-		HeadSpineInfoBuffer headSpineAttr = g_headSpineBuffer[0];
+		const HeadSpineInfoBuffer& headSpineAttr = headSpineInfo;
 	
 		float spine = MAX_DIST;
 		for (int i = 0; i < SPINE_LOC_COUNT; i += 3) {
@@ -666,7 +655,7 @@ public:
 	
 	// OVERALL SCENE SDF -- rotates about z-axis (turn-table style)
 	float sceneSDF(vec3 p) {
-		HeadSpineInfoBuffer headSpineAttr = g_headSpineBuffer[0];
+		const HeadSpineInfoBuffer& headSpineAttr = headSpineInfo;
 	
 		float headSDF = 0;
 		int headType = headSpineAttr.headData[4];
@@ -681,8 +670,13 @@ public:
 		}
 		float spine = spineSDF(p);
 		float headSpine = smin(spine, headSDF, .1);
-		float limbs = armSDF(p);
-		float appendages = appendagesSDF(p);
-		return headSpine;//smin(smin(limbs, appendages, .2), headSpine, .1);
+		// The limbs and appendages are left out, see creatureSDF(). Evaluating them here only to drop them
+		// doubled the cost of creatureSDF() on the CPU.
+		return headSpine;//smin(smin(armSDF(p), appendagesSDF(p), .2), headSpine, .1);
+	}
+	
+	// Every part of the creature. sceneSDF() above leaves out the limbs and appendages.
+	float creatureSDF(vec3 p) {
+		return smin(smin(armSDF(p), appendagesSDF(p), .2), sceneSDF(p), .1);
 	}
 };
\ No newline at end of file
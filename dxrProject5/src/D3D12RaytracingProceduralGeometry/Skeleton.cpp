@@ -0,0 +1,276 @@
+#include "stdafx.h"
+#include "Skeleton.h"
+#include "ModelHelper.h"
+
+// Vertices per parallel_for item in Skin::deform()
+static const UINT c_deformChunkSize = 4096;
+
+// Keeps a vertex sitting right on a bone from getting an infinite weight, in creature space units
+static const float c_minBoneDistance = 0.01f;
+
+// The SDFs evaluate p + position, so a primitive at position actually sits at -position.
+static XMFLOAT3 sdfPosition(const float position[3])
+{
+	return XMFLOAT3(-position[0], -position[1], -position[2]);
+}
+
+static Bone makeBone(int parent, XMFLOAT3 head, XMFLOAT3 tail, float radius, int headJoint = -1, int tailJoint = -1)
+{
+	Bone bone;
+	bone.parent = parent;
+	bone.head = head;
+	bone.tail = tail;
+	bone.radius = radius;
+	bone.headJoint = headJoint;
+	bone.tailJoint = tailJoint;
+	return bone;
+}
+
+Skeleton::Skeleton() :
+	headBone(-1)
+{
+}
+
+Skeleton::Skeleton(const HeadSpineInfoBuffer& headSpineAttr, const LimbInfoBuffer& limbAttr) :
+	headBone(-1)
+{
+	// Spine. Zero positions are unused slots, see spineSDF().
+	std::vector<XMFLOAT3> spine;
+	std::vector<float> spineRadii;
+	for (int i = 0; i < SPINE_LOC_COUNT; i += 3)
+	{
+		const float* position = &headSpineAttr.spineLocData[i];
+		if (position[0] == 0.0f && position[1] == 0.0f && position[2] == 0.0f) continue;
+		spine.push_back(sdfPosition(position));
+		spineRadii.push_back(headSpineAttr.spineRadData[i / 3]);
+	}
+
+	// One bone between every two metaballs, or a single point-like bone for a lone metaball
+	UINT numSpineBones = spine.size() > 1 ? UINT(spine.size() - 1) : UINT(spine.size());
+	for (UINT i = 0; i < numSpineBones; i++)
+	{
+		UINT next = min(i + 1, UINT(spine.size() - 1));
+		bones.push_back(makeBone(int(i) - 1, spine[i], spine[next], max(spineRadii[i], spineRadii[next])));
+	}
+
+	auto ClosestSpineBone = [&](XMFLOAT3 position)
+	{
+		int closest = -1;
+		float closestDistance = FLT_MAX;
+		for (UINT b = 0; b < numSpineBones; b++)
+		{
+			float distance = distanceToBone(b, XMLoadFloat3(&position));
+			if (distance < closestDistance)
+			{
+				closest = int(b);
+				closestDistance = distance;
+			}
+		}
+		return closest;
+	};
+
+	// Head, from the closer end of its spine bone to the head center
+	int headType = int(headSpineAttr.headData[4]);
+	if (headType >= 0 && headType < 3)
+	{
+		XMFLOAT3 center = sdfPosition(headSpineAttr.headData);
+		int parent = ClosestSpineBone(center);
+		XMFLOAT3 joint = center;
+		if (parent >= 0)
+		{
+			XMVECTOR vCenter = XMLoadFloat3(&center);
+			float toHead = XMVectorGetX(XMVector3LengthSq(XMLoadFloat3(&bones[parent].head) - vCenter));
+			float toTail = XMVectorGetX(XMVector3LengthSq(XMLoadFloat3(&bones[parent].tail) - vCenter));
+			joint = (toHead < toTail) ? bones[parent].head : bones[parent].tail;
+		}
+		headBone = int(bones.size());
+		bones.push_back(makeBone(parent, joint, center, headSpineAttr.headData[3]));
+	}
+
+	// Limbs, walked the same way armSDF() does. Hands and feet are skinned to the last segment.
+	int numJoints = 0;
+	for (int l = 0; l < LIMBLEN_COUNT; l++)
+	{
+		numJoints += int(limbAttr.limbLengths[l]);
+	}
+	int start = 0;
+	for (int l = 0; l < LIMBLEN_COUNT && start < numJoints * 3; l++)
+	{
+		int count = int(limbAttr.limbLengths[l]);
+		if (count <= 0) continue;
+
+		int parent = ClosestSpineBone(sdfPosition(&limbAttr.jointLocData[start]));
+		limbBones.push_back(int(bones.size()));
+		for (int j = 0; j < max(count - 1, 1); j++)
+		{
+			int joint = start + 3 * j;
+			int next = start + 3 * min(j + 1, count - 1);
+			float radius = max(limbAttr.jointRadData[joint / 3], limbAttr.jointRadData[next / 3]);
+			bones.push_back(makeBone(parent, sdfPosition(&limbAttr.jointLocData[joint]), sdfPosition(&limbAttr.jointLocData[next]), radius,
+				joint / 3, next / 3));
+			parent = int(bones.size()) - 1;
+		}
+		start += count * 3;
+	}
+}
+
+UINT Skeleton::boneCount() const
+{
+	return static_cast<UINT>(bones.size());
+}
+
+void Skeleton::computeSkinMatrices(const std::vector<XMFLOAT4>& localRotations, std::vector<XMFLOAT4X4>& skinMatrices) const
+{
+	std::vector<XMMATRIX> global(bones.size());
+	skinMatrices.resize(bones.size());
+	for (UINT b = 0; b < boneCount(); b++)
+	{
+		const Bone& bone = bones[b];
+		XMVECTOR head = XMLoadFloat3(&bone.head);
+		XMVECTOR rotation = (b < localRotations.size()) ? XMLoadFloat4(&localRotations[b]) : XMQuaternionIdentity();
+
+		// Rotate about the bone's head, then follow the parent
+		XMMATRIX local = XMMatrixTranslationFromVector(XMVectorNegate(head)) * XMMatrixRotationQuaternion(rotation) * XMMatrixTranslationFromVector(head);
+		global[b] = (bone.parent >= 0) ? local * global[bone.parent] : local;
+		XMStoreFloat4x4(&skinMatrices[b], global[b]);
+	}
+}
+
+void Skeleton::poseLimbs(const LimbInfoBuffer& posedLimbs, std::vector<XMFLOAT4>& localRotations) const
+{
+	// Global rotation of every bone, the one taking its bind direction onto its posed one
+	std::vector<XMVECTOR> global(bones.size(), XMQuaternionIdentity());
+	localRotations.assign(bones.size(), XMFLOAT4(0.0f, 0.0f, 0.0f, 1.0f));
+	for (UINT b = 0; b < boneCount(); b++)
+	{
+		const Bone& bone = bones[b];
+		XMVECTOR parent = (bone.parent >= 0) ? global[bone.parent] : XMQuaternionIdentity();
+		global[b] = parent;
+		// The spine and head are not posed, and a limb of a single joint is a point that follows its parent
+		if (bone.headJoint < 0 || bone.headJoint == bone.tailJoint) continue;
+
+		XMFLOAT3 head = sdfPosition(&posedLimbs.jointLocData[3 * bone.headJoint]);
+		XMFLOAT3 tail = sdfPosition(&posedLimbs.jointLocData[3 * bone.tailJoint]);
+		XMVECTOR bindAxis = XMLoadFloat3(&bone.tail) - XMLoadFloat3(&bone.head);
+		XMVECTOR posedAxis = XMLoadFloat3(&tail) - XMLoadFloat3(&head);
+		XMVECTOR axis = XMVector3Cross(bindAxis, posedAxis);
+		float axisLength = XMVectorGetX(XMVector3Length(axis));
+		float dot = XMVectorGetX(XMVector3Dot(bindAxis, posedAxis));
+		// A bone that did not turn has no axis
+		global[b] = (axisLength > 1e-6f * abs(dot)) ? XMQuaternionRotationAxis(axis, std::atan2(axisLength, dot)) : XMQuaternionIdentity();
+
+		// computeSkinMatrices() applies the local rotation first, then the parent's
+		XMStoreFloat4(&localRotations[b], XMQuaternionMultiply(global[b], XMQuaternionInverse(parent)));
+	}
+}
+
+float Skeleton::distanceToBone(UINT bone, XMVECTOR p) const
+{
+	XMVECTOR head = XMLoadFloat3(&bones[bone].head);
+	XMVECTOR axis = XMLoadFloat3(&bones[bone].tail) - head;
+	float lengthSq = XMVectorGetX(XMVector3LengthSq(axis));
+	float t = (lengthSq > 0.0f) ? XMVectorGetX(XMVector3Dot(p - head, axis)) / lengthSq : 0.0f;
+	t = max(min(t, 1.0f), 0.0f);
+	return XMVectorGetX(XMVector3Length(p - (head + t * axis)));
+}
+
+Skin::Skin()
+{
+}
+
+void Skin::bind(const Skeleton& skeleton, const std::vector<vec3>& positions, const std::vector<vec3>& normals)
+{
+	bindPositions.resize(positions.size());
+	bindNormals.resize(positions.size());
+	vertexWeights.resize(positions.size());
+
+	for (UINT v = 0; v < vertexCount(); v++)
+	{
+		bindPositions[v] = XMFLOAT3(positions[v][0], positions[v][1], positions[v][2]);
+		bindNormals[v] = (v < normals.size()) ? XMFLOAT3(normals[v][0], normals[v][1], normals[v][2]) : XMFLOAT3(0.0f, 1.0f, 0.0f);
+
+		// Keep the closest bones, sorted by distance
+		SkinWeights& skinWeights = vertexWeights[v];
+		float distances[c_maxBoneInfluences];
+		for (int i = 0; i < c_maxBoneInfluences; i++)
+		{
+			skinWeights.bones[i] = 0;
+			distances[i] = FLT_MAX;
+		}
+		XMVECTOR p = XMLoadFloat3(&bindPositions[v]);
+		for (UINT b = 0; b < skeleton.boneCount(); b++)
+		{
+			float distance = max(skeleton.distanceToBone(b, p), c_minBoneDistance);
+			UINT16 bone = UINT16(b);
+			// Insert it, pushing the farthest one out
+			for (int i = 0; i < c_maxBoneInfluences; i++)
+			{
+				if (distance < distances[i])
+				{
+					std::swap(distance, distances[i]);
+					std::swap(bone, skinWeights.bones[i]);
+				}
+			}
+		}
+
+		float sum = 0.0f;
+		for (int i = 0; i < c_maxBoneInfluences; i++)
+		{
+			skinWeights.weights[i] = (distances[i] < FLT_MAX) ? 1.0f / (distances[i] * distances[i]) : 0.0f;
+			sum += skinWeights.weights[i];
+		}
+		for (int i = 0; i < c_maxBoneInfluences; i++)
+		{
+			skinWeights.weights[i] = (sum > 0.0f) ? skinWeights.weights[i] / sum : 0.0f;
+		}
+	}
+}
+
+UINT Skin::vertexCount() const
+{
+	return static_cast<UINT>(bindPositions.size());
+}
+
+void Skin::deform(const std::vector<XMFLOAT4X4>& skinMatrices, std::vector<XMFLOAT3>& positions, std::vector<XMFLOAT3>& normals,
+	UINT numThreads) const
+{
+	positions.resize(vertexCount());
+	normals.resize(vertexCount());
+	if (skinMatrices.empty())
+	{
+		positions = bindPositions;
+		normals = bindNormals;
+		return;
+	}
+
+	// Load the matrices into SIMD registers once instead of once per influence
+	std::vector<XMMATRIX> matrices(skinMatrices.size());
+	for (size_t b = 0; b < skinMatrices.size(); b++)
+	{
+		matrices[b] = XMLoadFloat4x4(&skinMatrices[b]);
+	}
+
+	if (numThreads == 0)
+	{
+		numThreads = max(1u, std::thread::hardware_concurrency());
+	}
+	UINT chunkCount = (vertexCount() + c_deformChunkSize - 1) / c_deformChunkSize;
+	Model::parallel_for(chunkCount, numThreads, [&](UINT chunk)
+	{
+		UINT end = min((chunk + 1) * c_deformChunkSize, vertexCount());
+		for (UINT v = chunk * c_deformChunkSize; v < end; v++)
+		{
+			const SkinWeights& skinWeights = vertexWeights[v];
+
+			// Influences are sorted by distance, so the first one always has the largest weight
+			XMMATRIX blended = matrices[skinWeights.bones[0]] * skinWeights.weights[0];
+			for (int i = 1; i < c_maxBoneInfluences && skinWeights.weights[i] > 0.0f; i++)
+			{
+				blended += matrices[skinWeights.bones[i]] * skinWeights.weights[i];
+			}
+
+			XMStoreFloat3(&positions[v], XMVector3Transform(XMLoadFloat3(&bindPositions[v]), blended));
+			XMStoreFloat3(&normals[v], XMVector3Normalize(XMVector3TransformNormal(XMLoadFloat3(&bindNormals[v]), blended)));
+		}
+	});
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "SDFfucns.h"
+
+using namespace DirectX;
+
+// A bone of the creature skeleton in creature (SDF) space. Bones have no orientation of their own in the
+// bind pose, so posing one is a rotation about its head followed by its parent's transform.
+struct Bone
+{
+	int parent;		// Index of the parent bone, -1 for the root
+	XMFLOAT3 head;	// Joint the bone rotates about
+	XMFLOAT3 tail;
+	float radius;	// Thickness of the body part
+	int headJoint;	// Limb joints (jointLocData[3 * joint]) the head and tail sit on, -1 for the spine and head bones
+	int tailJoint;
+};
+
+// Skeleton extracted from the same buffers the SDFs read:
+//	* the spine metaballs become a chain of bones, the first one being the root
+//	* the head hangs off the spine bone closest to it
+//	* every limb becomes a chain of bones (one per segment between joints) hanging off the closest spine bone
+// Parents always come before their children, so a single pass over the bones poses the whole skeleton.
+class Skeleton
+{
+public:
+	std::vector<Bone> bones;
+	int headBone;					// -1 if the creature has no head
+	std::vector<int> limbBones;		// First bone of every limb
+
+	Skeleton();
+	Skeleton(const HeadSpineInfoBuffer& headSpineAttr, const LimbInfoBuffer& limbAttr);
+
+	UINT boneCount() const;
+
+	// Forward kinematics. localRotations holds one quaternion per bone, rotating it about its head relative
+	// to its parent. skinMatrices receives bind pose -> posed creature space for every bone.
+	void computeSkinMatrices(const std::vector<XMFLOAT4>& localRotations, std::vector<XMFLOAT4X4>& skinMatrices) const;
+
+	// Local rotations that bring every limb bone onto the joints of posedLimbs, e.g. as CreatureGait left them.
+	// Segments keep their length and limb roots stay put there, so turning each bone is enough.
+	void poseLimbs(const LimbInfoBuffer& posedLimbs, std::vector<XMFLOAT4>& localRotations) const;
+
+	// Distance from p to the bone's segment. Scaling it by the radius let the thick spine and thigh bones
+	// crowd the short knee and ankle bones, buried in their blended joints, out of every vertex's influences.
+	float distanceToBone(UINT bone, XMVECTOR p) const;
+};
+
+static const int c_maxBoneInfluences = 4;
+
+struct SkinWeights
+{
+	UINT16 bones[c_maxBoneInfluences];
+	float weights[c_maxBoneInfluences];	// Sum to 1, unused influences have a weight of 0
+};
+
+// A mesh (the output of March) bound to a skeleton with linear blend skinning.
+// Posing it only runs deform(), the SDF and marching cubes are not touched again.
+class Skin
+{
+public:
+	std::vector<XMFLOAT3> bindPositions;
+	std::vector<XMFLOAT3> bindNormals;
+	std::vector<SkinWeights> vertexWeights;
+
+	Skin();
+
+	// Automatic weights: every vertex is skinned to its c_maxBoneInfluences closest bones (see distanceToBone()),
+	// weighted by the inverse square of their distance.
+	void bind(const Skeleton& skeleton, const std::vector<vec3>& positions, const std::vector<vec3>& normals);
+
+	UINT vertexCount() const;
+
+	// Blends the skin matrices of each vertex's bones and transforms its bind position and normal.
+	// Runs on numThreads threads, 0 for one per hardware thread.
+	void deform(const std::vector<XMFLOAT4X4>& skinMatrices, std::vector<XMFLOAT3>& positions, std::vector<XMFLOAT3>& normals,
+		UINT numThreads = 0) const;
+};
@@ -0,0 +1,176 @@
+#include "stdafx.h"
+#include "TextureCache.h"
+#include "stb_image.h"
+
+using namespace Model;
+
+namespace
+{
+	const char c_magic[4] = { 'T', 'X', 'B', 'C' };
+
+	struct CacheHeader
+	{
+		char magic[4];
+		UINT version;
+		UINT format;				// BlockFormat
+		UINT quality;
+		UINT srgb;
+		UINT generate_mips;
+		UINT filter;				// MipFilter
+		UINT mip_count;
+		float psnr;
+		UINT blocks_offset;			// Mip offsets count from here
+		UINT64 blocks_size;
+		UINT64 source_size;
+		UINT64 source_write_time;
+		UINT64 source_hash;
+	};
+
+	const char* extension(BlockFormat format)
+	{
+		switch (format)
+		{
+		case BlockFormat::BC1: return ".bc1";
+		case BlockFormat::BC4: return ".bc4";
+		default: return ".bc7";
+		}
+	}
+}
+
+bool TextureCache::load(const std::string& image_path, const TextureIngestOptions& ingest, const BlockCompressOptions& compress)
+{
+	std::string cache_path = image_path + extension(compress.format);
+	if (open(cache_path, image_path, ingest, compress))
+	{
+		return true;
+	}
+	file.reset();
+
+	// Stamp the source before compressing it, so a change meanwhile makes the next run compress again
+	CacheHeader header{};
+	memcpy(header.magic, c_magic, sizeof(c_magic));
+	header.version = c_version;
+	header.format = UINT(compress.format);
+	header.quality = compress.quality;
+	header.srgb = ingest.srgb;
+	header.generate_mips = ingest.generate_mips;
+	header.filter = UINT(ingest.filter);
+	if (!file_stamp(image_path, header.source_size, header.source_write_time))
+	{
+		return false;
+	}
+
+	TextureData texture, compressed;
+	{
+		MappedFile source(image_path);
+		if (!source.is_open())
+		{
+			return false;
+		}
+		header.source_hash = hash_bytes(source.data(), source.size());
+
+		int width, height, channels;
+		UINT8* pixels = stbi_load_from_memory(reinterpret_cast<const stbi_uc*>(source.data()), int(source.size()), &width, &height, &channels, STBI_default);
+		if (!pixels)
+		{
+			return false;
+		}
+		bool ingested = ingest_texture(pixels, width, height, channels, width * channels, ingest, texture);
+		stbi_image_free(pixels);
+		if (!ingested || !compress_texture(texture, compress, compressed))
+		{
+			return false;
+		}
+	}
+	header.psnr = Model::compression_psnr(texture, compressed, compress.format);
+	header.mip_count = UINT(compressed.mips.size());
+	size_t entries_end = sizeof(CacheHeader) + compressed.mips.size() * sizeof(TextureSubresource);
+	header.blocks_offset = UINT((entries_end + D3D12_TEXTURE_DATA_PLACEMENT_ALIGNMENT - 1) & ~size_t(D3D12_TEXTURE_DATA_PLACEMENT_ALIGNMENT - 1));
+	header.blocks_size = compressed.size;
+
+	image.assign(size_t(header.blocks_offset + header.blocks_size), 0);
+	memcpy(image.data(), &header, sizeof(header));
+	memcpy(image.data() + sizeof(header), compressed.mips.data(), compressed.mips.size() * sizeof(TextureSubresource));
+	memcpy(image.data() + header.blocks_offset, compressed.pixels.get(), size_t(compressed.size));
+
+	// Not being able to write the cache only costs the next run a compression
+	write_file(cache_path, image);
+	return parse(image.data(), image.size());
+}
+
+bool TextureCache::open(const std::string& cache_path, const std::string& source_path, const TextureIngestOptions& ingest,
+	const BlockCompressOptions& compress)
+{
+	UINT64 source_size, source_write_time;
+	if (!file_stamp(source_path, source_size, source_write_time))
+	{
+		return false;
+	}
+
+	std::unique_ptr<MappedFile> mapped(new MappedFile(cache_path));
+	if (!mapped->is_open() || mapped->size() < sizeof(CacheHeader))
+	{
+		return false;
+	}
+	const CacheHeader* header = reinterpret_cast<const CacheHeader*>(mapped->data());
+	if (header->source_size != source_size ||
+		header->format != UINT(compress.format) ||
+		header->quality != compress.quality ||
+		header->srgb != UINT(ingest.srgb) ||
+		header->generate_mips != UINT(ingest.generate_mips) ||
+		header->filter != UINT(ingest.filter))
+	{
+		return false;
+	}
+	// Touched but not changed is as good as untouched
+	if (header->source_write_time != source_write_time &&
+		!restamp_cache(mapped, cache_path, source_path, header->source_hash, offsetof(CacheHeader, source_write_time), source_write_time))
+	{
+		return false;
+	}
+
+	if (!parse(mapped->data(), mapped->size()))
+	{
+		return false;
+	}
+	file = std::move(mapped);
+	return true;
+}
+
+bool TextureCache::parse(const char* data, size_t size)
+{
+	levels.clear();
+
+	const CacheHeader* header = reinterpret_cast<const CacheHeader*>(data);
+	if (size < sizeof(CacheHeader) ||
+		memcmp(header->magic, c_magic, sizeof(c_magic)) != 0 ||
+		header->version != c_version ||
+		header->format > UINT(BlockFormat::BC7) ||
+		header->mip_count == 0 ||
+		header->mip_count > (size - sizeof(CacheHeader)) / sizeof(TextureSubresource) ||
+		header->blocks_offset > size ||
+		header->blocks_size > size - header->blocks_offset)
+	{
+		return false;
+	}
+
+	// Every mip has to lie within the blocks, a truncated cache is just an outdated one
+	const TextureSubresource* entries = reinterpret_cast<const TextureSubresource*>(data + sizeof(CacheHeader));
+	for (UINT i = 0; i < header->mip_count; i++)
+	{
+		const TextureSubresource& level = entries[i];
+		UINT64 length = UINT64(level.row_pitch) * ((level.height + 3) / 4);
+		if (level.offset > header->blocks_size || length > header->blocks_size - level.offset)
+		{
+			levels.clear();
+			return false;
+		}
+		levels.push_back(level);
+	}
+
+	blocks = reinterpret_cast<const UINT8*>(data + header->blocks_offset);
+	block_format = BlockFormat(header->format);
+	is_srgb = header->srgb != 0;
+	measured_psnr = header->psnr;
+	return true;
+}
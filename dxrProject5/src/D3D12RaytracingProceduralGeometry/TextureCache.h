@@ -0,0 +1,47 @@
+#pragma once
+
+#include "BlockCompression.h"
+#include "MappedFile.h"
+
+#include <memory>
+#include <string>
+
+namespace Model
+{
+	// Block compressed mip chain of an image, next to it (image_path + ".bc1", ".bc4" or ".bc7"):
+	//	header | mip entries | blocks, laid out like TextureData and 512 byte aligned
+	// Used under the same rules as MeshCache: the image's size and write time match, or failing that its content
+	// hash does, and it was made with the same options. Otherwise the image is ingested and compressed again.
+	// The blocks of a used cache are mapped and uploaded straight from the mapping.
+	class TextureCache
+	{
+	public:
+		// Returns false if the image cannot be loaded or its size cannot be block compressed
+		bool load(const std::string& image_path, const TextureIngestOptions& ingest, const BlockCompressOptions& compress);
+
+		UINT width() const { return levels.empty() ? 0 : levels[0].width; }
+		UINT height() const { return levels.empty() ? 0 : levels[0].height; }
+		// Rows of these are rows of blocks
+		const std::vector<TextureSubresource>& mips() const { return levels; }
+		const UINT8* data(UINT mip) const { return blocks + levels[mip].offset; }
+		BlockFormat format() const { return block_format; }
+		bool srgb() const { return is_srgb; }
+		float psnr() const { return measured_psnr; }	// Measured when the image was compressed
+		bool was_cached() const { return file != nullptr; }
+
+		static const UINT c_version = 1;
+
+	private:
+		bool open(const std::string& cache_path, const std::string& source_path, const TextureIngestOptions& ingest,
+			const BlockCompressOptions& compress);
+		bool parse(const char* data, size_t size);
+
+		std::unique_ptr<MappedFile> file;
+		std::vector<char> image;		// What was written, when the image was compressed this time
+		std::vector<TextureSubresource> levels;
+		const UINT8* blocks = nullptr;
+		BlockFormat block_format = BlockFormat::BC7;
+		bool is_srgb = false;
+		float measured_psnr = 0;
+	};
+}
@@ -0,0 +1,373 @@
+#include "stdafx.h"
+#include "TextureIngest.h"
+#include "ModelHelper.h"
+
+#include <intrin.h>
+#include <thread>
+#include <tmmintrin.h>
+
+using namespace Model;
+
+namespace
+{
+	const UINT c_band_rows = 16;		// Destination rows per task
+	const float c_kaiser_width = 3.0f;	// Radius in destination texels
+	const float c_kaiser_alpha = 4.0f;
+
+	bool has_ssse3()
+	{
+		static const bool supported = []
+		{
+			int info[4];
+			__cpuid(info, 1);
+			return (info[2] & (1 << 9)) != 0;
+		}();
+		return supported;
+	}
+
+	float srgb_to_linear(float value)
+	{
+		return (value <= 0.04045f) ? value / 12.92f : powf((value + 0.055f) / 1.055f, 2.4f);
+	}
+
+	// Decoding is a lookup. Encoding starts from the lowest code of the value's bucket and steps over the
+	// interval edges below the value, which rounds exactly the way the formula would without a powf per channel.
+	struct ChannelCoding
+	{
+		static const int c_buckets = 4096;	// Narrower than a code except in the steep sRGB toe, where they span two
+
+		float decode[256];
+		float edges[256];		// Code k covers [edges[k - 1], edges[k]), the last edge is never reached
+		UINT8 bucket_codes[c_buckets + 1];
+
+		explicit ChannelCoding(bool srgb)
+		{
+			for (int i = 0; i < 256; i++)
+			{
+				decode[i] = srgb ? srgb_to_linear(i / 255.0f) : i / 255.0f;
+				float middle = (i + 0.5f) / 255.0f;
+				edges[i] = (i == 255) ? FLT_MAX : (srgb ? srgb_to_linear(middle) : middle);
+			}
+			UINT code = 0;
+			for (int b = 0; b <= c_buckets; b++)
+			{
+				while (edges[code] <= float(b) / c_buckets)
+				{
+					code++;
+				}
+				bucket_codes[b] = UINT8(code);
+			}
+		}
+
+		UINT8 encode(float value) const
+		{
+			float scaled = value * c_buckets;
+			UINT code = bucket_codes[scaled <= 0.0f ? 0 : (scaled >= c_buckets ? c_buckets : int(scaled))];
+			while (value >= edges[code])
+			{
+				code++;
+			}
+			return UINT8(code);
+		}
+	};
+
+	double bessel_i0(double x)
+	{
+		double sum = 1.0;
+		double term = 1.0;
+		for (int k = 1; k < 32; k++)
+		{
+			term *= (x * 0.5 / k) * (x * 0.5 / k);
+			sum += term;
+		}
+		return sum;
+	}
+
+	float kaiser_sinc(float x)
+	{
+		float t = x / c_kaiser_width;
+		if (fabsf(t) >= 1.0f)
+		{
+			return 0.0f;
+		}
+		float sinc = (x == 0.0f) ? 1.0f : sinf(XM_PI * x) / (XM_PI * x);
+		return sinc * float(bessel_i0(c_kaiser_alpha * sqrt(1.0 - t * t)) / bessel_i0(c_kaiser_alpha));
+	}
+
+	// The source texels each destination texel along one axis reads, and how much of each
+	struct FilterTaps
+	{
+		std::vector<UINT> first;
+		std::vector<UINT> count;
+		std::vector<UINT> offset;
+		std::vector<float> weights;
+
+		FilterTaps(UINT source_size, UINT size, MipFilter filter)
+		{
+			float scale = float(source_size) / float(size);
+			for (UINT i = 0; i < size; i++)
+			{
+				float low = i * scale;
+				float high = (i + 1) * scale;
+				int begin = int(floorf(low));
+				int end = int(ceilf(high));
+				if (filter == MipFilter::Kaiser)
+				{
+					float center = (low + high) * 0.5f;
+					begin = int(floorf(center - c_kaiser_width * scale));
+					end = int(ceilf(center + c_kaiser_width * scale));
+				}
+
+				// Taps outside the image read the edge texel
+				UINT lowest = UINT(min(max(begin, 0), int(source_size) - 1));
+				UINT highest = UINT(min(max(end - 1, 0), int(source_size) - 1));
+				offset.push_back(UINT(weights.size()));
+				first.push_back(lowest);
+				count.push_back(highest - lowest + 1);
+				weights.resize(weights.size() + highest - lowest + 1, 0.0f);
+				float* tap_weights = &weights[offset.back()];
+				float total = 0.0f;
+				for (int j = begin; j < end; j++)
+				{
+					float weight;
+					if (filter == MipFilter::Box)
+					{
+						weight = min(high, float(j + 1)) - max(low, float(j));
+					}
+					else
+					{
+						weight = kaiser_sinc((j + 0.5f - (low + high) * 0.5f) / scale);
+					}
+					tap_weights[min(max(j, 0), int(source_size) - 1) - int(lowest)] += weight;
+					total += weight;
+				}
+				for (UINT j = 0; j < count.back(); j++)
+				{
+					tap_weights[j] /= total;
+				}
+			}
+		}
+	};
+
+	void expand_scalar(const UINT8* source, UINT channels, size_t pixel_count, UINT8* destination)
+	{
+		for (size_t i = 0; i < pixel_count; i++, source += channels, destination += 4)
+		{
+			UINT8 grey = source[0];
+			destination[0] = grey;
+			destination[1] = (channels >= 3) ? source[1] : grey;
+			destination[2] = (channels >= 3) ? source[2] : grey;
+			destination[3] = (channels == 2) ? source[1] : ((channels == 4) ? source[3] : 0xFF);
+		}
+	}
+
+	// Filters the 8 bit level above into the next one, a band of destination rows at a time. Each band filters
+	// the source rows it needs horizontally into linear floats, then combines them vertically.
+	void downsample(const TextureData& texture, UINT mip, const ChannelCoding& coding, MipFilter filter, UINT num_threads, UINT8* pixels)
+	{
+		const TextureSubresource& source = texture.mips[mip - 1];
+		const TextureSubresource& level = texture.mips[mip];
+		const UINT8* source_pixels = pixels + source.offset;
+		UINT8* level_pixels = pixels + level.offset;
+
+		FilterTaps columns(source.width, level.width, filter);
+		FilterTaps rows(source.height, level.height, filter);
+		const float alpha_scale = 1.0f / 255.0f;
+		// The usual power of two case: every texel is the average of 2x2 above it
+		bool halves = filter == MipFilter::Box && source.width == level.width * 2 && source.height == level.height * 2;
+
+		UINT band_count = (level.height + c_band_rows - 1) / c_band_rows;
+		parallel_for(band_count, num_threads, [&](UINT band)
+		{
+			UINT y_begin = band * c_band_rows;
+			UINT y_end = min(y_begin + c_band_rows, level.height);
+			if (halves)
+			{
+				for (UINT y = y_begin; y < y_end; y++)
+				{
+					const UINT8* top = source_pixels + UINT64(y) * 2 * source.row_pitch;
+					const UINT8* bottom = top + source.row_pitch;
+					UINT8* out = level_pixels + UINT64(y) * level.row_pitch;
+					for (UINT x = 0; x < level.width * 4; x += 4, top += 8, bottom += 8)
+					{
+						for (UINT c = 0; c < 3; c++)
+						{
+							out[x + c] = coding.encode(0.25f * (coding.decode[top[c]] + coding.decode[top[c + 4]] +
+								coding.decode[bottom[c]] + coding.decode[bottom[c + 4]]));
+						}
+						out[x + 3] = UINT8((top[3] + top[7] + bottom[3] + bottom[7] + 2) >> 2);
+					}
+				}
+				return;
+			}
+
+			UINT row_begin = rows.first[y_begin];
+			UINT row_end = rows.first[y_end - 1] + rows.count[y_end - 1];
+
+			std::vector<float> linear(source.width * 4);
+			std::vector<float> filtered((row_end - row_begin) * level.width * 4);
+			for (UINT r = row_begin; r < row_end; r++)
+			{
+				const UINT8* row = source_pixels + UINT64(r) * source.row_pitch;
+				for (UINT x = 0; x < source.width * 4; x += 4)
+				{
+					linear[x] = coding.decode[row[x]];
+					linear[x + 1] = coding.decode[row[x + 1]];
+					linear[x + 2] = coding.decode[row[x + 2]];
+					linear[x + 3] = row[x + 3] * alpha_scale;
+				}
+
+				float* out = &filtered[(r - row_begin) * level.width * 4];
+				for (UINT x = 0; x < level.width; x++, out += 4)
+				{
+					const float* in = &linear[columns.first[x] * 4];
+					const float* weight = &columns.weights[columns.offset[x]];
+					float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+					for (UINT t = 0; t < columns.count[x]; t++, in += 4)
+					{
+						sum[0] += in[0] * weight[t];
+						sum[1] += in[1] * weight[t];
+						sum[2] += in[2] * weight[t];
+						sum[3] += in[3] * weight[t];
+					}
+					memcpy(out, sum, sizeof(sum));
+				}
+			}
+
+			std::vector<float> sum(level.width * 4);
+			for (UINT y = y_begin; y < y_end; y++)
+			{
+				std::fill(sum.begin(), sum.end(), 0.0f);
+				const float* weight = &rows.weights[rows.offset[y]];
+				for (UINT t = 0; t < rows.count[y]; t++)
+				{
+					const float* in = &filtered[(rows.first[y] + t - row_begin) * level.width * 4];
+					for (UINT x = 0; x < level.width * 4; x++)
+					{
+						sum[x] += in[x] * weight[t];
+					}
+				}
+
+				UINT8* out = level_pixels + UINT64(y) * level.row_pitch;
+				for (UINT x = 0; x < level.width * 4; x += 4)
+				{
+					out[x] = coding.encode(sum[x]);
+					out[x + 1] = coding.encode(sum[x + 1]);
+					out[x + 2] = coding.encode(sum[x + 2]);
+					float alpha = sum[x + 3] * 255.0f + 0.5f;
+					out[x + 3] = UINT8(alpha <= 0.0f ? 0.0f : (alpha >= 255.0f ? 255.0f : alpha));
+				}
+			}
+		});
+	}
+}
+
+void Model::expand_to_rgba8(const UINT8* source, UINT channels, size_t pixel_count, UINT8* destination)
+{
+	if (channels == 4)
+	{
+		memcpy(destination, source, pixel_count * 4);
+		return;
+	}
+
+	size_t i = 0;
+	const __m128i opaque = _mm_set1_epi32(0xFF000000);
+	if (channels == 1)
+	{
+		// SSE2 is enough to spread grey: each unpack doubles the bytes per pixel
+		const __m128i ones = _mm_set1_epi8(char(0xFF));
+		for (; i + 16 <= pixel_count; i += 16)
+		{
+			__m128i grey = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i));
+			__m128i grey_grey_low = _mm_unpacklo_epi8(grey, grey);
+			__m128i grey_grey_high = _mm_unpackhi_epi8(grey, grey);
+			__m128i grey_alpha_low = _mm_unpacklo_epi8(grey, ones);
+			__m128i grey_alpha_high = _mm_unpackhi_epi8(grey, ones);
+			__m128i* out = reinterpret_cast<__m128i*>(destination + i * 4);
+			_mm_storeu_si128(out, _mm_unpacklo_epi16(grey_grey_low, grey_alpha_low));
+			_mm_storeu_si128(out + 1, _mm_unpackhi_epi16(grey_grey_low, grey_alpha_low));
+			_mm_storeu_si128(out + 2, _mm_unpacklo_epi16(grey_grey_high, grey_alpha_high));
+			_mm_storeu_si128(out + 3, _mm_unpackhi_epi16(grey_grey_high, grey_alpha_high));
+		}
+	}
+	else if (channels == 2 && has_ssse3())
+	{
+		const __m128i low = _mm_setr_epi8(0, 0, 0, 1, 2, 2, 2, 3, 4, 4, 4, 5, 6, 6, 6, 7);
+		const __m128i high = _mm_setr_epi8(8, 8, 8, 9, 10, 10, 10, 11, 12, 12, 12, 13, 14, 14, 14, 15);
+		for (; i + 8 <= pixel_count; i += 8)
+		{
+			__m128i grey_alpha = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i * 2));
+			__m128i* out = reinterpret_cast<__m128i*>(destination + i * 4);
+			_mm_storeu_si128(out, _mm_shuffle_epi8(grey_alpha, low));
+			_mm_storeu_si128(out + 1, _mm_shuffle_epi8(grey_alpha, high));
+		}
+	}
+	else if (channels == 3 && has_ssse3())
+	{
+		// Four pixels per 16 byte load, which reads 4 bytes past them: stop while 6 pixels are left
+		const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+		for (; i + 6 <= pixel_count; i += 4)
+		{
+			__m128i rgb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i * 3));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i * 4), _mm_or_si128(_mm_shuffle_epi8(rgb, spread), opaque));
+		}
+	}
+	expand_scalar(source + i * channels, channels, pixel_count - i, destination + i * 4);
+}
+
+UINT Model::mip_count(UINT width, UINT height)
+{
+	UINT count = 1;
+	for (UINT size = max(width, height); size > 1; size >>= 1)
+	{
+		count++;
+	}
+	return count;
+}
+
+bool Model::ingest_texture(const UINT8* source, UINT width, UINT height, UINT channels, UINT source_pitch,
+	const TextureIngestOptions& options, TextureData& texture)
+{
+	if (!source || width == 0 || height == 0 || channels < 1 || channels > 4)
+	{
+		return false;
+	}
+	UINT num_threads = options.num_threads ? options.num_threads : max(1u, std::thread::hardware_concurrency());
+
+	UINT count = options.generate_mips ? mip_count(width, height) : 1;
+	texture.mips.resize(count);
+	texture.srgb = options.srgb;
+	UINT64 size = 0;
+	for (UINT mip = 0; mip < count; mip++)
+	{
+		TextureSubresource& level = texture.mips[mip];
+		level.width = max(width >> mip, 1u);
+		level.height = max(height >> mip, 1u);
+		level.row_pitch = UINT(align(level.width * 4, D3D12_TEXTURE_DATA_PITCH_ALIGNMENT));
+		level.offset = align(size, D3D12_TEXTURE_DATA_PLACEMENT_ALIGNMENT);
+		size = level.offset + UINT64(level.row_pitch) * level.height;
+	}
+	// Left uninitialized: the row padding is never read
+	texture.pixels.reset(new UINT8[size_t(size)]);
+	texture.size = size;
+	UINT8* pixels = texture.pixels.get();
+
+	UINT band_count = (height + c_band_rows - 1) / c_band_rows;
+	parallel_for(band_count, num_threads, [&](UINT band)
+	{
+		for (UINT y = band * c_band_rows; y < min((band + 1) * c_band_rows, height); y++)
+		{
+			expand_to_rgba8(source + UINT64(y) * source_pitch, channels, width, pixels + UINT64(y) * texture.mips[0].row_pitch);
+		}
+	});
+
+	if (count > 1)
+	{
+		ChannelCoding coding(options.srgb);
+		for (UINT mip = 1; mip < count; mip++)
+		{
+			downsample(texture, mip, coding, options.filter, num_threads, pixels);
+		}
+	}
+	return true;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+namespace Model
+{
+	enum class MipFilter
+	{
+		Box,		// Average of the pixels each texel covers
+		Kaiser,		// Kaiser windowed sinc, 3 texels wide: sharper, may ring a little at hard edges
+	};
+
+	struct TextureIngestOptions
+	{
+		bool srgb = true;				// Colour channels are sRGB encoded and get filtered in linear space; alpha is linear
+		bool generate_mips = true;		// The full chain down to 1x1, otherwise only the top level
+		MipFilter filter = MipFilter::Box;
+		UINT num_threads = 0;			// 0 for one per hardware thread
+	};
+
+	// Where one mip level lives in TextureData::pixels. The layout is the one D3D12 copies textures from
+	// (D3D12_TEXTURE_DATA_PITCH_ALIGNMENT and D3D12_TEXTURE_DATA_PLACEMENT_ALIGNMENT), so the whole
+	// thing can go to an upload buffer in one copy.
+	struct TextureSubresource
+	{
+		UINT width;
+		UINT height;
+		UINT row_pitch;		// Bytes between rows, at least width * 4
+		UINT64 offset;		// Bytes from the start of pixels
+	};
+
+	// An RGBA8 texture and its mip chain, ready to upload
+	struct TextureData
+	{
+		std::unique_ptr<UINT8[]> pixels;
+		UINT64 size;		// Of pixels, in bytes
+		std::vector<TextureSubresource> mips;
+		bool srgb;
+
+		const UINT8* data(UINT mip) const { return pixels.get() + mips[mip].offset; }
+	};
+
+	// Widens pixel_count pixels of 1 (grey), 2 (grey, alpha), 3 (RGB) or 4 channels to RGBA, opaque where the source
+	// has no alpha. Vectorized with SSSE3 when the CPU has it.
+	void expand_to_rgba8(const UINT8* source, UINT channels, size_t pixel_count, UINT8* destination);
+
+	// Converts an image with rows of width * channels bytes, source_pitch bytes apart, and builds its mips.
+	// Returns false for an empty image or an unsupported channel count.
+	bool ingest_texture(const UINT8* source, UINT width, UINT height, UINT channels, UINT source_pitch,
+		const TextureIngestOptions& options, TextureData& texture);
+
+	UINT mip_count(UINT width, UINT height);
+}
@@ -0,0 +1,169 @@
+#include "stdafx.h"
+#include "VertexPacking.h"
+
+#include <DirectXPackedVector.h>
+
+using namespace Model;
+using namespace DirectX::PackedVector;
+
+namespace
+{
+	inline UINT quantize_unorm16(float value, float offset, float extent)
+	{
+		float q = (value - offset) / extent * 65535.0f + 0.5f;
+		return static_cast<UINT>(q <= 0.0f ? 0.0f : (q >= 65535.0f ? 65535.0f : q));
+	}
+
+	inline float snorm8_to_float(int value)
+	{
+		return max(float(value) / 127.0f, -1.0f);
+	}
+
+	inline int to_snorm8(float value)
+	{
+		return int(floorf(min(max(value, -1.0f), 1.0f) * 127.0f + 0.5f));
+	}
+
+	XMFLOAT3 oct_decode(float x, float y)
+	{
+		XMFLOAT3 n(x, y, 1.0f - fabsf(x) - fabsf(y));
+		float t = max(-n.z, 0.0f);
+		n.x += (n.x >= 0.0f) ? -t : t;
+		n.y += (n.y >= 0.0f) ? -t : t;
+		float length = sqrtf(n.x * n.x + n.y * n.y + n.z * n.z);
+		return XMFLOAT3(n.x / length, n.y / length, n.z / length);
+	}
+
+	XMFLOAT3 unit(const XMFLOAT3& v)
+	{
+		float length = sqrtf(v.x * v.x + v.y * v.y + v.z * v.z);
+		return (length > 0.0f) ? XMFLOAT3(v.x / length, v.y / length, v.z / length) : XMFLOAT3(0.0f, 0.0f, 1.0f);
+	}
+
+	inline float dot(const XMFLOAT3& a, const XMFLOAT3& b)
+	{
+		return a.x * b.x + a.y * b.y + a.z * b.z;
+	}
+
+	// Octahedral coordinates of a normal as two 8 bit snorms in the low 16 bits. Rounding each coordinate on its
+	// own can land on a code whose direction is not the closest one, so all four around the exact point are tried.
+	UINT encode_oct_normal(const XMFLOAT3& normal)
+	{
+		XMFLOAT3 n = unit(normal);
+		float sum = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+		float x = n.x / sum;
+		float y = n.y / sum;
+		if (n.z < 0.0f)
+		{
+			float folded_x = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+			float folded_y = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+			x = folded_x;
+			y = folded_y;
+		}
+
+		int base_x = int(floorf(x * 127.0f));
+		int base_y = int(floorf(y * 127.0f));
+		int best_x = to_snorm8(x);
+		int best_y = to_snorm8(y);
+		float best_dot = -2.0f;
+		for (int i = 0; i < 4; i++)
+		{
+			int cx = min(max(base_x + (i & 1), -127), 127);
+			int cy = min(max(base_y + (i >> 1), -127), 127);
+			float d = dot(n, oct_decode(snorm8_to_float(cx), snorm8_to_float(cy)));
+			if (d > best_dot)
+			{
+				best_dot = d;
+				best_x = cx;
+				best_y = cy;
+			}
+		}
+		return UINT(best_x & 0xff) | (UINT(best_y & 0xff) << 8);
+	}
+
+	XMFLOAT3 decode_oct_normal(UINT packed)
+	{
+		int x = int(INT8(packed & 0xff));
+		int y = int(INT8((packed >> 8) & 0xff));
+		return oct_decode(snorm8_to_float(x), snorm8_to_float(y));
+	}
+}
+
+PackingBounds Model::packing_bounds(const Vertex* vertices, UINT count)
+{
+	XMFLOAT3 low(FLT_MAX, FLT_MAX, FLT_MAX);
+	XMFLOAT3 high(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	for (UINT i = 0; i < count; i++)
+	{
+		const XMFLOAT3& p = vertices[i].position;
+		low = XMFLOAT3(min(low.x, p.x), min(low.y, p.y), min(low.z, p.z));
+		high = XMFLOAT3(max(high.x, p.x), max(high.y, p.y), max(high.z, p.z));
+	}
+
+	PackingBounds bounds;
+	if (count == 0)
+	{
+		bounds.min = XMFLOAT3(0.0f, 0.0f, 0.0f);
+		bounds.extent = XMFLOAT3(1.0f, 1.0f, 1.0f);
+		return bounds;
+	}
+	bounds.min = low;
+	bounds.extent = XMFLOAT3(
+		(high.x > low.x) ? high.x - low.x : 1.0f,
+		(high.y > low.y) ? high.y - low.y : 1.0f,
+		(high.z > low.z) ? high.z - low.z : 1.0f);
+	return bounds;
+}
+
+PackedVertex Model::pack_vertex(const Vertex& vertex, const PackingBounds& bounds)
+{
+	PackedVertex packed;
+	packed.positionXY = quantize_unorm16(vertex.position.x, bounds.min.x, bounds.extent.x) |
+		(quantize_unorm16(vertex.position.y, bounds.min.y, bounds.extent.y) << 16);
+	packed.positionZNormal = quantize_unorm16(vertex.position.z, bounds.min.z, bounds.extent.z) |
+		(encode_oct_normal(vertex.normal) << 16);
+	packed.texCoord = UINT(XMConvertFloatToHalf(vertex.texCoord.x)) | (UINT(XMConvertFloatToHalf(vertex.texCoord.y)) << 16);
+	return packed;
+}
+
+Model::Vertex Model::unpack_vertex(const PackedVertex& packed, const PackingBounds& bounds)
+{
+	Vertex vertex;
+	vertex.position = XMFLOAT3(
+		bounds.min.x + float(packed.positionXY & 0xffff) / 65535.0f * bounds.extent.x,
+		bounds.min.y + float(packed.positionXY >> 16) / 65535.0f * bounds.extent.y,
+		bounds.min.z + float(packed.positionZNormal & 0xffff) / 65535.0f * bounds.extent.z);
+	vertex.normal = decode_oct_normal(packed.positionZNormal >> 16);
+	vertex.texCoord = XMFLOAT2(
+		XMConvertHalfToFloat(static_cast<HALF>(packed.texCoord & 0xffff)),
+		XMConvertHalfToFloat(static_cast<HALF>(packed.texCoord >> 16)));
+	return vertex;
+}
+
+PackingBounds Model::pack_vertices(const Vertex* vertices, UINT count, std::vector<PackedVertex>& packed)
+{
+	PackingBounds bounds = packing_bounds(vertices, count);
+	packed.resize(count);
+	for (UINT i = 0; i < count; i++)
+	{
+		packed[i] = pack_vertex(vertices[i], bounds);
+	}
+	return bounds;
+}
+
+PackingError Model::packing_error(const Vertex* vertices, const PackedVertex* packed, UINT count, const PackingBounds& bounds)
+{
+	PackingError error = { 0.0f, 0.0f, 0.0f };
+	float min_normal_dot = 1.0f;
+	for (UINT i = 0; i < count; i++)
+	{
+		const Vertex& original = vertices[i];
+		Vertex unpacked = unpack_vertex(packed[i], bounds);
+		XMFLOAT3 d(unpacked.position.x - original.position.x, unpacked.position.y - original.position.y, unpacked.position.z - original.position.z);
+		error.position = max(error.position, sqrtf(dot(d, d)));
+		min_normal_dot = min(min_normal_dot, dot(unit(original.normal), unpacked.normal));
+		error.tex_coord = max(error.tex_coord, max(fabsf(unpacked.texCoord.x - original.texCoord.x), fabsf(unpacked.texCoord.y - original.texCoord.y)));
+	}
+	error.normal_degrees = XMConvertToDegrees(acosf(min(max(min_normal_dot, -1.0f), 1.0f)));
+	return error;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "Mesh.h"
+#include "RaytracingHlslCompat.h"
+
+namespace Model
+{
+	static_assert(sizeof(Vertex) == VERTEX_SIZE_IN_BYTES, "The shaders address vertices by VERTEX_SIZE_IN_BYTES");
+	static_assert(sizeof(PackedVertex) == PACKED_VERTEX_SIZE_IN_BYTES, "The shaders address vertices by PACKED_VERTEX_SIZE_IN_BYTES");
+
+	// What packed positions are relative to, the bounds of the mesh. Flat axes get an extent of 1.
+	struct PackingBounds
+	{
+		XMFLOAT3 min;
+		XMFLOAT3 extent;
+	};
+
+	PackingBounds packing_bounds(const Vertex* vertices, UINT count);
+
+	// Positions round to the nearest of 65536 steps across the bounds on each axis, normals to the closest of the
+	// four neighbouring 8 bit octahedral codes, texture coordinates to halfs
+	PackedVertex pack_vertex(const Vertex& vertex, const PackingBounds& bounds);
+
+	// What LoadPackedVertex() reads back on the GPU
+	Vertex unpack_vertex(const PackedVertex& packed, const PackingBounds& bounds);
+
+	PackingBounds pack_vertices(const Vertex* vertices, UINT count, std::vector<PackedVertex>& packed);
+
+	// Largest differences between vertices and their packed versions
+	struct PackingError
+	{
+		float position;			// Distance, in position units
+		float normal_degrees;
+		float tex_coord;		// Per coordinate
+	};
+
+	PackingError packing_error(const Vertex* vertices, const PackedVertex* packed, UINT count, const PackingBounds& bounds);
+}
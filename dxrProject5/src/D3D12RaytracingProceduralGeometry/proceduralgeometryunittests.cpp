@@ -0,0 +1,969 @@
+#include "stdafx.h"
+#include "CppUnitTest.h"
+#include "MeshLoader.h"
+#include "TextureIngest.h"
+#include "BlockCompression.h"
+#include "VertexPacking.h"
+#include "MeshSimplifier.h"
+#include "Creature.h"
+#include "CreatureBounds.h"
+#include "CreatureMass.h"
+#include "Skeleton.h"
+#include "CreatureGait.h"
+#include "March.h"
+#include "MappedFile.h"
+
+#include <array>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace ProceduralGeometryUnitTests
+{
+	// Test inputs next to this file
+	std::string FixturePath(const std::string& directory)
+	{
+		std::string path = __FILE__;
+		return path.substr(0, path.find_last_of("\\/") + 1) + directory;
+	}
+
+	TEST_CLASS(MeshLoaderTests)
+	{
+	public:
+		// The fixtures only hold values floats represent exactly, so both parsers have to agree to the bit
+		TEST_METHOD(QuadsMatchObjl)
+		{
+			CompareToObjl("quads.obj", {});
+		}
+
+		TEST_METHOD(ConvexPolygonsMatchObjl)
+		{
+			CompareToObjl("ngons.obj", {});
+		}
+
+		TEST_METHOD(NegativeIndicesMatchObjl)
+		{
+			CompareToObjl("negative_indices.obj", {});
+		}
+
+		// objl names every usemtl split of a mesh _2, the loader numbers them
+		TEST_METHOD(MaterialSplitsMatchObjl)
+		{
+			CompareToObjl("usemtl_splits.obj", { "part_2", "part_3", "part_4", "part", "other" });
+		}
+
+	private:
+		// A triangle as its corners' position, normal and texture coordinate, starting at its smallest corner
+		typedef std::array<float, 8> Corner;
+		typedef std::array<Corner, 3> Triangle;
+
+		static Triangle MakeTriangle(Corner a, Corner b, Corner c)
+		{
+			Triangle triangle = { a, b, c };
+			size_t first = std::min_element(triangle.begin(), triangle.end()) - triangle.begin();
+			std::rotate(triangle.begin(), triangle.begin() + first, triangle.end());
+			return triangle;
+		}
+
+		// Welding and the vertex cache optimizer change the vertices and the order of the triangles, not the triangles
+		static std::vector<Triangle> Triangles(const Model::Mesh& mesh)
+		{
+			auto GetCorner = [&](UINT index)
+			{
+				const Model::Vertex& v = mesh.vertices[index];
+				return Corner{ v.position.x, v.position.y, v.position.z, v.normal.x, v.normal.y, v.normal.z, v.texCoord.x, v.texCoord.y };
+			};
+			auto Index = [&](UINT i)
+			{
+				return mesh.vertex_indices32.empty() ? UINT(mesh.vertex_indices[i]) : mesh.vertex_indices32[i];
+			};
+			std::vector<Triangle> triangles;
+			for (UINT i = 0; i + 2 < mesh.index_count(); i += 3)
+			{
+				triangles.push_back(MakeTriangle(GetCorner(Index(i)), GetCorner(Index(i + 1)), GetCorner(Index(i + 2))));
+			}
+			std::sort(triangles.begin(), triangles.end());
+			return triangles;
+		}
+
+		static std::vector<Triangle> Triangles(const objl::Mesh& mesh)
+		{
+			auto GetCorner = [&](UINT index)
+			{
+				const objl::Vertex& v = mesh.Vertices[index];
+				return Corner{ v.Position.X, v.Position.Y, v.Position.Z, v.Normal.X, v.Normal.Y, v.Normal.Z,
+					v.TextureCoordinate.X, v.TextureCoordinate.Y };
+			};
+			std::vector<Triangle> triangles;
+			for (size_t i = 0; i + 2 < mesh.Indices.size(); i += 3)
+			{
+				triangles.push_back(MakeTriangle(GetCorner(mesh.Indices[i]), GetCorner(mesh.Indices[i + 1]), GetCorner(mesh.Indices[i + 2])));
+			}
+			std::sort(triangles.begin(), triangles.end());
+			return triangles;
+		}
+
+		// Same meshes with the same triangles, in the same order. names replaces objl's mesh names if given.
+		static void CompareToObjl(const std::string& objectName, std::vector<std::string> names)
+		{
+			std::string basePath = FixturePath("objects\\fixtures\\");
+			objl::Loader loader;
+			Assert::IsTrue(loader.LoadFile(basePath + objectName), L"objl could not load the fixture");
+			std::vector<Model::Mesh> meshes = Model::MeshLoader::load_obj(basePath, objectName);
+
+			Assert::AreEqual(loader.LoadedMeshes.size(), meshes.size(), L"Different number of meshes");
+			for (size_t i = 0; i < meshes.size(); i++)
+			{
+				std::string expectedName = names.empty() ? loader.LoadedMeshes[i].MeshName : names[i];
+				Assert::AreEqual(expectedName, meshes[i].name, L"Different mesh name");
+				Assert::IsTrue(Triangles(loader.LoadedMeshes[i]) == Triangles(meshes[i]), L"Different triangles");
+			}
+		}
+	};
+
+	TEST_CLASS(TextureIngestTests)
+	{
+	public:
+		// Every channel count, with pixel counts around each vectorized step so the scalar tails run too
+		TEST_METHOD(ExpansionMatchesScalar)
+		{
+			for (UINT channels = 1; channels <= 4; channels++)
+			{
+				for (size_t pixelCount : { 0, 1, 3, 5, 6, 7, 8, 9, 15, 16, 17, 31, 33, 1021 })
+				{
+					std::vector<UINT8> source(pixelCount * channels);
+					for (size_t i = 0; i < source.size(); i++)
+					{
+						source[i] = UINT8(i * 37 + channels);
+					}
+					// One guard pixel past the end, which nothing may write
+					std::vector<UINT8> expanded((pixelCount + 1) * 4, 0xCD);
+					Model::expand_to_rgba8(source.data(), channels, pixelCount, expanded.data());
+
+					for (size_t i = 0; i < pixelCount; i++)
+					{
+						const UINT8* in = &source[i * channels];
+						const UINT8 expected[4] = { in[0], (channels >= 3) ? in[1] : in[0], (channels >= 3) ? in[2] : in[0],
+							(channels == 2) ? in[1] : ((channels == 4) ? in[3] : UINT8(0xFF)) };
+						Assert::IsTrue(memcmp(&expanded[i * 4], expected, 4) == 0, L"Expanded pixel differs from the scalar one");
+					}
+					for (size_t i = pixelCount * 4; i < expanded.size(); i++)
+					{
+						Assert::AreEqual(UINT8(0xCD), expanded[i], L"Expansion wrote past the last pixel");
+					}
+				}
+			}
+		}
+
+		// Black and white average to linear 0.5, which is sRGB 188, not the 128 a gamma-unaware average gives
+		TEST_METHOD(CheckerAveragesToSrgbMiddle)
+		{
+			const UINT size = 16;
+			std::vector<UINT8> image(size * size * 3);
+			for (UINT y = 0; y < size; y++)
+			{
+				for (UINT x = 0; x < size; x++)
+				{
+					memset(&image[(y * size + x) * 3], ((x + y) & 1) ? 255 : 0, 3);
+				}
+			}
+			Model::TextureIngestOptions options;
+			Model::TextureData texture;
+			Assert::IsTrue(Model::ingest_texture(image.data(), size, size, 3, size * 3, options, texture));
+
+			for (UINT mip = 1; mip < texture.mips.size(); mip++)
+			{
+				const Model::TextureSubresource& level = texture.mips[mip];
+				for (UINT y = 0; y < level.height; y++)
+				{
+					const UINT8* row = texture.data(mip) + y * level.row_pitch;
+					for (UINT x = 0; x < level.width * 4; x += 4)
+					{
+						Assert::AreEqual(188, int(row[x]), L"Checker mip is not sRGB 188");
+						Assert::AreEqual(188, int(row[x + 2]), L"Checker mip is not sRGB 188");
+						Assert::AreEqual(255, int(row[x + 3]), L"Checker mip is not opaque");
+					}
+				}
+			}
+		}
+
+		// Whatever the filter and however the sizes round, the weights sum to one
+		TEST_METHOD(ConstantImagesStayConstant)
+		{
+			const UINT8 colour[4] = { 37, 150, 222, 99 };
+			const UINT sizes[][2] = { { 1, 1 }, { 1, 7 }, { 3, 5 }, { 17, 9 }, { 33, 31 }, { 64, 3 } };
+			for (Model::MipFilter filter : { Model::MipFilter::Box, Model::MipFilter::Kaiser })
+			{
+				for (const UINT* size : sizes)
+				{
+					std::vector<UINT8> image(size[0] * size[1] * 4);
+					for (size_t i = 0; i < image.size(); i += 4)
+					{
+						memcpy(&image[i], colour, 4);
+					}
+					Model::TextureIngestOptions options;
+					options.filter = filter;
+					Model::TextureData texture;
+					Assert::IsTrue(Model::ingest_texture(image.data(), size[0], size[1], 4, size[0] * 4, options, texture));
+					Assert::AreEqual(size_t(Model::mip_count(size[0], size[1])), texture.mips.size(), L"Incomplete mip chain");
+
+					for (UINT mip = 0; mip < texture.mips.size(); mip++)
+					{
+						const Model::TextureSubresource& level = texture.mips[mip];
+						for (UINT y = 0; y < level.height; y++)
+						{
+							const UINT8* row = texture.data(mip) + y * level.row_pitch;
+							for (UINT x = 0; x < level.width * 4; x += 4)
+							{
+								Assert::IsTrue(memcmp(row + x, colour, 4) == 0, L"A constant image changed in its mips");
+							}
+						}
+					}
+				}
+			}
+		}
+	};
+
+	TEST_CLASS(BlockCompressionTests)
+	{
+	public:
+		// The minimums are a few dB under what each codec reaches on the test image, at every quality
+		TEST_METHOD(BC1DecodesAboveMinimumPsnr)
+		{
+			CheckPsnr(Model::BlockFormat::BC1, 30.0f);
+		}
+
+		TEST_METHOD(BC4DecodesAboveMinimumPsnr)
+		{
+			CheckPsnr(Model::BlockFormat::BC4, 45.0f);
+		}
+
+		TEST_METHOD(BC7DecodesAboveMinimumPsnr)
+		{
+			CheckPsnr(Model::BlockFormat::BC7, 32.0f);
+		}
+
+		// Mode 6 shares a p-bit between the channels of an endpoint, so a solid block can be one step off
+		TEST_METHOD(SolidBlocksDecodeWithinOneStep)
+		{
+			const UINT8 colours[][4] = { { 200, 120, 40, 255 }, { 201, 121, 41, 255 }, { 0, 0, 0, 0 }, { 255, 255, 255, 128 } };
+			for (const UINT8* colour : colours)
+			{
+				UINT8 texels[64], decoded[64];
+				for (UINT i = 0; i < 16; i++)
+				{
+					memcpy(texels + i * 4, colour, 4);
+				}
+				UINT8 block[16];
+				Model::encode_block(Model::BlockFormat::BC7, texels, 1, block);
+				Model::decode_block(Model::BlockFormat::BC7, block, decoded);
+				for (UINT i = 0; i < 64; i++)
+				{
+					Assert::IsTrue(abs(int(texels[i]) - int(decoded[i])) <= 1, L"BC7 moved a solid block by more than a step");
+				}
+			}
+		}
+
+		TEST_METHOD(RejectsPartialBlocks)
+		{
+			std::vector<UINT8> image;
+			CreateImage(30, 32, image);
+			Model::TextureIngestOptions ingest;
+			Model::TextureData texture, compressed;
+			Assert::IsTrue(Model::ingest_texture(image.data(), 30, 32, 4, 30 * 4, ingest, texture));
+			Assert::IsFalse(Model::compress_texture(texture, Model::BlockCompressOptions(), compressed), L"A width of 30 cannot be block compressed");
+		}
+
+	private:
+		// Gradients, a hard edged disc and a little noise in colour, and an alpha gradient for BC7
+		static void CreateImage(UINT width, UINT height, std::vector<UINT8>& pixels)
+		{
+			pixels.resize(width * height * 4);
+			UINT noise = 12345;
+			for (UINT y = 0; y < height; y++)
+			{
+				for (UINT x = 0; x < width; x++)
+				{
+					noise = noise * 1664525u + 1013904223u;
+					int jitter = int(noise >> 29) - 4;
+					float dx = x - width * 0.5f, dy = y - height * 0.5f;
+					bool disc = dx * dx + dy * dy < width * height * 0.1f;
+					UINT8* pixel = &pixels[(y * width + x) * 4];
+					pixel[0] = UINT8(max(0, min(255, int(x * 255 / width) + jitter)));
+					pixel[1] = UINT8(max(0, min(255, (disc ? 200 : int(y * 255 / height)) + jitter)));
+					pixel[2] = UINT8(disc ? 40 : 160);
+					pixel[3] = UINT8((x + y) * 255 / (width + height));
+				}
+			}
+		}
+
+		static void CheckPsnr(Model::BlockFormat format, float minimumPsnr)
+		{
+			const UINT size = 64;
+			std::vector<UINT8> image;
+			CreateImage(size, size, image);
+			Model::TextureIngestOptions ingest;
+			ingest.srgb = false;
+			Model::TextureData texture;
+			Assert::IsTrue(Model::ingest_texture(image.data(), size, size, 4, size * 4, ingest, texture));
+
+			for (UINT quality = 0; quality <= 2; quality++)
+			{
+				Model::BlockCompressOptions options;
+				options.format = format;
+				options.quality = quality;
+				Model::TextureData compressed;
+				Assert::IsTrue(Model::compress_texture(texture, options, compressed));
+				Assert::AreEqual(texture.mips.size(), compressed.mips.size(), L"Every mip should be compressed");
+				float psnr = Model::compression_psnr(texture, compressed, format);
+				Assert::IsTrue(psnr >= minimumPsnr, L"Decoded blocks too far from the image");
+			}
+		}
+	};
+
+	TEST_CLASS(MeshSimplifierTests)
+	{
+	public:
+		// Every level close to its share of the triangles, and each one further from the surface than the last
+		TEST_METHOD(SphereLodsReachTheirRatios)
+		{
+			std::vector<float> positions;
+			std::vector<UINT> indices;
+			CreateSphere(60, 120, positions, indices);
+			const std::vector<float> ratios = { 0.5f, 0.25f, 0.125f };
+			std::vector<Model::MeshLod> lods = Model::build_lod_chain(indices, Streams(positions), ratios);
+
+			Assert::AreEqual(ratios.size(), lods.size());
+			float previousError = 0.0f;
+			for (size_t i = 0; i < lods.size(); i++)
+			{
+				size_t target = size_t(indices.size() / 3 * ratios[i]);
+				size_t triangles = lods[i].indices.size() / 3;
+				Assert::IsTrue(triangles <= target && triangles >= target * 9 / 10, L"Level far from its triangle count");
+				Assert::IsTrue(lods[i].error > previousError && lods[i].error < 0.02f, L"Level error out of range");
+				previousError = lods[i].error;
+			}
+		}
+
+		// An open grid keeps its outline however far it is simplified
+		TEST_METHOD(BoundariesStayPut)
+		{
+			const UINT size = 40;
+			std::vector<float> positions;
+			std::vector<UINT> indices;
+			for (UINT z = 0; z <= size; z++)
+			{
+				for (UINT x = 0; x <= size; x++)
+				{
+					positions.insert(positions.end(), { x * 0.1f, 0.01f * sinf(x * 0.5f) * cosf(z * 0.3f), z * 0.1f });
+				}
+			}
+			for (UINT z = 0; z < size; z++)
+			{
+				for (UINT x = 0; x < size; x++)
+				{
+					UINT a = z * (size + 1) + x;
+					UINT b = a + size + 1;
+					indices.insert(indices.end(), { a, b, a + 1, a + 1, b, b + 1 });
+				}
+			}
+
+			std::vector<UINT> simplified;
+			Model::simplify(indices, Streams(positions), UINT(indices.size() / 10), FLT_MAX, simplified);
+			Assert::IsTrue(simplified.size() < indices.size() / 2, L"The grid was barely simplified");
+			std::vector<bool> used(positions.size() / 3, false);
+			for (UINT index : simplified)
+			{
+				used[index] = true;
+			}
+			for (UINT i = 0; i <= size; i++)
+			{
+				Assert::IsTrue(used[i] && used[size * (size + 1) + i] && used[i * (size + 1)] && used[i * (size + 1) + size],
+					L"A boundary vertex was collapsed");
+			}
+		}
+
+	private:
+		static Model::VertexStreams Streams(const std::vector<float>& positions)
+		{
+			Model::VertexStreams streams;
+			streams.positions = positions.data();
+			streams.normals = nullptr;
+			streams.stride = 3;
+			streams.vertex_count = UINT(positions.size() / 3);
+			return streams;
+		}
+
+		// A closed unit sphere of rings around y, wound counterclockwise seen from outside
+		static void CreateSphere(UINT rings, UINT segments, std::vector<float>& positions, std::vector<UINT>& indices)
+		{
+			positions = { 0.0f, 1.0f, 0.0f };
+			for (UINT r = 1; r < rings; r++)
+			{
+				for (UINT s = 0; s < segments; s++)
+				{
+					float theta = XM_PI * r / rings;
+					float phi = 2.0f * XM_PI * s / segments;
+					positions.insert(positions.end(), { sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi) });
+				}
+			}
+			positions.insert(positions.end(), { 0.0f, -1.0f, 0.0f });
+
+			UINT bottom = UINT(positions.size() / 3) - 1;
+			UINT lastRing = 1 + (rings - 2) * segments;
+			for (UINT s = 0; s < segments; s++)
+			{
+				UINT next = (s + 1) % segments;
+				indices.insert(indices.end(), { 0, 1 + next, 1 + s });
+				indices.insert(indices.end(), { bottom, lastRing + s, lastRing + next });
+				for (UINT r = 0; r + 2 < rings; r++)
+				{
+					UINT a = 1 + r * segments + s;
+					UINT b = 1 + r * segments + next;
+					indices.insert(indices.end(), { a, b, a + segments, b, b + segments, a + segments });
+				}
+			}
+		}
+	};
+
+	TEST_CLASS(VertexPackingTests)
+	{
+	public:
+		// Each axis is rounded to the nearest of 65536 steps across the bounds. Unpacking in floats adds a few ulps.
+		TEST_METHOD(PositionsWithinHalfAStep)
+		{
+			std::vector<Model::Vertex> vertices = CreateVertices(10000);
+			std::vector<PackedVertex> packed;
+			Model::PackingBounds bounds = Model::pack_vertices(vertices.data(), UINT(vertices.size()), packed);
+			const float* extent = &bounds.extent.x;
+			for (size_t i = 0; i < vertices.size(); i++)
+			{
+				Model::Vertex unpacked = Model::unpack_vertex(packed[i], bounds);
+				for (UINT axis = 0; axis < 3; axis++)
+				{
+					float original = (&vertices[i].position.x)[axis];
+					float error = fabsf((&unpacked.position.x)[axis] - original);
+					float rounding = 4.0f * FLT_EPSILON * max(fabsf(original), fabsf((&bounds.min.x)[axis]));
+					Assert::IsTrue(error <= extent[axis] / 65535.0f * 0.5f + rounding, L"Position off by more than half a step");
+				}
+			}
+		}
+
+		// Measured worst case of the 8 bit octahedral codes is about 0.64 degrees
+		TEST_METHOD(NormalsWithinAngle)
+		{
+			std::vector<Model::Vertex> vertices = CreateVertices(100000);
+			std::vector<PackedVertex> packed;
+			Model::PackingBounds bounds = Model::pack_vertices(vertices.data(), UINT(vertices.size()), packed);
+			Model::PackingError error = Model::packing_error(vertices.data(), packed.data(), UINT(vertices.size()), bounds);
+			Assert::IsTrue(error.normal_degrees <= 0.7f, L"Normal turned too far");
+		}
+
+		// Halfs round to nearest, so within half a unit in the last place of the half
+		TEST_METHOD(TexCoordsWithinHalfUlp)
+		{
+			std::vector<Model::Vertex> vertices = CreateVertices(10000);
+			std::vector<PackedVertex> packed;
+			Model::PackingBounds bounds = Model::pack_vertices(vertices.data(), UINT(vertices.size()), packed);
+			for (size_t i = 0; i < vertices.size(); i++)
+			{
+				Model::Vertex unpacked = Model::unpack_vertex(packed[i], bounds);
+				for (UINT c = 0; c < 2; c++)
+				{
+					float original = (&vertices[i].texCoord.x)[c];
+					float halfUlp = max(ldexpf(1.0f, ilogbf(original) - 11), ldexpf(1.0f, -25));
+					Assert::IsTrue(fabsf((&unpacked.texCoord.x)[c] - original) <= halfUlp, L"Texture coordinate off by more than half an ulp");
+				}
+			}
+		}
+
+	private:
+		// Positions in an uneven box, normals in every direction, texture coordinates a little beyond [0, 1]
+		static std::vector<Model::Vertex> CreateVertices(UINT count)
+		{
+			UINT state = 12345;
+			auto Random = [&](float low, float high)
+			{
+				state = state * 1664525u + 1013904223u;
+				return low + (high - low) * float(state >> 8) / float(1 << 24);
+			};
+			std::vector<Model::Vertex> vertices(count);
+			for (Model::Vertex& v : vertices)
+			{
+				v.position = XMFLOAT3(Random(-3.0f, 5.0f), Random(0.0f, 0.25f), Random(-100.0f, 100.0f));
+				XMFLOAT3 n;
+				do
+				{
+					n = XMFLOAT3(Random(-1.0f, 1.0f), Random(-1.0f, 1.0f), Random(-1.0f, 1.0f));
+				} while (n.x * n.x + n.y * n.y + n.z * n.z > 1.0f || n.x * n.x + n.y * n.y + n.z * n.z < 1e-4f);
+				float length = sqrtf(n.x * n.x + n.y * n.y + n.z * n.z);
+				v.normal = XMFLOAT3(n.x / length, n.y / length, n.z / length);
+				v.texCoord = XMFLOAT2(Random(-0.5f, 1.5f), Random(-0.5f, 1.5f));
+			}
+			return vertices;
+		}
+	};
+
+	TEST_CLASS(CreatureBoundsTests)
+	{
+	public:
+		// Rays only march inside the boxes, so anything outside them would be cut off
+		TEST_METHOD(WholeCreatureBoxIsConservative)
+		{
+			CheckConservative(false);
+		}
+
+		TEST_METHOD(PartBoxesAreConservative)
+		{
+			CheckConservative(true);
+		}
+
+	private:
+		// Every limb count and head type the number keys select, still and with the gait's reach
+		static void CheckConservative(bool splitParts)
+		{
+			for (int numLimbs = 1; numLimbs <= 3; numLimbs++)
+			{
+				for (int headType = -1; headType <= 2; headType++)
+				{
+					for (bool animatedLimbs : { false, true })
+					{
+						Creature creature;
+						creature.generate(0, numLimbs, headType);
+						SDF sdf;
+						sdf.headSpineInfo = {};
+						sdf.appenInfo = {};
+						sdf.limbInfo = {};
+						sdf.rotInfo = {};
+						creature.fillBuffers(sdf.headSpineInfo, sdf.appenInfo, sdf.limbInfo, sdf.rotInfo);
+
+						CreatureBounds bounds(sdf.headSpineInfo, sdf.appenInfo, sdf.limbInfo, animatedLimbs);
+						std::vector<D3D12_RAYTRACING_AABB> boxes = splitParts ? bounds.parts() : std::vector<D3D12_RAYTRACING_AABB>{ bounds.creature() };
+						Assert::IsTrue(CreatureBounds::isConservative(sdf, boxes), L"The creature reaches outside its boxes");
+					}
+				}
+			}
+		}
+	};
+
+	TEST_CLASS(CreatureMassTests)
+	{
+	public:
+		// The bounds are off center so the octree is not symmetric about the shape
+		TEST_METHOD(SphereMatchesAnalytic)
+		{
+			const float radius = 0.8f;
+			const XMFLOAT3 center(0.1f, -0.2f, 0.3f);
+			D3D12_RAYTRACING_AABB bounds = { center.x - 0.9f, center.y - 0.85f, center.z - 1.0f, center.x + 1.3f, center.y + 1.1f, center.z + 0.95f };
+			CreatureMass mass([&](const XMFLOAT3& p)
+			{
+				return XMVectorGetX(XMVector3Length(XMLoadFloat3(&p) - XMLoadFloat3(&center))) - radius;
+			}, bounds, c_tolerance);
+
+			double volume = 4.0 / 3.0 * XM_PI * radius * radius * radius;
+			double moment = 0.4 * volume * radius * radius;
+			CheckMass(mass, volume, center, { moment, moment, moment });
+		}
+
+		TEST_METHOD(BoxMatchesAnalytic)
+		{
+			const XMFLOAT3 half(0.6f, 0.3f, 0.45f);
+			const XMFLOAT3 center(-0.2f, 0.1f, 0.05f);
+			D3D12_RAYTRACING_AABB bounds = { center.x - 1.1f * half.x, center.y - 1.45f * half.y, center.z - 1.2f * half.z,
+				center.x + 1.6f * half.x, center.y + 1.15f * half.y, center.z + 1.3f * half.z };
+			CreatureMass mass([&](const XMFLOAT3& p)
+			{
+				XMFLOAT3 q(abs(p.x - center.x) - half.x, abs(p.y - center.y) - half.y, abs(p.z - center.z) - half.z);
+				XMFLOAT3 outside(max(q.x, 0.0f), max(q.y, 0.0f), max(q.z, 0.0f));
+				return XMVectorGetX(XMVector3Length(XMLoadFloat3(&outside))) + min(max(q.x, max(q.y, q.z)), 0.0f);
+			}, bounds, c_tolerance);
+
+			double volume = 8.0 * half.x * half.y * half.z;
+			double xx = half.x * half.x, yy = half.y * half.y, zz = half.z * half.z;
+			CheckMass(mass, volume, center, { volume / 3.0 * (yy + zz), volume / 3.0 * (xx + zz), volume / 3.0 * (xx + yy) });
+		}
+
+	private:
+		static constexpr float c_tolerance = 0.005f;
+
+		// Within the tolerance the way CreatureMass measures it: relative for the volume and inertia, and in
+		// units of the cube root of the volume for the centroid
+		static void CheckMass(const CreatureMass& mass, double volume, const XMFLOAT3& centroid, std::array<double, 3> principal)
+		{
+			Assert::IsTrue(abs(mass.volume - volume) <= c_tolerance * volume, L"Volume off");
+
+			double size = std::cbrt(volume);
+			XMVECTOR offset = XMLoadFloat3(&mass.centroid) - XMLoadFloat3(&centroid);
+			Assert::IsTrue(XMVectorGetX(XMVector3Length(offset)) <= c_tolerance * size, L"Centroid off");
+
+			double error = 0.0, norm = 0.0;
+			for (int i = 0; i < 3; i++)
+			{
+				for (int j = 0; j < 3; j++)
+				{
+					double expected = (i == j) ? principal[i] : 0.0;
+					error += (mass.inertia.m[i][j] - expected) * (mass.inertia.m[i][j] - expected);
+					norm += expected * expected;
+				}
+			}
+			Assert::IsTrue(std::sqrt(error) <= c_tolerance * std::sqrt(norm), L"Inertia off");
+		}
+	};
+
+	TEST_CLASS(CreatureGaitTests)
+	{
+	public:
+		// The dirty ranges are all that gets uploaded, so they have to cover every float that changed,
+		// and start and end on a joint or rotation that did change
+		TEST_METHOD(StepMarksExactlyWhatMoved)
+		{
+			for (int numLimbs = 1; numLimbs <= 3; numLimbs++)
+			{
+				GaitCreature creature(numLimbs);
+				for (float time : { 0.1f, 0.35f, 0.7f, 1.05f })
+				{
+					LimbInfoBuffer limbs = creature.limbs;
+					RotationInfoBuffer rotations = creature.rotations;
+					DirtyRange jointLocs, jointRotations;
+					creature.gait.update(time, creature.limbs, creature.rotations, jointLocs, jointRotations);
+
+					CheckRange(limbs.jointLocData, creature.limbs.jointLocData, JOINT_LOC_COUNT, 3, jointLocs);
+					CheckRange(rotations.rotations, creature.rotations.rotations, ROT_COUNT, 4, jointRotations);
+					Assert::IsFalse(jointLocs.empty(), L"A step moved no joint");
+				}
+			}
+		}
+
+		TEST_METHOD(RestMarksNothing)
+		{
+			GaitCreature creature(2);
+			DirtyRange jointLocs, jointRotations;
+			creature.gait.restore(creature.limbs, creature.rotations, jointLocs, jointRotations);
+			Assert::IsTrue(jointLocs.empty() && jointRotations.empty(), L"The rest pose marked floats dirty");
+
+			// Back at rest after a step, and staying there
+			creature.gait.update(0.5f, creature.limbs, creature.rotations, jointLocs, jointRotations);
+			DirtyRange restJointLocs, restRotations;
+			creature.gait.restore(creature.limbs, creature.rotations, restJointLocs, restRotations);
+			Assert::IsFalse(restJointLocs.empty(), L"Going back to rest moved no joint");
+			restJointLocs = DirtyRange();
+			restRotations = DirtyRange();
+			creature.gait.restore(creature.limbs, creature.rotations, restJointLocs, restRotations);
+			Assert::IsTrue(restJointLocs.empty() && restRotations.empty(), L"Staying at rest marked floats dirty");
+		}
+
+	private:
+		struct GaitCreature
+		{
+			HeadSpineInfoBuffer headSpine = {};
+			AppendageInfoBuffer appendages = {};
+			LimbInfoBuffer limbs = {};
+			RotationInfoBuffer rotations = {};
+			CreatureGait gait;
+
+			GaitCreature(int numLimbs)
+			{
+				Creature creature;
+				creature.generate(0, numLimbs, 0);
+				creature.fillBuffers(headSpine, appendages, limbs, rotations);
+				gait.reset(appendages, limbs);
+			}
+		};
+
+		// Elements of size floats: everything that changed is inside the range, and its first and last elements changed
+		static void CheckRange(const float* before, const float* after, int count, int size, const DirtyRange& range)
+		{
+			auto Changed = [&](int element)
+			{
+				return !std::equal(before + element * size, before + (element + 1) * size, after + element * size);
+			};
+			for (int i = 0; i < count; i++)
+			{
+				if (before[i] != after[i])
+				{
+					Assert::IsTrue(i >= range.begin && i < range.end, L"A float changed outside the dirty range");
+				}
+			}
+			if (range.empty())
+			{
+				return;
+			}
+			Assert::IsTrue(range.begin % size == 0 && range.end % size == 0, L"The dirty range splits an element");
+			Assert::IsTrue(Changed(range.begin / size) && Changed(range.end / size - 1), L"The dirty range is wider than what changed");
+		}
+	};
+
+	TEST_CLASS(SkinTests)
+	{
+	public:
+		TEST_METHOD(RestPoseKeepsBindPose)
+		{
+			Skeleton skeleton;
+			Skin skin = CreateSkin(skeleton);
+			std::vector<XMFLOAT4X4> skinMatrices;
+			skeleton.computeSkinMatrices(std::vector<XMFLOAT4>(skeleton.boneCount(), XMFLOAT4(0.0f, 0.0f, 0.0f, 1.0f)), skinMatrices);
+			std::vector<XMFLOAT3> positions, normals;
+			skin.deform(skinMatrices, positions, normals);
+			for (UINT v = 0; v < skin.vertexCount(); v++)
+			{
+				Assert::IsTrue(Distance(positions[v], skin.bindPositions[v]) < 1e-5f, L"Vertex moved in the rest pose");
+				Assert::IsTrue(Distance(normals[v], skin.bindNormals[v]) < 1e-5f, L"Normal turned in the rest pose");
+			}
+		}
+
+		// Every bone follows the root, so turning it alone turns the whole creature about the root's head
+		TEST_METHOD(RootRotationTurnsEveryVertex)
+		{
+			Skeleton skeleton;
+			Skin skin = CreateSkin(skeleton);
+			std::vector<XMFLOAT4> rotations(skeleton.boneCount(), XMFLOAT4(0.0f, 0.0f, 0.0f, 1.0f));
+			XMVECTOR turn = XMQuaternionRotationRollPitchYaw(0.3f, 1.2f, -0.4f);
+			XMStoreFloat4(&rotations[0], turn);
+			std::vector<XMFLOAT4X4> skinMatrices;
+			skeleton.computeSkinMatrices(rotations, skinMatrices);
+			std::vector<XMFLOAT3> positions, normals;
+			skin.deform(skinMatrices, positions, normals);
+
+			XMVECTOR root = XMLoadFloat3(&skeleton.bones[0].head);
+			for (UINT v = 0; v < skin.vertexCount(); v++)
+			{
+				XMFLOAT3 expected;
+				XMStoreFloat3(&expected, XMVector3Rotate(XMLoadFloat3(&skin.bindPositions[v]) - root, turn) + root);
+				Assert::IsTrue(Distance(positions[v], expected) < 1e-4f, L"Vertex did not follow the root");
+				XMStoreFloat3(&expected, XMVector3Rotate(XMLoadFloat3(&skin.bindNormals[v]), turn));
+				Assert::IsTrue(Distance(normals[v], expected) < 1e-4f, L"Normal did not follow the root");
+			}
+		}
+
+		// Posed from the gait's joints, every limb bone ends up on the segment the SDF draws
+		TEST_METHOD(GaitPoseMovesBonesOntoTheirJoints)
+		{
+			Creature creature;
+			creature.generate(0, 2, 0);
+			HeadSpineInfoBuffer headSpine = {};
+			AppendageInfoBuffer appendages = {};
+			LimbInfoBuffer limbs = {};
+			RotationInfoBuffer rotations = {};
+			creature.fillBuffers(headSpine, appendages, limbs, rotations);
+			Skeleton skeleton(headSpine, limbs);
+
+			CreatureGait gait;
+			gait.reset(appendages, limbs);
+			DirtyRange jointLocs, jointRotations;
+			gait.update(0.4f * gait.cycleSeconds, limbs, rotations, jointLocs, jointRotations);
+			Assert::IsFalse(jointLocs.empty(), L"The gait moved nothing");
+
+			std::vector<XMFLOAT4> localRotations;
+			std::vector<XMFLOAT4X4> skinMatrices;
+			skeleton.poseLimbs(limbs, localRotations);
+			skeleton.computeSkinMatrices(localRotations, skinMatrices);
+			for (const Bone& bone : skeleton.bones)
+			{
+				if (bone.headJoint < 0) continue;
+				const XMFLOAT4X4& skinMatrix = skinMatrices[&bone - &skeleton.bones[0]];
+				XMFLOAT3 head, tail;
+				XMStoreFloat3(&head, XMVector3Transform(XMLoadFloat3(&bone.head), XMLoadFloat4x4(&skinMatrix)));
+				XMStoreFloat3(&tail, XMVector3Transform(XMLoadFloat3(&bone.tail), XMLoadFloat4x4(&skinMatrix)));
+				// The SDFs draw a primitive at -position
+				const float* posedHead = &limbs.jointLocData[3 * bone.headJoint];
+				const float* posedTail = &limbs.jointLocData[3 * bone.tailJoint];
+				Assert::IsTrue(Distance(head, XMFLOAT3(-posedHead[0], -posedHead[1], -posedHead[2])) < 1e-4f, L"Bone head is off its joint");
+				Assert::IsTrue(Distance(tail, XMFLOAT3(-posedTail[0], -posedTail[1], -posedTail[2])) < 1e-4f, L"Bone tail is off its joint");
+			}
+		}
+
+		// The creature marched the way OnMarchCubes() does it, limbs included, has to move every limb bone
+		TEST_METHOD(EveryLimbBoneWeighsOnTheMarchedCreature)
+		{
+			Cases cases;
+			for (int numLimbs = 1; numLimbs <= 3; numLimbs++)
+			{
+				for (int headType = -1; headType <= 2; headType++)
+				{
+					Creature creature;
+					creature.generate(0, numLimbs, headType);
+					SDF sdf;
+					sdf.headSpineInfo = {};
+					sdf.appenInfo = {};
+					sdf.limbInfo = {};
+					sdf.rotInfo = {};
+					creature.fillBuffers(sdf.headSpineInfo, sdf.appenInfo, sdf.limbInfo, sdf.rotInfo);
+
+					March march(CreatureBounds(sdf.headSpineInfo, sdf.appenInfo, sdf.limbInfo).creature(), 20.0f, &cases, &sdf);
+					march.testVertexSDFs();
+					march.testBoxValues();
+					march.setTriangles();
+					Skeleton skeleton(sdf.headSpineInfo, sdf.limbInfo);
+					Skin skin;
+					skin.bind(skeleton, march.triVerts, march.triNorms);
+
+					// Limb bones come after the spine and head ones
+					Assert::IsFalse(skeleton.limbBones.empty(), L"The creature has no limbs");
+					std::vector<bool> weighted(skeleton.boneCount(), false);
+					for (const SkinWeights& skinWeights : skin.vertexWeights)
+					{
+						for (int i = 0; i < c_maxBoneInfluences; i++)
+						{
+							if (skinWeights.weights[i] > 0.0f) weighted[skinWeights.bones[i]] = true;
+						}
+					}
+					for (UINT b = skeleton.limbBones[0]; b < skeleton.boneCount(); b++)
+					{
+						Assert::IsTrue(weighted[b], L"A limb bone drives no vertex");
+					}
+				}
+			}
+		}
+
+	private:
+		// Points around a generated creature's skeleton, bound with automatic weights
+		static Skin CreateSkin(Skeleton& skeleton)
+		{
+			Creature creature;
+			creature.generate(0, 2, 0);
+			HeadSpineInfoBuffer headSpine = {};
+			AppendageInfoBuffer appendages = {};
+			LimbInfoBuffer limbs = {};
+			RotationInfoBuffer rotations = {};
+			creature.fillBuffers(headSpine, appendages, limbs, rotations);
+			skeleton = Skeleton(headSpine, limbs);
+			Assert::IsTrue(skeleton.boneCount() > 1, L"The creature has no skeleton");
+
+			std::vector<vec3> positions, normals;
+			for (const Bone& bone : skeleton.bones)
+			{
+				for (float t : { 0.0f, 0.5f, 1.0f })
+				{
+					positions.push_back(vec3(bone.head.x + t * (bone.tail.x - bone.head.x), bone.head.y + t * (bone.tail.y - bone.head.y) + bone.radius,
+						bone.head.z + t * (bone.tail.z - bone.head.z)));
+					normals.push_back(vec3(0.0f, 1.0f, 0.0f));
+				}
+			}
+			Skin skin;
+			skin.bind(skeleton, positions, normals);
+			return skin;
+		}
+
+		static float Distance(const XMFLOAT3& a, const XMFLOAT3& b)
+		{
+			return XMVectorGetX(XMVector3Length(XMLoadFloat3(&a) - XMLoadFloat3(&b)));
+		}
+	};
+
+	TEST_CLASS(MeshStreamWriterTests)
+	{
+	public:
+		// The files written slab by slab while marching have to hold exactly the mesh the march ends up with
+		TEST_METHOD(MarchedSlabsReadBackWhole)
+		{
+			char tempDirectory[MAX_PATH];
+			GetTempPathA(MAX_PATH, tempDirectory);
+			const std::string plyPath = std::string(tempDirectory) + "MeshStreamWriterTests.ply";
+			const std::string stlPath = std::string(tempDirectory) + "MeshStreamWriterTests.stl";
+
+			Creature creature;
+			creature.generate(0, 2, 0);
+			SDF sdf;
+			sdf.headSpineInfo = {};
+			sdf.appenInfo = {};
+			sdf.limbInfo = {};
+			sdf.rotInfo = {};
+			creature.fillBuffers(sdf.headSpineInfo, sdf.appenInfo, sdf.limbInfo, sdf.rotInfo);
+
+			Cases cases;
+			March march(CreatureBounds(sdf.headSpineInfo, sdf.appenInfo, sdf.limbInfo).creature(), 12.0f, &cases, &sdf);
+			march.testVertexSDFs();
+			march.testBoxValues();
+
+			Model::PlyWriter ply;
+			Model::StlWriter stl;
+			SlabCounter slabs;
+			Assert::IsTrue(ply.open(plyPath, true), L"Could not open the PLY file");
+			Assert::IsTrue(stl.open(stlPath), L"Could not open the STL file");
+			march.setTriangles({ &ply, &stl, &slabs });
+			Assert::IsTrue(ply.close(), L"Could not write the PLY file");
+			Assert::IsTrue(stl.close(), L"Could not write the STL file");
+
+			Assert::IsTrue(slabs.count > 1, L"The mesh was not streamed in slabs");
+			Assert::IsFalse(march.triIndices.empty(), L"Nothing was marched");
+			CheckPly(plyPath, march);
+			CheckStl(stlPath, march);
+			DeleteFileA(plyPath.c_str());
+			DeleteFileA(stlPath.c_str());
+		}
+
+	private:
+		// Counts the slabs that brought triangles
+		class SlabCounter : public Model::MeshStreamWriter
+		{
+		public:
+			UINT count = 0;
+
+			void add(const Model::VertexStreams&, UINT, const UINT*, UINT index_count) override
+			{
+				if (index_count > 0) count++;
+			}
+			bool close() override { return true; }
+		};
+
+		static void CheckPly(const std::string& path, const March& march)
+		{
+			Model::MappedFile file(path);
+			Assert::IsTrue(file.is_open(), L"Could not read the PLY file back");
+			const std::string contents(file.data(), file.size());
+			const size_t headerEnd = contents.find("end_header\n");
+			Assert::IsTrue(headerEnd != std::string::npos, L"The PLY header is not terminated");
+			const std::string header = contents.substr(0, headerEnd);
+
+			// The counts were patched in after everything else was written
+			UINT vertexCount = 0, faceCount = 0;
+			Assert::AreEqual(1, sscanf(header.c_str() + header.find("element vertex"), "element vertex %u", &vertexCount));
+			Assert::AreEqual(1, sscanf(header.c_str() + header.find("element face"), "element face %u", &faceCount));
+			Assert::AreEqual(UINT(march.triVerts.size()), vertexCount, L"Wrong vertex count in the PLY header");
+			Assert::AreEqual(UINT(march.triIndices.size() / 3), faceCount, L"Wrong face count in the PLY header");
+
+			const size_t vertexRecord = 6 * sizeof(float);
+			const size_t faceRecord = 1 + 3 * sizeof(int);
+			const char* vertices = file.data() + headerEnd + strlen("end_header\n");
+			const char* faces = vertices + vertexCount * vertexRecord;
+			Assert::AreEqual(size_t(faces + faceCount * faceRecord - file.data()), file.size(), L"Wrong PLY file size");
+
+			for (UINT v = 0; v < vertexCount; v++)
+			{
+				Assert::IsTrue(SameBits(vertices + v * vertexRecord, march.triVerts[v]), L"PLY position differs");
+				Assert::IsTrue(SameBits(vertices + v * vertexRecord + 3 * sizeof(float), march.triNorms[v]), L"PLY normal differs");
+			}
+			for (UINT f = 0; f < faceCount; f++)
+			{
+				Assert::AreEqual(3, int(faces[f * faceRecord]), L"PLY face is not a triangle");
+				Assert::IsTrue(memcmp(faces + f * faceRecord + 1, &march.triIndices[3 * f], 3 * sizeof(int)) == 0, L"PLY face differs");
+			}
+		}
+
+		static void CheckStl(const std::string& path, const March& march)
+		{
+			Model::MappedFile file(path);
+			Assert::IsTrue(file.is_open(), L"Could not read the STL file back");
+			const size_t triangleRecord = 12 * sizeof(float) + sizeof(UINT16);
+			UINT triangleCount = 0;
+			Assert::IsTrue(file.size() >= 84, L"The STL file has no header");
+			memcpy(&triangleCount, file.data() + 80, sizeof(triangleCount));
+			Assert::AreEqual(UINT(march.triIndices.size() / 3), triangleCount, L"Wrong triangle count in the STL header");
+			Assert::AreEqual(84 + triangleCount * triangleRecord, file.size(), L"Wrong STL file size");
+
+			for (UINT t = 0; t < triangleCount; t++)
+			{
+				const char* corners = file.data() + 84 + t * triangleRecord + 3 * sizeof(float);
+				for (int c = 0; c < 3; c++)
+				{
+					Assert::IsTrue(SameBits(corners + c * 3 * sizeof(float), march.triVerts[march.triIndices[3 * t + c]]), L"STL corner differs");
+				}
+			}
+		}
+
+		static bool SameBits(const char* bytes, const vec3& v)
+		{
+			const float values[3] = { v[0], v[1], v[2] };
+			return memcmp(bytes, values, sizeof(values)) == 0;
+		}
+	};
+}